@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,10 +10,31 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <time.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <termios.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define XSSH_LEX_X86 1
+#endif
 
 #define BUFLEN 128
-#define INSNUM 13
+#define INSNUM 22
 
 
 /**
@@ -84,7 +107,7 @@ char* state_str[] =
 *          2)  2>&1   (Here output of standard error descriptor '2' is being redirected to standard out
 *                      descriptor '1')/
 *
-*  XSSH support 5 type of I/O rediection and redirect_info->mode identifies type of redirection info.
+*  XSSH support 7 type of I/O rediection and redirect_info->mode identifies type of redirection info.
 *  
 *  1) Output redirection from descriptor to file  (eg. > FilePath, 2>FilePath).
 *     If no descrptor number is preceding an output redirection then XSSH shell assumes descriptor standard
@@ -97,6 +120,18 @@ char* state_str[] =
 *  4) Input redirection from file to descriptor (e.g. < FilePath, 3< FilePath).
 *
 *  5) Input redirection from one descriptor to another descriptor (e.g. 1<&3).
+*
+*  6) Here-document (e.g. <<EOF). Lines following the command up to delimiter line are the input.
+*
+*  7) Here-string (e.g. <<< word). Word followed by newline is the input.
+*
+*  8) Output redirection from descriptor to process (e.g. >(wc -l), 2>(grep err)). Command is kept in dstfile.
+*
+*  Input of mode 6 and 7 is written into a memfd_create file by XSSH before fork, so no file is created on disk
+*  and body of any size is available to the process without waiting on a pipe.
+*
+*  If a descriptor is redirected to more than one file (e.g. > a > b) or to a process, its output is relayed to
+*  all targets, see start_relay().
 */
 
 typedef struct _redirect_info
@@ -116,7 +151,20 @@ typedef struct _redirect_info
     /*Redirection type*/
     int mode;
 
-    
+    /*Here-document body (mode 6). Delimiter (mode 6) or word (mode 7) is kept in srcfile*/
+    char *body;
+
+    /*memfd holding input of mode 6 and 7 while job is being started, 0 if not open*/
+    int memfd;
+
+    /*File name (or word of mode 7) has variables, they are expanded with arguments by expand_job()*/
+    int expand;
+
+    /*Relay of output (see start_relay()) while process is being started: opened target file (-errno if open failed)
+     *and, at first target of descriptor, pipe from process to relay. 0 if not open*/
+    int relayfd;
+    int relaypipe[2];
+
     CIRCLEQ_ENTRY(_redirect_info) link; 
 }redirect_info;
 
@@ -146,12 +194,82 @@ typedef struct _proc_info
     */
     int    background;
 
+    /*Time (CLOCK_MONOTONIC in ns) at which XSSH forked this process*/
+    uint64_t start_ns;
+
+    /*Arguments produced by glob expansion point into arena of job (not freed one by one)*/
+    const char *glob_arena;
+    size_t glob_len;
+
+    /*Copy of command text of process, arguments are its words NUL terminated in place (not freed one by one)
+     *until they are expanded or replaced*/
+    char  *words;
+    size_t words_len;
+
+    /*Offset of first '$' in each argument, -1 if argument has no variable. Expansion is done by expand_job()
+     *when job is started, so values are never parsed as syntax*/
+    short *dollar;
+
     /*List of redirection info */
     CIRCLEQ_HEAD(ril_head, _redirect_info) redirect_info_list;
 
+    /*Output of this process is part of pipeline prefix being stored in output cache*/
+    int   cache_prefix;
+
+    /*Relay processes started by setup_redirections() for builtin run by XSSH itself, waited once redirections are
+     *undone. Relays of forked processes are helpers of job*/
+    pid_t relays[10];
+    int   nrelays;
+
     CIRCLEQ_ENTRY(_proc_info) link; 
 }proc_info;
 
+/**
+* @brief  Byte counter of one pipe between two processes of a job, see start_meter(). It lives in memory shared
+*  with relay process which updates it.
+*/
+typedef struct _pipe_meter
+{
+    pid_t    pid;           //relay process
+    uint64_t start_ns;
+    uint64_t end_ns;        //0 while data still flows
+    uint64_t bytes;
+    uint64_t starved_ns;    //waiting for writer to produce data, reader side is starved
+    uint64_t blocked_ns;    //waiting for reader to take data, writer side is blocked
+    uint64_t wait_ns;       //start of current wait, for live values
+    int      waiting;       //1: relay waits for writer, 2: for reader
+}pipe_meter;
+
+/**
+* @brief  State of a task of tasks builtin.
+*/
+typedef enum _task_state
+{
+    XSSH_TASK_WAITING,
+    XSSH_TASK_RUNNING,
+    XSSH_TASK_DONE,
+    XSSH_TASK_FAILED,
+    XSSH_TASK_SKIPPED       //a dependency failed or tasks was interrupted
+}task_state;
+
+/**
+* @brief  Task of tasks builtin: named command which runs as a background job once all tasks it depends on
+*  have succeeded.
+*/
+typedef struct _task_info
+{
+    char *name;
+    char *cmd;              //empty for a task which only groups its dependencies
+    int  *deps;             //indexes of tasks this one depends on
+    int  ndeps;
+    task_state state;
+    int  status;
+    pid_t pgid;
+    struct _job_info *job;  //job running the task, cleared when job is destroyed
+    uint64_t start_ns;
+    uint64_t end_ns;
+}task_info;
+
 /**
 * @brief  Struct is being used to store information of a job.
 *      A job represents one or more than process grouped which shall be part of same process group.
@@ -201,10 +319,401 @@ typedef struct _job_info
 
     /*Status of the last process*/
     int  status;   
+
+    /*Time (CLOCK_MONOTONIC in ns) at which first process of the job was forked*/
+    uint64_t start_ns;
+
+    /*If greater than 0, stdout of last process goes to this descriptor (command substitution pipe)*/
+    int  capture_fd;
+
+    /*Glob results of all processes of job, NUL separated*/
+    char *glob_arena;
+    size_t glob_len;
+
+    /*timeout builtin: armed timerfd (0 if none), signal sent when it fires, delay of SIGKILL after it (0: none)
+     *and 1 once signal is sent, 2 once SIGKILL is sent*/
+    int  timer_fd;
+    int  timeout_sig;
+    uint64_t kill_after_ns;
+    int  timed_out;
+
+    /*Output cache: output of first cache_len processes is stored in cache_path once job succeeds, see cache_apply().
+     *cache_failed is set when one of them fails, cache_pid is relay which writes the file*/
+    int  cache_len;
+    int  cache_failed;
+    pid_t cache_pid;
+    char *cache_path;
+
+    /*Last process was a builtin run by XSSH itself (see stage_in_shell()) and its exit status, which is status
+     *of job instead of status of the last forked process*/
+    int  inshell;
+    int  inshell_status;
+
+    /*tasks builtin: task run by this job, its status and end time are recorded when job is destroyed*/
+    task_info *task;
+
+    /*pipestat: one meter per pipe (nprocs - 1 of them at start), NULL if job is not metered*/
+    pipe_meter *meters;
+    int  nmeters;
+
+    /*Relays of output (see start_relays()) in process group of job which have not exited yet. Job is finished once
+     *its processes and these have exited, end_state is state it then gets*/
+    pid_t *helpers;
+    int  nhelpers;
+    job_state end_state;
+
     CIRCLEQ_HEAD (pil_head, _proc_info)  proc_info_list; 
     CIRCLEQ_ENTRY(_job_info) link; 
 }job_info;
 
+/**
+* @brief  Struct describing a single trace event recorded while tracing is enabled (see trace builtin).
+*
+*  Events follow the Chrome trace-event format so that dumped file can be loaded in chrome://tracing or
+*  Perfetto UI. Each job is shown as a trace "process" (pid = job pgid) and each of its processes as a
+*  "thread" (tid = process pid). Events of the shell itself are recorded with pid = tid = pid of XSSH.
+*/
+typedef struct _trace_event
+{
+    /*Sequence number (index + 1) of event, written last so that a half written slot can be detected*/
+    uint64_t seq;
+
+    /*Time stamp (CLOCK_MONOTONIC in ns)*/
+    uint64_t ts;
+
+    /*Duration in ns, used only by complete ('X') events*/
+    uint64_t dur;
+
+    /*Chrome trace phase: 'X' for complete span, 'i' for instant*/
+    char     ph;
+
+    pid_t    pid;
+    pid_t    tid;
+
+    /*Event name, always a string literal so it stays valid in every forked child*/
+    const char *name;
+
+    /*Exit status or signal number depending upon event*/
+    int      arg;
+
+    /*Command of the job (truncated)*/
+    char     label[40];
+}trace_event;
+
+#define TRACE_RING_SIZE 65536
+
+/**
+* @brief  Ring buffer of trace events.
+*
+*  Ring is mapped MAP_SHARED | MAP_ANONYMOUS so a forked child can also record events (e.g. tcsetpgrp and exec start)
+*  right up to execvp() without any IPC. Slot is reserved with an atomic increment of head, once ring is full
+*  oldest events get overwritten.
+*/
+typedef struct _trace_ring
+{
+    uint64_t head;
+    trace_event events[TRACE_RING_SIZE];
+}trace_ring;
+
+/**
+* @brief  Enum describing type of a node of parsed compound command (if, while, until, for).
+*/
+typedef enum _node_type
+{
+    /*Simple command or pipeline, executed from a parsed job template*/
+    XSSH_NODE_CMD,
+
+    /*Sequence of commands separated by ';' or newline*/
+    XSSH_NODE_LIST,
+
+    /*if cond; then body; [elif ...;] [else orelse;] fi, elif is an XSSH_NODE_IF in orelse*/
+    XSSH_NODE_IF,
+
+    /*while cond; do body; done*/
+    XSSH_NODE_WHILE,
+
+    /*until cond; do body; done*/
+    XSSH_NODE_UNTIL,
+
+    /*for var in words; do body; done*/
+    XSSH_NODE_FOR,
+
+    /*break [n] and continue [n]*/
+    XSSH_NODE_BREAK,
+    XSSH_NODE_CONTINUE,
+
+    /*name() { body; }*/
+    XSSH_NODE_FUNCDEF,
+
+    /*return [n]*/
+    XSSH_NODE_RETURN,
+
+    /*cond && body, cond || body: body runs only if status of cond is zero (&&) or non zero (||)*/
+    XSSH_NODE_AND,
+    XSSH_NODE_OR
+}node_type;
+
+/**
+* @brief  Struct describing a node of the syntax tree of a compound command.
+*
+*   Whole construct is parsed once. Leaves (XSSH_NODE_CMD) hold a job_info template created by create_job with
+*   variables left unexpanded. Each execution of a leaf expands the words of template into a new job which is then
+*   run by run_job/execute_job, so loop body is never tokenized again.
+*
+*   Ex:
+*          for f in a b; do if test -f $f; then show $f; fi; done
+*
+*          FOR(f, [a b])
+*            LIST
+*              IF
+*                cond: LIST [CMD "test -f $f"]
+*                body: LIST [CMD "show $f"]
+*/
+typedef struct _ast_node
+{
+    node_type type;
+
+    /*XSSH_NODE_CMD: parsed job template*/
+    job_info *tmpl;
+
+    /*XSSH_NODE_CMD: index of internal instruction (see deinstr) if command is one, else 0*/
+    int ins;
+
+
+    /*XSSH_NODE_IF, XSSH_NODE_WHILE, XSSH_NODE_UNTIL, XSSH_NODE_FOR, XSSH_NODE_AND, XSSH_NODE_OR*/
+    struct _ast_node *cond;
+    struct _ast_node *body;
+    struct _ast_node *orelse;
+
+    /*XSSH_NODE_FOR: loop variable name and unexpanded words, nwords is -1 when "in" is omitted.
+    * XSSH_NODE_FUNCDEF: function name*/
+    char *var;
+    char **words;
+    int  nwords;
+
+    /*XSSH_NODE_BREAK, XSSH_NODE_CONTINUE: number of enclosing loops. XSSH_NODE_RETURN: status, -1 for $?*/
+    int  levels;
+
+    /*XSSH_NODE_LIST: commands in order*/
+    CIRCLEQ_HEAD(ast_head, _ast_node) children;
+    CIRCLEQ_ENTRY(_ast_node) link;
+}ast_node;
+
+/**
+* @brief  Struct describing a shell function. Body is parsed once when function is defined and each call
+* executes the same syntax tree.
+*/
+typedef struct _func_info
+{
+    char *name;
+    ast_node *body;
+    CIRCLEQ_ENTRY(_func_info) link;
+}func_info;
+
+/**
+* @brief  Struct describing an alias. Name starting a pipeline stage is replaced by value when command is parsed,
+* see alias_expand().
+*/
+typedef struct _alias_info
+{
+    char *name;
+    char *value;
+    CIRCLEQ_ENTRY(_alias_info) link;
+}alias_info;
+
+/*Positional parameters ($1 .. $n, $#, $@) of the function being executed*/
+typedef struct _pos_params
+{
+    int  argc;
+    char **argv;
+    char count[16];
+    char *all;
+}pos_params;
+
+/*Parser state of compound command source*/
+typedef struct _ast_parser
+{
+    const char *src;
+    int pos;
+
+    /*Source ended inside an unfinished construct, more lines are needed*/
+    int incomplete;
+    int error;
+
+    /*End of here-document bodies which follow current line, skipped at its newline*/
+    int heredoc_end;
+}ast_parser;
+
+/*Number of 64 bit words of structural bitmap of n bytes*/
+#define LEX_WORDS(n) (((n) + 63) / 64 + 1)
+
+/*Each power of two range is divided into 2^HIST_SUB_BITS linear sub buckets (~12% worst case error)*/
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS  (64 << HIST_SUB_BITS)
+
+/**
+* @brief  Log bucketed latency histogram (values are in ns).
+*     Recording is a couple of atomic increments so histograms are always on.
+*/
+typedef struct _latency_hist
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+}latency_hist;
+
+typedef enum _stat_id
+{
+    /*Time taken to parse a command line*/
+    XSSH_STAT_PARSE,
+
+    /*Time from fork() in shell to execvp() in child*/
+    XSSH_STAT_FORK_EXEC,
+
+    /*Wall time of foreground jobs*/
+    XSSH_STAT_FG_JOB,
+
+    /*Time from SIGCHLD delivery to shell reaping the child*/
+    XSSH_STAT_EXIT_NOTICE,
+
+    XSSH_STAT_MAX
+}stat_id;
+
+/**
+* @brief  Latency histograms reported by stats builtin.
+*     Mapped MAP_SHARED so a forked child can record its own fork to exec latency just before execvp().
+*/
+typedef struct _xssh_stats
+{
+    latency_hist hist[XSSH_STAT_MAX];
+}xssh_stats;
+
+/**
+* @brief  Persistent history file ($XSSH_HISTFILE or ~/.xssh_history) is a fixed size ring of fixed size slots
+* which is mmap'd MAP_SHARED by every running XSSH. Appending reserves a sequence number with atomic increment
+* of next, so concurrent shells never write the same slot (unless whole ring wraps meanwhile). Slot seq is cleared
+* while text is written and set to sequence + 1 afterwards, reader copies text and accepts it only if seq is
+* same before and after the copy.
+*/
+#define HISTORY_MAGIC  0x3159524f54534948ULL     //"HISTORY1"
+#define HISTORY_SLOTS  (1 << 16)
+#define HISTORY_TEXT   120
+
+typedef struct _history_slot
+{
+    uint64_t seq;
+    char text[HISTORY_TEXT];
+}history_slot;
+
+typedef struct _history_header
+{
+    uint64_t magic;
+    uint64_t nslots;
+    uint64_t next;
+    char pad[sizeof(history_slot) - 3 * sizeof(uint64_t)];
+}history_header;
+
+/**
+* @brief  In-memory index of history built on first search from the ring and updated from last indexed sequence.
+*     Texts are packed into one arena, each entry has a 64 bit mask of its character pairs so search skips entries
+*     which can not contain pattern without touching their text.
+*/
+typedef struct _history_entry
+{
+    uint64_t seq;
+    uint64_t mask;
+    uint32_t off;
+    uint32_t len;
+}history_entry;
+
+typedef struct _history_index
+{
+    history_header *hdr;
+    history_slot *slots;
+    size_t maplen;
+
+    history_entry *entries;
+    long n;
+    long cap;
+    char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+
+    /*Next sequence number which is not indexed yet*/
+    uint64_t synced;
+}history_index;
+
+/**
+* @brief  Index of executables on $PATH used by command completion. Each directory is read once and watched with
+*     inotify, Tab re-reads only directories which got an event since and whole index is rebuilt if $PATH changes.
+*/
+typedef struct _path_dir
+{
+    char *path;
+    int  wd;
+    int  dirty;
+    char **names;   //sorted
+    int  n;
+}path_dir;
+
+typedef struct _path_index
+{
+    char *path;
+    int  inotify_fd;
+    path_dir *dirs;
+    int  ndirs;
+}path_index;
+
+/*Growable list of strings (completion candidates)*/
+typedef struct _str_list
+{
+    char **v;
+    int  n;
+    int  cap;
+}str_list;
+
+/*State of line being edited by read_input()*/
+typedef struct _line_editor
+{
+    char *buf;
+    int  size;
+    int  len;
+    int  pos;
+    const char *prompt;
+
+    /*History entry shown by Up/Down (number of entries when editing own line) and own line saved meanwhile*/
+    long hist_idx;
+    char saved[BUFLEN];
+    int  saved_len;
+}line_editor;
+
+/**
+* @brief  Environment passed to every execve(). It is imported from environ at startup and kept up to date one entry
+*     at a time by export, unexport and set, so spawning a process does not build anything. environ points to
+*     same array so getenv() and PATH search of execvpe() see exported values.
+*/
+typedef struct _env_cache
+{
+    char **envp;    //"NAME=value" strings, NULL terminated
+    int  n;
+    int  cap;
+}env_cache;
+
+/**
+* @brief  Entry of pid index of jtop builtin: descriptors of /proc/<pid>/stat, statm and io of a process of a job
+*  and its CPU time at previous refresh. Descriptors stay open while process is sampled, so a refresh costs three
+*  pread() calls per process instead of open, read and close of each file.
+*/
+typedef struct _proc_sample
+{
+    pid_t    pid;       //0: free slot
+    int      fd[3];     //stat, statm, io, -1 if not kept open
+    int      seen;      //refresh in which process was last sampled, others are dropped
+    int      valid;     //ticks hold a previous sample
+    uint64_t ticks;     //utime + stime
+}proc_sample;
+
 typedef struct _xssh_global_context
 {
     CIRCLEQ_HEAD(jobs_head, _job_info) bg_jobs;
@@ -213,15 +722,104 @@ typedef struct _xssh_global_context
     int last_bg_job_index;
     int last_status;
     char last_cmd[BUFLEN];
+
+    /*Trace ring buffer, NULL when tracing is disabled*/
+    trace_ring *trace;
+    char trace_file[BUFLEN];
+
+    /*Latency histograms, always on*/
+    xssh_stats *stats;
+
+    /*Time at which first unreaped SIGCHLD was delivered, 0 if none pending*/
+    volatile uint64_t sigchld_ns;
+
+    /*Non zero while a builtin or compound command runs inside XSSH process, ctrl+C then interrupts it
+    * instead of printing prompt*/
+    volatile int in_builtin;
+    volatile int interrupted;
+
+    /*Set by ctrl+Z while tasks builtin waits, running tasks are then left as background jobs*/
+    volatile int detach;
+
+    /*Pending break/continue levels while executing loops of a compound command*/
+    int breaks;
+    int continues;
+    int loop_depth;
+
+    /*Defined functions, set when return is executed and depth of function calls*/
+    CIRCLEQ_HEAD(funcs_head, _func_info) funcs;
+    int returning;
+    int func_depth;
+    pos_params *params;
+
+    /*Bodies of functions redefined while a function runs (it may be the one redefined), freed once none runs*/
+    ast_node **retired;
+    int nretired;
+
+    /*Set in child forked to run command substitution*/
+    int subshell;
+
+    /*History file is opened on first use, open_failed avoids retrying on each command*/
+    history_index history;
+    int history_failed;
+
+    /*Executables on $PATH for completion, built on first Tab*/
+    path_index commands;
+
+    env_cache env;
+
+    /*pipestat on: pipes between processes of job are metered*/
+    int pipestat;
+
+    /*SIGCHLD handler writes to this pipe to wake up poll() of daemon mode and of jobs with timeout*/
+    int sigchld_pipe[2];
+
+    /*Number of jobs with armed timeout timer*/
+    int ntimers;
+
+    /*Output cache of pipeline prefixes (cache on), limit of total size and counters*/
+    int cache_on;
+    uint64_t cache_limit;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    /*jtop: pid index (open addressing, size is power of 2), current refresh and number of descriptors kept
+     *open out of at most sample_fd_max*/
+    proc_sample *samples;
+    int samples_size;
+    int nsamples;
+    int sample_gen;
+    int sample_fds;
+    int sample_fd_max;
+
+    /*Defined aliases*/
+    CIRCLEQ_HEAD(aliases_head, _alias_info) aliases;
+
+    /*Snapshot of rc file mapped at startup (see rc_load()). Functions and aliases loaded from it live inside
+     *mapping and are never freed*/
+    char  *snap;
+    size_t snap_len;
+
+    /*While rc file runs for a snapshot: environment variables it looked up with values it saw, they are part of
+     *snapshot key, and if it read $$ or $! which differ in every shell*/
+    str_list *rc_env;
+    int rc_volatile;
+
+    /*Fork server (XSSH_ZYGOTE): socket to it, its pid and pid of XSSH which started it*/
+    int zygote_fd;
+    pid_t zygote_pid;
+    pid_t zygote_owner;
 }xssh_global_context;
 
 xssh_global_context g_context;
 
 job_info *create_job(char cmd[BUFLEN]);
 void destroy_job(job_info *job); 
-proc_info *create_proc(const char *proc_buffer);
+proc_info *create_proc(const char *proc_buffer, const uint64_t *bits, size_t base);
 void destroy_proc(proc_info *process);
 void destroy_redirectinfo(redirect_info *rinfo);
+void free_arg(proc_info *p, char *arg);
+int  expand_job(job_info *job);
 
 void process_stopped(job_info *job, pid_t pid);
 void process_continued(job_info *job, pid_t pid);
@@ -232,9 +830,48 @@ void fg_job_continued();
 void fg_job_terminated();
 void fg_job_stopped();
 int execute_job(job_info *job);
+int run_job(job_info *job);
+
+int is_compound(const char *buffer);
+int is_list(const char *buffer);
+ast_node *parse_compound(const char *src, int *incomplete);
+void destroy_node(ast_node *node);
+int exec_node(ast_node *node);
+int run_compound(char buffer[BUFLEN], int xsshprint);
+job_info *instantiate_job(job_info *tmpl);
+char *expand_word(const char *word);
+int setvar(const char *name, const char *value);
+char *getvar(const char *name);
+void run_line(char buffer[BUFLEN], int xsshprint, uint64_t parse_ns);
+int subst_span(const char *str);
+int has_subst(const char *word);
+static int str_list_add(str_list *l, const char *str, int len);
+static void str_list_free(str_list *l);
+int heredoc_body(const char *src, const char *delim, char **body);
+int read_heredocs(job_info *job, int xsshprint);
+int open_heredocs(job_info *job);
+void close_heredocs(job_info *job);
+int subst_fields(const char *word, int split, char ***fields);
+char *capture_output(const char *cmd, size_t *len);
+func_info *find_function(const char *name);
+int call_function(int argc, char **argv);
+void run_instr(int ins, char buffer[BUFLEN]);
+int setup_redirections(proc_info *p);
 void wait_job();
 void wait_background_job(int pstatus);
+int  timeout_parse(job_info *job, proc_info *p, int first, uint64_t *ns);
+int  timeout_arm(job_info *job, uint64_t ns);
+void timeout_disarm(job_info *job);
+int  wait_ready(int fd);
+void timeout_poll();
 void print_job_status(job_info *job);
+void pipestat_print(job_info *job, FILE *out);
+void pipestat_report(job_info *job);
+void cache_apply(job_info *job);
+void cache_commit(job_info *job);
+void trace_wait_event(job_info *job, siginfo_t *info);
+uint64_t hist_percentile(latency_hist *h, double pct);
+void hist_fmt_ns(char *str, uint64_t ns);
 
 void suspend_job(job_info *job);
 void resume_job(job_info *job);
@@ -244,15 +881,50 @@ void send_job_to_bg(job_info *job, int resume);
 void sigint_fg_job();
 void sigtstp_fg_job();
 
+uint64_t now_ns();
+int  trace_start(const char *file);
+void trace_stop();
+int  trace_dump(const char *file);
+void trace_add(char ph, const char *name, pid_t pid, pid_t tid, uint64_t ts, uint64_t dur, int arg, const char *label);
+void trace_atexit();
+
+int  stats_init();
+void stats_record(stat_id id, uint64_t ns);
+void stats_child_reaped();
+
+int  history_open();
+void history_add(const char *line);
+int  history_sync();
+long history_search(const char *pattern, long from, int prefix);
+const char *history_text(long i);
+
+int  env_init();
+int  env_set(const char *name, const char *value);
+void env_unset(const char *name);
+char *env_get(const char *name);
+int  is_assignment(const char *word);
+int  is_glob_pattern(const char *word);
+int  serve(const char *path, int max_jobs);
+int  zygote_start();
+pid_t zygote_spawn(job_info *job, proc_info *p, int first, int infd, int outfd, uint64_t start_ns);
+int  expand_globs(job_info *job);
+int  count_assignments(proc_info *p);
+
+int  read_input(char *buffer, int size, const char *prompt, int xsshprint);
+int  edit_line(char *buffer, int size, const char *prompt);
+void path_index_refresh();
+
 
 /*internal instructions*/
-char *instr[INSNUM] = {"show","set","export","unexport","show","exit","wait","help", "bg", "fg", "jobs", "pwd", "cd"};
+char *instr[INSNUM] = {"show","set","export","unexport","show","exit","wait","help", "bg", "fg", "jobs", "pwd", "cd", "trace", "stats", "history", "pipestat", "cache", "tasks", "jtop", "alias", "unalias"};
 /*predefined variables*/
 /*varvalue[0] stores the rootpid of xssh*/
 /*varvalue[3] stores the childpid of the last process that was executed by xssh in the background*/
 int varmax = 3;
 char varname[BUFLEN][BUFLEN] = {"$\0", "?\0", "!\0",'\0'};
 char varvalue[BUFLEN][BUFLEN] = {'\0', '\0', '\0'};
+/*varexported[j] is set if variable j is in environment of children*/
+char varexported[BUFLEN] = {0};
 
 /*remember pid*/
 int childnum = 0;
@@ -264,7 +936,12 @@ char rootdir[BUFLEN] = "\0";
 
 /*functions for parsing the commands*/
 int deinstr(char buffer[BUFLEN]);
-void substitute(char *buffer);
+void strip_comment(char *buffer);
+void lex_classify(const char *buf, size_t len, uint64_t *bits);
+size_t lex_next(const uint64_t *bits, size_t base, size_t from, size_t len);
+int lex_bench(int mb);
+int jobctl_bench(int njobs, int rounds);
+int expand_instr(char buffer[BUFLEN]);
 void ltrim(char *str);
 void rtrim(char *str);
 
@@ -275,8 +952,10 @@ void help(char buffer[BUFLEN]);
 int program(char buffer[BUFLEN]);
 void catchctrlc();
 void catchctrlz();
+void catchsigchld();
 void ctrlc_sig(int sig);
 void ctrlz_sig(int sig);
+void sigchld_sig(int sig, siginfo_t *info, void *ctx);
 void waitchild(char buffer[BUFLEN]);
 void set(char buffer[BUFLEN]);
 void export(char buffer[BUFLEN]);
@@ -286,17 +965,96 @@ void fg(char buffer[BUFLEN]);
 void jobs(char buffer[BUFLEN]);
 void pwd();
 void cd(char buffer[BUFLEN]);
+void trace(char buffer[BUFLEN]);
+void stats(char buffer[BUFLEN]);
+void history(char buffer[BUFLEN]);
+void pipestat(char buffer[BUFLEN]);
+void cache(char buffer[BUFLEN]);
+void tasks(char buffer[BUFLEN]);
+void jtop(char buffer[BUFLEN]);
+void alias(char buffer[BUFLEN]);
+void unalias(char buffer[BUFLEN]);
+int  alias_expand(char buffer[BUFLEN]);
+void rc_load();
+int  snap_owns(const void *ptr);
+void task_finished(job_info *job);
 
 
 void run_exec (int inprevpipe, int inpipe, int outpipe, proc_info *p);
+
+/**
+* @brief  Builtins which take argv like an external command and are run inside XSSH process
+* (no fork and exec) when they are not part of a pipeline.
+*/
+typedef int (*fast_builtin_fn)(int argc, char **argv);
+
+typedef struct _fast_builtin
+{
+    const char *name;
+    fast_builtin_fn fn;
+}fast_builtin;
+
+int builtin_echo(int argc, char **argv);
+int builtin_printf(int argc, char **argv);
+int builtin_test(int argc, char **argv);
+int builtin_true(int argc, char **argv);
+int builtin_false(int argc, char **argv);
+int builtin_sleep(int argc, char **argv);
+
+fast_builtin fast_builtins[] =
+{
+    {"echo",   builtin_echo},
+    {"printf", builtin_printf},
+    {"test",   builtin_test},
+    {"[",      builtin_test},
+    {"true",   builtin_true},
+    {"false",  builtin_false},
+    {"sleep",  builtin_sleep},
+    {NULL,     NULL}
+};
+
+fast_builtin_fn find_fast_builtin(const char *name);
+int run_fast_builtin(job_info *job, fast_builtin_fn fn);
+int is_stage_builtin(const char *name);
+int run_stage_builtin(proc_info *p);
+int stage_in_shell(job_info *job, proc_info *p);
 /*for optional exercise, implement the function below*/
 int pipeprog(char buffer[BUFLEN]);
 
 /*main function*/
-int main()
+int main(int argc, char **argv)
 {
     memset(&g_context, 0, sizeof(g_context));
     CIRCLEQ_INIT(&g_context.bg_jobs);
+    CIRCLEQ_INIT(&g_context.funcs);
+    CIRCLEQ_INIT(&g_context.aliases);
+    env_init();
+    if(pipe2(g_context.sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+
+    /*xssh --bench-lex [MB] measures command line lexer*/
+    if(argc > 1 && !strcmp(argv[1], "--bench-lex"))
+        return lex_bench(argc > 2 ? atoi(argv[2]) : 64);
+
+    /*xssh --bench-jobctl [JOBS] [ROUNDS] drives xssh on a pseudo-terminal and times ctrl+C/ctrl+Z handling*/
+    if(argc > 1 && !strcmp(argv[1], "--bench-jobctl"))
+        return jobctl_bench(argc > 2 ? atoi(argv[2]) : 200, argc > 3 && atoi(argv[3]) > 0 ? atoi(argv[3]) : 20);
+
+    /*xssh --serve /path/sock [max-jobs] runs jobs submitted over Unix socket instead of reading stdin*/
+    if(argc > 1 && !strcmp(argv[1], "--serve"))
+    {
+        if(argc < 3)
+        {
+            fprintf(stderr, "usage: xssh --serve /path/sock [max-jobs]\n");
+            return 2;
+        }
+        rootpid = getpid();
+        sprintf(varvalue[0], "%d", rootpid);
+        stats_init();
+        if(getenv("XSSH_ZYGOTE") && strcmp(getenv("XSSH_ZYGOTE"), "0"))
+            zygote_start();
+        return serve(argv[2], argc > 3 ? atoi(argv[3]) : 0);
+    }
     
     /*set the variable $$*/
     rootpid = getpid();
@@ -306,83 +1064,167 @@ int main()
 
     catchctrlc();
     catchctrlz();
+    catchsigchld();
+    stats_init();
+
+    /*XSSH_ZYGOTE=1 starts fork server while XSSH is still small*/
+    if(getenv("XSSH_ZYGOTE") && strcmp(getenv("XSSH_ZYGOTE"), "0"))
+        zygote_start();
+
+    /*XSSH_TRACE=file enables tracing from the very first command*/
+    if(getenv("XSSH_TRACE"))
+        trace_start(getenv("XSSH_TRACE"));
+    atexit(trace_atexit);
+
+    /*~/.xsshrc defines variables, functions and aliases, its snapshot is mapped instead when it is up to date*/
+    rc_load();
 
     /*run the xssh, read the input instrcution*/
     int xsshprint = 0;
     if(isatty(fileno(stdin))) xsshprint = 1;
-    if(xsshprint) printf("xssh>> ");
     char buffer[BUFLEN];
     int do_wait = 1;
-    while(fgets(buffer, BUFLEN, stdin) > 0)
-    {
-        /*substitute the variables*/
-        substitute(buffer);
-        /*delete the comment*/
-        char *p = strchr(buffer, '#');
-        if(p != NULL)
-        {
-            *p = '\n';
-            *(p+1) = '\0';
-        }
-        /*decode the instructions*/
-        //fprintf(stdout, "buffer=%s", buffer);
-        int ins = deinstr(buffer);
-        /*run according to the decoding*/
-        if(ins == 1)
-            show(buffer);
-        else if(ins == 2)
-            set(buffer);
-        else if(ins == 3)
-            export(buffer);
-        else if(ins == 4)
-            unexport(buffer);
-        else if(ins == 5) show(buffer); //Not used for now
-        else if(ins == 6)
-            xsshexit(buffer);
-        else if(ins == 7)
-            waitchild(buffer);
-        else if(ins == 8)
-            help(buffer);
-        else if(ins == 9)
-            bg(buffer);
-        else if(ins == 10)
-            fg(buffer);
-        else if(ins == 11)
-        {
-            jobs(buffer);
-        }
-        else if(ins == 12)
-            pwd(buffer);
-        else if(ins == 13)
-            cd(buffer);
-        else if(ins == 14)
-            time(NULL);    
-        else
-        {
-            //Parsing the Command buffer
-            job_info *job = create_job(buffer);
-            
-            //Executing the job
-            int retval = execute_job(job);
-            job->state =  XSSH_JOB_STATE_RUNNING;
+    uint64_t prompt_ns = now_ns();
+    while(read_input(buffer, BUFLEN, "xssh>> ", xsshprint))
+    {
+        uint64_t parse_ns = now_ns();
+        if(g_context.trace)
+            trace_add('X', "read", rootpid, rootpid, prompt_ns, parse_ns - prompt_ns, 0, NULL);
 
-            if(retval == 0 && job->background)
-            {
-                send_job_to_bg(job, 0);
-                fprintf(stdout, "[%d] %s &\n", job->job_spec, job->cmd);
-            }
-            else
-                g_context.fg_job = job;
-        }
+        /*interactive lines go to persistent history*/
+        if(xsshprint)
+            history_add(buffer);
 
-        wait_job();
+        run_line(buffer, xsshprint, parse_ns);
 
-        if(xsshprint) printf("xssh>> ");
+        if(g_context.trace)
+        {
+            prompt_ns = now_ns();
+            trace_add('i', "prompt", rootpid, rootpid, prompt_ns, 0, 0, NULL);
+        }
         memset(buffer, 0, BUFLEN);
     }
     return -1;
 }
 
+/**
+* @brief  Runs one input line: compound command, internal instruction or job.
+*
+* @param buffer    [IN] command line, modified by alias expansion
+* @param xsshprint [IN] if continuation prompts of compound commands shall be printed
+* @param parse_ns  [IN] time at which parsing of line started
+*/
+void run_line(char buffer[BUFLEN], int xsshprint, uint64_t parse_ns)
+{
+    /*compound commands (if, while, until, for) and lists (;, &&, ||) are parsed as a whole and expand variables
+     *on execution*/
+    if(is_compound(buffer) || is_list(buffer))
+    {
+        run_compound(buffer, xsshprint);
+        return;
+    }
+
+    /*delete the comment, variables and $(...) or `...` are expanded after the line is split into words*/
+    strip_comment(buffer);
+    if(alias_expand(buffer) < 0)
+    {
+        sprintf(varvalue[1], "%d", 2);
+        return;
+    }
+    /*decode the instructions, a pipeline runs builtins as its stages*/
+    //fprintf(stdout, "buffer=%s", buffer);
+    int ins = strchr(buffer, '|') ? 0 : deinstr(buffer);
+    /*run according to the decoding*/
+    if(ins)
+    {
+        if(expand_instr(buffer) < 0)
+        {
+            sprintf(varvalue[1], "%d", 1);
+            return;
+        }
+        run_instr(ins, buffer);
+    }
+    else
+    {
+        //Parsing the Command buffer
+        job_info *job = create_job(buffer);
+        uint64_t end_ns = now_ns();
+        stats_record(XSSH_STAT_PARSE, end_ns - parse_ns);
+        if(g_context.trace)
+            trace_add('X', "parse", rootpid, rootpid, parse_ns, end_ns - parse_ns, 0, job ? job->cmd : NULL);
+        
+        //Executing the job
+        if(job && read_heredocs(job, xsshprint) < 0)
+        {
+            destroy_job(job);
+            job = NULL;
+        }
+        if(job)
+            run_job(job);
+        else
+            sprintf(varvalue[1], "%d", 2);
+    }
+
+    wait_job();
+}
+
+/**
+* @brief  Runs internal instruction decoded by deinstr.
+*
+* @param ins    [IN] instruction number returned by deinstr
+* @param buffer [IN] command buffer
+*/
+void run_instr(int ins, char buffer[BUFLEN])
+{
+    if(ins == 1)
+        show(buffer);
+    else if(ins == 2)
+        set(buffer);
+    else if(ins == 3)
+        export(buffer);
+    else if(ins == 4)
+        unexport(buffer);
+    else if(ins == 5) show(buffer); //Not used for now
+    else if(ins == 6)
+        xsshexit(buffer);
+    else if(ins == 7)
+        waitchild(buffer);
+    else if(ins == 8)
+        help(buffer);
+    else if(ins == 9)
+        bg(buffer);
+    else if(ins == 10)
+        fg(buffer);
+    else if(ins == 11)
+    {
+        jobs(buffer);
+    }
+    else if(ins == 12)
+        pwd(buffer);
+    else if(ins == 13)
+        cd(buffer);
+    else if(ins == 14)
+        trace(buffer);
+    else if(ins == 15)
+        stats(buffer);
+    else if(ins == 16)
+        history(buffer);
+    else if(ins == 17)
+        pipestat(buffer);
+    else if(ins == 18)
+        cache(buffer);
+    else if(ins == 19)
+        tasks(buffer);
+    else if(ins == 20)
+        jtop(buffer);
+    else if(ins == 21)
+        alias(buffer);
+    else if(ins == 22)
+        unalias(buffer);
+    else if(ins == INSNUM + 1)
+        ;   //blank line or comment
+}
+
 /*exit I*/
 int xsshexit(char buffer[BUFLEN])
 {
@@ -462,6 +1304,31 @@ void help(char buffer[BUFLEN])
     printf("\n\t\t 2) bg job_num #This will resume the specified suspended background job to running.");
     printf("\n  cd         - Change the current working ddirectory of SHELL.");
     printf("\n  pwd        - Print the current working directory.");
+    printf("\n  if/while/until/for - Compound commands, e.g. for f in a b; do if test -f $f; then show $f; fi; done");
+    printf("\n  a; b, a && b, a || b - Run b after a, only if a succeeded, only if a failed.");
+    printf("\n  break, continue - Leave or restart enclosing for/while/until loop.");
+    printf("\n  name() { ...; } - Define function, called as name args with $1.. $#, $@; return [n] leaves it.");
+    printf("\n  $(command), `command` - Replaced by output of command with trailing newlines removed.");
+    printf("\n  Line editing: arrows, ^A ^E ^K ^U ^W, Up/Down recall commands starting with typed text, ^R searches");
+    printf("\n    history, Tab completes commands, files and %%job specs.");
+    printf("\n  *, ?, [...] - Arguments with these are replaced by sorted matching path names (kept if none match).");
+    printf("\n  NAME=value [cmd] - Set shell variable, or put NAME in environment of cmd only.");
+    printf("\n  history [n] | -s text | -p prefix | -c - List last n commands, search or clear shared history file.");
+    printf("\n  cmd > a > b >(cmd2) - Same output goes to every file and command (relayed with tee/splice).");
+    printf("\n  cmd <<WORD, cmd <<< word - Here-document (lines up to WORD) or here-string as standard input.");
+    printf("\n  echo, printf, test, [, true, false, sleep - Run inside xssh without fork when not part of a pipeline.");
+    printf("\n  builtin | cmd - Builtins and functions may be pipeline stages, they run without exec (last printing stage in xssh).");
+    printf("\n  timeout DURATION [--signal SIG] [--kill-after D] cmd - Signal job when DURATION (s, m, h, d) passes, $? is 124.");
+    printf("\n  tasks [-j N] file - Run tasks of file (name: deps... ; command) as parallel jobs in dependency order.");
+    printf("\n  alias [name[=value]], unalias name|-a - Define, print or remove alias replacing first word of a command.");
+    printf("\n  ~/.xsshrc  - Run at start (XSSH_RC=file), definitions only rc is loaded from its snapshot ~/.xsshrc.snap.");
+    printf("\n  jtop [-d SECS] [-n COUNT] - Refresh CPU%%, RSS, read/write bytes of background jobs from /proc (ctrl+C quits).");
+    printf("\n  cache [on|off|clear|limit SIZE] - Reuse stored output of unchanged pipeline prefix (or stages before @cache).");
+    printf("\n  pipestat on|off - Meter pipes of jobs: bytes/s, writer blocked and reader starved time (also in jobs -l).");
+    printf("\n  stats      - Print latency percentiles of parse, fork to exec, foreground job and exit notice (stats reset to clear).");
+    printf("\n  trace      - Record job lifecycle events and write them as Chrome trace (trace on [file] | off | dump [file]).");
+    printf("\n  XSSH_ZYGOTE=1 - Start commands through fork server created at startup, so their start time does not grow with xssh.");
+    printf("\n  xssh --serve sock [n] - Run as daemon: lines \"run cmd\" or \"capture cmd\" on Unix socket sock, at most n jobs at once.");
     printf("\n  Finished optional (a); Finished optional (b).\n\n");
 }
 
@@ -475,7 +1342,7 @@ void bg(char buffer[BUFLEN])
     if(strlen(buffer + 2) == 0)
         job_spec = g_context.last_bg_job_index;
     else 
-        job_spec = strtol(buffer + 2, NULL, 10);
+        job_spec = strtol(buffer + 2 + strspn(buffer + 2, " %"), NULL, 10);
 
     job_info *job = NULL;
     CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
@@ -514,7 +1381,7 @@ void fg(char buffer[BUFLEN])
     if(strlen(buffer + 2) == 0)
         job_spec = g_context.last_bg_job_index;
     else 
-        job_spec = strtol(buffer + 2, NULL, 10);
+        job_spec = strtol(buffer + 2 + strspn(buffer + 2, " %"), NULL, 10);
 
 
     job_info *job = NULL;
@@ -548,6 +1415,21 @@ void jobs(char buffer[BUFLEN])
 {
     wait_background_job(1);
 
+    //jobs -l: process ids and live pipestat meters
+    rtrim(buffer);
+    if(!strcmp(buffer, "jobs -l"))
+    {
+        job_info *job = NULL;
+        CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+        {
+            proc_info *p = NULL;
+            fprintf(stdout, "[%d] pgid %d\n", job->job_spec, job->pgid);
+            CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+                fprintf(stdout, "  %d %s %s\n", p->pid, state_str[p->state], p->nargs > 1 ? p->args[1] : "");
+            pipestat_print(job, stdout);
+        }
+    }
+
     /*if(!CIRCLEQ_EMPTY(&g_context.bg_jobs))
     {
         job_info *job = NULL;
@@ -582,1643 +1464,11740 @@ void pwd()
     sprintf(varvalue[1], "%d", 1); 
 }
 
-/*export variable --- set the variable name in the varname list*/
-void export(char buffer[BUFLEN])
+/**
+* @brief  trace builtin. Controls recording of job lifecycle events into trace ring buffer.
+*
+*     trace              - Print whether tracing is on and number of recorded events.
+*     trace on [file]    - Start tracing, events will be written to file (default xssh-trace.json).
+*     trace dump [file]  - Write recorded events to file without stopping the trace.
+*     trace off          - Write recorded events to file and stop tracing.
+*/
+void trace(char buffer[BUFLEN])
 {
-    int i, j;
-    //flag == 1, if variable name exists in the varname list
-    int flag = 0;
-    //parse and store the variable name in buffer[]
-    char str[BUFLEN];
-    int start = 7;
-    while(buffer[start]==' ')start++;
-    for(i = start; (i < strlen(buffer))&&(buffer[i]!='#')&&(buffer[i]!=' ')&&(buffer[i]!='\n'); i++)
+    char *arg = NULL;
+    char *file = NULL;
+    char *saveptr = NULL;
+
+    rtrim(buffer);
+    arg = strtok_r(buffer + 5, " ", &saveptr);
+    if(arg)
+        file = strtok_r(NULL, " ", &saveptr);
+
+    if(!arg)
     {
-        str[i-start] = buffer[i];
-    }
-    str[i-start] = '\0';
-    //hint: try to print "str" and "varname[j]" to see what's stored there
-    for(j = 0; j < varmax; j++)
+        if(g_context.trace)
+            fprintf(stdout, "trace: on, %llu events, file %s\n", (unsigned long long)g_context.trace->head, g_context.trace_file);
+        else
+            fprintf(stdout, "trace: off\n");
+        sprintf(varvalue[1], "%d", 0);
+        return;
+    }
+
+    if(!strcmp(arg, "on"))
     {
-        //FIXME: if the variable name (in "str") exist in the
-        //varname list (in "varname[j]"), set the flag to be 1
-        //using strcmp()
-        
-        if(!strcmp(varname[j], str))
+        if(trace_start(file ? file : "xssh-trace.json") < 0)
         {
-            flag = 1;
-            break;
+            sprintf(varvalue[1], "%d", 1);
+            return;
         }
     }
-    if(flag == 0) //variable name does not exist in the varname list
+    else if(!strcmp(arg, "off"))
     {
-        //FIXME: copy the variable name to "varname[varmax]" using strcpy()
-        //FIXME: set the corresponding value in "varvalue[varmax]" to empty string '\0'
-        //FIXME: update the 'varmax' (by +1)
-        //FIXME: print "-xssh: Export variable str.", where str is newly exported variable name
-      
-        strcpy(varname[varmax], str);     
-        varvalue[varmax++][0]='\0';
-        printf("-xssh: Export variable %s.\n", str);
-        sprintf(varvalue[1], "%d", 0);
+        if(g_context.trace && trace_dump(g_context.trace_file) == 0)
+            fprintf(stdout, "trace: written to %s\n", g_context.trace_file);
+        trace_stop();
     }
-    else //variable name already exists in the varname list
+    else if(!strcmp(arg, "dump"))
     {
-        //FIXME: print "-xssh: Existing variable str is value.", where str is newly exported variable name and value is its corresponding value (stored in varvalue list)
-        printf("-xssh:Existing variable %s is %s.\n", str, varvalue[j]);
-        sprintf(varvalue[1], "%d", EEXIST);
+        if(!g_context.trace)
+        {
+            fprintf(stderr, "-xssh: trace: tracing is off\n");
+            sprintf(varvalue[1], "%d", 1);
+            return;
+        }
+
+        if(trace_dump(file ? file : g_context.trace_file) < 0)
+        {
+            sprintf(varvalue[1], "%d", 1);
+            return;
+        }
+        fprintf(stdout, "trace: written to %s\n", file ? file : g_context.trace_file);
+    }
+    else
+    {
+        fprintf(stderr, "-xssh: trace: %s: invalid argument\n", arg);
+        sprintf(varvalue[1], "%d", 2);
+        return;
     }
+
+    sprintf(varvalue[1], "%d", 0);
 }
 
-/*unexport the variable --- remove the variable name in the varname list*/
-void unexport(char buffer[BUFLEN])
+/**
+* @brief  pipestat builtin. "pipestat on" meters every pipe of jobs started later, per pipe summary is printed
+*  when job finishes and live values by "jobs -l". "pipestat off" stops it, no argument prints the setting.
+*/
+void pipestat(char buffer[BUFLEN])
 {
-    int i, j;
-    //flag == 1, if variable name exists in the varname list
-    int flag = 0;
-    //parse and store the variable name in buffer[]
-    char str[BUFLEN];
-    int start = 9;
-    while(buffer[start]==' ')start++;
-    for(i = start; (i < strlen(buffer))&&(buffer[i]!='#')&&(buffer[i]!=' ')&&(buffer[i]!='\n'); i++)
+    char *arg = NULL;
+    char *saveptr = NULL;
+
+    rtrim(buffer);
+    arg = strtok_r(buffer + 8, " ", &saveptr);
+    if(!arg)
+        fprintf(stdout, "pipestat: %s\n", g_context.pipestat ? "on" : "off");
+    else if(!strcmp(arg, "on") || !strcmp(arg, "off"))
+        g_context.pipestat = !strcmp(arg, "on");
+    else
     {
-        str[i-start] = buffer[i];
+        fprintf(stderr, "-xssh: pipestat: %s: invalid argument\n", arg);
+        sprintf(varvalue[1], "%d", 2);
+        return;
     }
-    str[i-start] = '\0';
-    for(j = 0; j < varmax; j++)
+    sprintf(varvalue[1], "%d", 0);
+}
+
+/**
+* @brief  stats builtin. Prints percentiles of latency histograms or clears them with "stats reset".
+*/
+void stats(char buffer[BUFLEN])
+{
+    static const char *names[XSSH_STAT_MAX] = {"parse", "fork-exec", "fg-job", "exit-notice"};
+    char *arg = NULL;
+    char *saveptr = NULL;
+    int i;
+
+    rtrim(buffer);
+    arg = strtok_r(buffer + 5, " ", &saveptr);
+    if(arg && !strcmp(arg, "reset"))
     {
-        //FIXME: if the variable name (in "str") exist in the
-        //varname list (in "varname[j]"), set the flag to be 1
-        //using strcmp() --- same with export()
-        if(!strcmp(varname[j], str))
-        {
-            flag = 1;
-            break;
-        }
+        memset(g_context.stats, 0, sizeof(xssh_stats));
+        sprintf(varvalue[1], "%d", 0);
+        return;
     }
-    if(flag == 0) //variable name does not exist in the varname list
+    else if(arg)
     {
-        //FIXME: print "-xssh: Variable str does not exist.",
-        //where str is the variable name to be unexported
-        printf("-xssh: Variable %s does not exist.\n", str);
-        sprintf(varvalue[1], "%d", ENOENT);
+        fprintf(stderr, "-xssh: stats: %s: invalid argument\n", arg);
+        sprintf(varvalue[1], "%d", 2);
+        return;
     }
-    else //variable name already exists in the varname list
+
+    fprintf(stdout, "%-12s %10s %10s %10s %10s %10s %10s %10s\n", "", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for(i = 0; i < XSSH_STAT_MAX; i++)
     {
-        //FIXME: clear the found variable by setting its
-        //"varname" and "varvalue" both to '\0'
-        //FIXME: print "-xssh: Variable str is unexported.",
-        //where str is the variable name to be unexported
-        varname[j][0]='\0';
-        varvalue[j][0]='\0';
-        printf("-xssh: Variable %s is unexported.\n", str);
-        sprintf(varvalue[1], "%d", 0);
+        latency_hist *h = &g_context.stats->hist[i];
+        char str[7][16];
+        uint64_t count = h->count;
+
+        hist_fmt_ns(str[0], count ? h->sum / count : 0);
+        hist_fmt_ns(str[1], hist_percentile(h, 50.0));
+        hist_fmt_ns(str[2], hist_percentile(h, 90.0));
+        hist_fmt_ns(str[3], hist_percentile(h, 99.0));
+        hist_fmt_ns(str[4], hist_percentile(h, 99.9));
+        hist_fmt_ns(str[5], h->max);
+        fprintf(stdout, "%-12s %10llu %10s %10s %10s %10s %10s %10s\n", names[i], (unsigned long long)count,
+                str[0], str[1], str[2], str[3], str[4], str[5]);
     }
+    sprintf(varvalue[1], "%d", 0);
 }
 
-/*set the variable --- set the variable value for the given variable name*/
-void set(char buffer[BUFLEN])
+/**
+* @brief  History builtin.
+*     history [n]        - list last n (default 16) commands with their numbers
+*     history -s text    - list commands containing text, newest first
+*     history -p prefix  - print most recent command starting with prefix
+*     history -c         - clear history file
+*/
+void history(char buffer[BUFLEN])
 {
-    int i, j;
-    //flag == 1, if variable name exists in the varname list
-    int flag = 0;
-    //parse and store the variable name in buffer[]
-    char str[BUFLEN];
-    int start = 4;
+    char *arg = NULL;
+    char *pat = NULL;
+    char *saveptr = NULL;
+    long i, count = 16;
 
     rtrim(buffer);
-    while(buffer[start]==' ')start++;
-    for(i = start; (i < strlen(buffer))&&(buffer[i]!=' ')&&(buffer[i]!='#'); i++)
+    arg = strtok_r(buffer + 7, " ", &saveptr);
+    pat = arg ? strtok_r(NULL, "", &saveptr) : NULL;
+
+    if(history_sync() < 0)
     {
-        str[i-start] = buffer[i];
+        sprintf(varvalue[1], "%d", 1);
+        return;
     }
-    str[i-start] = '\0';
-    while(buffer[i]==' ')i++;
-    if(buffer[i]=='\n' || buffer[i] == '\0')
+
+    if(arg && !strcmp(arg, "-c"))
     {
-        printf("No value to set!\n");
-        sprintf(varvalue[1], "%d", EINVAL);
+        history_header *hdr = g_context.history.hdr;
+        memset(g_context.history.slots, 0, hdr->nslots * sizeof(history_slot));
+        g_context.history.n = 0;
+        g_context.history.arena_len = 0;
+        sprintf(varvalue[1], "%d", 0);
         return;
     }
-    for(j = 0; j < varmax; j++)
+
+    if(arg && (!strcmp(arg, "-s") || !strcmp(arg, "-p")))
     {
-        //FIXME: if the variable name (in "str") exist in the
-        //varname list (in "varname[j]"), set the flag to be 1
-        //using strcmp() --- same with export()
-        //
-        if(!strcmp(varname[j], str))
+        int prefix = arg[1] == 'p';
+        int found = 0;
+
+        if(!pat)
         {
-            flag = 1;
-            break;
+            fprintf(stderr, "-xssh: history: %s: argument required\n", arg);
+            sprintf(varvalue[1], "%d", 2);
+            return;
+        }
+
+        for(i = history_search(pat, g_context.history.n, prefix); i >= 0; i = history_search(pat, i, prefix))
+        {
+            fprintf(stdout, "%6llu  %s\n", (unsigned long long)g_context.history.entries[i].seq + 1, history_text(i));
+            found = 1;
+            if(prefix)
+                break;
         }
+        sprintf(varvalue[1], "%d", found ? 0 : 1);
+        return;
     }
-    if(flag == 0)
+
+    if(arg)
     {
-        //FIXME: print "-xssh: Variable str does not exist.",
-        //where str is the variable name to be unexported
-        printf("-xssh: Variable %s does not exist.\n", str);
-        sprintf(varvalue[1], "%d", 2);
+        char *endptr = NULL;
+        count = strtol(arg, &endptr, 10);
+        if(*endptr || count < 0)
+        {
+            fprintf(stderr, "-xssh: history: %s: invalid argument\n", arg);
+            sprintf(varvalue[1], "%d", 2);
+            return;
+        }
     }
-    else
-    {
-        //hint: try to print "buffer[i]" to see what's stored there
-        //hint: may need to add '\0' by the end of a string
-        //FIXME: set the corresponding varvalue to be value (in buffer[i]) using strcpy()
-        //FIXME: print "-xssh: Set existing variable str to value.", where str is newly exported variable name and value is its corresponding value (stored in varvalue list)
-        rtrim(buffer);
-        start = 4;
-        start += strlen(str) + 1;
-        ltrim(buffer + start);
-        int temp = start;
-        while(buffer[start] && !isspace(buffer[start])) start++;
-        if(isspace(buffer[start]))
-            buffer[start]='\0';
 
-        sprintf(varvalue[j], "%s", buffer + temp);
-        printf("-xssh: Set existing variable %s to %s.\n", varname[j], varvalue[j]);
-        sprintf(varvalue[1], "%d", 0);
-    }
+    for(i = g_context.history.n > count ? g_context.history.n - count : 0; i < g_context.history.n; i++)
+        fprintf(stdout, "%6llu  %s\n", (unsigned long long)g_context.history.entries[i].seq + 1, history_text(i));
+    sprintf(varvalue[1], "%d", 0);
 }
 
-/*catch the ctrl+C*/
-void catchctrlc()
+/**
+* @brief  Writes string with backslash escapes interpreted (as by echo -e and printf %b).
+*
+* @return 1 if \c was found and no further output shall be produced else 0
+*/
+static int put_escaped(const char *str, int octal_needs_zero)
 {
-    //FIXME: catch the ctrl+C signal
-    //printf("Replace me for catching ctrl+C\n");
-    signal(SIGINT, ctrlc_sig);
-}
+    while(*str)
+    {
+        int c = *str++;
+        if(c != '\\' || !*str)
+        {
+            fputc(c, stdout);
+            continue;
+        }
 
-/*catch the ctrl+Z*/
-void catchctrlz()
-{
-    //FIXME: catch the ctrl+C signal
-    //printf("Replace me for catching ctrl+C\n");
-    signal(SIGTSTP, ctrlz_sig);
+        c = *str++;
+        switch(c)
+        {
+            case 'a': fputc('\a', stdout); break;
+            case 'b': fputc('\b', stdout); break;
+            case 'c': return 1;
+            case 'e': fputc(033, stdout); break;
+            case 'f': fputc('\f', stdout); break;
+            case 'n': fputc('\n', stdout); break;
+            case 'r': fputc('\r', stdout); break;
+            case 't': fputc('\t', stdout); break;
+            case 'v': fputc('\v', stdout); break;
+            case '\\': fputc('\\', stdout); break;
+            case 'x':
+            {
+                int n = 0, val = 0;
+                while(n < 2 && isxdigit((unsigned char)*str))
+                {
+                    val = val * 16 + (isdigit((unsigned char)*str) ? *str - '0' : tolower((unsigned char)*str) - 'a' + 10);
+                    str++;
+                    n++;
+                }
+                if(n)
+                    fputc(val, stdout);
+                else
+                    fputs("\\x", stdout);
+                break;
+            }
+            default:
+                if(c >= '0' && c <= '7' && (c == '0' || !octal_needs_zero))
+                {
+                    int n = (c == '0' && octal_needs_zero) ? 0 : 1;
+                    int val = (c == '0' && octal_needs_zero) ? 0 : c - '0';
+                    while(n < 3 && *str >= '0' && *str <= '7')
+                    {
+                        val = val * 8 + (*str++ - '0');
+                        n++;
+                    }
+                    fputc(val & 0xff, stdout);
+                }
+                else
+                {
+                    fputc('\\', stdout);
+                    fputc(c, stdout);
+                }
+        }
+    }
+    return 0;
 }
 
-/*ctrl+C handler*/
-void ctrlc_sig(int sig)
+/*echo [-neE] [arg ...]*/
+int builtin_echo(int argc, char **argv)
 {
-    if(g_context.fg_job)
-        sigint_fg_job();        
-    else
+    int i = 1, newline = 1, escapes = 0;
+
+    for(; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
     {
-        printf("\nxssh>> ");
-        fflush(stdout);       
+        const char *opt = argv[i] + 1;
+        if(strspn(opt, "neE") != strlen(opt))
+            break;
+
+        for(; *opt; opt++)
+        {
+            if(*opt == 'n')
+                newline = 0;
+            else if(*opt == 'e')
+                escapes = 1;
+            else
+                escapes = 0;
+        }
     }
-}
 
-void ctrlz_sig(int sig)
-{
-    if(g_context.fg_job)
-        sigtstp_fg_job();
+    for(; i < argc; i++)
+    {
+        if(escapes)
+        {
+            if(put_escaped(argv[i], 1))
+                return 0;
+        }
+        else
+            fputs(argv[i], stdout);
+
+        if(i + 1 < argc)
+            fputc(' ', stdout);
+    }
+
+    if(newline)
+        fputc('\n', stdout);
+    return 0;
 }
 
-/*wait instruction*/
-void waitchild(char buffer[BUFLEN])
+/*Numeric printf argument, a leading quote gives value of following character as in POSIX*/
+static int printf_number(const char *arg, long long *val, int *status)
 {
-    int i;
-    int start = 5;
+    char *endptr = NULL;
 
-    /*store the childpid in pid*/
-    char number[BUFLEN] = {'\0'};
-    while(buffer[start]==' ')start++;
-    for(i = start; (i < strlen(buffer))&&(buffer[i]!='\n')&&(buffer[i]!='#'); i++)
+    if(arg[0] == '\'' || arg[0] == '"')
     {
-        number[i-start] = buffer[i];
+        *val = (unsigned char)arg[1];
+        return 0;
     }
-    number[i-start] = '\0';
-    char *endptr;
-    int pid = strtol(number, &endptr, 10);
 
-    /*simple check to see if the input is valid or not*/
-    if((*number != '\0')&&(*endptr == '\0'))
+    errno = 0;
+    *val = strtoll(arg, &endptr, 0);
+    if(*arg == '\0')
+        return 0;
+
+    if(errno || *endptr)
     {
-        //FIXME: if pid is not -1, try to wait the background process pid
-        //FIXME: if successful, print "-xssh: Have finished waiting process pid", where pid is the pid of the background process
-        //FIXME: if not successful, print "-xssh: Unsuccessfully wait the background process pid", where pid is the pid of the background process
+        fprintf(stderr, "-xssh: printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return 0;
+}
 
+/*printf format [argument ...], format is reused until all arguments are consumed*/
+int builtin_printf(int argc, char **argv)
+{
+    const char *fmt;
+    int argi = 2;
+    int status = 0;
 
-        //FIXME: if pid is -1, print "-xssh: wait childnum background processes" where childnum stores the number of background processes, and wait all the background processes
-        //hint: remember to set the childnum correctly after waiting!
-        
-        fprintf(stderr, "Waiting for child %d\n", pid);  
+    if(argc < 2)
+    {
+        fprintf(stderr, "-xssh: printf: usage: printf format [arguments]\n");
+        return 2;
+    }
 
-        //exit(-1);
-        siginfo_t info; 
-        int exitstatus = 0;
-        int ni = 0;
-        do
-        { 
-            int retval = waitid(pid < 0 ? P_ALL : P_PID, pid, &info, WEXITED);
-            if(retval < 0 && errno == ECHILD)
+    do
+    {
+        int consumed = 0;
+        for(fmt = argv[1]; *fmt; fmt++)
+        {
+            if(*fmt == '\\')
             {
-                if(ni > 0) 
-                    fprintf(stdout, "-xssh:all child processes are terminated\n");
-                else
-                    fprintf(stdout, "-xssh:no child process exist\n");
+                char esc[5] = {0};
+                int n = 0;
+                esc[n++] = *fmt++;
+                if(!*fmt)
+                {
+                    fputc('\\', stdout);
+                    break;
+                }
+                esc[n++] = *fmt;
+                //octal escape of format can have up to three digits after backslash
+                while(n < 4 && esc[1] >= '0' && esc[1] <= '7' && fmt[1] >= '0' && fmt[1] <= '7')
+                    esc[n++] = *++fmt;
+                if(esc[1] == 'x')
+                    while(n < 4 && isxdigit((unsigned char)fmt[1]))
+                        esc[n++] = *++fmt;
+                if(put_escaped(esc, 0))
+                    return status;
+                continue;
+            }
 
-                sprintf(varvalue[1], "%d", 0);
-                break;    
+            if(*fmt != '%')
+            {
+                fputc(*fmt, stdout);
+                continue;
             }
-            else if(retval < 0)
+
+            if(fmt[1] == '%')
             {
-                if(pid < 0)
-                    fprintf(stdout, "-xssh:failed to wait for all child process\n");
-                else
-                    fprintf(stdout, "-xssh:failed to wait for %d child process\n", pid);
-                sprintf(varvalue[1], "%d", errno);
-                break;
+                fputc('%', stdout);
+                fmt++;
+                continue;
             }
-        
-            ni++;    
-            if(info.si_code == CLD_EXITED)
+
+            //build a conversion specification for stdio, '%', 7 flags, two ints of 11 characters, '.', "ll", the conversion and NUL
+            char spec[35];
+            int n = 0;
+            const char *arg = NULL;
+
+            spec[n++] = *fmt++;
+            while(*fmt && strchr("-+ #0", *fmt) && n < 8)
+                spec[n++] = *fmt++;
+            if(*fmt == '*')
             {
-                fprintf(stdout, "-xssh: child process %d is terminated with status=%d\n", info.si_pid, info.si_status);
-                fflush(stdout);
+                long long w = 0;
+                printf_number(argi < argc ? argv[argi++] : "0", &w, &status);
+                consumed = 1;
+                n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)w);
+                fmt++;
             }
-            else
+            while(isdigit((unsigned char)*fmt) && n < 19)
+                spec[n++] = *fmt++;
+            if(*fmt == '.')
             {
-                fprintf(stdout, "-xssh: child process %d is killed by signal=%d\n", info.si_pid, info.si_status);
-                fflush(stdout);
+                spec[n++] = *fmt++;
+                if(*fmt == '*')
+                {
+                    long long pr = 0;
+                    printf_number(argi < argc ? argv[argi++] : "0", &pr, &status);
+                    consumed = 1;
+                    n += snprintf(spec + n, sizeof(spec) - n, "%d", (int)pr);
+                    fmt++;
+                }
+                while(isdigit((unsigned char)*fmt) && n < 31)
+                    spec[n++] = *fmt++;
             }
 
-
-            job_info *job = NULL;
-            proc_info *p = NULL;
-            int found = 0;
-            CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+            //room is left for "ll", the conversion and NUL, longer width or precision is rejected
+            if(n > (int)sizeof(spec) - 4 || isdigit((unsigned char)*fmt))
             {
-                CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
-                    if(info.si_pid == p->pid)
-                    { 
-                        found = 1;
-                        break;
-                    }
+                fprintf(stderr, "-xssh: printf: %s: conversion specification too long\n", argv[1]);
+                return 1;
+            }
 
-                if(found)
-                    break; 
-            }            
-            if(found)
+            if(!*fmt)
             {
-                if(info.si_code == CLD_EXITED)
-                    process_terminated(job, p->pid, info.si_status);                    
-                else
-                    process_killed(job, p->pid, info.si_status);                    
-                
-                CIRCLEQ_REMOVE(&g_context.bg_jobs, job, link);
+                fprintf(stderr, "-xssh: printf: %s: missing format character\n", argv[1]);
+                return 1;
             }
-        }while(pid < 0);
-    }
-    else
-    { 
-        printf("-xssh: wait: Invalid pid\n");
-        sprintf(varvalue[1], "%d", ((unsigned char)-1));
-    }
-}
-
-/*execute the external command*/
-int program(char buffer[BUFLEN])
-{
-    /*if backflag == 0, xssh need to wait for the external command to complete*/
-    /*if backflag == 1, xssh need to execute the external command in the background*/
-    int backflag = 0;
-    char *ptr = strchr(buffer, '&');
-    if(ptr != NULL) backflag = 1;
 
-    pid_t pid;
-    //FIXME: create a new process for executing the external command
-
-    //FIXME: remember to check if the process creation is successful or not. if not, print error message and return -2, see codes below;
+            if(argi < argc)
+            {
+                arg = argv[argi++];
+                consumed = 1;
+            }
 
+            switch(*fmt)
+            {
+                case 'd': case 'i':
+                case 'o': case 'u': case 'x': case 'X':
+                {
+                    long long val = 0;
+                    printf_number(arg ? arg : "0", &val, &status);
+                    spec[n++] = 'l';
+                    spec[n++] = 'l';
+                    spec[n++] = *fmt;
+                    spec[n] = '\0';
+                    fprintf(stdout, spec, val);
+                    break;
+                }
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                {
+                    char *endptr = NULL;
+                    double val = arg ? strtod(arg, &endptr) : 0.0;
+                    if(arg && *endptr)
+                    {
+                        fprintf(stderr, "-xssh: printf: %s: invalid number\n", arg);
+                        status = 1;
+                    }
+                    spec[n++] = *fmt;
+                    spec[n] = '\0';
+                    fprintf(stdout, spec, val);
+                    break;
+                }
+                case 'c':
+                    spec[n++] = 'c';
+                    spec[n] = '\0';
+                    if(arg && *arg)
+                        fprintf(stdout, spec, arg[0]);
+                    break;
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    fprintf(stdout, spec, arg ? arg : "");
+                    break;
+                case 'b':
+                    if(arg && put_escaped(arg, 1))
+                        return status;
+                    break;
+                default:
+                    fprintf(stderr, "-xssh: printf: %%%c: invalid directive\n", *fmt);
+                    return 1;
+            }
+        }
 
-    //FIXME: write the code to execute the external command in the newly created process, using execvp()
-    //hint: the external command is stored in buffer, but before execute it you may need to do some basic validation check or minor changes, depending on how you execute
-    //FIXME: remember to check if the external command is executed successfully; if not, print error message "-xssh: Unable to execute the instruction buffer", where buffer is replaced with the actual external command to be printed
-    //hint: after executing the extenal command using execvp(), you need to return -1;
-    /*for optional exercise, implement stdin/stdout redirection in here*/
+        //format without any conversion shall not loop forever
+        if(!consumed)
+            break;
+    }while(argi < argc);
 
-    printf("Replace me for executing external commands\n");
+    return status;
+}
 
-    //FIXME: in the xssh process, remember to act differently, based on whether backflag is 0 or 1
-    //hint: the codes below are necessary to support command "wait -1", but you need to put them in the correct place
-    childnum++;
-    childpid = pid;
-    childnum--; //this may or may not be needed, depending on where you put the previous line
-    //hint: the code below is necessary to support command "show $!", but you need to put it in the correct place
-    sprintf(varvalue[2], "%d\0", pid);
+int builtin_true(int argc, char **argv)
+{
     return 0;
 }
 
-/*for optional exercise, implement the function below*/
-/*execute the pipe programs*/
-int pipeprog(char buffer[BUFLEN])
+int builtin_false(int argc, char **argv)
 {
-    printf("-xssh: For optional exercise: currently not supported.\n");
-    return 0;
+    return 1;
 }
 
-/*substitute the variable with its value*/
-void substitute(char *buffer)
+/**
+* @brief  sleep NUMBER[smhd]... Sleeps inside XSSH, ctrl+C interrupts the sleep with status 130.
+*/
+int builtin_sleep(int argc, char **argv)
 {
-    char newbuf[BUFLEN] = {'\0'};
+    double secs = 0;
     int i;
-    int pos = 0;
-    for(i = 0; i < strlen(buffer);i++)
+
+    if(argc < 2)
     {
-        if(buffer[i]=='#')
+        fprintf(stderr, "-xssh: sleep: missing operand\n");
+        return 1;
+    }
+
+    for(i = 1; i < argc; i++)
+    {
+        char *endptr = NULL;
+        double val = strtod(argv[i], &endptr);
+
+        if(endptr == argv[i] || val < 0 || (endptr[0] && endptr[1]) || (endptr[0] && !strchr("smhd", endptr[0])))
         {
-            newbuf[pos]='\n';
-            pos++;
-            break;
+            fprintf(stderr, "-xssh: sleep: invalid time interval '%s'\n", argv[i]);
+            return 1;
         }
-        else if(buffer[i]=='$')
+
+        if(*endptr == 'm')
+            val *= 60;
+        else if(*endptr == 'h')
+            val *= 3600;
+        else if(*endptr == 'd')
+            val *= 86400;
+        secs += val;
+    }
+
+    struct timespec req, rem;
+    req.tv_sec = (time_t)secs;
+    req.tv_nsec = (long)((secs - req.tv_sec) * 1e9);
+
+    //timeouts of background jobs expire while XSSH sleeps, end of sleep is a timerfd waited together with them
+    if(g_context.ntimers > 0)
+    {
+        struct itimerspec its;
+        int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+        memset(&its, 0, sizeof(its));
+        its.it_value = req;
+        if(!req.tv_sec && !req.tv_nsec)
+            its.it_value.tv_nsec = 1;   //zero would disarm
+        if(tfd >= 0 && timerfd_settime(tfd, 0, &its, NULL) == 0)
         {
-            if((buffer[i+1]!='#')&&(buffer[i+1]!=' ')&&(buffer[i+1]!='\n'))
+            while(!wait_ready(tfd))
             {
-                i++;
-                int count = 0;
-                char tmp[BUFLEN];
-                for(; (buffer[i]!='#')&&(buffer[i]!='\n')&&(buffer[i]!=' '); i++)
-                {
-                    tmp[count] = buffer[i];
-                    count++;
-                }
-                tmp[count] = '\0';
-                int flag = 0;
-                int j;
-                for(j = 0; j < varmax; j++)
-                {
-                    if(strcmp(tmp,varname[j]) == 0)
-                    {
-                        flag = 1;
-                        break;
-                    }
-                }
-                if(flag == 0)
+                if(g_context.interrupted)
                 {
-                    printf("-xssh: Does not exist variable $%s.\n", tmp);
+                    close(tfd);
+                    fputc('\n', stdout);
+                    return 128 + SIGINT;
                 }
-                else
-                {
-                    strcat(&newbuf[pos], varvalue[j]);
-                    pos = strlen(newbuf);
-                }
-                i--;
-            }
-            else
-            {
-                newbuf[pos] = buffer[i];
-                pos++;
             }
+            close(tfd);
+            return 0;
         }
-        else
-        {
-            newbuf[pos] = buffer[i];
-            pos++;
-        }
+        if(tfd >= 0)
+            close(tfd);
     }
-    if(newbuf[pos-1]!='\n')
+
+    while(nanosleep(&req, &rem) < 0 && errno == EINTR)
     {
-        newbuf[pos]='\n';
-        pos++;
+        //SIGCHLD of a background job also interrupts nanosleep, only ctrl+C ends the sleep
+        if(g_context.interrupted)
+        {
+            fputc('\n', stdout);
+            return 128 + SIGINT;
+        }
+        req = rem;
     }
-    newbuf[pos] = '\0';
-    strcpy(buffer, newbuf);
-    //printf("Decode: %s", buffer);
+    return 0;
 }
 
-void ltrim(char *str)
+typedef struct _test_ctx
 {
-    char *ptr = str;
-    while(isspace(*ptr) || *ptr == '\n')
-        ptr++;
-    memmove(str, ptr, strlen(ptr) + 1);
-}
+    int argc;
+    char **argv;
+    int pos;
+    int error;
+}test_ctx;
 
-void rtrim(char *str)
-{
-    char *ptr = str + strlen(str) - 1;
-    while(ptr >= str && (isspace(*ptr) || *ptr == '\n'))
-        *(ptr--)='\0';
-}
+static int test_expr(test_ctx *t);
 
-int isampersand(char c)
+static int test_isbinop(const char *op)
 {
-    return c == '&';   
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+    int i;
+    for(i = 0; ops[i]; i++)
+        if(!strcmp(ops[i], op))
+            return 1;
+    return 0;
 }
 
-int isinredir(char c)
+static int test_isunop(const char *op)
 {
-    return c == '<';
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghknprsStuwxzLOG", op[1]);
 }
 
-int isoutredir(char c)
+static long long test_int(test_ctx *t, const char *str)
 {
-    return c == '>';
-}
+    char *endptr = NULL;
+    const char *ptr = str;
+    long long val;
 
-int isredir(char c)
-{
-    return (isinredir(c) || isoutredir(c));
+    while(isspace(*ptr))
+        ptr++;
+    errno = 0;
+    val = strtoll(ptr, &endptr, 10);
+    while(endptr && isspace(*endptr))
+        endptr++;
+    if(!*ptr || errno || *endptr)
+    {
+        fprintf(stderr, "-xssh: test: %s: integer expression expected\n", str);
+        t->error = 1;
+    }
+    return val;
 }
 
-int isvalidtokenchar(char c)
+static int test_unary(test_ctx *t, char op, const char *arg)
 {
-    return !(isinredir(c) || isoutredir(c) || isampersand(c) || isspace(c) || c == '\0');
-}
+    struct stat st;
 
-int isvalidfd(const char *ptr)
-{
-    int start=0;
-    if(strlen(ptr) == 0)
-        return 0;
+    switch(op)
+    {
+        case 'n': return arg[0] != '\0';
+        case 'z': return arg[0] == '\0';
+        case 't': return isatty((int)test_int(t, arg));
+        case 'L':
+        case 'h': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(arg, R_OK) == 0;
+        case 'w': return access(arg, W_OK) == 0;
+        case 'x': return access(arg, X_OK) == 0;
+    }
 
-    while(ptr[start] && isdigit(ptr[start])) start++;
-    if(!ptr[start])
-        return 1;
+    if(stat(arg, &st) < 0)
+        return 0;
 
+    switch(op)
+    {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+    }
     return 0;
 }
 
+static int test_binary(test_ctx *t, const char *a, const char *op, const char *b)
+{
+    if(!strcmp(op, "=") || !strcmp(op, "=="))
+        return strcmp(a, b) == 0;
+    if(!strcmp(op, "!="))
+        return strcmp(a, b) != 0;
+    if(!strcmp(op, "<"))
+        return strcmp(a, b) < 0;
+    if(!strcmp(op, ">"))
+        return strcmp(a, b) > 0;
+
+    if(op[1] == 'n' || op[1] == 'o' || !strcmp(op, "-ef"))
+    {
+        struct stat sa, sb;
+        int ra = stat(a, &sa), rb = stat(b, &sb);
+        if(!strcmp(op, "-ef"))
+            return ra == 0 && rb == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if(!strcmp(op, "-nt"))
+            return ra == 0 && (rb < 0 || sa.st_mtime > sb.st_mtime);
+        if(!strcmp(op, "-ot"))
+            return rb == 0 && (ra < 0 || sa.st_mtime < sb.st_mtime);
+    }
 
+    long long x = test_int(t, a), y = test_int(t, b);
+    if(!strcmp(op, "-eq")) return x == y;
+    if(!strcmp(op, "-ne")) return x != y;
+    if(!strcmp(op, "-lt")) return x < y;
+    if(!strcmp(op, "-le")) return x <= y;
+    if(!strcmp(op, "-gt")) return x > y;
+    return x >= y;
+}
 
-/*decode the instruction*/
-int deinstr(char buffer[BUFLEN])
+static int test_primary(test_ctx *t)
 {
-    int i;
-    int flag = 0;
-    for(i = 0; i < INSNUM; i++)
+    char **argv = t->argv;
+    int left = t->argc - t->pos;
+
+    if(left <= 0)
     {
-        flag = 0;
-        int j = 0;
-        int stdlen = strlen(instr[i]);
-        ltrim(buffer);
-        int len = strlen(buffer);
-        if((len == 0) ||(buffer[0]=='#'))
-        {
-            flag = 0;
-            i = INSNUM;
-            break;
-        }
-        for(j = 0; (j < len)&&(j < stdlen); j++)
-        {
-            if(instr[i][j] != buffer[j])
-            {
-                flag = 1;
-                break;
-            }
-        }
-        
-        if((flag == 0) && (i >= 8) && (i <=12))
-        {
-            break;
-        }
-        else if((flag == 0) && (j  == stdlen) && (j <= len) && (buffer[j] == ' '))
-        {
-            break;
-        }
-        else if((flag == 0) && (j == stdlen) && (j <= len) && (i == 5))
-        {
-            break;
-        }
-        else if((flag == 0) && (j == stdlen) && (j <= len) && (i == 7))
-        {
-            break;
-        }
-        else
-        {
-            flag = 1;
-        }
+        fprintf(stderr, "-xssh: test: argument expected\n");
+        t->error = 1;
+        return 0;
     }
-    if(flag == 1)
+
+    //binary operator takes precedence, e.g. "test -n = -n" compares two strings
+    if(left >= 3 && test_isbinop(argv[t->pos + 1]))
     {
-        i = 0;
+        int val = test_binary(t, argv[t->pos], argv[t->pos + 1], argv[t->pos + 2]);
+        t->pos += 3;
+        return val;
     }
-    else
+
+    if(!strcmp(argv[t->pos], "!"))
     {
-        i++;
+        t->pos++;
+        return !test_primary(t);
     }
-    return i;
-}
+
+    if(!strcmp(argv[t->pos], "(") && left >= 2)
+    {
+        t->pos++;
+        int val = test_expr(t);
+        if(t->pos >= t->argc || strcmp(argv[t->pos], ")"))
+        {
+            fprintf(stderr, "-xssh: test: ')' expected\n");
+            t->error = 1;
+            return 0;
+        }
+        t->pos++;
+        return val;
+    }
+
+    if(left >= 2 && test_isunop(argv[t->pos]))
+    {
+        int val = test_unary(t, argv[t->pos][1], argv[t->pos + 1]);
+        t->pos += 2;
+        return val;
+    }
+
+    return argv[t->pos++][0] != '\0';
+}
+
+static int test_and(test_ctx *t)
+{
+    int val = test_primary(t);
+    while(t->pos < t->argc && !strcmp(t->argv[t->pos], "-a"))
+    {
+        t->pos++;
+        val = test_primary(t) && val;
+    }
+    return val;
+}
+
+static int test_expr(test_ctx *t)
+{
+    int val = test_and(t);
+    while(t->pos < t->argc && !strcmp(t->argv[t->pos], "-o"))
+    {
+        t->pos++;
+        val = test_and(t) || val;
+    }
+    return val;
+}
+
+/**
+* @brief  test EXPRESSION / [ EXPRESSION ]. Returns 0 if expression is true, 1 if false and 2 on error.
+*/
+int builtin_test(int argc, char **argv)
+{
+    test_ctx t;
+    int val;
+
+    if(!strcmp(argv[0], "["))
+    {
+        if(strcmp(argv[argc - 1], "]"))
+        {
+            fprintf(stderr, "-xssh: [: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+
+    if(argc <= 1)
+        return 1;
+
+    t.argc = argc;
+    t.argv = argv;
+    t.pos = 1;
+    t.error = 0;
+    val = test_expr(&t);
+    if(!t.error && t.pos != argc)
+    {
+        fprintf(stderr, "-xssh: test: %s: unexpected argument\n", argv[t.pos]);
+        t.error = 1;
+    }
+
+    if(t.error)
+        return 2;
+    return val ? 0 : 1;
+}
+
+/*export variable --- set the variable name in the varname list*/
+void export(char buffer[BUFLEN])
+{
+    int i, j;
+    //flag == 1, if variable name exists in the varname list
+    int flag = 0;
+    //parse and store the variable name in buffer[]
+    char str[BUFLEN];
+    int start = 7;
+    while(buffer[start]==' ')start++;
+    for(i = start; (i < strlen(buffer))&&(buffer[i]!='#')&&(buffer[i]!=' ')&&(buffer[i]!='\n'); i++)
+    {
+        str[i-start] = buffer[i];
+    }
+    str[i-start] = '\0';
+    //hint: try to print "str" and "varname[j]" to see what's stored there
+    for(j = 0; j < varmax; j++)
+    {
+        //FIXME: if the variable name (in "str") exist in the
+        //varname list (in "varname[j]"), set the flag to be 1
+        //using strcmp()
+        
+        if(!strcmp(varname[j], str))
+        {
+            flag = 1;
+            break;
+        }
+    }
+    if(flag == 0 && varmax == BUFLEN)
+    {
+        fprintf(stderr, "-xssh: %s: too many variables\n", str);
+        sprintf(varvalue[1], "%d", 1);
+    }
+    else if(flag == 0) //variable name does not exist in the varname list
+    {
+        //FIXME: copy the variable name to "varname[varmax]" using strcpy()
+        //FIXME: set the corresponding value in "varvalue[varmax]" to empty string '\0'
+        //FIXME: update the 'varmax' (by +1)
+        //FIXME: print "-xssh: Export variable str.", where str is newly exported variable name
+      
+        strcpy(varname[varmax], str);     
+        varvalue[varmax][0]='\0';
+        //variable imported from environment keeps its value
+        if(env_get(str))
+            snprintf(varvalue[varmax], BUFLEN, "%s", env_get(str));
+        else
+            env_set(str, "");
+        varexported[varmax++] = 1;
+        printf("-xssh: Export variable %s.\n", str);
+        sprintf(varvalue[1], "%d", 0);
+    }
+    else //variable name already exists in the varname list
+    {
+        //FIXME: print "-xssh: Existing variable str is value.", where str is newly exported variable name and value is its corresponding value (stored in varvalue list)
+        printf("-xssh:Existing variable %s is %s.\n", str, varvalue[j]);
+        if(j > 2 && !varexported[j])
+        {
+            varexported[j] = 1;
+            env_set(str, varvalue[j]);
+        }
+        sprintf(varvalue[1], "%d", EEXIST);
+    }
+}
+
+/*unexport the variable --- remove the variable name in the varname list*/
+void unexport(char buffer[BUFLEN])
+{
+    int i, j;
+    //flag == 1, if variable name exists in the varname list
+    int flag = 0;
+    //parse and store the variable name in buffer[]
+    char str[BUFLEN];
+    int start = 9;
+    while(buffer[start]==' ')start++;
+    for(i = start; (i < strlen(buffer))&&(buffer[i]!='#')&&(buffer[i]!=' ')&&(buffer[i]!='\n'); i++)
+    {
+        str[i-start] = buffer[i];
+    }
+    str[i-start] = '\0';
+    for(j = 0; j < varmax; j++)
+    {
+        //FIXME: if the variable name (in "str") exist in the
+        //varname list (in "varname[j]"), set the flag to be 1
+        //using strcmp() --- same with export()
+        if(!strcmp(varname[j], str))
+        {
+            flag = 1;
+            break;
+        }
+    }
+    if(flag == 0 && env_get(str)) //variable is only in environment inherited by XSSH
+    {
+        env_unset(str);
+        printf("-xssh: Variable %s is unexported.\n", str);
+        sprintf(varvalue[1], "%d", 0);
+    }
+    else if(flag == 0) //variable name does not exist in the varname list
+    {
+        //FIXME: print "-xssh: Variable str does not exist.",
+        //where str is the variable name to be unexported
+        printf("-xssh: Variable %s does not exist.\n", str);
+        sprintf(varvalue[1], "%d", ENOENT);
+    }
+    else //variable name already exists in the varname list
+    {
+        //FIXME: clear the found variable by setting its
+        //"varname" and "varvalue" both to '\0'
+        //FIXME: print "-xssh: Variable str is unexported.",
+        //where str is the variable name to be unexported
+        if(varexported[j])
+            env_unset(str);
+        varexported[j] = 0;
+        varname[j][0]='\0';
+        varvalue[j][0]='\0';
+        printf("-xssh: Variable %s is unexported.\n", str);
+        sprintf(varvalue[1], "%d", 0);
+    }
+}
+
+/*set the variable --- set the variable value for the given variable name*/
+void set(char buffer[BUFLEN])
+{
+    int i, j;
+    //flag == 1, if variable name exists in the varname list
+    int flag = 0;
+    //parse and store the variable name in buffer[]
+    char str[BUFLEN];
+    int start = 4;
+
+    rtrim(buffer);
+    while(buffer[start]==' ')start++;
+    for(i = start; (i < strlen(buffer))&&(buffer[i]!=' ')&&(buffer[i]!='#'); i++)
+    {
+        str[i-start] = buffer[i];
+    }
+    str[i-start] = '\0';
+    while(buffer[i]==' ')i++;
+    if(buffer[i]=='\n' || buffer[i] == '\0')
+    {
+        printf("No value to set!\n");
+        sprintf(varvalue[1], "%d", EINVAL);
+        return;
+    }
+    for(j = 0; j < varmax; j++)
+    {
+        //FIXME: if the variable name (in "str") exist in the
+        //varname list (in "varname[j]"), set the flag to be 1
+        //using strcmp() --- same with export()
+        //
+        if(!strcmp(varname[j], str))
+        {
+            flag = 1;
+            break;
+        }
+    }
+    if(flag == 0 && env_get(str))
+    {
+        //variable inherited from environment, it can be longer than shell variables so it stays only there
+        rtrim(buffer);
+        int end = i;
+        while(buffer[end] && !isspace(buffer[end])) end++;
+        buffer[end] = '\0';
+        env_set(str, buffer + i);
+        printf("-xssh: Set existing variable %s to %s.\n", str, buffer + i);
+        sprintf(varvalue[1], "%d", 0);
+    }
+    else if(flag == 0)
+    {
+        //FIXME: print "-xssh: Variable str does not exist.",
+        //where str is the variable name to be unexported
+        printf("-xssh: Variable %s does not exist.\n", str);
+        sprintf(varvalue[1], "%d", 2);
+    }
+    else
+    {
+        //hint: try to print "buffer[i]" to see what's stored there
+        //hint: may need to add '\0' by the end of a string
+        //FIXME: set the corresponding varvalue to be value (in buffer[i]) using strcpy()
+        //FIXME: print "-xssh: Set existing variable str to value.", where str is newly exported variable name and value is its corresponding value (stored in varvalue list)
+        rtrim(buffer);
+        start = 4;
+        start += strlen(str) + 1;
+        ltrim(buffer + start);
+        int temp = start;
+        while(buffer[start] && !isspace(buffer[start])) start++;
+        if(isspace(buffer[start]))
+            buffer[start]='\0';
+
+        sprintf(varvalue[j], "%s", buffer + temp);
+        if(varexported[j])
+            env_set(varname[j], varvalue[j]);
+        printf("-xssh: Set existing variable %s to %s.\n", varname[j], varvalue[j]);
+        sprintf(varvalue[1], "%d", 0);
+    }
+}
+
+/*catch the ctrl+C*/
+void catchctrlc()
+{
+    //FIXME: catch the ctrl+C signal
+    //printf("Replace me for catching ctrl+C\n");
+    signal(SIGINT, ctrlc_sig);
+}
+
+/*catch the ctrl+Z*/
+void catchctrlz()
+{
+    //FIXME: catch the ctrl+C signal
+    //printf("Replace me for catching ctrl+C\n");
+    signal(SIGTSTP, ctrlz_sig);
+}
+
+/*catch the SIGCHLD, to time stamp child exits for stats and to wake up poll() through sigchld_pipe.
+ *Reaping is still done by waitid(). Stops are delivered as well, wait_job() needs them when it polls*/
+void catchsigchld()
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigchld_sig;
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+}
+
+void sigchld_sig(int sig, siginfo_t *info, void *ctx)
+{
+    int exited = info->si_code == CLD_EXITED || info->si_code == CLD_KILLED || info->si_code == CLD_DUMPED;
+    if(exited && !g_context.sigchld_ns)
+        g_context.sigchld_ns = now_ns();
+
+    if(g_context.sigchld_pipe[1] > 0)
+    {
+        int saved = errno;
+        char c = 0;
+        if(write(g_context.sigchld_pipe[1], &c, 1) < 0)
+            ;   //pipe is full, poll() wakes up anyway
+        errno = saved;
+    }
+}
+
+/*ctrl+C handler*/
+void ctrlc_sig(int sig)
+{
+    if(g_context.fg_job)
+        sigint_fg_job();        
+    else if(g_context.in_builtin)
+        g_context.interrupted = 1;
+    else
+    {
+        printf("\nxssh>> ");
+        fflush(stdout);       
+    }
+}
+
+void ctrlz_sig(int sig)
+{
+    if(g_context.fg_job)
+        sigtstp_fg_job();
+    else if(g_context.in_builtin)
+        g_context.detach = 1;
+}
+
+/*wait instruction*/
+void waitchild(char buffer[BUFLEN])
+{
+    int i;
+    int start = 5;
+
+    /*store the childpid in pid*/
+    char number[BUFLEN] = {'\0'};
+    while(buffer[start]==' ')start++;
+    for(i = start; (i < strlen(buffer))&&(buffer[i]!='\n')&&(buffer[i]!='#'); i++)
+    {
+        number[i-start] = buffer[i];
+    }
+    number[i-start] = '\0';
+    char *endptr;
+    int pid = strtol(number, &endptr, 10);
+
+    /*simple check to see if the input is valid or not*/
+    if((*number != '\0')&&(*endptr == '\0'))
+    {
+        //FIXME: if pid is not -1, try to wait the background process pid
+        //FIXME: if successful, print "-xssh: Have finished waiting process pid", where pid is the pid of the background process
+        //FIXME: if not successful, print "-xssh: Unsuccessfully wait the background process pid", where pid is the pid of the background process
+
+
+        //FIXME: if pid is -1, print "-xssh: wait childnum background processes" where childnum stores the number of background processes, and wait all the background processes
+        //hint: remember to set the childnum correctly after waiting!
+        
+        fprintf(stderr, "Waiting for child %d\n", pid);  
+
+        //exit(-1);
+        siginfo_t info; 
+        int exitstatus = 0;
+        int ni = 0;
+        do
+        { 
+            int retval = waitid(pid < 0 ? P_ALL : P_PID, pid, &info, WEXITED);
+            if(retval < 0 && errno == ECHILD)
+            {
+                if(ni > 0) 
+                    fprintf(stdout, "-xssh:all child processes are terminated\n");
+                else
+                    fprintf(stdout, "-xssh:no child process exist\n");
+
+                sprintf(varvalue[1], "%d", 0);
+                break;    
+            }
+            else if(retval < 0)
+            {
+                if(pid < 0)
+                    fprintf(stdout, "-xssh:failed to wait for all child process\n");
+                else
+                    fprintf(stdout, "-xssh:failed to wait for %d child process\n", pid);
+                sprintf(varvalue[1], "%d", errno);
+                break;
+            }
+        
+            ni++;    
+            if(info.si_code == CLD_EXITED)
+            {
+                fprintf(stdout, "-xssh: child process %d is terminated with status=%d\n", info.si_pid, info.si_status);
+                fflush(stdout);
+            }
+            else
+            {
+                fprintf(stdout, "-xssh: child process %d is killed by signal=%d\n", info.si_pid, info.si_status);
+                fflush(stdout);
+            }
+
+
+            job_info *job = NULL;
+            proc_info *p = NULL;
+            int found = 0;
+            CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+            {
+                CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+                    if(info.si_pid == p->pid)
+                    { 
+                        found = 1;
+                        break;
+                    }
+
+                if(found)
+                    break; 
+            }            
+            if(found)
+            {
+                if(info.si_code == CLD_EXITED)
+                    process_terminated(job, p->pid, info.si_status);                    
+                else
+                    process_killed(job, p->pid, info.si_status);                    
+                
+                CIRCLEQ_REMOVE(&g_context.bg_jobs, job, link);
+            }
+        }while(pid < 0);
+    }
+    else
+    { 
+        printf("-xssh: wait: Invalid pid\n");
+        sprintf(varvalue[1], "%d", ((unsigned char)-1));
+    }
+}
+
+/*execute the external command*/
+int program(char buffer[BUFLEN])
+{
+    /*if backflag == 0, xssh need to wait for the external command to complete*/
+    /*if backflag == 1, xssh need to execute the external command in the background*/
+    int backflag = 0;
+    char *ptr = strchr(buffer, '&');
+    if(ptr != NULL) backflag = 1;
+
+    pid_t pid;
+    //FIXME: create a new process for executing the external command
+
+    //FIXME: remember to check if the process creation is successful or not. if not, print error message and return -2, see codes below;
+
+
+    //FIXME: write the code to execute the external command in the newly created process, using execvp()
+    //hint: the external command is stored in buffer, but before execute it you may need to do some basic validation check or minor changes, depending on how you execute
+    //FIXME: remember to check if the external command is executed successfully; if not, print error message "-xssh: Unable to execute the instruction buffer", where buffer is replaced with the actual external command to be printed
+    //hint: after executing the extenal command using execvp(), you need to return -1;
+    /*for optional exercise, implement stdin/stdout redirection in here*/
+
+    printf("Replace me for executing external commands\n");
+
+    //FIXME: in the xssh process, remember to act differently, based on whether backflag is 0 or 1
+    //hint: the codes below are necessary to support command "wait -1", but you need to put them in the correct place
+    childnum++;
+    childpid = pid;
+    childnum--; //this may or may not be needed, depending on where you put the previous line
+    //hint: the code below is necessary to support command "show $!", but you need to put it in the correct place
+    sprintf(varvalue[2], "%d\0", pid);
+    return 0;
+}
+
+/*for optional exercise, implement the function below*/
+/*execute the pipe programs*/
+int pipeprog(char buffer[BUFLEN])
+{
+    printf("-xssh: For optional exercise: currently not supported.\n");
+    return 0;
+}
+
+/*Cuts comment off command line, '#' starts a comment at beginning of a word outside of $(...) and `...`*/
+void strip_comment(char *buffer)
+{
+    uint64_t bits[LEX_WORDS(BUFLEN)];
+    size_t len = strnlen(buffer, BUFLEN), i;
+
+    lex_classify(buffer, len, bits);
+    for(i = lex_next(bits, 0, 0, len); i < len; i = lex_next(bits, 0, i + 1, len))
+    {
+        int span = subst_span(buffer + i);
+        if(span)
+            i += span - 1;
+        else if(buffer[i] == '#' && (i == 0 || isspace(buffer[i - 1])))
+        {
+            buffer[i++] = '\n';
+            buffer[i] = '\0';
+            break;
+        }
+    }
+}
+
+/**
+* @brief  Expands variables and command substitutions in words of internal instruction, which parses its command
+*     buffer itself. Words without them are left where they are.
+*
+* @return 0 on success, -1 if substitution failed or expanded words do not fit in buffer
+*/
+int expand_instr(char buffer[BUFLEN])
+{
+    char out[BUFLEN] = "";
+    char word[BUFLEN];
+    const char *ptr = buffer;
+    int len = 0, k;
+
+    if(!strpbrk(buffer, "$`"))
+        return 0;
+
+    while(*ptr)
+    {
+        char **fields = NULL;
+        int n = 0, nfields = 0;
+
+        if(isspace(*ptr))
+        {
+            ptr++;
+            continue;
+        }
+
+        //$(...) and `...` are part of word
+        while(*ptr && !isspace(*ptr))
+        {
+            int span = subst_span(ptr);
+            memcpy(word + n, ptr, span ? span : 1);
+            n += span ? span : 1;
+            ptr += span ? span : 1;
+        }
+        word[n] = '\0';
+
+        if(has_subst(word))
+            nfields = subst_fields(word, 1, &fields);
+        else if(strchr(word, '$'))
+        {
+            fields = malloc(sizeof(char *));
+            if(fields && !(fields[0] = expand_word(word)))
+            {
+                free(fields);
+                fields = NULL;
+            }
+            nfields = fields ? 1 : -1;
+        }
+        if(nfields < 0)
+            return -1;
+
+        for(k = 0; k < (fields ? nfields : 1); k++)
+        {
+            const char *value = fields ? fields[k] : word;
+            if(len + (len > 0) + strlen(value) >= BUFLEN - 1)
+                len = BUFLEN;
+            else
+                len += sprintf(out + len, len ? " %s" : "%s", value);
+        }
+        for(k = 0; k < nfields; k++)
+            free(fields[k]);
+        free(fields);
+
+        if(len == BUFLEN)
+        {
+            fprintf(stderr, "-xssh: expanded command is longer than %d bytes\n", BUFLEN - 2);
+            return -1;
+        }
+    }
+    snprintf(buffer, BUFLEN, "%s\n", out);
+    return 0;
+}
+
+void ltrim(char *str)
+{
+    char *ptr = str;
+    while(isspace(*ptr) || *ptr == '\n')
+        ptr++;
+    memmove(str, ptr, strlen(ptr) + 1);
+}
+
+void rtrim(char *str)
+{
+    char *ptr = str + strlen(str) - 1;
+    while(ptr >= str && (isspace(*ptr) || *ptr == '\n'))
+        *(ptr--)='\0';
+}
+
+/**
+* @brief  Structural bitmap of command text. Bit i (bits[i / 64], bit i % 64) is set if byte i is one of
+*  | < > & # $ ( ) ` or white space, all other bytes belong to words. Lexer jumps from one structural byte to the
+*  next instead of testing each byte.
+*
+*  Kernels classify 16 (SSE2) or 32 (AVX2) bytes at once, best one supported by CPU is chosen at first use,
+*  XSSH_LEX=scalar|sse2|avx2 forces one.
+*/
+typedef void (*lex_classify_fn)(const char *buf, size_t len, uint64_t *bits);
+
+static const unsigned char lex_structural[256] =
+{
+    ['|'] = 1, ['<'] = 1, ['>'] = 1, ['&'] = 1, ['#'] = 1, ['$'] = 1, ['('] = 1, [')'] = 1, ['`'] = 1,
+    [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1
+};
+
+static void lex_classify_tail(const char *buf, size_t i, size_t len, uint64_t *bits)
+{
+    for(; i < len; i++)
+        if(lex_structural[(unsigned char)buf[i]])
+            bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static void lex_classify_scalar(const char *buf, size_t len, uint64_t *bits)
+{
+    memset(bits, 0, LEX_WORDS(len) * sizeof(uint64_t));
+    lex_classify_tail(buf, 0, len, bits);
+}
+
+#ifdef XSSH_LEX_X86
+/*Compares against each structural byte, white space \t..\r is one unsigned range check (min_epu8)*/
+__attribute__((target("sse2")))
+static void lex_classify_sse2(const char *buf, size_t len, uint64_t *bits)
+{
+    const __m128i ws_first = _mm_set1_epi8('\t'), ws_span = _mm_set1_epi8('\r' - '\t');
+    const __m128i sp = _mm_set1_epi8(' '), bar = _mm_set1_epi8('|'), lt = _mm_set1_epi8('<');
+    const __m128i gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&'), hash = _mm_set1_epi8('#');
+    const __m128i dollar = _mm_set1_epi8('$'), lpar = _mm_set1_epi8('('), rpar = _mm_set1_epi8(')');
+    const __m128i tick = _mm_set1_epi8('`');
+    size_t i = 0;
+
+    memset(bits, 0, LEX_WORDS(len) * sizeof(uint64_t));
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i ws = _mm_sub_epi8(v, ws_first);
+        __m128i m = _mm_cmpeq_epi8(_mm_min_epu8(ws, ws_span), ws);
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, bar)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, amp), _mm_cmpeq_epi8(v, hash)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, dollar), _mm_cmpeq_epi8(v, lpar)));
+        m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(v, rpar), _mm_cmpeq_epi8(v, tick)));
+        bits[i / 64] |= (uint64_t)(uint16_t)_mm_movemask_epi8(m) << (i % 64);
+    }
+    lex_classify_tail(buf, i, len, bits);
+}
+
+/**
+*  Nibble lookup: byte is structural if lo[low nibble] & hi[high nibble] is not zero. Classes are
+*  1: 0x09-0x0d, 2: 0x20 0x23 0x24 0x26 0x28 0x29, 4: 0x3c 0x3e, 8: 0x7c, 16: 0x60.
+*/
+__attribute__((target("avx2")))
+static void lex_classify_avx2(const char *buf, size_t len, uint64_t *bits)
+{
+    const __m256i lo = _mm256_setr_epi8(18, 0, 0, 2, 2, 0, 2, 0, 2, 3, 1, 1, 13, 1, 4, 0,
+                                        18, 0, 0, 2, 2, 0, 2, 0, 2, 3, 1, 1, 13, 1, 4, 0);
+    const __m256i hi = _mm256_setr_epi8(1, 0, 2, 4, 0, 0, 16, 8, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        1, 0, 2, 4, 0, 0, 16, 8, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+
+    memset(bits, 0, LEX_WORDS(len) * sizeof(uint64_t));
+    for(; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i l = _mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble));
+        __m256i h = _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i m = _mm256_cmpeq_epi8(_mm256_and_si256(l, h), _mm256_setzero_si256());
+        bits[i / 64] |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(m) << (i % 64);
+    }
+    lex_classify_tail(buf, i, len, bits);
+}
+#endif
+
+typedef struct _lex_kernel
+{
+    const char *name;
+    lex_classify_fn fn;
+}lex_kernel;
+
+static const lex_kernel lex_kernels[] =
+{
+    {"scalar", lex_classify_scalar},
+#ifdef XSSH_LEX_X86
+    {"sse2",   lex_classify_sse2},
+    {"avx2",   lex_classify_avx2},
+#endif
+    {NULL,     NULL}
+};
+
+static lex_classify_fn lex_impl;
+
+static int lex_supported(const lex_kernel *k)
+{
+#ifdef XSSH_LEX_X86
+    if(k->fn == lex_classify_sse2)
+        return __builtin_cpu_supports("sse2");
+    if(k->fn == lex_classify_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/*Picks kernel: XSSH_LEX if set and supported, else last (widest) supported one*/
+static lex_classify_fn lex_select()
+{
+    const char *env = getenv("XSSH_LEX");
+    lex_classify_fn fn = lex_classify_scalar;
+    int i;
+
+    for(i = 0; lex_kernels[i].name; i++)
+    {
+        if(!lex_supported(&lex_kernels[i]))
+            continue;
+        if(env && !strcmp(env, lex_kernels[i].name))
+            return lex_kernels[i].fn;
+        fn = lex_kernels[i].fn;
+    }
+    return fn;
+}
+
+/**
+* @brief  Fills structural bitmap of buf, bits shall have LEX_WORDS(len) words.
+*/
+void lex_classify(const char *buf, size_t len, uint64_t *bits)
+{
+    if(!lex_impl)
+        lex_impl = lex_select();
+    lex_impl(buf, len, bits);
+}
+
+/**
+* @brief  Position of first structural byte at or after from, positions are relative to base within bitmap.
+*
+* @return position or len if there is none before len
+*/
+size_t lex_next(const uint64_t *bits, size_t base, size_t from, size_t len)
+{
+    size_t pos = base + from, end = base + len;
+
+    while(pos < end)
+    {
+        uint64_t w = bits[pos / 64] >> (pos % 64);
+        if(w)
+        {
+            pos += __builtin_ctzll(w);
+            return pos < end ? pos - base : len;
+        }
+        pos = (pos / 64 + 1) * 64;
+    }
+    return len;
+}
+
+/**
+* @brief  xssh --bench-lex [MB]: measures structural classification of each supported kernel and whole command
+*  parsing (create_job) on generated script of MB megabytes and prints GB/s. "make bench" runs it from an -O2 build.
+*  Parsing gains little: lines are at most BUFLEN bytes, so per line costs (allocation) outweigh the scan.
+*/
+int lex_bench(int mb)
+{
+    static const char *lines[] =
+    {
+        "cat input_%d.txt | grep -v pattern | sort -u > out_%d.log 2>&1",
+        "X=%d make -j8 target_%d >> build.log &",
+        "echo $HOME/dir_%d/file_%d.c | wc -c",
+        "tee >(gzip > a_%d.gz) < data_%d.bin > /dev/null",
+        "./generated_command_number_%d --flag=value_%d --another-long-option",
+    };
+    size_t size = (size_t)mb << 20, len = 0, nlines = 0, i;
+    char *script = NULL;
+    uint64_t *bits = NULL, *ref = NULL;
+    int k, n = 0;
+
+    script = malloc(size + BUFLEN);
+    bits = malloc(LEX_WORDS(size + BUFLEN) * sizeof(uint64_t));
+    ref = malloc(LEX_WORDS(size + BUFLEN) * sizeof(uint64_t));
+    if(!script || !bits || !ref)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return 1;
+    }
+    while(len < size)
+    {
+        len += sprintf(script + len, lines[n % 5], n, n);
+        script[len++] = '\n';
+        n++;
+        nlines++;
+    }
+
+    printf("lex bench: %zu bytes, %zu lines\n", len, nlines);
+    lex_classify_scalar(script, len, ref);
+    for(k = 0; lex_kernels[k].name; k++)
+    {
+        uint64_t start, ns;
+        int reps = 0;
+
+        if(!lex_supported(&lex_kernels[k]))
+        {
+            printf("  %-8s not supported by CPU\n", lex_kernels[k].name);
+            continue;
+        }
+
+        start = now_ns();
+        do
+        {
+            lex_kernels[k].fn(script, len, bits);
+            reps++;
+        }while((ns = now_ns() - start) < 500000000ULL);
+
+        printf("  %-8s classify %7.2f GB/s%s\n", lex_kernels[k].name, (double)len * reps / ns,
+               memcmp(bits, ref, LEX_WORDS(len) * sizeof(uint64_t)) ? "  MISMATCH" : "");
+    }
+
+    //whole parse of each line, with scalar and with selected kernel
+    for(k = 0; k < 2; k++)
+    {
+        uint64_t start = now_ns(), ns;
+        char buffer[BUFLEN];
+        char *line = script, *end = NULL;
+
+        lex_impl = k ? lex_select() : lex_classify_scalar;
+        while(line < script + len)
+        {
+            end = strchr(line, '\n');
+            memcpy(buffer, line, end - line);
+            buffer[end - line] = '\0';
+            destroy_job(create_job(buffer));
+            line = end + 1;
+        }
+        ns = now_ns() - start;
+        for(i = 0; lex_kernels[i].name && lex_kernels[i].fn != lex_impl; i++)
+            ;
+        printf("  parse %-8s %7.3f GB/s, %.0f lines/s\n", lex_kernels[i].name, (double)len / ns, nlines * 1e9 / ns);
+    }
+
+    lex_impl = NULL;
+    free(script);
+    free(bits);
+    free(ref);
+    return 0;
+}
+
+int isampersand(char c)
+{
+    return c == '&';   
+}
+
+int isinredir(char c)
+{
+    return c == '<';
+}
+
+int isoutredir(char c)
+{
+    return c == '>';
+}
+
+int isredir(char c)
+{
+    return (isinredir(c) || isoutredir(c));
+}
+
+int isvalidtokenchar(char c)
+{
+    return !(isinredir(c) || isoutredir(c) || isampersand(c) || isspace(c) || c == '\0');
+}
+
+int isvalidfd(const char *ptr)
+{
+    int start=0;
+    if(strlen(ptr) == 0)
+        return 0;
+
+    while(ptr[start] && isdigit(ptr[start])) start++;
+    if(!ptr[start])
+        return 1;
+
+    return 0;
+}
+
+
+
+/*decode the instruction*/
+int deinstr(char buffer[BUFLEN])
+{
+    int i;
+    int flag = 0;
+    for(i = 0; i < INSNUM; i++)
+    {
+        flag = 0;
+        int j = 0;
+        int stdlen = strlen(instr[i]);
+        ltrim(buffer);
+        int len = strlen(buffer);
+        if((len == 0) ||(buffer[0]=='#'))
+        {
+            flag = 0;
+            i = INSNUM;
+            break;
+        }
+        for(j = 0; (j < len)&&(j < stdlen); j++)
+        {
+            if(instr[i][j] != buffer[j])
+            {
+                flag = 1;
+                break;
+            }
+        }
+        
+        if((flag == 0) && (i >= 8) && (i <=12))
+        {
+            break;
+        }
+        else if((flag == 0) && (j  == stdlen) && (j <= len) && (buffer[j] == ' '))
+        {
+            break;
+        }
+        else if((flag == 0) && (j == stdlen) && (j <= len) && (i == 5))
+        {
+            break;
+        }
+        else if((flag == 0) && (j == stdlen) && (j <= len) && (i == 7))
+        {
+            break;
+        }
+        else if((flag == 0) && (j == stdlen) && (j <= len) && (i >= 13) && (buffer[j] == '\n' || buffer[j] == '\0'))
+        {
+            break;
+        }
+        else
+        {
+            flag = 1;
+        }
+    }
+    if(flag == 1)
+    {
+        i = 0;
+    }
+    else
+    {
+        i++;
+    }
+    return i;
+}
+
+/**
+* @brief This function parse the Command buffer and determines information such as command arguments and recirecton info.
+*
+* @param proc_buffer [IN] Command buffer for a single command being parsed.
+*
+* @return instance of proc_info structure on sucess else NULL
+*/
+/**
+* @brief  Parses command text of one process.
+*
+* @param bits [IN] structural bitmap of whole command line (see lex_classify)
+* @param base [IN] offset of proc_buffer in command line
+*/
+proc_info * create_proc(const char *proc_buffer, const uint64_t *bits, size_t base)
+{
+    int retval = 0;
+    int token = 0;
+    int len = 0;
+    int i = 0;
+    int j = 0;
+    int nargs = 0; 
+    int cur_off = 0;
+    int prev_off = 0;
+    int *offs = NULL;
+    char *cur_token = NULL;
+    char *prev_token = NULL;
+
+    proc_info *p = NULL;
+    redirect_info *rinfo = NULL;
+
+    len = strlen(proc_buffer);
+    cur_token = malloc(BUFLEN);
+    if(!cur_token)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        retval = -1;
+        goto done;
+    }
+    memset(cur_token, 0, BUFLEN);
+
+    prev_token = malloc(BUFLEN);
+    if(!prev_token)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        retval = -1;
+        goto done;
+    }
+    memset(prev_token, 0, BUFLEN);
+
+    //offsets of arguments in words, a word takes at least two characters with its separator
+    offs = malloc(sizeof(int) * (len / 2 + 2));
+    if(!offs)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        retval = -1;
+        goto done;
+    }
+
+    p = malloc(sizeof(proc_info));
+    if(!p)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        retval = -1;
+        goto done;   
+    }
+    memset(p, 0, sizeof(proc_info));
+    CIRCLEQ_INIT(&p->redirect_info_list); 
+
+    p->words = strdup(proc_buffer);
+    if(!p->words)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        retval = -1;
+        goto done;
+    }
+    p->words_len = len + 1;
+
+    while(i <= len)
+    {
+        // if character is one of '>', '<', '&', '\0', ' ' then is invalid char for a token. 
+        if(!isvalidtokenchar(proc_buffer[i]))
+        {
+            if(token)
+            { 
+                memcpy(cur_token, &proc_buffer[j], i - j);
+                cur_token[i - j] = '\0';
+                //word ends at separator, which is still read from proc_buffer
+                p->words[i] = '\0';
+                cur_off = j;
+                token = 0;
+            }
+        }
+        else
+        {
+            int span = subst_span(&proc_buffer[i]);
+            if(!token)
+            {
+                j = i;
+                token = 1;
+            }
+            //rest of word up to next structural byte is taken at once, $(...) and `...` are part of word
+            i = span ? i + span : lex_next(bits, base, i + 1, len);
+            continue;
+        } 
+
+        if(rinfo)
+        {
+            if(strlen(cur_token))
+            { 
+                int fd = -1;
+                char *file = strdup(cur_token); 
+
+                if(file == NULL)
+                {
+                    fprintf(stderr, "-xssh:%s(%d)]: malloc failed", __FUNCTION__, __LINE__);
+                    retval = -1;
+                    goto done;
+                }
+
+                if(isvalidfd(cur_token))
+                    fd = atol(cur_token);
+
+                //here-document delimiter is taken literally
+                if(strpbrk(file, "$`") && rinfo->mode != 6)
+                    rinfo->expand = 1;
+
+                if(rinfo->mode == 1)
+                {
+                    rinfo->dstfile = file;
+                    rinfo->dstfd = -1;
+                    //fprintf(stdout, "%d>%s\n", rinfo.srcfd, rinfo.dstfile);
+                }
+
+                if(rinfo->mode == 2)
+                {
+                    rinfo->dstfile = file;
+                    rinfo->dstfd = -1;
+                    //fprintf(stdout, "%d>>%s\n", rinfo.srcfd, rinfo.dstfile);
+                }
+
+                if(rinfo->mode == 3)
+                {
+                    rinfo->dstfd = fd;
+                    rinfo->dstfile = file;
+
+                    if(rinfo->dstfd >=0)
+                    {
+                        free(rinfo->dstfile);
+                        rinfo->dstfile = NULL;
+                    }
+
+                    if(rinfo->dstfile)
+                    {
+                        if(rinfo->srcfd != 1)
+                        {
+                            fprintf(stderr, "-xssh:%s ambiguous redirect", cur_token);
+                            retval = -1;
+                            goto done;
+                        }
+                        else
+                            rinfo->mode = 1;
+                    }
+
+                    //if(rinfo->dstfile)
+                    //fprintf(stdout, "%d>%s\n", rinfo.srcfd, rinfo.dstfile);
+                    //else
+                    //fprintf(stdout, "%d>&%d\n", rinfo.srcfd, rinfo.dstfd);
+                }
+
+                if(rinfo->mode == 4)
+                {
+                    rinfo->srcfd = -1;
+                    rinfo->srcfile = file;
+                    //fprintf(stdout, "%d<%s\n", rinfo->dstfd, rinfo->srcfile);   
+                }
+
+                if(rinfo->mode == 5)
+                {
+                    rinfo->dstfd = fd;
+                    rinfo->dstfile = file;
+
+                    if(rinfo->dstfd >=0)
+                    {
+                        free(rinfo->dstfile);
+                        rinfo->dstfile = NULL;
+                    }
+
+                    if(rinfo->dstfile)
+                    {
+                        fprintf(stderr, "-xssh:%s ambiguous redirect", cur_token);
+                        retval = -1;
+                        goto done;
+                    }
+
+                    //fprintf(stdout, "%d<&%d\n", rinfo->dstfd, rinfo->srcfd);   
+                }
+
+                if(rinfo->mode == 6 || rinfo->mode == 7)
+                {
+                    rinfo->srcfd = -1;
+                    rinfo->srcfile = file;
+                }
+
+                CIRCLEQ_INSERT_TAIL(&p->redirect_info_list, rinfo, link);
+                rinfo = NULL;
+                cur_token[0] = '\0';
+            }
+        }
+
+        if(p->background)
+        {
+            if(strlen(cur_token) != 0)
+            {
+                fprintf(stderr, "-xssh:%s ambiguous redirect", cur_token);
+                retval = -1;
+                goto done;
+            }
+        }
+
+        //symbol 
+        memcpy(prev_token, cur_token, strlen(cur_token) + 1);
+        prev_off = cur_off;
+        cur_token[0] = '\0';
+
+        //if char is either '<' or '>'.
+        if(isredir(proc_buffer[i]))
+        {
+            if(rinfo || p->background)
+            {
+                fprintf(stderr, "-xssh: syntax error near unexpected token `%c'", proc_buffer[i]);
+                retval = -1;
+                goto done;
+            }
+
+            rinfo = malloc(sizeof(redirect_info));
+            if(!rinfo)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                retval = -1;
+                goto done;
+            }
+            memset(rinfo, 0, sizeof(redirect_info)); 
+            rinfo->srcfd = -1;
+            rinfo->srcfile = NULL;
+            rinfo->dstfile = NULL;
+            rinfo->dstfd = -1; 
+
+            int fd = -1;
+            int start = 0;
+
+            if(isvalidfd(prev_token))
+                fd = atol(prev_token);
+
+            if(fd >= 0)
+                prev_token[0]='\0';
+
+            if(isoutredir(proc_buffer[i]))
+            {
+                rinfo->srcfile = NULL; 
+                rinfo->srcfd = fd; 
+                if(rinfo->srcfd < 0)
+                    rinfo->srcfd = 1;
+
+                rinfo->mode = 1;
+                if(((i + 1) < len) && isoutredir(proc_buffer[i + 1]))
+                {
+                    rinfo->mode = 2;
+                    i++;
+                }
+                else if(((i + 1)< len) && isampersand(proc_buffer[i + 1]))
+                {
+                    rinfo->mode = 3;
+                    i++;
+                }
+                else if(((i + 1) < len) && proc_buffer[i + 1] == '(')
+                {
+                    //>(command) takes everything up to matching ')' as command
+                    int depth = 0, k;
+                    for(k = i + 1; k < len; k++)
+                    {
+                        if(proc_buffer[k] == '(')
+                            depth++;
+                        else if(proc_buffer[k] == ')' && --depth == 0)
+                            break;
+                    }
+
+                    if(k >= len)
+                    {
+                        fprintf(stderr, "-xssh: syntax error near unexpected token `('");
+                        retval = -1;
+                        goto done;
+                    }
+
+                    rinfo->mode = 8;
+                    rinfo->dstfile = strndup(&proc_buffer[i + 2], k - i - 2);
+                    if(!rinfo->dstfile)
+                    {
+                        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                        retval = -1;
+                        goto done;
+                    }
+                    CIRCLEQ_INSERT_TAIL(&p->redirect_info_list, rinfo, link);
+                    rinfo = NULL;
+                    i = k;
+                }
+            }
+            else
+            {
+                rinfo->srcfd = -1;
+                rinfo->srcfile = NULL;
+                rinfo->dstfile = NULL;
+                rinfo->dstfd = fd; 
+                if(rinfo->dstfd < 0)
+                    rinfo->dstfd = 0;
+
+                rinfo->mode = 4;
+                if(((i + 1) < len) && isampersand(proc_buffer[i + 1]))
+                {
+                    rinfo->mode = 5;
+                    i++;
+                }
+                else if(((i + 1) < len) && isinredir(proc_buffer[i + 1]))
+                {
+                    rinfo->mode = 6;
+                    i++;
+                    if(((i + 1) < len) && isinredir(proc_buffer[i + 1]))
+                    {
+                        rinfo->mode = 7;
+                        i++;
+                    }
+                }
+            }
+
+        }
+        else if (isampersand(proc_buffer[i]))  //If char is '&'
+        {
+            if(rinfo)
+            {
+                fprintf(stderr, "-xssh: syntax error near unexpected token `&'");
+                retval = -1;
+                goto done;
+            }
+
+            p->background = 1;
+        }else if(proc_buffer[i] == '\0')
+        {
+            if(rinfo)
+            {
+                fprintf(stderr, "-xssh: syntax error near unexpected token `newline'");
+                retval = -1;
+                goto done;
+            }
+        }
+
+        if(strlen(prev_token) != 0)
+        {
+            //consuming it as an argument to program
+            //printf("argument = %s\n", prev_token); 
+            offs[nargs++] = prev_off;
+        }
+        i++; 
+    }
+
+    if(nargs)
+    {
+        int cnt = 0;
+
+        //args[0] (command name copy) and arguments are slices of words, no copy is made
+        nargs +=1; 
+        p->args = malloc(sizeof(char*) * (nargs + 1));
+        p->dollar = malloc(sizeof(short) * (nargs + 1));
+        if(!p->args || !p->dollar)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            retval = -1;
+            goto done;
+        }
+        p->nargs = nargs;
+
+        for(cnt = 0; cnt < nargs; cnt++)
+        {
+            char *dollar = NULL;
+
+            p->args[cnt] = p->words + offs[cnt ? cnt - 1 : 0];
+            dollar = strpbrk(p->args[cnt], "$`");
+            p->dollar[cnt] = dollar ? dollar - p->args[cnt] : -1;
+        }
+        p->args[cnt] = NULL;
+    } 
+
+done:
+    if(rinfo)
+        destroy_redirectinfo(rinfo);
+
+    free(offs);
+
+    if(prev_token)
+        free(prev_token);
+
+    if(cur_token)
+        free(cur_token);
+
+    if(retval != 0)
+    {
+        if(p)
+            destroy_proc(p);
+        p = NULL;
+    }
+    return p;
+}
+
+void destroy_redirectinfo(redirect_info *rinfo)
+{
+    if(!rinfo)
+        return;
+
+    if(rinfo->srcfile)
+        free(rinfo->srcfile);
+
+    if(rinfo->dstfile)
+        free(rinfo->dstfile);
+
+    if(rinfo->body)
+        free(rinfo->body);
+
+    if(rinfo->memfd > 0)
+        close(rinfo->memfd);
+
+    free(rinfo);
+}
+
+void destroy_proc(proc_info *p)
+{
+    if(!p)
+        return;
+
+    while(!CIRCLEQ_EMPTY(&p->redirect_info_list))
+    {
+        redirect_info *rinfo = CIRCLEQ_FIRST(&p->redirect_info_list); 
+        CIRCLEQ_REMOVE(&p->redirect_info_list, rinfo, link);
+        destroy_redirectinfo(rinfo);
+    }
+
+    if(p->nargs)
+    {
+        int i = 0;
+        for(i = 0; i < p->nargs; i++)
+            free_arg(p, p->args[i]);
+        free(p->args);
+    }
+
+    free(p->dollar);
+    free(p->words);
+    free(p);
+}
+
+/*Frees argument of process unless it is a slice of its words or of glob arena*/
+void free_arg(proc_info *p, char *arg)
+{
+    if(!arg || (arg >= p->glob_arena && arg < p->glob_arena + p->glob_len) ||
+       (arg >= p->words && arg < p->words + p->words_len))
+        return;
+    free(arg);
+}
+
+/**
+* @brief  Replaces argument i of process by fields of its command substitutions (see subst_fields()). An assignment
+*     is not split. Argument without fields is removed, process without any argument left has none (nargs 0) like
+*     a command of only redirections.
+*
+* @return number of fields or -1 on failure
+*/
+static int expand_fields(proc_info *p, int i)
+{
+    char **fields = NULL, **args = NULL;
+    short *dollar = NULL;
+    int n, k;
+
+    n = subst_fields(p->args[i], !is_assignment(p->args[i]), &fields);
+    if(n < 0)
+        return -1;
+
+    args = malloc((p->nargs + n) * sizeof(char *));
+    dollar = malloc((p->nargs + n) * sizeof(short));
+    if(!args || !dollar)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        for(k = 0; k < n; k++)
+            free(fields[k]);
+        free(fields);
+        free(args);
+        free(dollar);
+        return -1;
+    }
+
+    //fields are done, so their dollar is -1
+    memcpy(args, p->args, i * sizeof(char *));
+    memcpy(dollar, p->dollar, i * sizeof(short));
+    for(k = 0; k < n; k++)
+    {
+        args[i + k] = fields[k];
+        dollar[i + k] = -1;
+    }
+    memcpy(args + i + n, p->args + i + 1, (p->nargs - i) * sizeof(char *));
+    memcpy(dollar + i + n, p->dollar + i + 1, (p->nargs - i - 1) * sizeof(short));
+    free(fields);
+
+    free_arg(p, p->args[i]);
+    free(p->args);
+    free(p->dollar);
+    p->args = args;
+    p->dollar = dollar;
+    p->nargs += n - 1;
+
+    //only copy of command name (args[0]) is left
+    if(p->nargs == 1)
+    {
+        free_arg(p, p->args[0]);
+        free(p->args);
+        p->args = NULL;
+        p->nargs = 0;
+    }
+    return n;
+}
+
+/**
+* @brief  Expands variables and command substitutions of arguments and redirection files of job. Parser recorded
+*     which arguments have them, all other arguments stay slices of command text. Value of a variable is a single
+*     argument and output of a command substitution is split into arguments, so '|', '>', '#' or spaces in them are
+*     never parsed as syntax.
+*
+* @return 0 on success else -1
+*/
+int expand_job(job_info *job)
+{
+    proc_info *p = NULL;
+    redirect_info *rinfo = NULL;
+    int i;
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        for(i = 0; p->dollar && i < p->nargs; i++)
+        {
+            char *value = NULL;
+
+            if(p->dollar[i] < 0)
+                continue;
+            if(has_subst(p->args[i]))
+            {
+                int n = 0;
+
+                //args[0] is copied from args[1] once that is expanded, so inner commands run once
+                if(i == 0)
+                    continue;
+                n = expand_fields(p, i);
+                if(n < 0)
+                    return -1;
+                i += n - 1;
+                continue;
+            }
+            value = expand_word(p->args[i]);
+            if(!value)
+                return -1;
+            free_arg(p, p->args[i]);
+            p->args[i] = value;
+        }
+        //argument list may now be rearranged (globs, timeout)
+        free(p->dollar);
+        p->dollar = NULL;
+
+        if(p->nargs > 1 && strcmp(p->args[0], p->args[1]))
+        {
+            char *name = strdup(p->args[1]);
+            if(!name)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                return -1;
+            }
+            free_arg(p, p->args[0]);
+            p->args[0] = name;
+        }
+
+        CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+        {
+            char **file = rinfo->srcfile ? &rinfo->srcfile : &rinfo->dstfile;
+            char *value = NULL;
+
+            if(!rinfo->expand)
+                continue;
+            if(has_subst(*file))
+            {
+                char **fields = NULL;
+
+                //file name is a single word, output is not split
+                if(subst_fields(*file, 0, &fields) < 0)
+                    return -1;
+                value = fields[0];
+                free(fields);
+            }
+            else
+                value = expand_word(*file);
+            if(!value)
+                return -1;
+            free(*file);
+            *file = value;
+            rinfo->expand = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief  This function parse the command buffer and deteremines processes and thier redirection info then if parsing is successful
+* it allocates a job_info structure.
+*
+* @param buffer[BUFLEN]  [IN] Buffer to parsed
+*
+* @return job_info structure
+*/
+/*strtok_r() for '|' which leaves '|' inside parentheses of >(command) and inside $(...) or `...` alone. Only
+ *structural bytes of line (bits) are visited*/
+static char *split_stage(char *str, char **saveptr, char *line, size_t len, const uint64_t *bits)
+{
+    char *s = str ? str : *saveptr;
+    char *e = NULL;
+    int depth = 0;
+
+    if(!s)
+        return NULL;
+
+    while(*s == '|')
+        s++;
+    if(*s == '\0')
+    {
+        *saveptr = s;
+        return NULL;
+    }
+
+    for(e = line + lex_next(bits, 0, s - line, len); *e && (*e != '|' || depth > 0);
+        e = line + lex_next(bits, 0, e - line + 1, len))
+    {
+        int span = subst_span(e);
+        if(span)
+            e += span - 1;
+        else if(*e == '(')
+            depth++;
+        else if(*e == ')' && depth > 0)
+            depth--;
+    }
+
+    if(*e)
+        *e++ = '\0';
+    *saveptr = e;
+    return s;
+}
+
+job_info * create_job(char buffer[BUFLEN])
+{
+    int retval = 0;
+    int c = 0, k = 0;
+    char *saveptr = NULL;
+    char *token = NULL;
+    char cmdBuffer[BUFLEN]={0};
+    job_info *job = NULL;
+    proc_info *p = NULL;
+
+    uint64_t bits[LEX_WORDS(BUFLEN)];
+    size_t len = 0;
+
+    ltrim(buffer);
+    rtrim(buffer);
+
+    strcpy(cmdBuffer, buffer);
+    len = strlen(buffer);
+    lex_classify(buffer, len, bits);
+
+    token = split_stage(buffer, &saveptr, buffer, len, bits);
+    while (token != NULL)
+    {
+        p = create_proc(token, bits, token - buffer);
+        if(!p)
+        {
+            retval = -1;
+            goto done;
+        }
+
+        if(!job)
+        {
+            job = malloc(sizeof(job_info));
+            if(!job)
+            {
+                fprintf(stderr, "-xssh:%s(%d)]: malloc failed", __FUNCTION__, __LINE__);
+                retval = -1;
+                goto done;
+            }
+            memset(job, 0, sizeof(job_info));
+            CIRCLEQ_INIT(&job->proc_info_list);
+        }
+
+
+       /* If '|' exists. It means more than one commands are piped together. 
+        * So each process get appended in job_info's process list in same order 
+        * as they are present in command buffer.
+        */
+        token = split_stage(NULL, &saveptr, buffer, len, bits);
+      
+        /*If sets of commands supposed to run in background then last process background field shall be set
+         * to 1 by create_proc functon.
+         * If background flag is set for a command but it is not the last command in command list
+         * then parser will fail.
+         */
+        if(p->background && token)
+        {
+            fprintf(stderr, "-xssh: syntax error near unexpected token `|'");
+            retval = -1;
+            goto done;
+        }
+        
+        if(p->background)
+            job->background = 1;   
+
+        CIRCLEQ_INSERT_TAIL(&job->proc_info_list, p, link);
+        job->nprocs++;
+        p = NULL; 
+    }
+
+
+    if(job->background)
+        cmdBuffer[strlen(cmdBuffer)-1]='\0';
+    strcpy(job->cmd, cmdBuffer);
+
+done:
+
+    if(p)
+        destroy_proc(p);
+    if(retval != 0)
+    {
+        destroy_job(job);
+        job = NULL;
+    }
+    return job;
+}
+
+void destroy_job(job_info *job)
+{
+    if(!job)
+        return;
+
+    while(!CIRCLEQ_EMPTY(&job->proc_info_list))
+    {
+        proc_info *p = CIRCLEQ_FIRST(&job->proc_info_list);
+        CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
+        destroy_proc(p);
+    }
+
+    if(job->task)
+        task_finished(job);
+    free(job->glob_arena);
+    if(job->meters)
+        munmap(job->meters, job->nmeters * sizeof(pipe_meter));
+    timeout_disarm(job);
+    free(job->cache_path);
+    free(job->helpers);
+    free(job);
+}
+
+/*Words which start or end a compound command, they can not be used as command names*/
+static const char *ast_keywords[] = {"if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for", "{", "}", NULL};
+
+static int ast_inlist(const char *word, const char **list)
+{
+    int i;
+    for(i = 0; list && list[i]; i++)
+        if(!strcmp(word, list[i]))
+            return 1;
+    return 0;
+}
+
+static int ps_isdelim(char c)
+{
+    return c == '\0' || c == ';' || c == '\n' || c == ' ' || c == '\t';
+}
+
+/*Returns length of && or || operator at str, else 0*/
+static int ps_isop(const char *str)
+{
+    return ((str[0] == '&' && str[1] == '&') || (str[0] == '|' && str[1] == '|')) ? 2 : 0;
+}
+
+/*Skips blanks and a comment, stops at newline*/
+static void ps_skip_blank(ast_parser *ps)
+{
+    while(ps->src[ps->pos] == ' ' || ps->src[ps->pos] == '\t')
+        ps->pos++;
+
+    if(ps->src[ps->pos] == '#')
+        while(ps->src[ps->pos] && ps->src[ps->pos] != '\n')
+            ps->pos++;
+}
+
+/*Skips blanks, comments and command separators*/
+static void ps_skip_separators(ast_parser *ps)
+{
+    ps_skip_blank(ps);
+    while(ps->src[ps->pos] == ';' || ps->src[ps->pos] == '\n')
+    {
+        if(ps->src[ps->pos] == '\n' && ps->heredoc_end > ps->pos)
+        {
+            ps->pos = ps->heredoc_end;
+            ps->heredoc_end = 0;
+        }
+        else
+            ps->pos++;
+        ps_skip_blank(ps);
+    }
+}
+
+/**
+* @brief  Copies next word into word without consuming it.
+*
+* @return number of source characters of the word, 0 if parser is at a separator or end of source
+*/
+static int ps_peek_word(ast_parser *ps, char *word, int size)
+{
+    int i, n = 0;
+
+    ps_skip_blank(ps);
+    for(i = ps->pos; !ps_isdelim(ps->src[i]); )
+    {
+        //blanks and ';' inside $(...) and `...` belong to the word
+        int span = subst_span(ps->src + i), end = i + (span ? span : 1);
+        for(; i < end; i++)
+            if(n < size - 1)
+                word[n++] = ps->src[i];
+    }
+    word[n] = '\0';
+    return i - ps->pos;
+}
+
+static void ps_syntax_error(ast_parser *ps, const char *token)
+{
+    if(ps->error || ps->incomplete)
+        return;
+    fprintf(stderr, "-xssh: syntax error near unexpected token `%s'\n", token);
+    ps->error = 1;
+}
+
+/*Consumes keyword kw, source ending before kw means construct is incomplete*/
+static int ps_expect(ast_parser *ps, const char *kw)
+{
+    char word[BUFLEN];
+    int len;
+
+    if(ps->error || ps->incomplete)
+        return -1;
+
+    ps_skip_separators(ps);
+    len = ps_peek_word(ps, word, sizeof(word));
+    if(len == 0 && ps->src[ps->pos] == '\0')
+    {
+        ps->incomplete = 1;
+        return -1;
+    }
+
+    if(strcmp(word, kw))
+    {
+        ps_syntax_error(ps, len ? word : "newline");
+        return -1;
+    }
+    ps->pos += len;
+    return 0;
+}
+
+/*Compound command must be followed by a command separator*/
+static void ps_expect_end(ast_parser *ps)
+{
+    char word[BUFLEN];
+    if(ps->error || ps->incomplete)
+        return;
+
+    ps_skip_blank(ps);
+    if(!strchr(";\n", ps->src[ps->pos]) && ps->src[ps->pos] != '\0' && !ps_isop(ps->src + ps->pos))
+    {
+        ps_peek_word(ps, word, sizeof(word));
+        ps_syntax_error(ps, word[0] ? word : (char[2]){ps->src[ps->pos], '\0'});
+    }
+}
+
+static ast_node *new_node(node_type type)
+{
+    ast_node *node = malloc(sizeof(ast_node));
+    if(!node)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+    memset(node, 0, sizeof(ast_node));
+    node->type = type;
+    CIRCLEQ_INIT(&node->children);
+    return node;
+}
+
+static ast_node *ps_parse_list(ast_parser *ps, const char **terms);
+
+/*Parses rest of if (or elif) after the keyword*/
+static ast_node *ps_parse_if(ast_parser *ps)
+{
+    static const char *then_terms[] = {"then", NULL};
+    static const char *body_terms[] = {"elif", "else", "fi", NULL};
+    static const char *else_terms[] = {"fi", NULL};
+    char word[BUFLEN];
+    int len;
+
+    ast_node *node = new_node(XSSH_NODE_IF);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    node->cond = ps_parse_list(ps, then_terms);
+    if(ps_expect(ps, "then") < 0)
+        return node;
+
+    node->body = ps_parse_list(ps, body_terms);
+    if(ps->error || ps->incomplete)
+        return node;
+
+    len = ps_peek_word(ps, word, sizeof(word));
+    ps->pos += len;
+    if(!strcmp(word, "elif"))
+        node->orelse = ps_parse_if(ps);
+    else if(!strcmp(word, "else"))
+    {
+        node->orelse = ps_parse_list(ps, else_terms);
+        ps_expect(ps, "fi");
+    }
+    return node;
+}
+
+/*Parses rest of while/until after the keyword*/
+static ast_node *ps_parse_while(ast_parser *ps, node_type type)
+{
+    static const char *do_terms[] = {"do", NULL};
+    static const char *done_terms[] = {"done", NULL};
+
+    ast_node *node = new_node(type);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    node->cond = ps_parse_list(ps, do_terms);
+    if(ps_expect(ps, "do") < 0)
+        return node;
+
+    node->body = ps_parse_list(ps, done_terms);
+    ps_expect(ps, "done");
+    return node;
+}
+
+/*Parses rest of for after the keyword*/
+static ast_node *ps_parse_for(ast_parser *ps)
+{
+    static const char *done_terms[] = {"done", NULL};
+    char word[BUFLEN];
+    int len, i;
+
+    ast_node *node = new_node(XSSH_NODE_FOR);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    len = ps_peek_word(ps, word, sizeof(word));
+    if(len == 0)
+    {
+        if(ps->src[ps->pos] == '\0')
+            ps->incomplete = 1;
+        else
+            ps_syntax_error(ps, ps->src[ps->pos] == ';' ? ";" : "newline");
+        return node;
+    }
+
+    for(i = 0; word[i] && (isalpha(word[i]) || word[i] == '_' || (i && isdigit(word[i]))); i++)
+        ;
+    if(word[i])
+    {
+        fprintf(stderr, "-xssh: `%s': not a valid identifier\n", word);
+        ps->error = 1;
+        return node;
+    }
+    node->var = strdup(word);
+    ps->pos += len;
+
+    len = ps_peek_word(ps, word, sizeof(word));
+    if(!strcmp(word, "in"))
+    {
+        ps->pos += len;
+        while((len = ps_peek_word(ps, word, sizeof(word))) > 0)
+        {
+            char **words = realloc(node->words, sizeof(char *) * (node->nwords + 1));
+            if(!words)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                ps->error = 1;
+                return node;
+            }
+            node->words = words;
+            node->words[node->nwords] = malloc(len + 1);
+            if(!node->words[node->nwords])
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                ps->error = 1;
+                return node;
+            }
+            memcpy(node->words[node->nwords], ps->src + ps->pos, len);
+            node->words[node->nwords++][len] = '\0';
+            ps->pos += len;
+        }
+
+        if(ps->src[ps->pos] == '\0')
+        {
+            ps->incomplete = 1;
+            return node;
+        }
+    }
+    else if(len)
+    {
+        ps_syntax_error(ps, word);
+        return node;
+    }
+    else
+        node->nwords = -1;  //iterate over positional parameters
+
+    if(ps_expect(ps, "do") < 0)
+        return node;
+
+    node->body = ps_parse_list(ps, done_terms);
+    ps_expect(ps, "done");
+    return node;
+}
+
+/*Parses break [n] or continue [n]*/
+static ast_node *ps_parse_loopctl(ast_parser *ps, node_type type)
+{
+    char word[BUFLEN];
+    int len;
+    char *endptr = NULL;
+
+    ast_node *node = new_node(type);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    node->levels = 1;
+    len = ps_peek_word(ps, word, sizeof(word));
+    if(len)
+    {
+        node->levels = strtol(word, &endptr, 10);
+        if(*endptr || node->levels < 1)
+        {
+            fprintf(stderr, "-xssh: %s: %s: loop count out of range\n", type == XSSH_NODE_BREAK ? "break" : "continue", word);
+            ps->error = 1;
+        }
+        ps->pos += len;
+    }
+    return node;
+}
+
+/*Parses return [n]*/
+static ast_node *ps_parse_return(ast_parser *ps)
+{
+    char word[BUFLEN];
+    char *endptr = NULL;
+    int len;
+
+    ast_node *node = new_node(XSSH_NODE_RETURN);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    node->levels = -1;
+    len = ps_peek_word(ps, word, sizeof(word));
+    if(len)
+    {
+        node->levels = strtol(word, &endptr, 10) & 0xff;
+        if(*endptr)
+        {
+            fprintf(stderr, "-xssh: return: %s: numeric argument required\n", word);
+            ps->error = 1;
+        }
+        ps->pos += len;
+    }
+    return node;
+}
+
+/**
+* @brief  Checks if parser is at a function definition "name()" or "name ()".
+*
+* @param name [OUT] function name
+*
+* @return number of characters up to and including "()", 0 if it is not a function definition
+*/
+static int ps_funcdef(ast_parser *ps, char *name, int size)
+{
+    const char *src = ps->src + ps->pos;
+    int i = 0, n = 0;
+
+    while(src[i] == ' ' || src[i] == '\t')
+        i++;
+    if(!isalpha(src[i]) && src[i] != '_')
+        return 0;
+
+    while((isalnum(src[i]) || src[i] == '_') && n < size - 1)
+        name[n++] = src[i++];
+    name[n] = '\0';
+
+    while(src[i] == ' ' || src[i] == '\t')
+        i++;
+    if(src[i] != '(' || src[i + 1] != ')')
+        return 0;
+    return i + 2;
+}
+
+/*Parses name() { list; }*/
+static ast_node *ps_parse_funcdef(ast_parser *ps, const char *name)
+{
+    static const char *brace_terms[] = {"}", NULL};
+
+    ast_node *node = new_node(XSSH_NODE_FUNCDEF);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    if(ast_inlist(name, ast_keywords) || find_fast_builtin(name))
+    {
+        fprintf(stderr, "-xssh: `%s': not a valid function name\n", name);
+        ps->error = 1;
+        return node;
+    }
+
+    node->var = strdup(name);
+    if(ps_expect(ps, "{") < 0)
+        return node;
+
+    node->body = ps_parse_list(ps, brace_terms);
+    ps_expect(ps, "}");
+    return node;
+}
+
+/*Takes bodies of here-documents of job from lines following current line*/
+static void ps_parse_heredocs(ast_parser *ps, job_info *job)
+{
+    proc_info *p = NULL;
+    redirect_info *rinfo = NULL;
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+        {
+            const char *line = NULL;
+            int start;
+
+            if(rinfo->mode != 6)
+                continue;
+
+            if(ps->heredoc_end > ps->pos)
+                start = ps->heredoc_end;
+            else
+            {
+                line = strchr(ps->src + ps->pos, '\n');
+                start = line ? line - ps->src + 1 : strlen(ps->src);
+            }
+
+            int len = heredoc_body(ps->src + start, rinfo->srcfile, &rinfo->body);
+            if(len < 0)
+            {
+                ps->incomplete = 1;
+                return;
+            }
+            ps->heredoc_end = start + len;
+        }
+    }
+}
+
+/**
+* @brief  Parses a simple command or pipeline up to next command separator into a job template.
+*/
+static ast_node *ps_parse_simple(ast_parser *ps)
+{
+    char buffer[BUFLEN];
+    char decode[BUFLEN + 1];
+    int start = ps->pos;
+    int end;
+    ast_node *node = NULL;
+
+    while(ps->src[ps->pos] && !strchr(";\n", ps->src[ps->pos]) && !ps_isop(ps->src + ps->pos))
+    {
+        //'#' starting a word begins a comment
+        if(ps->src[ps->pos] == '#' && ps->pos > start && isspace(ps->src[ps->pos - 1]))
+            break;
+
+        //separators inside $(...) and `...` belong to the inner command
+        int span = subst_span(ps->src + ps->pos);
+        ps->pos += span ? span : 1;
+    }
+
+    end = ps->pos;
+    if(ps->src[ps->pos] == '#')
+        while(ps->src[ps->pos] && ps->src[ps->pos] != '\n')
+            ps->pos++;
+
+    if(end - start >= BUFLEN - 1)
+    {
+        fprintf(stderr, "-xssh: command too long\n");
+        ps->error = 1;
+        return NULL;
+    }
+
+    //an operator needs a command on its both sides
+    while(end > start && isspace(ps->src[end - 1]))
+        end--;
+    if(end == start)
+    {
+        ps_syntax_error(ps, ps_isop(ps->src + ps->pos) ? (ps->src[ps->pos] == '&' ? "&&" : "||") : ";");
+        return NULL;
+    }
+
+    memcpy(buffer, ps->src + start, end - start);
+    buffer[end - start] = '\0';
+    if(alias_expand(buffer) < 0)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+    strcpy(decode, buffer);
+    strcat(decode, "\n");
+
+    node = new_node(XSSH_NODE_CMD);
+    if(!node)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    node->ins = strchr(buffer, '|') ? 0 : deinstr(decode);
+    node->tmpl = create_job(buffer);
+    if(!node->tmpl)
+    {
+        fprintf(stderr, "\n");
+        ps->error = 1;
+        return node;
+    }
+
+    ps_parse_heredocs(ps, node->tmpl);
+    return node;
+}
+
+static ast_node *ps_parse_command(ast_parser *ps)
+{
+    char word[BUFLEN];
+    char name[BUFLEN];
+    int len = ps_peek_word(ps, word, sizeof(word));
+    int deflen = ps_funcdef(ps, name, sizeof(name));
+    ast_node *node = NULL;
+
+    if(deflen)
+    {
+        ps->pos += deflen;
+        node = ps_parse_funcdef(ps, name);
+        ps_expect_end(ps);
+    }
+    else if(!strcmp(word, "if"))
+    {
+        ps->pos += len;
+        node = ps_parse_if(ps);
+        ps_expect_end(ps);
+    }
+    else if(!strcmp(word, "while") || !strcmp(word, "until"))
+    {
+        ps->pos += len;
+        node = ps_parse_while(ps, word[0] == 'w' ? XSSH_NODE_WHILE : XSSH_NODE_UNTIL);
+        ps_expect_end(ps);
+    }
+    else if(!strcmp(word, "for"))
+    {
+        ps->pos += len;
+        node = ps_parse_for(ps);
+        ps_expect_end(ps);
+    }
+    else if(!strcmp(word, "break") || !strcmp(word, "continue"))
+    {
+        ps->pos += len;
+        node = ps_parse_loopctl(ps, word[0] == 'b' ? XSSH_NODE_BREAK : XSSH_NODE_CONTINUE);
+        ps_expect_end(ps);
+    }
+    else if(!strcmp(word, "return"))
+    {
+        ps->pos += len;
+        node = ps_parse_return(ps);
+        ps_expect_end(ps);
+    }
+    else if(ast_inlist(word, ast_keywords))
+        ps_syntax_error(ps, word);
+    else
+        node = ps_parse_simple(ps);
+
+    return node;
+}
+
+/**
+* @brief  Parses commands joined by && and || (left associative, equal precedence). Newlines may follow an operator.
+*/
+static ast_node *ps_parse_andor(ast_parser *ps)
+{
+    ast_node *node = ps_parse_command(ps);
+
+    while(node && !ps->error && !ps->incomplete)
+    {
+        ast_node *op = NULL;
+        int len;
+
+        ps_skip_blank(ps);
+        len = ps_isop(ps->src + ps->pos);
+        if(!len)
+            break;
+
+        op = new_node(ps->src[ps->pos] == '&' ? XSSH_NODE_AND : XSSH_NODE_OR);
+        if(!op)
+        {
+            ps->error = 1;
+            break;
+        }
+        ps->pos += len;
+        op->cond = node;
+        node = op;
+
+        //command after operator may be on next line
+        ps_skip_blank(ps);
+        while(ps->src[ps->pos] == '\n')
+        {
+            ps->pos++;
+            ps_skip_blank(ps);
+        }
+        if(ps->src[ps->pos] == '\0')
+        {
+            ps->incomplete = 1;
+            break;
+        }
+        if(ps->src[ps->pos] == ';' || ps_isop(ps->src + ps->pos))
+        {
+            ps_syntax_error(ps, ps->src[ps->pos] == ';' ? ";" : (ps->src[ps->pos] == '&' ? "&&" : "||"));
+            break;
+        }
+        op->body = ps_parse_command(ps);
+        if(!op->body)
+            ps->error = 1;
+    }
+    return node;
+}
+
+/**
+* @brief  Parses commands separated by ';' or newline until one of the terminating keywords (not consumed).
+*
+* @param terms [IN] NULL terminated list of keywords ending the list, NULL at top level.
+*/
+static ast_node *ps_parse_list(ast_parser *ps, const char **terms)
+{
+    char word[BUFLEN];
+    ast_node *list = new_node(XSSH_NODE_LIST);
+
+    if(!list)
+    {
+        ps->error = 1;
+        return NULL;
+    }
+
+    while(!ps->error && !ps->incomplete)
+    {
+        ps_skip_separators(ps);
+        if(ps->src[ps->pos] == '\0')
+        {
+            if(terms)
+                ps->incomplete = 1;
+            break;
+        }
+
+        ps_peek_word(ps, word, sizeof(word));
+        if(terms && ast_inlist(word, terms))
+        {
+            if(CIRCLEQ_EMPTY(&list->children))
+                ps_syntax_error(ps, word);
+            break;
+        }
+
+        ast_node *node = ps_parse_andor(ps);
+        if(node)
+            CIRCLEQ_INSERT_TAIL(&list->children, node, link);
+    }
+    return list;
+}
+
+/**
+* @brief  Checks if command buffer starts a compound command (if, while, until, for or function definition).
+*/
+int is_compound(const char *buffer)
+{
+    //other keywords and break/continue are also handed to the parser so that it reports them
+    static const char *starts[] = {"if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for",
+                                   "{", "}", "break", "continue", "return", NULL};
+    char word[BUFLEN];
+    int n = 0;
+    ast_parser ps;
+
+    //function definition name() { ... }
+    memset(&ps, 0, sizeof(ps));
+    ps.src = buffer;
+    if(ps_funcdef(&ps, word, sizeof(word)))
+        return 1;
+
+    while(isspace(*buffer))
+        buffer++;
+    while(n < BUFLEN - 1 && !ps_isdelim(buffer[n]))
+    {
+        word[n] = buffer[n];
+        n++;
+    }
+    word[n] = '\0';
+    return ast_inlist(word, starts);
+}
+
+/**
+* @brief  Checks if command line is a list of commands joined by ';', '&&' or '||'. Such line is parsed as a whole
+*     like a compound command, so each command runs from the parsed tree without returning to the read loop.
+*/
+int is_list(const char *buffer)
+{
+    const char *ptr = buffer;
+
+    while(*ptr)
+    {
+        int span = subst_span(ptr);
+        if(span)
+        {
+            ptr += span;
+            continue;
+        }
+
+        //'#' starting a word begins a comment
+        if(*ptr == '#' && (ptr == buffer || isspace(ptr[-1])))
+            return 0;
+        if(*ptr == ';' || ps_isop(ptr))
+            return 1;
+        ptr++;
+    }
+    return 0;
+}
+
+/**
+* @brief  Parses source of compound command into syntax tree.
+*
+* @param src        [IN]  source text, may span multiple lines
+* @param incomplete [OUT] set to 1 if source ended inside a construct and more lines shall be appended
+*
+* @return root node (XSSH_NODE_LIST) on success else NULL
+*/
+ast_node *parse_compound(const char *src, int *incomplete)
+{
+    ast_parser ps;
+    ast_node *root = NULL;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.src = src;
+    root = ps_parse_list(&ps, NULL);
+
+    *incomplete = ps.incomplete;
+    if(ps.error || ps.incomplete)
+    {
+        destroy_node(root);
+        root = NULL;
+    }
+    return root;
+}
+
+void destroy_node(ast_node *node)
+{
+    int i;
+
+    //function bodies loaded from rc snapshot are part of its mapping
+    if(!node || snap_owns(node))
+        return;
+
+    while(!CIRCLEQ_EMPTY(&node->children))
+    {
+        ast_node *child = CIRCLEQ_FIRST(&node->children);
+        CIRCLEQ_REMOVE(&node->children, child, link);
+        destroy_node(child);
+    }
+
+    destroy_node(node->cond);
+    destroy_node(node->body);
+    destroy_node(node->orelse);
+    destroy_job(node->tmpl);
+
+    for(i = 0; i < node->nwords; i++)
+        free(node->words[i]);
+    free(node->words);
+    free(node->var);
+    free(node);
+}
+
+/**
+* @brief  Returns value of variable or NULL if variable does not exist.
+*/
+char *getvar(const char *name)
+{
+    static char shell_name[] = "xssh";
+    pos_params *params = g_context.params;
+    int j;
+
+    //positional parameters of function being executed
+    if(isdigit(name[0]))
+    {
+        int n = atoi(name);
+        if(n == 0)
+            return shell_name;
+        return (params && n < params->argc) ? params->argv[n] : "";
+    }
+    if(!strcmp(name, "#"))
+        return params ? params->count : "0";
+    if(!strcmp(name, "@") || !strcmp(name, "*"))
+        return params ? params->all : "";
+
+    for(j = 0; j < varmax; j++)
+    {
+        if(varname[j][0] && !strcmp(varname[j], name))
+        {
+            if(j < 3 && g_context.rc_env)
+                g_context.rc_volatile = 1;
+            return varvalue[j];
+        }
+    }
+    return env_get(name);
+}
+
+/**
+* @brief  Sets value of variable, variable is created if it does not exist (e.g. loop variable of for).
+*     Variable created for a name inherited from environment stays exported.
+*
+* @return 0 on success else -1
+*/
+int setvar(const char *name, const char *value)
+{
+    int j;
+    for(j = 0; j < varmax; j++)
+    {
+        if(!strcmp(varname[j], name))
+            break;
+    }
+
+    if(j == varmax)
+    {
+        if(varmax == BUFLEN || strlen(name) >= BUFLEN)
+        {
+            fprintf(stderr, "-xssh: %s: too many variables\n", name);
+            return -1;
+        }
+        varexported[varmax] = env_get(name) != NULL;
+        strcpy(varname[varmax++], name);
+    }
+
+    snprintf(varvalue[j], BUFLEN, "%s", value);
+    if(varexported[j])
+        env_set(name, varvalue[j]);
+    return 0;
+}
+
+/**
+* @brief  Expands variables ($name, ${name}, $?, $$, $!) in a word.
+*
+* @return newly allocated expanded word, NULL if allocation failed
+*/
+char *expand_word(const char *word)
+{
+    size_t cap, len = 0;
+    char *out = NULL;
+    const char *ptr = word;
+
+    if(!strchr(word, '$'))
+        return strdup(word);
+
+    cap = strlen(word) + BUFLEN;
+    out = malloc(cap);
+    if(!out)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    while(*ptr)
+    {
+        char name[BUFLEN];
+        const char *value = NULL;
+        int n = 0;
+
+        if(*ptr != '$' || !ptr[1])
+        {
+            out[len++] = *ptr++;
+            if(len == cap)
+                goto grow;
+            continue;
+        }
+
+        ptr++;
+        if(*ptr == '{')
+        {
+            ptr++;
+            while(*ptr && *ptr != '}' && n < BUFLEN - 1)
+                name[n++] = *ptr++;
+            if(*ptr == '}')
+                ptr++;
+        }
+        else if(strchr("$?!#@*", *ptr) || isdigit(*ptr))
+            name[n++] = *ptr++;
+        else
+        {
+            while((isalnum(*ptr) || *ptr == '_') && n < BUFLEN - 1)
+                name[n++] = *ptr++;
+        }
+        name[n] = '\0';
+
+        if(n == 0)
+        {
+            //a lone '$' is kept as it is
+            out[len++] = '$';
+            if(len == cap)
+                goto grow;
+            continue;
+        }
+
+        value = getvar(name);
+        if(!value)
+        {
+            printf("-xssh: Does not exist variable $%s.\n", name);
+            continue;
+        }
+
+        while(len + strlen(value) + 1 >= cap)
+        {
+            char *tmp = realloc(out, cap * 2);
+            if(!tmp)
+            {
+                free(out);
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                return NULL;
+            }
+            out = tmp;
+            cap *= 2;
+        }
+        strcpy(out + len, value);
+        len += strlen(value);
+        continue;
+grow:
+        {
+            char *tmp = realloc(out, cap * 2);
+            if(!tmp)
+            {
+                free(out);
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                return NULL;
+            }
+            out = tmp;
+            cap *= 2;
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+/**
+* @brief  Creates a new job from a job template. Its variables and command substitutions are expanded by
+*     expand_job() when it is run.
+*
+* @param tmpl [IN] template created by create_job
+*
+* @return new job_info on success else NULL
+*/
+job_info *instantiate_job(job_info *tmpl)
+{
+    job_info *job = NULL;
+    proc_info *tp = NULL;
+    redirect_info *tr = NULL;
+    int i;
+
+    job = malloc(sizeof(job_info));
+    if(!job)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+    memset(job, 0, sizeof(job_info));
+    CIRCLEQ_INIT(&job->proc_info_list);
+    job->background = tmpl->background;
+    strcpy(job->cmd, tmpl->cmd);
+
+    CIRCLEQ_FOREACH(tp, &tmpl->proc_info_list, link)
+    {
+        proc_info *p = malloc(sizeof(proc_info));
+        if(!p)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            goto error;
+        }
+        memset(p, 0, sizeof(proc_info));
+        CIRCLEQ_INIT(&p->redirect_info_list);
+        CIRCLEQ_INSERT_TAIL(&job->proc_info_list, p, link);
+        job->nprocs++;
+        p->background = tp->background;
+
+        if(tp->nargs)
+        {
+            p->args = calloc(tp->nargs + 1, sizeof(char *));
+            p->dollar = malloc(sizeof(short) * (tp->nargs + 1));
+            if(!p->args || !p->dollar)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                goto error;
+            }
+            p->nargs = tp->nargs;
+            for(i = 0; i < tp->nargs; i++)
+            {
+                char *dollar = strpbrk(tp->args[i], "$`");
+
+                p->args[i] = strdup(tp->args[i]);
+                if(!p->args[i])
+                {
+                    fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                    goto error;
+                }
+                p->dollar[i] = dollar ? dollar - tp->args[i] : -1;
+            }
+        }
+
+        CIRCLEQ_FOREACH(tr, &tp->redirect_info_list, link)
+        {
+            redirect_info *rinfo = malloc(sizeof(redirect_info));
+            if(!rinfo)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                goto error;
+            }
+            memcpy(rinfo, tr, sizeof(redirect_info));
+            rinfo->memfd = 0;
+            rinfo->body = tr->body ? strdup(tr->body) : NULL;
+            rinfo->srcfile = tr->srcfile ? strdup(tr->srcfile) : NULL;
+            rinfo->dstfile = tr->dstfile ? strdup(tr->dstfile) : NULL;
+            CIRCLEQ_INSERT_TAIL(&p->redirect_info_list, rinfo, link);
+        }
+    }
+    return job;
+
+error:
+    destroy_job(job);
+    return NULL;
+}
+
+/*Runs leaf of syntax tree and returns its exit status*/
+static int exec_cmd(ast_node *node)
+{
+    job_info *job = instantiate_job(node->tmpl);
+
+    if(!job)
+    {
+        sprintf(varvalue[1], "%d", 1);
+        return 1;
+    }
+
+    if(node->ins)
+    {
+        //internal instructions parse the command buffer themselves
+        char buffer[BUFLEN] = {0};
+        proc_info *p = CIRCLEQ_FIRST(&job->proc_info_list);
+        int i, len = 0;
+
+        if(expand_job(job) < 0)
+        {
+            destroy_job(job);
+            sprintf(varvalue[1], "%d", 1);
+            return 1;
+        }
+        for(i = 1; i < p->nargs && len < BUFLEN - 2; i++)
+            len += snprintf(buffer + len, BUFLEN - 1 - len, i > 1 ? " %s" : "%s", p->args[i]);
+        strcat(buffer, "\n");
+        destroy_job(job);
+        run_instr(node->ins, buffer);
+    }
+    else
+    {
+        run_job(job);
+        wait_job();
+    }
+
+    return atoi(varvalue[1]);
+}
+
+/**
+* @brief  Expands words of for loop (positional parameters if "in" is omitted) into argv of a single process job,
+*     so variable, command substitution and glob expansion of jobs apply to them too.
+*
+* @return job owning the words (args[1] .. args[nargs - 1]) or NULL on failure
+*/
+static job_info *for_words(ast_node *node)
+{
+    job_info *job = NULL;
+    proc_info *p = NULL;
+    int i, n = node->nwords;
+
+    if(n < 0)
+        n = g_context.params ? g_context.params->argc - 1 : 0;
+
+    job = malloc(sizeof(job_info));
+    p = malloc(sizeof(proc_info));
+    if(!job || !p)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        free(job);
+        free(p);
+        return NULL;
+    }
+    memset(job, 0, sizeof(job_info));
+    memset(p, 0, sizeof(proc_info));
+    CIRCLEQ_INIT(&job->proc_info_list);
+    CIRCLEQ_INIT(&p->redirect_info_list);
+    CIRCLEQ_INSERT_TAIL(&job->proc_info_list, p, link);
+    job->nprocs = 1;
+
+    p->args = calloc(n + 3, sizeof(char *));
+    p->dollar = malloc(sizeof(short) * (n + 3));
+    if(!p->args || !p->dollar)
+        goto error;
+    p->nargs = n + 2;
+    p->args[0] = strdup("for");
+    p->args[1] = strdup("for");
+    p->dollar[0] = p->dollar[1] = -1;
+    for(i = 0; i < n; i++)
+    {
+        const char *word = node->nwords < 0 ? g_context.params->argv[i + 1] : node->words[i];
+        char *dollar = node->nwords < 0 ? NULL : strpbrk(word, "$`");
+
+        p->args[i + 2] = strdup(word);
+        if(!p->args[i + 2])
+            goto error;
+        p->dollar[i + 2] = dollar ? dollar - word : -1;
+    }
+
+    if(expand_job(job) < 0 || expand_globs(job) < 0)
+        goto error;
+
+    //drop the command name so words are args[1] ..
+    free(p->args[1]);
+    memmove(&p->args[1], &p->args[2], (p->nargs - 1) * sizeof(char *));
+    p->nargs--;
+    return job;
+
+error:
+    destroy_job(job);
+    return NULL;
+}
+
+/*Handles pending break/continue after one iteration, returns 1 if loop shall end*/
+static int loop_done()
+{
+    if(g_context.interrupted || g_context.returning)
+        return 1;
+
+    if(g_context.breaks)
+    {
+        g_context.breaks--;
+        return 1;
+    }
+
+    if(g_context.continues)
+    {
+        g_context.continues--;
+        return g_context.continues > 0;
+    }
+    return 0;
+}
+
+/**
+* @brief  Executes a node of syntax tree.
+*
+* @return exit status of last command executed
+*/
+int exec_node(ast_node *node)
+{
+    ast_node *child = NULL;
+    int status = 0;
+    int i;
+
+    if(!node)
+        return 0;
+
+    switch(node->type)
+    {
+        case XSSH_NODE_CMD:
+            status = exec_cmd(node);
+            break;
+
+        case XSSH_NODE_LIST:
+            CIRCLEQ_FOREACH(child, &node->children, link)
+            {
+                status = exec_node(child);
+                if(g_context.interrupted || g_context.breaks || g_context.continues || g_context.returning)
+                    break;
+            }
+            break;
+
+        case XSSH_NODE_AND:
+        case XSSH_NODE_OR:
+            //status of a list whose right side is skipped is status of left side
+            status = exec_node(node->cond);
+            if((status == 0) == (node->type == XSSH_NODE_AND) && !g_context.interrupted && !g_context.breaks &&
+               !g_context.continues && !g_context.returning)
+                status = exec_node(node->body);
+            break;
+
+        case XSSH_NODE_IF:
+            if(exec_node(node->cond) == 0)
+                status = exec_node(node->body);
+            else if(node->orelse && !g_context.interrupted)
+                status = exec_node(node->orelse);
+            break;
+
+        case XSSH_NODE_WHILE:
+        case XSSH_NODE_UNTIL:
+            g_context.loop_depth++;
+            while(!g_context.interrupted)
+            {
+                int cond = exec_node(node->cond);
+                if(g_context.interrupted || g_context.returning || (cond == 0) != (node->type == XSSH_NODE_WHILE))
+                    break;
+
+                status = exec_node(node->body);
+                if(loop_done())
+                    break;
+            }
+            g_context.loop_depth--;
+            break;
+
+        case XSSH_NODE_FOR:
+        {
+            //words are expanded (variables, then globs) once before first iteration
+            job_info *words = for_words(node);
+            proc_info *p = words ? CIRCLEQ_FIRST(&words->proc_info_list) : NULL;
+
+            g_context.loop_depth++;
+            for(i = 1; p && i < p->nargs && !g_context.interrupted; i++)
+            {
+                setvar(node->var, p->args[i]);
+                status = exec_node(node->body);
+                if(loop_done())
+                    break;
+            }
+            g_context.loop_depth--;
+            destroy_job(words);
+            break;
+        }
+
+        case XSSH_NODE_BREAK:
+        case XSSH_NODE_CONTINUE:
+            if(!g_context.loop_depth)
+            {
+                fprintf(stderr, "-xssh: %s: only meaningful in a `for', `while', or `until' loop\n",
+                        node->type == XSSH_NODE_BREAK ? "break" : "continue");
+                break;
+            }
+
+            //can not leave more loops than are enclosing
+            if(node->type == XSSH_NODE_BREAK)
+                g_context.breaks = node->levels < g_context.loop_depth ? node->levels : g_context.loop_depth;
+            else
+                g_context.continues = node->levels < g_context.loop_depth ? node->levels : g_context.loop_depth;
+            break;
+
+        case XSSH_NODE_FUNCDEF:
+        {
+            func_info *func = find_function(node->var);
+            if(!node->body)
+                break;  //already defined by an earlier execution of same definition
+
+            if(!func)
+            {
+                func = malloc(sizeof(func_info));
+                if(!func)
+                {
+                    fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                    status = 1;
+                    break;
+                }
+                func->name = strdup(node->var);
+                CIRCLEQ_INSERT_TAIL(&g_context.funcs, func, link);
+            }
+            else if(g_context.func_depth)
+            {
+                ast_node **tmp = realloc(g_context.retired, (g_context.nretired + 1) * sizeof(ast_node *));
+                if(!tmp)
+                {
+                    fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                    status = 1;
+                    break;
+                }
+                g_context.retired = tmp;
+                g_context.retired[g_context.nretired++] = func->body;
+            }
+            else
+                destroy_node(func->body);
+
+            //function keeps the parsed body, so definition outlives the command which defined it
+            func->body = node->body;
+            node->body = NULL;
+            break;
+        }
+
+        case XSSH_NODE_RETURN:
+            if(!g_context.func_depth)
+            {
+                fprintf(stderr, "-xssh: return: can only `return' from a function\n");
+                status = 1;
+                break;
+            }
+            status = node->levels < 0 ? atoi(varvalue[1]) : node->levels;
+            g_context.returning = 1;
+            break;
+    }
+
+    sprintf(varvalue[1], "%d", status);
+    return status;
+}
+
+/**
+* @brief  Reads (if needed, continuation lines of) a compound command, parses it once and executes it.
+*
+* @param buffer    [IN] first line of compound command
+* @param xsshprint [IN] print continuation prompt
+*
+* @return exit status
+*/
+int run_compound(char buffer[BUFLEN], int xsshprint)
+{
+    char line[BUFLEN];
+    char *src = NULL;
+    ast_node *root = NULL;
+    int incomplete = 0;
+    int status = 0;
+    uint64_t ns = 0;
+
+    src = strdup(buffer);
+    if(!src)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return 1;
+    }
+
+    while(1)
+    {
+        ns = now_ns();
+        root = parse_compound(src, &incomplete);
+        if(root || !incomplete)
+            break;
+
+        //command substitution has whole source, there is nothing more to read
+        if(g_context.subshell)
+        {
+            fprintf(stderr, "-xssh: syntax error: unexpected end of file\n");
+            break;
+        }
+
+        if(!read_input(line, BUFLEN, "> ", xsshprint))
+        {
+            fprintf(stderr, "-xssh: syntax error: unexpected end of file\n");
+            break;
+        }
+
+        char *tmp = realloc(src, strlen(src) + strlen(line) + 1);
+        if(!tmp)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            break;
+        }
+        src = tmp;
+        strcat(src, line);
+    }
+
+    if(!root)
+    {
+        free(src);
+        sprintf(varvalue[1], "%d", 2);
+        return 2;
+    }
+
+    stats_record(XSSH_STAT_PARSE, now_ns() - ns);
+    if(g_context.trace)
+        trace_add('X', "parse", rootpid, rootpid, ns, now_ns() - ns, 0, src);
+
+    g_context.interrupted = 0;
+    g_context.in_builtin++;
+    status = exec_node(root);
+    g_context.in_builtin--;
+    g_context.breaks = 0;
+    g_context.continues = 0;
+
+    destroy_node(root);
+    free(src);
+    sprintf(varvalue[1], "%d", status);
+    return status;
+}
+
+/**
+* @brief  Returns length of command substitution $(...) or `...` starting at str, 0 if str does not start one.
+*     Unterminated substitution extends up to end of string.
+*/
+int subst_span(const char *str)
+{
+    int i = 0, depth = 0;
+
+    if(str[0] == '`')
+    {
+        for(i = 1; str[i] && str[i] != '`'; i++)
+            ;
+        return str[i] ? i + 1 : i;
+    }
+
+    if(str[0] != '$' || str[1] != '(')
+        return 0;
+
+    for(i = 1; str[i]; i++)
+    {
+        if(str[i] == '(')
+            depth++;
+        else if(str[i] == ')' && --depth == 0)
+            return i + 1;
+    }
+    return i;
+}
+
+/**
+* @brief  Reads descriptor until end of file into buffer which grows as needed.
+*
+* @return malloced buffer (NUL terminated) or NULL on failure, *len is number of bytes read
+*/
+static char *read_all(int fd, size_t *len)
+{
+    size_t size = 4096;
+    char *buf = malloc(size);
+
+    *len = 0;
+    if(!buf)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    while(1)
+    {
+        if(*len + 1 >= size)
+        {
+            char *tmp = realloc(buf, size * 2);
+            if(!tmp)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                free(buf);
+                return NULL;
+            }
+            buf = tmp;
+            size *= 2;
+        }
+
+        ssize_t n = read(fd, buf + *len, size - *len - 1);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            break;
+        *len += n;
+    }
+    buf[*len] = '\0';
+    return buf;
+}
+
+/*Runs command line in forked copy of XSSH which has stdout on pipe*/
+static char *capture_subshell(const char *cmd, size_t *len)
+{
+    char buffer[BUFLEN];
+    char *out = NULL;
+    int fd[2];
+    int status = 0;
+    pid_t pid;
+
+    if(pipe2(fd, O_CLOEXEC) < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+        return NULL;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    }
+
+    if(pid == 0)
+    {
+        //background jobs belong to parent XSSH
+        CIRCLEQ_INIT(&g_context.bg_jobs);
+        g_context.subshell = 1;
+        dup2(fd[1], 1);
+        snprintf(buffer, BUFLEN, "%s\n", cmd);
+        run_line(buffer, 0, now_ns());
+        fflush(stdout);
+        _exit(atoi(varvalue[1]));
+    }
+
+    close(fd[1]);
+    out = read_all(fd[0], len);
+    close(fd[0]);
+
+    while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    sprintf(varvalue[1], "%d", WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    return out;
+}
+
+/**
+* @brief  Runs command line and returns its standard output. A single fast builtin writes directly into
+*     memory buffer (memory file if it has redirections), a job of external commands runs with stdout of its last process on a pipe which XSSH reads
+*     and everything else (compound commands, functions, internal instructions) runs in a forked copy of XSSH.
+*     $? is set to exit status of command.
+*
+* @param cmd [IN] command line without $( )
+* @param len [OUT] length of output
+*
+* @return malloced output or NULL on failure
+*/
+char *capture_output(const char *cmd, size_t *len)
+{
+    char buffer[BUFLEN];
+    job_info *job = NULL;
+    proc_info *p = NULL;
+    fast_builtin_fn fn = NULL;
+    char *out = NULL;
+    int fd[2], nassign;
+
+    *len = 0;
+    if(strlen(cmd) >= BUFLEN - 2)
+    {
+        fprintf(stderr, "-xssh: command too long\n");
+        return NULL;
+    }
+    sprintf(buffer, "%s\n", cmd);
+    if(is_compound(buffer) || is_list(buffer) || (!strchr(buffer, '|') && deinstr(buffer)))
+        return capture_subshell(cmd, len);
+
+    strip_comment(buffer);
+    job = create_job(buffer);
+    if(!job || expand_job(job) < 0)
+    {
+        destroy_job(job);
+        sprintf(varvalue[1], "%d", 2);
+        return NULL;
+    }
+
+    p = CIRCLEQ_FIRST(&job->proc_info_list);
+    if(job->nprocs == 1 && p->nargs > 0 && find_function(p->args[0]))
+    {
+        destroy_job(job);
+        return capture_subshell(cmd, len);
+    }
+
+    nassign = count_assignments(p);
+    if(job->nprocs == 1 && !job->background && p->nargs > 1 + nassign)
+        fn = find_fast_builtin(p->args[1 + nassign]);
+
+    if(fn && !nassign && CIRCLEQ_EMPTY(&p->redirect_info_list))
+    {
+        //builtin prints through stdio, so pointing stdout to memory stream captures it without fork
+        FILE *saved = stdout;
+        FILE *mem = NULL;
+        int status;
+
+        fflush(stdout);
+        mem = open_memstream(&out, len);
+        if(!mem)
+        {
+            fprintf(stderr, "-xssh:%s(%d) open_memstream failed", __FUNCTION__, __LINE__);
+            destroy_job(job);
+            return NULL;
+        }
+
+        stdout = mem;
+        g_context.in_builtin++;
+        status = fn(p->nargs - 1, &p->args[1]);
+        g_context.in_builtin--;
+        stdout = saved;
+        fclose(mem);
+
+        sprintf(varvalue[1], "%d", status);
+        destroy_job(job);
+        return out;
+    }
+
+    if(fn)
+    {
+        //builtin with redirections runs inside XSSH, which can not read a pipe meanwhile, so output goes to memory file
+        fd[0] = memfd_create("xssh-capture", MFD_CLOEXEC);
+        if(fd[0] < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) memfd_create failed\n", __FUNCTION__, __LINE__);
+            destroy_job(job);
+            return NULL;
+        }
+        job->capture_fd = fd[0];
+        run_job(job);
+        lseek(fd[0], 0, SEEK_SET);
+        out = read_all(fd[0], len);
+        close(fd[0]);
+        return out;
+    }
+
+    if(pipe2(fd, O_CLOEXEC) < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+        destroy_job(job);
+        return NULL;
+    }
+
+    //output is read until every process of job closes the pipe, then job is waited as foreground job
+    job->capture_fd = fd[1];
+    job->background = 0;
+    run_job(job);
+    close(fd[1]);
+    out = read_all(fd[0], len);
+    close(fd[0]);
+    wait_job();
+    return out;
+}
+
+/*Checks if word has a command substitution $(...) or `...`*/
+int has_subst(const char *word)
+{
+    for(; *word; word++)
+        if(subst_span(word))
+            return 1;
+    return 0;
+}
+
+/*Appends n bytes to field being built by subst_fields()*/
+static int field_add(char **field, size_t *len, size_t *cap, const char *data, size_t n)
+{
+    if(*len + n + 1 > *cap)
+    {
+        size_t size = *cap ? *cap : 64;
+        char *tmp = NULL;
+
+        while(*len + n + 1 > size)
+            size *= 2;
+        tmp = realloc(*field, size);
+        if(!tmp)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            return -1;
+        }
+        *field = tmp;
+        *cap = size;
+    }
+    memcpy(*field + *len, data, n);
+    *len += n;
+    (*field)[*len] = '\0';
+    return 0;
+}
+
+/**
+* @brief  Expands word which has command substitutions $(...) or `...`. Variables of text around them are expanded
+*     by expand_word(), inner commands are run by capture_output() and trailing newlines of their output are removed.
+*     With split, output is split at blanks and newlines into fields, text around a substitution sticks to its first
+*     and last field and a word which is only a substitution without output gives no field. Without split, newlines
+*     become spaces and word gives one field. Output is never parsed as command text.
+*
+* @param fields [OUT] malloced array of malloced fields
+*
+* @return number of fields or -1 on failure
+*/
+int subst_fields(const char *word, int split, char ***fields)
+{
+    str_list out = {0};
+    char *field = NULL;
+    size_t len = 0, cap = 0;
+    const char *ptr = word;
+    int have = 0;
+
+    *fields = NULL;
+    while(*ptr)
+    {
+        const char *start = ptr;
+        char *inner = NULL, *res = NULL;
+        size_t rlen = 0, k, n;
+        int span = 0;
+
+        while(*ptr && !(span = subst_span(ptr)))
+            ptr++;
+        if(ptr > start)
+        {
+            char *text = strndup(start, ptr - start);
+            char *value = text ? expand_word(text) : NULL;
+
+            free(text);
+            if(!value || field_add(&field, &len, &cap, value, strlen(value)) < 0)
+            {
+                free(value);
+                goto error;
+            }
+            have |= value[0] != '\0';
+            free(value);
+        }
+        if(!span)
+            break;
+
+        //strip $( ) or ` `
+        if(*ptr == '`')
+            inner = strndup(ptr + 1, span - ((ptr[span - 1] == '`' && span > 1) ? 2 : 1));
+        else
+            inner = strndup(ptr + 2, span - (ptr[span - 1] == ')' ? 3 : 2));
+        ptr += span;
+        if(!inner)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            goto error;
+        }
+
+        //inner command could not be started (reported by capture_output), outer one does not run without its output
+        res = capture_output(inner, &rlen);
+        free(inner);
+        if(!res)
+            goto error;
+
+        //NUL can not be passed in an argument, it is dropped
+        for(k = 0, n = 0; k < rlen; k++)
+            if(res[k] != '\0')
+                res[n++] = res[k];
+        if(n < rlen)
+            fprintf(stderr, "-xssh: command substitution: ignored null byte in output\n");
+        while(n > 0 && res[n - 1] == '\n')
+            n--;
+        res[n] = '\0';
+
+        for(k = 0; k < n; )
+        {
+            size_t run = split ? strcspn(res + k, " \t\n") : n - k;
+
+            if(run)
+            {
+                if(!split)
+                {
+                    size_t i;
+                    for(i = k; i < n; i++)
+                        if(res[i] == '\n')
+                            res[i] = ' ';
+                }
+                if(field_add(&field, &len, &cap, res + k, run) < 0)
+                {
+                    free(res);
+                    goto error;
+                }
+                have = 1;
+                k += run;
+            }
+            if(k < n)
+            {
+                //blanks end field
+                if(have && str_list_add(&out, field, len) < 0)
+                {
+                    free(res);
+                    goto error;
+                }
+                len = 0;
+                have = 0;
+                k += strspn(res + k, " \t\n");
+            }
+        }
+        free(res);
+    }
+
+    if((have || !split) && str_list_add(&out, field ? field : "", len) < 0)
+        goto error;
+    free(field);
+    *fields = out.v;
+    return out.n;
+
+error:
+    free(field);
+    str_list_free(&out);
+    return -1;
+}
+
+func_info *find_function(const char *name)
+{
+    func_info *func = NULL;
+    CIRCLEQ_FOREACH(func, &g_context.funcs, link)
+    {
+        if(!strcmp(func->name, name))
+            return func;
+    }
+    return NULL;
+}
+
+/**
+* @brief  Calls a shell function with positional parameters argv[1] .. argv[argc - 1].
+*     It has the same signature as fast builtins so run_fast_builtin handles redirections and $? for it.
+*
+* @return status of return or of last command executed in body
+*/
+int call_function(int argc, char **argv)
+{
+    func_info *func = find_function(argv[0]);
+    pos_params params;
+    pos_params *saved_params = g_context.params;
+    int saved_loop_depth = g_context.loop_depth;
+    size_t len = 0;
+    int i, status;
+
+    if(!func)
+        return 127;
+
+    if(g_context.func_depth >= 1000)
+    {
+        fprintf(stderr, "-xssh: %s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.argc = argc;
+    params.argv = argv;
+    sprintf(params.count, "%d", argc - 1);
+    for(i = 1; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    params.all = malloc(len + 1);
+    if(!params.all)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return 1;
+    }
+    params.all[0] = '\0';
+    for(i = 1; i < argc; i++)
+    {
+        strcat(params.all, argv[i]);
+        if(i + 1 < argc)
+            strcat(params.all, " ");
+    }
+
+    //loops of caller can not be left by break/continue inside function
+    g_context.params = &params;
+    g_context.loop_depth = 0;
+    g_context.func_depth++;
+    status = exec_node(func->body);
+    g_context.func_depth--;
+    if(!g_context.func_depth)
+    {
+        while(g_context.nretired > 0)
+            destroy_node(g_context.retired[--g_context.nretired]);
+    }
+    g_context.returning = 0;
+    g_context.loop_depth = saved_loop_depth;
+    g_context.params = saved_params;
+
+    free(params.all);
+    return status;
+}
+
+/**
+* @brief  Finds body of here-document in source which starts at line following the command.
+*
+* @param src   [IN] source text following the command line
+* @param delim [IN] delimiter word
+* @param body  [OUT] malloced body without delimiter line
+*
+* @return number of source characters including delimiter line, -1 if delimiter line is missing
+*/
+int heredoc_body(const char *src, const char *delim, char **body)
+{
+    size_t dlen = strlen(delim);
+    int pos = 0;
+
+    while(src[pos])
+    {
+        const char *eol = strchr(src + pos, '\n');
+        int llen = eol ? eol - (src + pos) : strlen(src + pos);
+
+        if(llen == dlen && !strncmp(src + pos, delim, dlen))
+        {
+            *body = strndup(src, pos);
+            return *body ? pos + llen + (eol ? 1 : 0) : -1;
+        }
+        if(!eol)
+            break;
+        pos += llen + 1;
+    }
+    return -1;
+}
+
+/**
+* @brief  Reads bodies of here-documents of job from standard input, line by line up to delimiter.
+*
+* @return 0 on success, -1 on end of input before delimiter
+*/
+int read_heredocs(job_info *job, int xsshprint)
+{
+    proc_info *p = NULL;
+    redirect_info *rinfo = NULL;
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+        {
+            char *line = NULL;
+            size_t cap = 0, len = 0, size = 0;
+            ssize_t n;
+
+            if(rinfo->mode != 6 || rinfo->body)
+                continue;
+
+            //forked copy running command substitution shares stdin with parent XSSH
+            if(g_context.subshell)
+            {
+                fprintf(stderr, "-xssh: here-document is not supported in command substitution\n");
+                return -1;
+            }
+
+            while(1)
+            {
+                if(xsshprint)
+                {
+                    printf("> ");
+                    fflush(stdout);
+                }
+
+                n = getline(&line, &cap, stdin);
+                if(n < 0)
+                {
+                    fprintf(stderr, "-xssh: here-document delimited by end-of-file (wanted `%s')\n", rinfo->srcfile);
+                    free(line);
+                    return -1;
+                }
+
+                if(n > 0 && line[n - 1] == '\n' && n - 1 == strlen(rinfo->srcfile) &&
+                   !strncmp(line, rinfo->srcfile, n - 1))
+                    break;
+
+                if(len + n + 1 > size)
+                {
+                    size = (len + n + 1) * 2;
+                    char *tmp = realloc(rinfo->body, size);
+                    if(!tmp)
+                    {
+                        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                        free(line);
+                        return -1;
+                    }
+                    rinfo->body = tmp;
+                }
+                memcpy(rinfo->body + len, line, n);
+                len += n;
+                rinfo->body[len] = '\0';
+            }
+
+            if(!rinfo->body)
+                rinfo->body = strdup("");
+            free(line);
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief  Writes input of here-documents (with variables expanded) and here-strings of job into memfd files.
+*     It is done once in XSSH before fork and every process of job dup2s its memfd.
+*
+* @return 0 on success else -errno
+*/
+int open_heredocs(job_info *job)
+{
+    proc_info *p = NULL;
+    redirect_info *rinfo = NULL;
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+        {
+            char *data = NULL;
+            size_t len, off = 0;
+
+            if((rinfo->mode != 6 && rinfo->mode != 7) || rinfo->memfd > 0)
+                continue;
+
+            rinfo->memfd = memfd_create(rinfo->mode == 6 ? "xssh-heredoc" : "xssh-herestring", MFD_CLOEXEC);
+            if(rinfo->memfd < 0)
+            {
+                int retval = -errno;
+                rinfo->memfd = 0;
+                fprintf(stderr, "-xssh:%s(%d) memfd_create failed\n", __FUNCTION__, __LINE__);
+                return retval;
+            }
+
+            if(rinfo->mode == 6)
+                data = expand_word(rinfo->body ? rinfo->body : "");
+            else if(asprintf(&data, "%s\n", rinfo->srcfile) < 0)
+                data = NULL;
+            if(!data)
+                return -ENOMEM;
+
+            len = strlen(data);
+            while(off < len)
+            {
+                ssize_t n = write(rinfo->memfd, data + off, len - off);
+                if(n < 0 && errno == EINTR)
+                    continue;
+                if(n < 0)
+                {
+                    int retval = -errno;
+                    fprintf(stderr, "-xssh:%s(%d) write failed\n", __FUNCTION__, __LINE__);
+                    free(data);
+                    return retval;
+                }
+                off += n;
+            }
+            free(data);
+        }
+    }
+    return 0;
+}
+
+/*Closes memfd files of job once its processes have their own copy*/
+void close_heredocs(job_info *job)
+{
+    proc_info *p = NULL;
+    redirect_info *rinfo = NULL;
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+        {
+            if(rinfo->memfd > 0)
+                close(rinfo->memfd);
+            rinfo->memfd = 0;
+        }
+    }
+}
+
+/**
+* @brief  Output relay. Descriptor which is redirected to several files (cmd > a > b) or to a process (cmd >(wc -l))
+*  becomes write end of a pipe. Relay process reads nothing itself: for every target but the last it duplicates
+*  pending data of the pipe with tee(2) into a private pipe and moves it into the target with splice(2), then moves
+*  the same bytes from the pipe into the last target. Data never reaches user space.
+*
+*  Processes of >(command) are forked by relay and run command like command substitution does, with standard input
+*  from relay and other descriptors as they were before redirection. Relay waits for them before it exits.
+*/
+#define RELAY_MAX_TARGETS  16
+#define RELAY_CHUNK        (64 * 1024)
+
+/*Collects output redirections (mode 1, 2 and 8) of descriptor fd in order, returns their number*/
+static int relay_targets(proc_info *p, int fd, redirect_info **targets)
+{
+    redirect_info *rinfo = NULL;
+    int n = 0;
+
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        if((rinfo->mode == 1 || rinfo->mode == 2 || rinfo->mode == 8) && rinfo->srcfd == fd && n < RELAY_MAX_TARGETS)
+            targets[n++] = rinfo;
+    }
+    return n;
+}
+
+/*Moves exactly len bytes from pipe in to out, -1 if out does not take them*/
+static int relay_move(int in, int out, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+static void relay_loop(int in, int *out, int nout)
+{
+    int tmp[RELAY_MAX_TARGETS][2];
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int k;
+
+    for(k = 0; k < nout - 1; k++)
+    {
+        if(pipe2(tmp[k], O_CLOEXEC) < 0)
+            _exit(1);
+    }
+
+    while(1)
+    {
+        ssize_t n;
+
+        //first tee decides how many bytes go to all targets in this round, private pipes are empty and as large
+        //as the input pipe so other tees copy as much
+        if(nout > 1)
+            n = tee(in, tmp[0][1], RELAY_CHUNK, 0);
+        else
+            n = splice(in, NULL, out[0], NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+        {
+            //target of single relay is gone, rest of output is dropped as by a closed pipe
+            if(n < 0 && nout == 1 && out[0] != devnull && devnull >= 0)
+            {
+                out[0] = devnull;
+                continue;
+            }
+            break;
+        }
+        if(nout == 1)
+            continue;
+
+        for(k = 1; k < nout - 1; k++)
+        {
+            while(tee(in, tmp[k][1], n, 0) < 0 && errno == EINTR)
+                ;
+        }
+
+        for(k = 0; k < nout; k++)
+        {
+            int from = k < nout - 1 ? tmp[k][0] : in;
+            if(relay_move(from, out[k], n) < 0)
+            {
+                //closed reader or full disk: target gets nothing more
+                out[k] = devnull;
+                relay_move(from, devnull, n);
+            }
+        }
+    }
+}
+
+/*Closes all descriptors of process but those in keep (keep is sorted in place)*/
+static void close_except(int *keep, int n)
+{
+    int i, j, fd, lo = 0;
+
+    for(i = 1; i < n; i++)
+    {
+        for(j = i; j > 0 && keep[j - 1] > keep[j]; j--)
+        {
+            int tmp = keep[j];
+            keep[j] = keep[j - 1];
+            keep[j - 1] = tmp;
+        }
+    }
+
+    for(i = 0; i <= n; i++)
+    {
+        unsigned int hi = i < n ? keep[i] - 1 : ~0U;
+        if(i < n && keep[i] < lo)
+            continue;
+        if(i == n || keep[i] > lo)
+        {
+            if(syscall(SYS_close_range, lo, hi, 0) < 0)
+                for(fd = lo; fd <= (hi > 1023 ? 1023 : (int)hi); fd++)
+                    close(fd);
+        }
+        if(i < n)
+            lo = keep[i] + 1;
+    }
+}
+
+/**
+* @brief  Opens target files of one descriptor and pipe from process to their relay. Called by XSSH before process
+*  is forked, so files are created and truncated in order of redirections before command runs.
+*
+* @param targets  [IN] output redirections of descriptor, from relay_targets()
+* @param n        [IN] number of targets
+*
+* @return 0 on success, -errno on failure which is kept in relayfd of failed target
+*/
+static int open_relay(redirect_info **targets, int n)
+{
+    int i, retval = 0;
+
+    for(i = 0; i < n; i++)
+    {
+        if(targets[i]->mode == 8)
+            continue;
+
+        //splice() refuses O_APPEND files, append target is positioned at its end instead
+        targets[i]->relayfd = open(targets[i]->dstfile, O_CREAT | O_WRONLY | O_CLOEXEC | (targets[i]->mode == 1 ? O_TRUNC : 0), 0777);
+        if(targets[i]->relayfd < 0)
+        {
+            retval = -errno;
+            fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, targets[i]->dstfile);
+            break;
+        }
+        if(targets[i]->mode == 2)
+            lseek(targets[i]->relayfd, 0, SEEK_END);
+    }
+
+    if(retval == 0 && pipe2(targets[0]->relaypipe, O_CLOEXEC) < 0)
+    {
+        retval = -errno;
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+    }
+
+    if(retval < 0)
+    {
+        int failed = i < n ? i : 0;
+        while(i-- > 0)
+        {
+            if(targets[i]->relayfd > 0)
+                close(targets[i]->relayfd);
+            targets[i]->relayfd = 0;
+        }
+        targets[0]->relaypipe[0] = targets[0]->relaypipe[1] = 0;
+        targets[failed]->relayfd = retval;
+    }
+    return retval;
+}
+
+/*Closes descriptors opened by open_relay(), errors are forgotten as well*/
+static void close_relay(redirect_info **targets, int n)
+{
+    int i;
+
+    for(i = 0; i < n; i++)
+    {
+        if(targets[i]->relayfd > 0)
+            close(targets[i]->relayfd);
+        targets[i]->relayfd = 0;
+    }
+    if(targets[0]->relaypipe[0] > 0)
+    {
+        close(targets[0]->relaypipe[0]);
+        close(targets[0]->relaypipe[1]);
+    }
+    targets[0]->relaypipe[0] = targets[0]->relaypipe[1] = 0;
+}
+
+/**
+* @brief  Forks relay of targets opened by open_relay(), see relay_loop(). Processes of >(cmd) targets are started
+*  by relay and get output of process (outfd) as their standard output.
+*
+* @param targets  [IN] output redirections of descriptor
+* @param n        [IN] number of targets
+* @param pgid     [IN] process group of job which relay joins, -1 to stay in group of XSSH
+* @param outfd    [IN] standard output of process
+*
+* @return pid of relay, -errno on failure
+*/
+static pid_t fork_relay(redirect_info **targets, int n, pid_t pgid, int outfd)
+{
+    int i;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+        return -errno;
+    }
+
+    if(pid == 0)
+    {
+        pid_t sinks[RELAY_MAX_TARGETS];
+        int out[RELAY_MAX_TARGETS], keep[RELAY_MAX_TARGETS + 6];
+        int in = targets[0]->relaypipe[0];
+        int nsinks = 0, nkeep = 0;
+
+        if(pgid >= 0)
+        {
+            int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
+            setpgid(0, pgid);
+            for(i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+                signal(signals[i], SIG_DFL);
+        }
+        signal(SIGPIPE, SIG_IGN);
+
+        //pipes of other processes of job are not held open by relay or its >(cmd) processes. Standard descriptors
+        //stay open until they are set up for >(cmd) processes
+        keep[nkeep++] = in;
+        keep[nkeep++] = outfd;
+        keep[nkeep++] = 0;
+        keep[nkeep++] = 1;
+        keep[nkeep++] = 2;
+        keep[nkeep++] = g_context.sigchld_pipe[0];
+        keep[nkeep++] = g_context.sigchld_pipe[1];
+        for(i = 0; i < n; i++)
+        {
+            out[i] = targets[i]->mode == 8 ? -1 : targets[i]->relayfd;
+            if(out[i] >= 0)
+                keep[nkeep++] = out[i];
+        }
+        close_except(keep, nkeep);
+
+        for(i = 0; i < n; i++)
+        {
+            int sp[2];
+            if(targets[i]->mode != 8)
+                continue;
+
+            if(pipe2(sp, O_CLOEXEC) < 0)
+                _exit(1);
+            fflush(stdout);
+            sinks[nsinks] = fork();
+            if(sinks[nsinks] == 0)
+            {
+                char buffer[BUFLEN];
+                int j;
+
+                dup2(sp[0], 0);
+                if(outfd != 1)
+                {
+                    dup2(outfd, 1);
+                    close(outfd);
+                }
+                close(sp[0]);
+                close(sp[1]);
+                close(in);
+                for(j = 0; j < n; j++)
+                    if(out[j] >= 0)
+                        close(out[j]);
+                signal(SIGPIPE, SIG_DFL);
+                CIRCLEQ_INIT(&g_context.bg_jobs);
+                g_context.fg_job = NULL;
+                g_context.subshell = 1;
+                snprintf(buffer, BUFLEN, "%s\n", targets[i]->dstfile);
+                run_line(buffer, 0, now_ns());
+                fflush(stdout);
+                _exit(atoi(varvalue[1]));
+            }
+            close(sp[0]);
+            if(sinks[nsinks] > 0)
+                nsinks++;
+            out[i] = sp[1];
+        }
+        close(0);
+        close(1);
+        if(outfd > 2)
+            close(outfd);
+
+        relay_loop(in, out, n);
+        for(i = 0; i < n; i++)
+            close(out[i]);
+        while(nsinks--)
+            waitpid(sinks[nsinks], NULL, 0);
+        _exit(0);
+    }
+
+    //in group before XSSH waits for it
+    if(pgid >= 0)
+        setpgid(pid, pgid);
+    return pid;
+}
+
+/**
+* @brief  Starts relay for targets of one descriptor and redirects descriptor to it, for builtin run by XSSH
+*  itself (see run_fast_builtin()). Relays of forked processes are started by execute_job(), see start_relays().
+*
+* @param p        [IN] process being set up, relay pid is kept in it
+* @param targets  [IN] output redirections of descriptor, from relay_targets()
+* @param n        [IN] number of targets
+*
+* @return 0 on success, -errno on failure
+*/
+static int start_relay(proc_info *p, redirect_info **targets, int n)
+{
+    int srcfd = targets[0]->srcfd;
+    int retval = 0;
+    pid_t pid;
+
+    if(p->nrelays == sizeof(p->relays) / sizeof(p->relays[0]))
+    {
+        fprintf(stderr, "-xssh:%s(%d) too many relays\n", __FUNCTION__, __LINE__);
+        return -EMFILE;
+    }
+
+    retval = open_relay(targets, n);
+    if(retval < 0)
+    {
+        close_relay(targets, n);
+        return retval;
+    }
+
+    pid = fork_relay(targets, n, -1, 1);
+    if(pid < 0)
+        retval = pid;
+    else
+    {
+        p->relays[p->nrelays++] = pid;
+        if(dup2(targets[0]->relaypipe[1], srcfd) < 0)
+            retval = -errno;
+    }
+    close_relay(targets, n);
+    return retval;
+}
+
+/*Number of targets of descriptor if rinfo is first of them and they are written through a relay, else 0*/
+static int relay_group(proc_info *p, redirect_info *rinfo, redirect_info **targets)
+{
+    int n;
+
+    if(rinfo->mode != 1 && rinfo->mode != 2 && rinfo->mode != 8)
+        return 0;
+    n = relay_targets(p, rinfo->srcfd, targets);
+    return targets[0] == rinfo && (n > 1 || rinfo->mode == 8) ? n : 0;
+}
+
+/*Makes room in helpers of job for one more process, before it is forked*/
+static int reserve_helper(job_info *job)
+{
+    pid_t *tmp = realloc(job->helpers, (job->nhelpers + 1) * sizeof(pid_t));
+    if(!tmp)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        return -ENOMEM;
+    }
+    job->helpers = tmp;
+    return 0;
+}
+
+/*Opens relays of process in XSSH before it is forked, failures are reported by process, see setup_redirections()*/
+static void open_relays(proc_info *p)
+{
+    redirect_info *rinfo = NULL;
+
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        redirect_info *targets[RELAY_MAX_TARGETS];
+        int n = relay_group(p, rinfo, targets);
+        if(n > 0)
+            open_relay(targets, n);
+    }
+}
+
+/*Closes relays opened by open_relays() which are not started*/
+static void close_relays(proc_info *p)
+{
+    redirect_info *rinfo = NULL;
+
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        redirect_info *targets[RELAY_MAX_TARGETS];
+        int n = relay_group(p, rinfo, targets);
+        if(n > 0)
+            close_relay(targets, n);
+    }
+}
+
+/**
+* @brief  Forks relays opened by open_relays() once process is forked. They are in process group of job and job
+*  is finished only after they have exited, so output is in files (or read by >(cmd)) when job is reported done.
+*
+* @param job    [IN] job of process, relay pids are added to it
+* @param p      [IN] process whose relays are started, its relay descriptors are closed
+* @param outfd  [IN] standard output of process
+*
+* @return 0 on success, -errno on failure
+*/
+static int start_relays(job_info *job, proc_info *p, int outfd)
+{
+    redirect_info *rinfo = NULL;
+    int retval = 0;
+
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        redirect_info *targets[RELAY_MAX_TARGETS];
+        int n = relay_group(p, rinfo, targets);
+        if(n == 0)
+            continue;
+
+        if(rinfo->relaypipe[0] > 0 && retval == 0)
+        {
+            pid_t pid = reserve_helper(job) < 0 ? -ENOMEM : fork_relay(targets, n, job->pgid, outfd);
+            if(pid < 0)
+                retval = pid;
+            else
+                job->helpers[job->nhelpers++] = pid;
+        }
+        //without relay process gets SIGPIPE on its output
+        close_relay(targets, n);
+    }
+    return retval;
+}
+
+/**
+* @brief  Applies redirections of a process in given order on current process's descriptors.
+*     Called in child before exec, and in XSSH itself (with descriptors saved) for builtins run in process.
+*
+* @param p [IN] process whose redirect_info_list is applied
+*
+* @return 0 on success else -errno
+*/
+int setup_redirections(proc_info *p)
+{
+    int retval = 0;
+    redirect_info *rinfo = NULL;
+    CIRCLEQ_FOREACH(rinfo,  &p->redirect_info_list, link)
+    {
+        int fd1;
+        int fd2;
+
+        if(rinfo->mode == 1 || rinfo->mode == 2 || rinfo->mode == 8)
+        {
+            redirect_info *targets[RELAY_MAX_TARGETS];
+            int n = relay_targets(p, rinfo->srcfd, targets);
+            if(n > 1 || rinfo->mode == 8)
+            {
+                int k;
+
+                //all targets of descriptor are handled by relay started at first of them
+                if(targets[0] != rinfo)
+                    continue;
+
+                //forked process: relay was opened by XSSH (failure already reported) and is started by it
+                for(k = 0; k < n; k++)
+                    if(targets[k]->relayfd < 0)
+                        return targets[k]->relayfd;
+                if(rinfo->relaypipe[1] > 0)
+                {
+                    if(dup2(rinfo->relaypipe[1], rinfo->srcfd) < 0)
+                        return -errno;
+                    continue;
+                }
+
+                retval = start_relay(p, targets, n);
+                if(retval < 0)
+                    return retval;
+                continue;
+            }
+        }
+
+        if(rinfo->mode == 1)
+        {
+            int srcfd = rinfo->srcfd;
+            char *dstfile = rinfo->dstfile;
+            
+            fd1 = srcfd; 
+            fd2 = open(rinfo->dstfile, O_CREAT | O_WRONLY | O_TRUNC, 0777);
+            if(fd2 < 0)
+            {
+                retval = -errno;
+                fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, rinfo->dstfile);
+                return retval;
+            }
+ 
+            //fprintf(stderr, "file=%s, fd=%d", dstfile, fd2);
+        }
+
+        if(rinfo->mode == 2)
+        {
+            int srcfd = rinfo->srcfd;
+            char *dstfile = rinfo->dstfile;
+            
+            fd1 = srcfd; 
+            fd2 = open(dstfile, O_CREAT | O_WRONLY | O_APPEND, 0777);
+            if(fd2 < 0)
+            {
+                retval = -errno;
+                fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, rinfo->dstfile);
+                return retval;
+            } 
+
+        }
+
+        if(rinfo->mode == 3)
+        {
+            int srcfd = rinfo->srcfd;
+            int dstfd = rinfo->dstfd;
+            fd1 = srcfd;
+            fd2 = dstfd;
+        } 
+
+        if(rinfo->mode == 4)
+        {
+            char *srcfile = rinfo->srcfile;
+            int dstfd = rinfo->dstfd;
+        
+            fd1 = dstfd;
+            fd2 = open(srcfile, O_RDONLY);
+            if(fd2 < 0)
+            {
+                retval = -errno;
+                fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, rinfo->srcfile);
+                return retval;
+            } 
+        }
+
+        if(rinfo->mode == 5)
+        {
+            int srcfd = rinfo->srcfd;
+            int dstfd = rinfo->dstfd;
+            fd1 = dstfd;
+            fd2 = srcfd;
+        }
+
+        if(rinfo->mode == 6 || rinfo->mode == 7)
+        {
+            //memfd is written by open_heredocs and rewound for each process which reads it
+            fd1 = rinfo->dstfd;
+            fd2 = rinfo->memfd;
+            lseek(fd2, 0, SEEK_SET);
+        }
+
+        if(dup2(fd2, fd1) < 0)
+        {
+            retval = -errno;
+            fprintf(stderr, "-xssh:%s(%d) failed to dup\n", __FUNCTION__, __LINE__);
+            return retval;
+        }
+
+        //descriptor to descriptor redirection (mode 3 and 5) must keep the source descriptor open,
+        //memfd of here-document is closed by XSSH once job is started
+        if(rinfo->mode != 3 && rinfo->mode != 5 && rinfo->mode != 6 && rinfo->mode != 7)
+            close(fd2); 
+    }
+
+    return 0;
+}
+
+/**
+* @brief  Fork server. When XSSH_ZYGOTE is set, a helper process is forked at startup while XSSH is still small and
+*  execute_job() asks it to create job processes, so that cost of starting a process does not grow with memory of
+*  XSSH (history, caches, job state).
+*
+*  Request is one SOCK_SEQPACKET message: zygote_request, dup2 map, argv, VAR=value prefixes and environment, with
+*  working directory, standard descriptors and opened redirection files attached by SCM_RIGHTS. Helper creates the
+*  process with clone(CLONE_PARENT), so XSSH is its parent and waits for it and controls its process group exactly
+*  as if it had forked it, and answers with the pid (or -errno).
+*/
+#define ZYGOTE_MAX_FDS  64
+#define ZYGOTE_MSG_MAX  (128 * 1024)
+
+typedef struct _zygote_request
+{
+    pid_t    pgid;          //0: process is leader of new process group
+    int      foreground;    //process group shall take the terminal, which is attached descriptor 1
+    int      nmap;          //dup2 steps, pairs of target fd and source
+    int      argc;
+    int      nassign;
+    int      envc;
+    uint64_t start_ns;
+}zygote_request;
+
+/*Map source >= 0 is index of attached descriptor, negative source -n-1 is descriptor n of process itself*/
+#define ZYGOTE_CHILD_FD(fd) (-(fd) - 1)
+
+static void zygote_child(zygote_request *req, int *map, char *strings, int *fds, int nfds)
+{
+    char *argv[req->argc + 1];
+    char *envp[req->envc + req->nassign + 1];
+    int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE};
+    int i, j, envc = req->envc;
+
+    for(i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        signal(signals[i], SIG_DFL);
+
+    if(setpgid(0, req->pgid) < 0)
+        _exit(-errno);
+
+    //attached descriptors are moved above any target of the map so that dup2 does not overwrite them
+    for(i = 0; i < nfds; i++)
+        fds[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, ZYGOTE_MAX_FDS);
+
+    if(fchdir(fds[0]) < 0)
+        _exit(-errno);
+
+    if(req->foreground)
+    {
+        signal(SIGTTOU, SIG_IGN);
+        if(tcsetpgrp(fds[1], getpgrp()) < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) error tcsetpgrp", __FUNCTION__, __LINE__);
+            _exit(-errno);
+        }
+        signal(SIGTTOU, SIG_DFL);
+    }
+
+    for(i = 0; i < req->nmap; i++)
+    {
+        int dst = map[2 * i], src = map[2 * i + 1];
+        src = src >= 0 ? fds[src] : -src - 1;
+        if(src != dst && dup2(src, dst) < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) failed to dup\n", __FUNCTION__, __LINE__);
+            _exit(-errno);
+        }
+    }
+
+    for(i = 0; i < req->argc; i++)
+    {
+        argv[i] = strings;
+        strings += strlen(strings) + 1;
+    }
+    argv[i] = NULL;
+
+    //environment strings follow VAR=value prefixes, which replace same variable of environment
+    char *assign = strings;
+    for(i = 0; i < req->nassign; i++)
+        strings += strlen(strings) + 1;
+    for(i = 0; i < req->envc; i++)
+    {
+        envp[i] = strings;
+        strings += strlen(strings) + 1;
+    }
+    for(i = 0; i < req->nassign; i++)
+    {
+        size_t len = strchr(assign, '=') - assign + 1;
+        for(j = 0; j < envc; j++)
+            if(!strncmp(envp[j], assign, len))
+                break;
+        envp[j] = assign;
+        if(j == envc)
+            envc++;
+        assign += strlen(assign) + 1;
+    }
+    envp[envc] = NULL;
+    environ = envp;     //execvpe searches PATH of environ
+
+    if(req->argc == 0)
+        _exit(0);
+
+    stats_record(XSSH_STAT_FORK_EXEC, now_ns() - req->start_ns);
+    execvpe(argv[0], argv, envp);
+    fprintf(stderr, "-xssh:%s(%d) execvp failed\n", __FUNCTION__, __LINE__);
+    _exit(-errno);
+}
+
+static void zygote_loop(int sock)
+{
+    char *msg = malloc(ZYGOTE_MSG_MAX);
+    char cbuf[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+
+    if(!msg)
+        _exit(1);
+
+    while(1)
+    {
+        struct iovec iov = {msg, ZYGOTE_MSG_MAX};
+        struct msghdr mh;
+        struct cmsghdr *cm;
+        int fds[ZYGOTE_MAX_FDS];
+        int i, nfds = 0;
+        pid_t pid;
+        ssize_t n;
+
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = cbuf;
+        mh.msg_controllen = sizeof(cbuf);
+        n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if(n == 0)
+            _exit(0);   //XSSH exited
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            _exit(1);
+        }
+
+        for(cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+        {
+            if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            {
+                nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(cm), nfds * sizeof(int));
+            }
+        }
+
+        zygote_request *req = (zygote_request *)msg;
+        if(n < sizeof(zygote_request) || nfds < 2 || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC)))
+            pid = -EINVAL;
+        else
+        {
+            pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+            if(pid == 0)
+                zygote_child(req, (int *)(req + 1), (char *)((int *)(req + 1) + 2 * req->nmap), fds, nfds);
+            if(pid < 0)
+                pid = -errno;
+        }
+
+        for(i = 0; i < nfds; i++)
+            close(fds[i]);
+        if(send(sock, &pid, sizeof(pid), 0) < 0 && errno != EINTR)
+            _exit(1);
+    }
+}
+
+/**
+* @brief  Starts fork server, see zygote_child().
+*
+* @return 0 on success else -1
+*/
+int zygote_start()
+{
+    int sv[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) socketpair failed: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+        return -1;
+    }
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGPIPE};
+        int i;
+
+        //own process group, so that signals from terminal reach jobs only
+        setpgid(0, 0);
+        for(i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+            signal(signals[i], SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if(getppid() == 1)
+            _exit(0);
+        close(sv[0]);
+        zygote_loop(sv[1]);
+    }
+
+    close(sv[1]);
+    g_context.zygote_fd = sv[0];
+    g_context.zygote_pid = pid;
+    g_context.zygote_owner = getpid();
+    return 0;
+}
+
+/**
+* @brief  Creates process p of job through fork server. Redirection files are opened here, in working directory of
+*  XSSH, and passed to the process with its pipe ends.
+*
+* @param first    [IN] p is first process of job, it creates process group
+* @param infd     [IN] descriptor which becomes standard input, 0 if it is input of XSSH
+* @param outfd    [IN] descriptor which becomes standard output, 1 if it is output of XSSH
+* @param start_ns [IN] time at which job was started, for fork-exec latency
+*
+* @return pid of process, or -1 if it shall be forked by caller (failed redirection is then reported by child)
+*/
+pid_t zygote_spawn(job_info *job, proc_info *p, int first, int infd, int outfd, uint64_t start_ns)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * ZYGOTE_MAX_FDS)];
+    int fds[ZYGOTE_MAX_FDS], owned[ZYGOTE_MAX_FDS];
+    int map[2 * ZYGOTE_MAX_FDS];
+    int nfds = 0, nmap = 0, i;
+    size_t len = 0, off;
+    ssize_t n;
+    char *msg = NULL;
+    pid_t pid = -1;
+    redirect_info *rinfo = NULL;
+    zygote_request req;
+
+    //output relays are opened by execute_job() and inherited from XSSH by forked process
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        redirect_info *targets[RELAY_MAX_TARGETS];
+        if(rinfo->mode == 8 || ((rinfo->mode == 1 || rinfo->mode == 2) && relay_targets(p, rinfo->srcfd, targets) > 1))
+            return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    memset(owned, 0, sizeof(owned));
+    req.pgid = first ? 0 : job->pgid;
+    req.foreground = first && !job->background && isatty(STDIN_FILENO);
+    req.nassign = count_assignments(p);
+    req.argc = p->nargs - 1 - req.nassign;
+    req.start_ns = start_ns;
+
+    fds[nfds] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    owned[nfds++] = 1;
+    if(fds[0] < 0)
+        return -1;
+    fds[nfds++] = infd;     //also terminal for tcsetpgrp of first process
+    fds[nfds++] = outfd;
+    fds[nfds++] = 2;
+    for(i = 0; i < 3; i++)
+    {
+        map[2 * nmap] = i;
+        map[2 * nmap++ + 1] = i + 1;
+    }
+
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        if(nfds == ZYGOTE_MAX_FDS)
+            goto done;
+
+        switch(rinfo->mode)
+        {
+            case 1:
+            case 2:
+                fds[nfds] = open(rinfo->dstfile, O_CREAT | O_WRONLY | O_CLOEXEC | (rinfo->mode == 1 ? O_TRUNC : O_APPEND), 0777);
+                map[2 * nmap] = rinfo->srcfd;
+                owned[nfds] = 1;
+                break;
+            case 3:
+                map[2 * nmap] = rinfo->srcfd;
+                map[2 * nmap + 1] = ZYGOTE_CHILD_FD(rinfo->dstfd);
+                nmap++;
+                continue;
+            case 4:
+                fds[nfds] = open(rinfo->srcfile, O_RDONLY | O_CLOEXEC);
+                map[2 * nmap] = rinfo->dstfd;
+                owned[nfds] = 1;
+                break;
+            case 5:
+                map[2 * nmap] = rinfo->dstfd;
+                map[2 * nmap + 1] = ZYGOTE_CHILD_FD(rinfo->srcfd);
+                nmap++;
+                continue;
+            case 6:
+            case 7:
+                lseek(rinfo->memfd, 0, SEEK_SET);
+                fds[nfds] = rinfo->memfd;
+                map[2 * nmap] = rinfo->dstfd;
+                break;
+            default:
+                continue;
+        }
+        if(fds[nfds] < 0)
+            goto done;      //child forked by caller reports the error as usual
+        map[2 * nmap++ + 1] = nfds++;
+    }
+    req.nmap = nmap;
+
+    //argv, VAR=value prefixes and environment as consecutive strings
+    for(i = 1; i < p->nargs; i++)
+        len += strlen(p->args[i]) + 1;
+    for(i = 0; g_context.env.envp[i]; i++)
+        len += strlen(g_context.env.envp[i]) + 1;
+    req.envc = i;
+    off = sizeof(req) + nmap * 2 * sizeof(int);
+    if(off + len > ZYGOTE_MSG_MAX || !(msg = malloc(off + len)))
+        goto done;
+    memcpy(msg, &req, sizeof(req));
+    memcpy(msg + sizeof(req), map, nmap * 2 * sizeof(int));
+    for(i = 1 + req.nassign; i < p->nargs; i++)
+        off += sprintf(msg + off, "%s", p->args[i]) + 1;
+    for(i = 1; i <= req.nassign; i++)
+        off += sprintf(msg + off, "%s", p->args[i]) + 1;
+    for(i = 0; i < req.envc; i++)
+        off += sprintf(msg + off, "%s", g_context.env.envp[i]) + 1;
+
+    struct iovec iov = {msg, off};
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    memset(&mh, 0, sizeof(mh));
+    memset(cbuf, 0, sizeof(cbuf));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * nfds);
+
+    while(sendmsg(g_context.zygote_fd, &mh, MSG_NOSIGNAL) < 0)
+    {
+        if(errno == EINTR)
+            continue;
+        goto broken;
+    }
+    while((n = recv(g_context.zygote_fd, &pid, sizeof(pid), 0)) != sizeof(pid))
+    {
+        if(n < 0 && errno == EINTR)
+            continue;
+        goto broken;
+    }
+    if(pid < 0)
+        pid = -1;
+    goto done;
+
+broken:
+    //fork server is gone, XSSH forks by itself from now on
+    fprintf(stderr, "-xssh: fork server failed, using fork\n");
+    close(g_context.zygote_fd);
+    g_context.zygote_fd = 0;
+    pid = -1;
+done:
+    for(i = 0; i < nfds; i++)
+        if(owned[i] && fds[i] >= 0)
+            close(fds[i]);
+    free(msg);
+    return pid;
+}
+
+/**
+* @brief  This function will execute the command using execvp and shall be called just after fork() in execute_job function.
+* but before it does execvp it also does some prequired task such pipe and redirection setup
+*
+* @param inprevpipe  previous pipe's in open file discritor 
+* @param inpipe      current pipe in open file descriptor.
+* @param outpipe     current pipe out open file descriptor
+* @param p
+*/
+void run_exec (int inprevpipe, int inpipe, int outpipe, proc_info *p)
+{
+    int retval = 0;
+    if(inpipe != 0)    //last process in job will have inpipe as 0 and outpipe as 1
+        close(inpipe); 
+
+    if(outpipe != 1)
+    {
+ 
+        retval = dup2(outpipe, 1);
+        if(retval < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) dup failed\n", __FUNCTION__, __LINE__);
+            goto done;
+        }
+
+        close(outpipe);    //should we do it  
+    }
+
+    if(inprevpipe != 0)
+    {
+        retval = dup2(inprevpipe, 0);
+        if(retval < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) dup failed\n", __FUNCTION__, __LINE__);
+            goto done;
+        }
+
+        close(inprevpipe); //should we do it 
+    }
+
+    //redirection setup
+    retval = setup_redirections(p);
+    if(retval < 0)
+        goto done;
+
+    //VAR=value prefixes only change environment of this child
+    int nassign = count_assignments(p);
+    int i;
+    for(i = 1; i <= nassign; i++)
+    {
+        char *eq = strchr(p->args[i], '=');
+        *eq = '\0';
+        env_set(p->args[i], eq + 1);
+    }
+
+    //builtin stage of pipeline runs in this child without exec
+    if(p->nargs - 1 > nassign && is_stage_builtin(p->args[1 + nassign]))
+    {
+        int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
+        for(i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+            signal(signals[i], SIG_DFL);
+        g_context.fg_job = NULL;
+        retval = run_stage_builtin(p);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(retval);
+    }
+
+    if(p->nargs - 1 > nassign)
+    {
+        uint64_t exec_ns = now_ns();
+        char **argv = &p->args[1 + nassign];
+        stats_record(XSSH_STAT_FORK_EXEC, exec_ns - p->start_ns);
+        if(g_context.trace)
+            trace_add('i', "exec", getpgrp(), getpid(), exec_ns, 0, 0, argv[0]);
+        retval = execvpe(argv[0], argv, g_context.env.envp);
+        if(retval < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) execvp failed\n", __FUNCTION__, __LINE__);
+            goto done;
+        }
+    }
+    else
+        _exit(0);
+done:
+    if(retval < 0)
+        _exit(-errno);   
+}
+
+/**
+* @brief  pipestat relay. Moves data from read end of pipe between process i and i + 1 into a new pipe, which
+*  process i + 1 reads instead, with non blocking splice(2) and counts bytes. When splice can not move anything,
+*  time until it can is charged to the side which is not ready: empty input means reader is starved by writer,
+*  full output means writer is blocked by reader. Relay belongs to process group of job and is its helper, so job
+*  is finished (and reported) only after relay has counted all bytes and exited.
+*
+* @param inpipe [IN/OUT] read end of pipe, replaced by read end of relayed pipe
+*
+* @return 0 on success else -errno
+*/
+static int start_meter(job_info *job, int i, int *inpipe)
+{
+    pipe_meter *m = &job->meters[i];
+    int out[2];
+    pid_t pid;
+
+    if(reserve_helper(job) < 0)
+        return -ENOMEM;
+    if(pipe2(out, O_CLOEXEC) < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+        return -errno;
+    }
+
+    m->start_ns = now_ns();
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+        close(out[0]);
+        close(out[1]);
+        return -errno;
+    }
+
+    if(pid == 0)
+    {
+        int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
+        int k;
+
+        setpgid(0, job->pgid);
+        for(k = 0; k < sizeof(signals) / sizeof(signals[0]); k++)
+            signal(signals[k], SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+        dup2(*inpipe, 0);
+        dup2(out[1], 1);
+        if(syscall(SYS_close_range, 3, ~0U, 0) < 0)
+            for(k = 3; k < 1024; k++)
+                close(k);
+
+        while(1)
+        {
+            struct pollfd pfd = {0, POLLIN, 0};
+            ssize_t n = splice(0, NULL, 1, NULL, RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            uint64_t ns;
+
+            if(n > 0)
+            {
+                __atomic_fetch_add(&m->bytes, n, __ATOMIC_RELAXED);
+                continue;
+            }
+            if(n == 0 || (errno != EAGAIN && errno != EINTR))
+                break;   //end of data or reader has gone
+
+            ns = now_ns();
+            __atomic_store_n(&m->wait_ns, ns, __ATOMIC_RELAXED);
+            if(poll(&pfd, 1, 0) == 0)
+            {
+                __atomic_store_n(&m->waiting, 1, __ATOMIC_RELEASE);
+                poll(&pfd, 1, -1);
+                __atomic_store_n(&m->waiting, 0, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&m->starved_ns, now_ns() - ns, __ATOMIC_RELAXED);
+            }
+            else
+            {
+                pfd.fd = 1;
+                pfd.events = POLLOUT;
+                __atomic_store_n(&m->waiting, 2, __ATOMIC_RELEASE);
+                poll(&pfd, 1, -1);
+                __atomic_store_n(&m->waiting, 0, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&m->blocked_ns, now_ns() - ns, __ATOMIC_RELAXED);
+                if(pfd.revents & POLLERR)
+                    break;
+            }
+        }
+        __atomic_store_n(&m->end_ns, now_ns(), __ATOMIC_RELEASE);
+        _exit(0);
+    }
+
+    setpgid(pid, job->pgid);
+    m->pid = pid;
+    job->helpers[job->nhelpers++] = pid;
+    close(*inpipe);
+    close(out[1]);
+    *inpipe = out[0];
+    return 0;
+}
+
+static void fmt_bytes(char *str, double bytes)
+{
+    const char *units[] = {"B", "KB", "MB", "GB", "TB"};
+    int u = 0;
+
+    while(bytes >= 1024 && u < 4)
+    {
+        bytes /= 1024;
+        u++;
+    }
+    sprintf(str, u ? "%.1f%s" : "%.0f%s", bytes, units[u]);
+}
+
+/**
+* @brief  Prints one line per metered pipe of job: bytes, rate and how long writer was blocked and reader starved.
+*  Values of pipes which are still running are live.
+*/
+void pipestat_print(job_info *job, FILE *out)
+{
+    int i;
+
+    for(i = 0; i < job->nmeters; i++)
+    {
+        pipe_meter *m = &job->meters[i];
+        uint64_t start = __atomic_load_n(&m->start_ns, __ATOMIC_RELAXED);
+        uint64_t end = __atomic_load_n(&m->end_ns, __ATOMIC_ACQUIRE);
+        uint64_t bytes = __atomic_load_n(&m->bytes, __ATOMIC_RELAXED);
+        uint64_t blocked = __atomic_load_n(&m->blocked_ns, __ATOMIC_RELAXED);
+        uint64_t starved = __atomic_load_n(&m->starved_ns, __ATOMIC_RELAXED);
+        uint64_t elapsed;
+        char size[16], rate[16], bstr[16], sstr[16];
+
+        if(!start)
+            continue;
+        if(!end)
+        {
+            //wait in progress is not in counters yet
+            int waiting = __atomic_load_n(&m->waiting, __ATOMIC_ACQUIRE);
+            uint64_t ns = now_ns() - __atomic_load_n(&m->wait_ns, __ATOMIC_RELAXED);
+            if(waiting == 1)
+                starved += ns;
+            else if(waiting == 2)
+                blocked += ns;
+        }
+        elapsed = (end ? end : now_ns()) - start;
+        if(!elapsed)
+            elapsed = 1;
+
+        fmt_bytes(size, bytes);
+        fmt_bytes(rate, bytes * 1e9 / elapsed);
+        hist_fmt_ns(bstr, blocked);
+        hist_fmt_ns(sstr, starved);
+        fprintf(out, "  %d>%d %10s %10s/s   writer blocked %8s (%3.0f%%)   reader starved %8s (%3.0f%%)%s\n",
+                i + 1, i + 2, size, rate, bstr, 100.0 * blocked / elapsed, sstr, 100.0 * starved / elapsed,
+                end ? "" : "   running");
+    }
+}
+
+/*Summary of metered job once it has finished, its relays have been reaped with it*/
+void pipestat_report(job_info *job)
+{
+    if(!job->meters)
+        return;
+
+    fflush(stdout);
+    fprintf(stderr, "pipestat: %s\n", job->cmd);
+    pipestat_print(job, stderr);
+}
+
+/**
+* @brief  Pipeline output cache. With "cache on" output of all stages but the last of a pipeline is stored, and
+*  "a | b | @cache | c" stores output of stages before @cache marker whether cache is on or not. Entry is keyed by
+*  working directory, exported environment, argv and redirections of stages and identity (device, inode, size,
+*  mtime) of their input files and of arguments naming existing files, so an edited or rerun pipeline whose prefix
+*  is unchanged reads stored bytes directly as input of first changed stage instead of running the prefix.
+*
+*  Standard input of XSSH is not part of key, so prefix is cached only if its first stage has input redirected or
+*  names a file in its arguments (e.g. "grep x log | sort", "seq 100 < /dev/null | sort"), others may read it.
+*
+*  Entries are files in $XSSH_CACHE_DIR (default ~/.cache/xssh) named by 64 bit key. Modification time of entry is
+*  its last use, entries used longest ago are removed while total size exceeds limit (XSSH_CACHE_SIZE or
+*  "cache limit", default 1G). Entry larger than quarter of limit is not stored.
+*/
+#define CACHE_DEFAULT_LIMIT  (1ULL << 30)
+
+static int cache_dir(char *dir, size_t size)
+{
+    const char *env = getenv("XSSH_CACHE_DIR");
+    char *p;
+
+    if(env && *env)
+        snprintf(dir, size, "%s", env);
+    else if(getenv("HOME"))
+        snprintf(dir, size, "%s/.cache/xssh", getenv("HOME"));
+    else
+        return -1;
+
+    //mkdir -p
+    for(p = dir + 1; *p; p++)
+    {
+        if(*p == '/')
+        {
+            *p = '\0';
+            mkdir(dir, 0700);
+            *p = '/';
+        }
+    }
+    if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+        return -1;
+    return 0;
+}
+
+static uint64_t cache_limit()
+{
+    const char *env = getenv("XSSH_CACHE_SIZE");
+
+    if(g_context.cache_limit)
+        return g_context.cache_limit;
+    if(env && *env)
+    {
+        char *end = NULL;
+        double v = strtod(env, &end);
+        switch(*end)
+        {
+            case 'K': case 'k': v *= 1024; break;
+            case 'M': case 'm': v *= 1024 * 1024; break;
+            case 'G': case 'g': v *= 1024 * 1024 * 1024; break;
+        }
+        if(v > 0)
+            return (uint64_t)v;
+    }
+    return CACHE_DEFAULT_LIMIT;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while(len--)
+    {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t fnv1a_file(uint64_t h, const char *path)
+{
+    struct stat st;
+    if(stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+        return fnv1a(h, "-", 1);
+    h = fnv1a(h, &st.st_dev, sizeof(st.st_dev));
+    h = fnv1a(h, &st.st_ino, sizeof(st.st_ino));
+    h = fnv1a(h, &st.st_size, sizeof(st.st_size));
+    h = fnv1a(h, &st.st_mtim, sizeof(st.st_mtim));
+    return h;
+}
+
+/*Key of first n processes of job, 0 if their output can not be cached (they write to files or processes, or
+ *first of them may read standard input of XSSH)*/
+static uint64_t cache_key(job_info *job, int n)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    char cwd[4096];
+    proc_info *p = NULL;
+    int k = 0, i, stdin_read = 1;
+
+    if(getcwd(cwd, sizeof(cwd)))
+        h = fnv1a(h, cwd, strlen(cwd) + 1);
+    for(i = 0; g_context.env.envp[i]; i++)
+        h = fnv1a(h, g_context.env.envp[i], strlen(g_context.env.envp[i]) + 1);
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        redirect_info *rinfo = NULL;
+        if(k++ == n)
+            break;
+
+        h = fnv1a(h, "|", 1);
+        for(i = 1; i < p->nargs; i++)
+        {
+            struct stat st;
+
+            h = fnv1a(h, p->args[i], strlen(p->args[i]) + 1);
+            if(p->args[i][0] != '-')
+                h = fnv1a_file(h, p->args[i]);
+            if(k == 1 && p->args[i][0] != '-' && stat(p->args[i], &st) == 0 && S_ISREG(st.st_mode))
+                stdin_read = 0;
+        }
+
+        CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+        {
+            if(rinfo->mode == 1 || rinfo->mode == 2 || rinfo->mode == 8)
+                return 0;
+            if(k == 1 && (rinfo->mode == 4 || rinfo->mode == 6 || rinfo->mode == 7) && rinfo->dstfd == 0)
+                stdin_read = 0;
+            h = fnv1a(h, &rinfo->mode, sizeof(rinfo->mode));
+            h = fnv1a(h, &rinfo->srcfd, sizeof(rinfo->srcfd));
+            h = fnv1a(h, &rinfo->dstfd, sizeof(rinfo->dstfd));
+            if(rinfo->srcfile)
+                h = fnv1a(h, rinfo->srcfile, strlen(rinfo->srcfile) + 1);
+            if(rinfo->body)
+                h = fnv1a(h, rinfo->body, strlen(rinfo->body) + 1);
+            if(rinfo->mode == 4)
+                h = fnv1a_file(h, rinfo->srcfile);
+        }
+    }
+    if(stdin_read)
+        return 0;
+    return h ? h : 1;
+}
+
+static void cache_drop_procs(job_info *job, int n)
+{
+    while(n-- > 0 && !CIRCLEQ_EMPTY(&job->proc_info_list))
+    {
+        proc_info *p = CIRCLEQ_FIRST(&job->proc_info_list);
+        CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
+        destroy_proc(p);
+        job->nprocs--;
+    }
+}
+
+/**
+* @brief  Called before job is started. Removes @cache marker, replaces longest cached prefix with its stored
+*  output (input redirection of first remaining process) or prepares storing of prefix output.
+*/
+void cache_apply(job_info *job)
+{
+    char dir[4096], path[4200];
+    proc_info *p = NULL;
+    int marker = 0, k = 0, n;
+
+    //"@cache" stage ends prefix, as last stage it is replaced by cat which prints the output
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        if(p->nargs == 2 && !strcmp(p->args[1], "@cache") && k > 0)
+        {
+            marker = k;
+            break;
+        }
+        k++;
+    }
+
+    if(marker)
+    {
+        if(marker == job->nprocs - 1)
+        {
+            free_arg(p, p->args[0]);
+            free_arg(p, p->args[1]);
+            p->args[0] = strdup("cat");
+            p->args[1] = strdup("cat");
+        }
+        else
+        {
+            CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
+            destroy_proc(p);
+            job->nprocs--;
+        }
+    }
+
+    if((!marker && !g_context.cache_on) || job->nprocs < 2 || cache_dir(dir, sizeof(dir)) < 0)
+        return;
+
+    //longest stored prefix wins, with marker only marked prefix is looked up
+    for(n = marker ? marker : job->nprocs - 1; n > 0; n--)
+    {
+        uint64_t key = cache_key(job, n);
+        redirect_info *rinfo = NULL;
+
+        if(!key)
+            continue;
+        snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)key);
+        if(access(path, R_OK) < 0)
+        {
+            if(marker)
+                break;
+            continue;
+        }
+
+        rinfo = malloc(sizeof(redirect_info));
+        if(!rinfo)
+            return;
+        memset(rinfo, 0, sizeof(redirect_info));
+        rinfo->mode = 4;
+        rinfo->srcfd = -1;
+        rinfo->dstfd = 0;
+        rinfo->srcfile = strdup(path);
+
+        cache_drop_procs(job, n);
+        p = CIRCLEQ_FIRST(&job->proc_info_list);
+        CIRCLEQ_INSERT_HEAD(&p->redirect_info_list, rinfo, link);
+        utimensat(AT_FDCWD, path, NULL, 0);    //most recently used
+        g_context.cache_hits++;
+        return;
+    }
+
+    g_context.cache_misses++;
+    n = marker ? marker : job->nprocs - 1;
+    uint64_t key = cache_key(job, n);
+    if(!key)
+        return;
+
+    snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)key);
+    job->cache_path = strdup(path);
+    job->cache_len = n;
+    k = 0;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+        p->cache_prefix = k++ < n;
+}
+
+/**
+* @brief  Cache relay between last prefix process and next one. Data is duplicated into next pipe with tee(2) and
+*  the same bytes are moved into temporary entry file with splice(2). If entry grows over its limit or can not be
+*  written, file is removed and relay only passes data on. If next process exits, relay exits and removes partial
+*  entry, so prefix gets SIGPIPE as it would without cache.
+*/
+static int start_cache_store(job_info *job, int *inpipe)
+{
+    char tmp[4300];
+    uint64_t max = cache_limit() / 4;
+    int out[2], fd;
+    pid_t pid;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->cache_path);
+    fd = open(tmp, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0)
+        return 0;   //nothing is stored
+
+    if(pipe2(out, O_CLOEXEC) < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+        close(fd);
+        return -errno;
+    }
+
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+        close(fd);
+        close(out[0]);
+        close(out[1]);
+        return -errno;
+    }
+
+    if(pid == 0)
+    {
+        int signals[] = {SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU, SIGCHLD};
+        int k, caching = 1, devnull;
+        uint64_t stored = 0;
+
+        setpgid(0, job->pgid);
+        for(k = 0; k < sizeof(signals) / sizeof(signals[0]); k++)
+            signal(signals[k], SIG_DFL);
+        signal(SIGPIPE, SIG_IGN);
+        dup2(*inpipe, 0);
+        dup2(out[1], 1);
+        dup2(fd, 3);
+        if(syscall(SYS_close_range, 4, ~0U, 0) < 0)
+            for(k = 4; k < 1024; k++)
+                close(k);
+        devnull = open("/dev/null", O_WRONLY);
+
+        while(1)
+        {
+            int teed = caching;
+            ssize_t n;
+
+            if(teed)
+                n = tee(0, 1, RELAY_CHUNK, 0);
+            else
+                n = splice(0, NULL, 1, NULL, RELAY_CHUNK, SPLICE_F_MOVE);
+
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n < 0 && errno == EPIPE)
+            {
+                //next process has gone: output of prefix is incomplete and prefix shall stop on SIGPIPE
+                caching = 0;
+                break;
+            }
+            if(n <= 0)
+                break;
+
+            if(caching && stored + n > max)
+            {
+                caching = 0;
+                ftruncate(3, 0);
+            }
+            if(caching)
+            {
+                if(relay_move(0, 3, n) < 0)
+                    caching = 0;
+            }
+            else if(teed)
+                relay_move(0, devnull, n);   //already passed on by tee, only consumed here
+            stored += n;
+        }
+
+        if(!caching)
+            unlink(tmp);
+        _exit(caching ? 0 : 1);
+    }
+
+    setpgid(pid, job->pgid);
+    job->cache_pid = pid;
+    close(fd);
+    close(*inpipe);
+    close(out[1]);
+    *inpipe = out[0];
+    return 0;
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    const struct { struct timespec mtime; off_t size; char name[256]; } *x = a, *y = b;
+    if(x->mtime.tv_sec != y->mtime.tv_sec)
+        return x->mtime.tv_sec < y->mtime.tv_sec ? -1 : 1;
+    return x->mtime.tv_nsec < y->mtime.tv_nsec ? -1 : x->mtime.tv_nsec > y->mtime.tv_nsec;
+}
+
+/*Removes entries used longest ago until total size is within limit (limit 0 removes all)*/
+static void cache_evict(const char *dir, uint64_t limit, uint64_t *total, int *count)
+{
+    struct { struct timespec mtime; off_t size; char name[256]; } *ents = NULL;
+    size_t n = 0, cap = 0, i;
+    uint64_t sum = 0;
+    struct dirent *de;
+    DIR *d = opendir(dir);
+
+    if(!d)
+        return;
+    while((de = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if(de->d_name[0] == '.' || fstatat(dirfd(d), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if(n == cap)
+        {
+            void *tmp = realloc(ents, (cap = cap ? cap * 2 : 64) * sizeof(*ents));
+            if(!tmp)
+                break;
+            ents = tmp;
+        }
+        ents[n].mtime = st.st_mtim;
+        ents[n].size = st.st_size;
+        snprintf(ents[n].name, sizeof(ents[n].name), "%s", de->d_name);
+        sum += st.st_size;
+        n++;
+    }
+
+    qsort(ents, n, sizeof(*ents), cache_entry_cmp);
+    for(i = 0; i < n && (sum > limit || !limit); i++)
+    {
+        if(unlinkat(dirfd(d), ents[i].name, 0) == 0)
+            sum -= ents[i].size;
+    }
+    closedir(d);
+
+    if(total)
+        *total = sum;
+    if(count)
+        *count = n - i;
+    free(ents);
+}
+
+/*Called when job has finished: entry becomes visible if all prefix processes succeeded*/
+void cache_commit(job_info *job)
+{
+    char tmp[4300], dir[4096];
+
+    if(!job->cache_path || !job->cache_pid)
+        return;
+
+    waitpid(job->cache_pid, NULL, 0);   //may have been reaped with job already
+    snprintf(tmp, sizeof(tmp), "%s.tmp", job->cache_path);
+    if(job->cache_failed || job->state == XSSH_JOB_STATE_KILLED || rename(tmp, job->cache_path) < 0)
+    {
+        unlink(tmp);
+        return;
+    }
+
+    if(cache_dir(dir, sizeof(dir)) == 0)
+        cache_evict(dir, cache_limit(), NULL, NULL);
+}
+
+/*Records result of task whose job is being destroyed*/
+void task_finished(job_info *job)
+{
+    task_info *t = job->task;
+
+    t->end_ns = now_ns();
+    t->job = NULL;
+    if(job->state == XSSH_JOB_STATE_DONE)
+        t->status = job->status;
+    else if(job->state == XSSH_JOB_STATE_KILLED)
+        t->status = 128 + job->status;
+    else
+        t->status = 1;  //never started or was abandoned
+    t->state = t->status ? XSSH_TASK_FAILED : XSSH_TASK_DONE;
+}
+
+static void tasks_free(task_info *t, int n)
+{
+    int i;
+    for(i = 0; i < n; i++)
+    {
+        free(t[i].name);
+        free(t[i].cmd);
+        free(t[i].deps);
+    }
+    free(t);
+}
+
+static int task_find(task_info *t, int n, const char *name)
+{
+    int i;
+    for(i = 0; i < n; i++)
+        if(!strcmp(t[i].name, name))
+            return i;
+    return -1;
+}
+
+/**
+* @brief  Reads task file. Each line is "name: deps... ; command", '#' starts a comment.
+*
+* @param order [OUT] malloced indexes of tasks in dependency order
+*
+* @return number of tasks, -1 on error (reported)
+*/
+static int tasks_load(const char *file, task_info **out, int **order)
+{
+    task_info *t = NULL;
+    char **deps = NULL;    //dependency names per task until all names are known
+    char *line = NULL;
+    size_t cap = 0;
+    int n = 0, lineno = 0, i, j, k, *indeg = NULL, *ord = NULL;
+    FILE *fp = fopen(file, "r");
+
+    if(!fp)
+    {
+        fprintf(stderr, "-xssh: tasks: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    while(getline(&line, &cap, fp) > 0)
+    {
+        char *ptr = line, *name, *colon, *semi, *end;
+        lineno++;
+
+        for(end = line; *end; end++)
+            if(*end == '#' && (end == line || isspace(end[-1])))
+                break;
+        while(end > line && isspace(end[-1]))
+            end--;
+        *end = '\0';
+        while(isspace(*ptr))
+            ptr++;
+        if(!*ptr)
+            continue;
+
+        colon = strchr(ptr, ':');
+        if(!colon)
+        {
+            fprintf(stderr, "-xssh: tasks: %s:%d: missing ':'\n", file, lineno);
+            goto error;
+        }
+        *colon = '\0';
+        name = ptr;
+        rtrim(name);
+        if(!*name || strpbrk(name, " \t"))
+        {
+            fprintf(stderr, "-xssh: tasks: %s:%d: invalid task name\n", file, lineno);
+            goto error;
+        }
+        if(task_find(t, n, name) >= 0)
+        {
+            fprintf(stderr, "-xssh: tasks: %s:%d: %s: task defined twice\n", file, lineno, name);
+            goto error;
+        }
+
+        semi = strchr(colon + 1, ';');
+        if(semi)
+            *semi++ = '\0';
+        while(semi && isspace(*semi))
+            semi++;
+        if(semi && strlen(semi) >= BUFLEN - 2)
+        {
+            fprintf(stderr, "-xssh: tasks: %s:%d: command too long\n", file, lineno);
+            goto error;
+        }
+
+        void *tmp = realloc(t, (n + 1) * sizeof(task_info));
+        void *tmp2 = tmp ? realloc(deps, (n + 1) * sizeof(char *)) : NULL;
+        if(tmp)
+            t = tmp;
+        if(tmp2)
+            deps = tmp2;
+        if(!tmp || !tmp2)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            goto error;
+        }
+        memset(&t[n], 0, sizeof(task_info));
+        t[n].name = strdup(name);
+        t[n].cmd = strdup(semi ? semi : "");
+        deps[n] = strdup(colon + 1);
+        n++;
+    }
+
+    //dependency names into indexes
+    for(i = 0; i < n; i++)
+    {
+        char *saveptr = NULL, *dep;
+        t[i].deps = malloc(sizeof(int) * (strlen(deps[i]) / 2 + 1));
+        if(!t[i].deps)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            goto error;
+        }
+        for(dep = strtok_r(deps[i], " \t", &saveptr); dep; dep = strtok_r(NULL, " \t", &saveptr))
+        {
+            k = task_find(t, n, dep);
+            if(k < 0)
+            {
+                fprintf(stderr, "-xssh: tasks: %s: unknown task %s\n", t[i].name, dep);
+                goto error;
+            }
+            t[i].deps[t[i].ndeps++] = k;
+        }
+    }
+
+    //Kahn: a task is ordered once all its dependencies are, leftovers form a cycle
+    indeg = calloc(n + 1, sizeof(int));
+    ord = malloc(sizeof(int) * (n + 1));
+    if(!indeg || !ord)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        goto error;
+    }
+    for(i = 0; i < n; i++)
+        indeg[i] = t[i].ndeps;
+    for(i = 0, k = 0; i < n; i++)
+        if(!indeg[i])
+            ord[k++] = i;
+    for(i = 0; i < k; i++)
+    {
+        for(j = 0; j < n; j++)
+        {
+            int d;
+            for(d = 0; d < t[j].ndeps; d++)
+                if(t[j].deps[d] == ord[i] && --indeg[j] == 0)
+                    ord[k++] = j;
+        }
+    }
+    if(k < n)
+    {
+        for(i = 0; i < n && !indeg[i]; i++)
+            ;
+        fprintf(stderr, "-xssh: tasks: dependency cycle through %s\n", t[i].name);
+        goto error;
+    }
+
+    for(i = 0; i < n; i++)
+        free(deps[i]);
+    free(deps);
+    free(indeg);
+    free(line);
+    fclose(fp);
+    *out = t;
+    *order = ord;
+    return n;
+
+error:
+    for(i = 0; i < n; i++)
+        free(deps[i]);
+    free(deps);
+    free(indeg);
+    free(ord);
+    free(line);
+    fclose(fp);
+    tasks_free(t, n);
+    return -1;
+}
+
+/*Starts task as a background job*/
+static void task_start(task_info *t)
+{
+    char buffer[BUFLEN];
+    job_info *tmpl = NULL, *job = NULL;
+
+    t->start_ns = now_ns();
+    t->state = XSSH_TASK_RUNNING;
+    if(!t->cmd[0])
+    {
+        t->end_ns = t->start_ns;
+        t->state = XSSH_TASK_DONE;
+        return;
+    }
+
+    snprintf(buffer, BUFLEN, "%s", t->cmd);
+    tmpl = create_job(buffer);
+    job = tmpl ? instantiate_job(tmpl) : NULL;
+    destroy_job(tmpl);
+    if(!job)
+    {
+        t->end_ns = now_ns();
+        t->status = 2;
+        t->state = XSSH_TASK_FAILED;
+        return;
+    }
+
+    job->background = 1;
+    job->task = t;
+    t->job = job;
+    run_job(job);
+    if(t->job)
+        t->pgid = t->job->pgid;
+
+    //job which could not be started is left as foreground job
+    if(g_context.fg_job)
+    {
+        wait_job();
+        if(g_context.fg_job)
+            fg_job_terminated();
+    }
+}
+
+/**
+* @brief  tasks builtin. Runs tasks of file as background jobs of XSSH (so jobs, fg and kill see them), at most
+*  N at a time (-j N, default number of CPUs), each one once its dependencies have succeeded. Dependents of failed
+*  task are skipped. Ctrl+C interrupts running tasks and starts no more, ctrl+Z leaves running tasks as background
+*  jobs and returns. Timings of tasks and critical path (chain of dependent tasks which took longest) are printed
+*  at the end.
+*/
+void tasks(char buffer[BUFLEN])
+{
+    task_info *t = NULL;
+    int *order = NULL;
+    char *arg = NULL, *file = NULL, *saveptr = NULL;
+    long maxjobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int n, i, k, running = 0, stopping = 0, counts[5] = {0};
+    uint64_t start_ns, *path_ns = NULL;
+    int *path_prev = NULL, last = -1;
+    char str[3][32];
+
+    rtrim(buffer);
+    for(arg = strtok_r(buffer + 5, " ", &saveptr); arg; arg = strtok_r(NULL, " ", &saveptr))
+    {
+        if(!strncmp(arg, "-j", 2))
+        {
+            char *val = arg[2] ? arg + 2 : strtok_r(NULL, " ", &saveptr);
+            maxjobs = val ? atol(val) : 0;
+            if(maxjobs <= 0)
+            {
+                fprintf(stderr, "-xssh: tasks: -j needs a positive number\n");
+                sprintf(varvalue[1], "%d", 2);
+                return;
+            }
+        }
+        else
+            file = arg;
+    }
+    if(!file)
+    {
+        fprintf(stderr, "-xssh: tasks: usage: tasks [-j N] file\n");
+        sprintf(varvalue[1], "%d", 2);
+        return;
+    }
+    if(maxjobs <= 0)
+        maxjobs = 1;
+
+    n = tasks_load(file, &t, &order);
+    if(n < 0)
+    {
+        sprintf(varvalue[1], "%d", 2);
+        return;
+    }
+
+    if(!g_context.in_builtin)
+        g_context.interrupted = 0;
+    g_context.detach = 0;
+    g_context.in_builtin++;
+    start_ns = now_ns();
+
+    while(1)
+    {
+        //walking in dependency order lets a failure skip all its dependents in one pass
+        running = 0;
+        for(k = 0; k < n; k++)
+        {
+            task_info *tk = &t[order[k]];
+            int ready = 1;
+
+            if(tk->state == XSSH_TASK_RUNNING)
+                running++;
+            if(tk->state != XSSH_TASK_WAITING)
+                continue;
+            for(i = 0; i < tk->ndeps; i++)
+            {
+                task_state ds = t[tk->deps[i]].state;
+                if(ds == XSSH_TASK_FAILED || ds == XSSH_TASK_SKIPPED)
+                    tk->state = XSSH_TASK_SKIPPED;
+                if(ds != XSSH_TASK_DONE)
+                    ready = 0;
+            }
+            if(stopping)
+                tk->state = XSSH_TASK_SKIPPED;
+            if(tk->state == XSSH_TASK_WAITING && ready && running < maxjobs)
+            {
+                task_start(tk);
+                if(tk->state == XSSH_TASK_RUNNING)
+                    running++;
+                else
+                {
+                    //finished at once, dependents may be ready now
+                    running = 0;
+                    k = -1;
+                }
+            }
+        }
+
+        if(!running || g_context.detach)
+            break;
+
+        //wait for SIGCHLD, background jobs are collected as in the prompt loop
+        wait_ready(-1);
+        wait_background_job(0);
+
+        if(g_context.interrupted && !stopping)
+        {
+            stopping = 1;
+            for(i = 0; i < n; i++)
+                if(t[i].state == XSSH_TASK_RUNNING && t[i].pgid > 0)
+                    kill(-t[i].pgid, SIGINT);
+        }
+    }
+    g_context.in_builtin--;
+
+    if(g_context.detach)
+    {
+        //running jobs stay in job table, they no longer report to the task list
+        for(i = 0; i < n; i++)
+        {
+            if(t[i].state == XSSH_TASK_RUNNING && t[i].job)
+                t[i].job->task = NULL;
+            if(t[i].state == XSSH_TASK_RUNNING)
+                counts[XSSH_TASK_RUNNING]++;
+            if(t[i].state == XSSH_TASK_WAITING)
+                counts[XSSH_TASK_WAITING]++;
+        }
+        fprintf(stdout, "\ntasks: %d running tasks left as background jobs, %d not started\n",
+                counts[XSSH_TASK_RUNNING], counts[XSSH_TASK_WAITING]);
+        g_context.detach = 0;
+        tasks_free(t, n);
+        free(order);
+        sprintf(varvalue[1], "%d", 128 + SIGTSTP);
+        return;
+    }
+
+    //critical path: longest chain of run time through dependencies
+    path_ns = calloc(n + 1, sizeof(uint64_t));
+    path_prev = malloc(sizeof(int) * (n + 1));
+    for(k = 0; k < n; k++)
+    {
+        task_info *tk = &t[order[k]];
+        int c = order[k];
+
+        path_prev[c] = -1;
+        if(tk->state != XSSH_TASK_DONE && tk->state != XSSH_TASK_FAILED)
+            continue;
+        for(i = 0; i < tk->ndeps; i++)
+        {
+            if(path_ns[tk->deps[i]] > path_ns[c])
+            {
+                path_ns[c] = path_ns[tk->deps[i]];
+                path_prev[c] = tk->deps[i];
+            }
+        }
+        path_ns[c] += tk->end_ns - tk->start_ns;
+        if(last < 0 || path_ns[c] > path_ns[last])
+            last = c;
+    }
+
+    fprintf(stdout, "%-20s %-8s %6s %10s %10s\n", "TASK", "STATE", "STATUS", "START", "TIME");
+    for(k = 0; k < n; k++)
+    {
+        static const char *names[] = {"waiting", "running", "done", "failed", "skipped"};
+        task_info *tk = &t[order[k]];
+
+        counts[tk->state]++;
+        if(tk->state == XSSH_TASK_DONE || tk->state == XSSH_TASK_FAILED)
+        {
+            hist_fmt_ns(str[0], tk->start_ns - start_ns);
+            hist_fmt_ns(str[1], tk->end_ns - tk->start_ns);
+            fprintf(stdout, "%-20s %-8s %6d %10s %10s\n", tk->name, names[tk->state], tk->status, str[0], str[1]);
+        }
+        else
+            fprintf(stdout, "%-20s %-8s %6s %10s %10s\n", tk->name, names[tk->state], "-", "-", "-");
+    }
+
+    hist_fmt_ns(str[2], now_ns() - start_ns);
+    fprintf(stdout, "tasks: %d done, %d failed, %d skipped in %s (-j %ld)\n", counts[XSSH_TASK_DONE],
+            counts[XSSH_TASK_FAILED], counts[XSSH_TASK_SKIPPED], str[2], maxjobs);
+    if(last >= 0)
+    {
+        char chain[BUFLEN * 4] = "";
+        int len = 0;
+
+        //path is followed from its end, so names are prepended
+        for(i = last; i >= 0; i = path_prev[i])
+        {
+            char tmp[BUFLEN * 4];
+            snprintf(tmp, sizeof(tmp), "%s%s%s", t[i].name, len ? " -> " : "", chain);
+            len = snprintf(chain, sizeof(chain), "%s", tmp);
+        }
+        hist_fmt_ns(str[2], path_ns[last]);
+        fprintf(stdout, "critical path: %s (%s)\n", chain, str[2]);
+    }
+
+    sprintf(varvalue[1], "%d", g_context.interrupted ? 128 + SIGINT : (counts[XSSH_TASK_FAILED] || counts[XSSH_TASK_SKIPPED]) ? 1 : 0);
+    free(path_ns);
+    free(path_prev);
+    tasks_free(t, n);
+    free(order);
+}
+
+/**
+* @brief  cache builtin.
+*     cache              - print setting, entries, size, limit and hit counts
+*     cache on|off       - cache output of all stages but the last of every pipeline
+*     cache clear        - remove all entries
+*     cache limit SIZE   - limit of total size (K, M, G suffixes)
+*/
+void cache(char buffer[BUFLEN])
+{
+    char dir[4096];
+    char *arg = NULL, *val = NULL;
+    char *saveptr = NULL;
+
+    rtrim(buffer);
+    arg = strtok_r(buffer + 5, " ", &saveptr);
+    if(arg)
+        val = strtok_r(NULL, " ", &saveptr);
+
+    if(cache_dir(dir, sizeof(dir)) < 0)
+    {
+        fprintf(stderr, "-xssh: cache: no cache directory\n");
+        sprintf(varvalue[1], "%d", 1);
+        return;
+    }
+
+    if(!arg)
+    {
+        uint64_t total = 0;
+        int count = 0;
+        char size[16], limit[16];
+
+        cache_evict(dir, ~0ULL, &total, &count);
+        fmt_bytes(size, total);
+        fmt_bytes(limit, cache_limit());
+        fprintf(stdout, "cache: %s, %s, %d entries, %s of %s, %llu hits, %llu misses\n", g_context.cache_on ? "on" : "off",
+                dir, count, size, limit, (unsigned long long)g_context.cache_hits, (unsigned long long)g_context.cache_misses);
+    }
+    else if(!strcmp(arg, "on") || !strcmp(arg, "off"))
+        g_context.cache_on = !strcmp(arg, "on");
+    else if(!strcmp(arg, "clear"))
+        cache_evict(dir, 0, NULL, NULL);
+    else if(!strcmp(arg, "limit") && val)
+    {
+        char *end = NULL;
+        double v = strtod(val, &end);
+        switch(*end)
+        {
+            case 'K': case 'k': v *= 1024; break;
+            case 'M': case 'm': v *= 1024 * 1024; break;
+            case 'G': case 'g': v *= 1024 * 1024 * 1024; break;
+        }
+        if(end == val || v <= 0)
+        {
+            fprintf(stderr, "-xssh: cache: %s: invalid size\n", val);
+            sprintf(varvalue[1], "%d", 2);
+            return;
+        }
+        g_context.cache_limit = (uint64_t)v;
+        cache_evict(dir, g_context.cache_limit, NULL, NULL);
+    }
+    else
+    {
+        fprintf(stderr, "-xssh: cache: %s: invalid argument\n", arg);
+        sprintf(varvalue[1], "%d", 2);
+        return;
+    }
+    sprintf(varvalue[1], "%d", 0);
+}
+
+/*Slot of pid in pid index of jtop, free slot where it would go if it is not there*/
+static proc_sample *sample_slot(proc_sample *tab, int size, pid_t pid)
+{
+    unsigned int i = ((unsigned int)pid * 2654435761u) & (size - 1);
+
+    while(tab[i].pid && tab[i].pid != pid)
+        i = (i + 1) & (size - 1);
+    return &tab[i];
+}
+
+static void sample_close(proc_sample *s)
+{
+    int i;
+
+    for(i = 0; i < 3; i++)
+    {
+        if(s->fd[i] >= 0)
+        {
+            close(s->fd[i]);
+            g_context.sample_fds--;
+        }
+        s->fd[i] = -1;
+    }
+}
+
+/**
+* @brief  Rebuilds pid index with room for twice its entries. With keep 0, processes which were not sampled in
+*  current refresh (reaped, or job left the table) are dropped and their descriptors closed.
+*/
+static void sample_rehash(int keep)
+{
+    proc_sample *old = g_context.samples;
+    int oldsize = g_context.samples_size, i, live = 0;
+    int size = 64;
+
+    for(i = 0; i < oldsize; i++)
+        if(old[i].pid && (keep || old[i].seen == g_context.sample_gen))
+            live++;
+    while(size < (live + 1) * 2)
+        size *= 2;
+
+    g_context.samples = calloc(size, sizeof(proc_sample));
+    g_context.samples_size = size;
+    g_context.nsamples = live;
+    for(i = 0; i < oldsize; i++)
+    {
+        if(!old[i].pid)
+            continue;
+        if(keep || old[i].seen == g_context.sample_gen)
+            *sample_slot(g_context.samples, size, old[i].pid) = old[i];
+        else
+            sample_close(&old[i]);
+    }
+    free(old);
+}
+
+static proc_sample *sample_find(pid_t pid)
+{
+    proc_sample *s = NULL;
+
+    if(!g_context.samples || (g_context.nsamples + 1) * 2 > g_context.samples_size)
+        sample_rehash(1);
+    s = sample_slot(g_context.samples, g_context.samples_size, pid);
+    if(!s->pid)
+    {
+        memset(s, 0, sizeof(*s));
+        s->pid = pid;
+        s->fd[0] = s->fd[1] = s->fd[2] = -1;
+        g_context.nsamples++;
+    }
+    return s;
+}
+
+/*Reads file i (stat, statm, io) of sampled process. File is kept open while descriptor budget allows*/
+static ssize_t sample_read(proc_sample *s, int i, char *buf, size_t size)
+{
+    static const char *files[] = {"stat", "statm", "io"};
+    char path[64];
+    ssize_t n;
+    int fd = s->fd[i];
+
+    if(fd < 0)
+    {
+        snprintf(path, sizeof(path), "/proc/%d/%s", s->pid, files[i]);
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd < 0)
+            return -1;
+        if(g_context.sample_fds < g_context.sample_fd_max)
+        {
+            s->fd[i] = fd;
+            g_context.sample_fds++;
+        }
+    }
+
+    n = pread(fd, buf, size - 1, 0);
+    if(s->fd[i] != fd)
+        close(fd);
+    if(n < 0)
+        return -1;
+    buf[n] = '\0';
+    return n;
+}
+
+/*Value of "name: N" line of /proc/<pid>/io*/
+static uint64_t io_field(const char *buf, const char *name)
+{
+    const char *p = strstr(buf, name);
+
+    return p ? strtoull(p + strlen(name) + 1, NULL, 10) : 0;
+}
+
+/**
+* @brief  Per job totals of jtop.
+*/
+typedef struct _jtop_row
+{
+    job_info *job;
+    double   cpu;
+    uint64_t rss;
+    uint64_t rd;
+    uint64_t wr;
+    int      nprocs;
+    char     states[10];    //state letter of each process from /proc, '+' if there are more
+}jtop_row;
+
+/**
+* @brief  Samples all processes of job into row. Delta of CPU ticks since previous refresh is added to row->cpu,
+*  percent is computed by caller which knows length of interval.
+*/
+static void jtop_sample(job_info *job, jtop_row *row, long pagesize)
+{
+    proc_info *p = NULL;
+    char buf[512];
+
+    memset(row, 0, sizeof(*row));
+    row->job = job;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        proc_sample *s = NULL;
+        uint64_t ticks = 0;
+        char *f = NULL;
+        int k;
+
+        if(p->pid <= 0 || p->state == XSSH_PROC_STATE_TERMINATED || p->state == XSSH_PROC_STATE_KILLED)
+            continue;
+        s = sample_find(p->pid);
+        s->seen = g_context.sample_gen;
+
+        //comm may contain spaces and ')', so fields are counted from last ')'
+        if(sample_read(s, 0, buf, sizeof(buf)) <= 0 || !(f = strrchr(buf, ')')) || !f[1] || !f[2])
+        {
+            //exited (or pid was reused by a new process), open it again next time
+            sample_close(s);
+            s->valid = 0;
+            continue;
+        }
+        f += 2;
+        if(row->nprocs < 8)
+            row->states[row->nprocs] = *f;
+        else
+            row->states[8] = '+';
+        for(k = 0; k < 11 && f; k++)
+            if((f = strchr(f, ' ')))
+                f++;
+        if(f)
+        {
+            char *end = NULL;
+            ticks = strtoull(f, &end, 10);
+            ticks += strtoull(end, NULL, 10);
+        }
+        if(s->valid && ticks >= s->ticks)
+            row->cpu += ticks - s->ticks;
+        s->ticks = ticks;
+        s->valid = 1;
+        row->nprocs++;
+
+        if(sample_read(s, 1, buf, sizeof(buf)) > 0 && (f = strchr(buf, ' ')))
+            row->rss += strtoull(f + 1, NULL, 10) * pagesize;
+        //rchar/wchar count pipe and terminal i/o as well, read_bytes/write_bytes only reach storage
+        if(sample_read(s, 2, buf, sizeof(buf)) > 0)
+        {
+            row->rd += io_field(buf, "rchar");
+            row->wr += io_field(buf, "wchar");
+        }
+    }
+}
+
+static int jtop_row_cmp(const void *a, const void *b)
+{
+    const jtop_row *x = a, *y = b;
+
+    if(x->cpu != y->cpu)
+        return x->cpu < y->cpu ? 1 : -1;
+    if(x->rss != y->rss)
+        return x->rss < y->rss ? 1 : -1;
+    return x->job->job_spec - y->job->job_spec;
+}
+
+/*Waits until deadline while collecting background jobs which change state, returns early on ctrl+C or ctrl+Z*/
+static void jtop_wait(uint64_t deadline)
+{
+    uint64_t t;
+
+    while(!g_context.interrupted && !g_context.detach && (t = now_ns()) < deadline)
+    {
+        struct pollfd pfd = {g_context.sigchld_pipe[0], POLLIN, 0};
+        char drain[64];
+
+        if(poll(&pfd, 1, (deadline - t + 999999) / 1000000) > 0)
+        {
+            while(read(g_context.sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
+            wait_background_job(0);
+        }
+        timeout_poll();
+    }
+}
+
+/**
+* @brief  jtop builtin: refreshes one line per background job with CPU% since previous refresh, resident memory,
+*  bytes read and written and states of its processes, busiest job first.
+*
+*     jtop [-d SECS] [-n COUNT]  - refresh every SECS (default 1) until ctrl+C, or COUNT times.
+*
+*  On terminal, screen is redrawn in place; with -n or when output is not a terminal refreshes follow each other.
+*/
+void jtop(char buffer[BUFLEN])
+{
+    char *arg = NULL, *val = NULL, *saveptr = NULL;
+    double secs = 1;
+    long count = 0, frame;
+    long hz = sysconf(_SC_CLK_TCK), pagesize = sysconf(_SC_PAGESIZE);
+    int redraw, status = 0;
+    uint64_t last_ns, interval_ns;
+    struct rlimit rl, saved_rl;
+    int raised = 0;
+
+    rtrim(buffer);
+    for(arg = strtok_r(buffer + 4, " ", &saveptr); arg; arg = strtok_r(NULL, " ", &saveptr))
+    {
+        val = NULL;
+        if(!strcmp(arg, "-d") || !strcmp(arg, "-n"))
+            val = strtok_r(NULL, " ", &saveptr);
+        if(val && arg[1] == 'd')
+            secs = strtod(val, NULL);
+        else if(val && arg[1] == 'n')
+            count = atol(val);
+        if(!val || secs <= 0 || count < 0)
+        {
+            fprintf(stderr, "-xssh: jtop: usage: jtop [-d SECS] [-n COUNT]\n");
+            sprintf(varvalue[1], "%d", 2);
+            return;
+        }
+    }
+    redraw = !count && isatty(STDOUT_FILENO);
+    interval_ns = (uint64_t)(secs * 1e9);
+
+    //three descriptors per process, use what hard limit allows and keep some for jobs started meanwhile.
+    //Limit is restored on exit, jobs started later get the limit they would get without jtop
+    if(!getrlimit(RLIMIT_NOFILE, &rl))
+    {
+        saved_rl = rl;
+        if(rl.rlim_cur < rl.rlim_max)
+        {
+            rl.rlim_cur = rl.rlim_max;
+            raised = !setrlimit(RLIMIT_NOFILE, &rl);
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        g_context.sample_fd_max = rl.rlim_cur > 128 ? (int)(rl.rlim_cur > INT32_MAX ? INT32_MAX : rl.rlim_cur) - 128 : 0;
+    }
+
+    if(!g_context.in_builtin)
+        g_context.interrupted = 0;
+    g_context.detach = 0;
+    g_context.in_builtin++;
+
+    wait_background_job(0);
+    last_ns = now_ns();
+    for(frame = 0; !count || frame <= count; frame++)
+    {
+        job_info *job = NULL;
+        jtop_row *rows = NULL;
+        int n = 0, i, nprocs = 0;
+        uint64_t t0, t1;
+        double elapsed;
+        char str[4][32];
+
+        CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+            n++;
+        rows = calloc(n + 1, sizeof(jtop_row));
+        if(!rows)
+        {
+            fprintf(stderr, "-xssh: jtop: %s\n", strerror(errno));
+            status = 1;
+            break;
+        }
+
+        g_context.sample_gen++;
+        t0 = now_ns();
+        i = 0;
+        CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+        {
+            jtop_sample(job, &rows[i], pagesize);
+            nprocs += rows[i++].nprocs;
+        }
+        t1 = now_ns();
+        if(g_context.nsamples > nprocs)
+            sample_rehash(0);
+        elapsed = (t0 - last_ns) / 1e9;
+        last_ns = t0;
+
+        //first pass only records CPU time, percent needs previous sample
+        if(frame)
+        {
+            for(i = 0; i < n; i++)
+                rows[i].cpu = elapsed > 0 ? rows[i].cpu * 100.0 / hz / elapsed : 0;
+            qsort(rows, n, sizeof(jtop_row), jtop_row_cmp);
+
+            if(redraw)
+                fprintf(stdout, "\033[H\033[J");
+            else if(frame > 1)
+                fprintf(stdout, "\n");
+            hist_fmt_ns(str[0], t1 - t0);
+            fprintf(stdout, "jtop: %d jobs, %d processes, sampled in %s, every %gs\n", n, nprocs, str[0], secs);
+            fprintf(stdout, "%-5s %-7s %-8s %-9s %6s %8s %8s %8s  %s\n",
+                    "JOB", "PGID", "STATE", "PROCS", "CPU%", "RSS", "READ", "WRITE", "COMMAND");
+            for(i = 0; i < n; i++)
+            {
+                sprintf(str[0], "[%d]", rows[i].job->job_spec);
+                fmt_bytes(str[1], rows[i].rss);
+                fmt_bytes(str[2], rows[i].rd);
+                fmt_bytes(str[3], rows[i].wr);
+                fprintf(stdout, "%-5s %-7d %-8s %-9s %6.1f %8s %8s %8s  %s\n", str[0], rows[i].job->pgid,
+                        state_str[rows[i].job->state], rows[i].nprocs ? rows[i].states : "-", rows[i].cpu,
+                        str[1], str[2], str[3], rows[i].job->cmd);
+            }
+            fflush(stdout);
+        }
+        free(rows);
+
+        if(count && frame == count)
+            break;
+        jtop_wait(last_ns + interval_ns);
+        if(g_context.interrupted || g_context.detach)
+        {
+            status = 128 + (g_context.interrupted ? SIGINT : SIGTSTP);
+            break;
+        }
+    }
+    g_context.in_builtin--;
+    g_context.detach = 0;
+
+    //descriptors are not kept between runs, processes may be long gone by next one
+    g_context.sample_gen++;
+    sample_rehash(0);
+    if(raised)
+        setrlimit(RLIMIT_NOFILE, &saved_rl);
+    if(redraw || status)
+        fprintf(stdout, "\n");
+    sprintf(varvalue[1], "%d", status);
+}
+
+int execute_job(job_info *job)
+{
+    int i = 0, inprevpipe = 0, inpipe = 0, outpipe = 1;
+    int end = job->nprocs - 1;
+    int retval = 0;
+    proc_info *p = NULL;
+
+    retval = open_heredocs(job);
+    if(retval < 0)
+        return retval;
+
+    if(g_context.pipestat && end > 0 && !job->meters)
+    {
+        void *mem = mmap(NULL, end * sizeof(pipe_meter), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(mem != MAP_FAILED)
+        {
+            memset(mem, 0, end * sizeof(pipe_meter));
+            job->meters = mem;
+            job->nmeters = end;
+        }
+    }
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        if (i >=0 && i < end)
+        {
+            int fd[2] = {0};
+            retval = pipe(fd);
+            if(retval < 0)
+            {
+                retval = -errno;
+                fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+                goto done;
+            }
+
+            inpipe = fd[0];
+            outpipe = fd[1];
+        }
+        else
+        {
+            inpipe  = 0; 
+            outpipe = job->capture_fd > 0 ? job->capture_fd : 1;
+        }
+
+        //last stage which only prints runs in XSSH, it does not read output of previous stage
+        if(i == end && i > 0 && stage_in_shell(job, p))
+        {
+            close(inprevpipe);
+            inprevpipe = 0;
+            CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
+            job->nprocs--;
+            g_context.in_builtin++;
+            job->inshell = 1;
+            job->inshell_status = run_stage_builtin(p);
+            g_context.in_builtin--;
+            fflush(stdout);
+            destroy_proc(p);
+            break;
+        }
+
+        //output relays are forked by XSSH, once process group exists, and waited with job
+        open_relays(p);
+
+        //flush pending output so that child does not inherit (and print again) stdio buffer
+        fflush(stdout);
+        uint64_t fork_ns = now_ns();
+        int pid = -1;
+        //fork server is used only by XSSH which started it, processes it creates are children of that XSSH.
+        //It can not run builtins, which need state of this XSSH.
+        if(g_context.zygote_fd > 0 && g_context.zygote_owner == getpid() &&
+           !(p->nargs > 1 + count_assignments(p) && is_stage_builtin(p->args[1 + count_assignments(p)])))
+            pid = zygote_spawn(job, p, i == 0, inprevpipe, outpipe, fork_ns);
+        if(pid < 0)
+            pid = fork();
+        if(pid < 0)
+        {
+            retval = -errno;
+            fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+            close_relays(p);
+            goto done;
+        }
+
+        if(pid == 0)
+        {
+            p->start_ns = fork_ns;
+            retval = setpgid(getpid(), i ? job->pgid : 0);
+            if(retval < 0)
+            {
+                //fprintf(stderr, "-xssh:%s(%d) error setpgid", __FUNCTION__, __LINE__);
+                _exit(-errno);
+            }
+
+            if(i == 0 && !job->background && isatty(STDIN_FILENO))
+            {
+                /* a) Only those processes which are part of terminal's foreground process group shall be 
+                 *   able to read from terminal (e.g. STDIN).
+                 * 
+                 * b) If any process's group is not terminal's foreground process group and that process performs any read using STDIN
+                 *    then it will receive SIGTTIN signal and if that process has not handled that signal
+                 *    then it will get another signal SIGSTOP which eventually leads to process being stopped.
+                 *
+                 * c) So if child process is supposed to be run in foreground then it must it's process group as
+                 *    terminal's foreground process group using tcsetpgrp
+                 *
+                 * d) Once child process's process group becomes terminal foreground process group.
+                 *    Not even XSSH can read input from STDIN. So we must be careful before XSSH perform any input I/O
+                 *    it must bring it's process group to terminal's foreground process group
+                 */
+
+
+                signal(SIGTTIN, SIG_IGN);  
+                signal(SIGTTOU, SIG_IGN);  
+                
+                //setting this process group in terminal foreground process group
+                uint64_t ts = now_ns();
+                retval = tcsetpgrp(STDIN_FILENO, getpgrp());
+                if(g_context.trace)
+                    trace_add('X', "tcsetpgrp", getpgrp(), getpid(), ts, now_ns() - ts, retval, NULL);
+                if(retval < 0)
+                {
+                    fprintf(stderr, "-xssh:%s(%d) error tcsetpgrp", __FUNCTION__, __LINE__);
+                    signal(SIGTTIN, SIG_DFL);
+                    signal(SIGTTOU, SIG_DFL);
+                    _exit(-errno);
+                }
+
+                signal(SIGTTIN, SIG_DFL);  
+                signal(SIGTTOU, SIG_DFL);  
+            }
+            
+            run_exec(inprevpipe, inpipe, outpipe, p);  //run_exec will either suceed or do exit
+        }
+
+        retval = setpgid(pid, i ? job->pgid : 0);
+        if(retval < 0 && errno != EACCES)
+        {
+            fprintf(stderr, "-xssh:%s(%d) error setpgid", __FUNCTION__, __LINE__);
+            close_relays(p);
+            goto done;
+        }
+
+        retval = 0;        
+        job->pgid = i ? job->pgid : pid;
+        job->lastpid = pid;
+        job->start_ns = i ? job->start_ns : fork_ns;
+        p->pid = pid;
+        p->start_ns = fork_ns;
+        if(g_context.trace)
+            trace_add('X', "fork", job->pgid, pid, fork_ns, now_ns() - fork_ns, 0, p->nargs ? p->args[0] : NULL);
+        p->state = XSSH_PROC_STATE_RUNNING;
+        job->nrunning++;
+
+        retval = start_relays(job, p, outpipe);
+        if(retval < 0)
+            goto done;
+
+        //pipestat: reader of this pipe gets data through a counting relay
+        if(job->meters && i < end)
+        {
+            retval = start_meter(job, i, &inpipe);
+            if(retval < 0)
+                goto done;
+        }
+
+        //output of cached prefix is copied into cache file on its way to next process
+        if(job->cache_len == i + 1 && i < end)
+        {
+            retval = start_cache_store(job, &inpipe);
+            if(retval < 0)
+                goto done;
+        }
+ 
+        if (i == end)   
+        {
+            if(inprevpipe != 0)
+            {
+                close(inprevpipe);
+                inprevpipe = 0;
+            }
+        }
+        else if( i > 0)
+        {
+            retval = dup2(inpipe, inprevpipe);
+            if(retval < 0)
+            {
+                fprintf(stderr, "-xssh:%s(%d) error dup2", __FUNCTION__, __LINE__);
+                retval = -errno;
+                goto done;
+            }
+
+            retval = 0;
+            close(inpipe);
+            close(outpipe);
+
+            inpipe = 0;
+            outpipe = 1;
+        }
+        else
+        {   
+            //no need to check outpipe since whenever control will come here. outpipe will have valid pipe fd  
+            close(outpipe);
+            inprevpipe = inpipe;
+            inpipe = 0;
+            outpipe = 1;
+        }
+        i++;
+    }
+
+done:
+    if(inprevpipe != 0)
+        close(inprevpipe);
+    if(inpipe != 0)
+        close(inpipe);
+    if(outpipe != 1 && outpipe != job->capture_fd)
+        close(outpipe);
+    close_heredocs(job);
+
+    return retval; 
+}
+
+/**
+* @brief  Runs a parsed job. Single command of a foreground job which is a function or fast builtin runs inside XSSH,
+* everything else is spawned by execute_job. Caller shall call wait_job() to wait for foreground job.
+*
+* @param job [IN] job created by create_job, ownership is taken by this function.
+*
+* @return 0 if job is started (or builtin completed) else error
+*/
+int run_job(job_info *job)
+{
+    int retval = 0;
+    proc_info *p = NULL;
+    fast_builtin_fn fn = NULL;
+
+    if(expand_job(job) < 0)
+    {
+        sprintf(varvalue[1], "%d", 1);
+        destroy_job(job);
+        return -1;
+    }
+    if(expand_globs(job) < 0)
+    {
+        sprintf(varvalue[1], "%d", 1);
+        destroy_job(job);
+        return -1;
+    }
+    p = CIRCLEQ_FIRST(&job->proc_info_list);
+
+    int nassign = count_assignments(p);
+
+    //command of only NAME=value words sets shell variables
+    if(job->nprocs == 1 && !job->background && p->nargs > 1 && nassign == p->nargs - 1)
+    {
+        int i, status = 0;
+        for(i = 1; i <= nassign; i++)
+        {
+            char *eq = strchr(p->args[i], '=');
+            *eq = '\0';
+            if(setvar(p->args[i], eq + 1) < 0)
+                status = 1;
+        }
+        sprintf(varvalue[1], "%d", status);
+        destroy_job(job);
+        return 0;
+    }
+
+    //timeout DURATION [--signal SIG] [--kill-after D] pipeline: job always runs in its own processes
+    uint64_t timeout_ns = 0;
+    if(p->nargs > 1 + nassign && !strcmp(p->args[1 + nassign], "timeout"))
+    {
+        if(timeout_parse(job, p, 1 + nassign, &timeout_ns) < 0)
+        {
+            sprintf(varvalue[1], "%d", 125);
+            destroy_job(job);
+            return -1;
+        }
+    }
+
+    if(job->nprocs == 1 && !job->background && p->nargs > 1 + nassign && !job->timeout_sig)
+        fn = find_function(p->args[1 + nassign]) ? call_function : find_fast_builtin(p->args[1 + nassign]);
+
+    if(fn)
+        return run_fast_builtin(job, fn);
+
+    cache_apply(job);
+    retval = execute_job(job);
+    job->state =  XSSH_JOB_STATE_RUNNING;
+    if(retval == 0 && timeout_ns)
+        timeout_arm(job, timeout_ns);
+    if(retval == 0 && job->background)
+    {
+        send_job_to_bg(job, 0);
+        fprintf(stdout, "[%d] %s &\n", job->job_spec, job->cmd);
+        sprintf(varvalue[1], "%d", 0);
+    }
+    else
+        g_context.fg_job = job;
+
+    return retval;
+}
+
+/*Parses duration of timeout: number (may be fractional) with optional suffix s, m, h or d. Returns -1 if invalid*/
+static int parse_duration(const char *str, uint64_t *ns)
+{
+    char *end = NULL;
+    double v = strtod(str, &end);
+
+    if(end == str || v < 0)
+        return -1;
+    switch(*end)
+    {
+        case '\0':
+        case 's': break;
+        case 'm': v *= 60; break;
+        case 'h': v *= 3600; break;
+        case 'd': v *= 86400; break;
+        default:  return -1;
+    }
+    if(*end && end[1])
+        return -1;
+
+    *ns = (uint64_t)(v * 1e9);
+    return 0;
+}
+
+/*Signal number of name (TERM, SIGTERM) or number, -1 if unknown*/
+static int parse_signal(const char *str)
+{
+    int sig;
+
+    if(isdigit(str[0]))
+    {
+        sig = atoi(str);
+        return sig > 0 && sig < NSIG ? sig : -1;
+    }
+    if(!strncmp(str, "SIG", 3))
+        str += 3;
+    for(sig = 1; sig < NSIG; sig++)
+    {
+        const char *name = sigabbrev_np(sig);
+        if(name && !strcmp(name, str))
+            return sig;
+    }
+    return -1;
+}
+
+/**
+* @brief  Takes "timeout DURATION [--signal SIG] [--kill-after D]" words (options may also precede DURATION) off
+*  process p, which is first process of job, and sets timeout of job. Timer itself is armed once job is started.
+*
+* @param first [IN] index of "timeout" in p->args
+* @param ns    [OUT] duration, 0 if job shall not be timed out
+*
+* @return 0 on success else -1
+*/
+int timeout_parse(job_info *job, proc_info *p, int first, uint64_t *ns)
+{
+    int i = first + 1, have_duration = 0, k;
+
+    job->timeout_sig = SIGTERM;
+    job->kill_after_ns = 0;
+    while(i < p->nargs && !have_duration)
+    {
+        const char *arg = p->args[i];
+        if((!strcmp(arg, "--signal") || !strcmp(arg, "-s")) && i + 1 < p->nargs)
+        {
+            job->timeout_sig = parse_signal(p->args[i + 1]);
+            if(job->timeout_sig < 0)
+            {
+                fprintf(stderr, "-xssh: timeout: %s: invalid signal\n", p->args[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if(!strncmp(arg, "--signal=", 9))
+        {
+            job->timeout_sig = parse_signal(arg + 9);
+            if(job->timeout_sig < 0)
+            {
+                fprintf(stderr, "-xssh: timeout: %s: invalid signal\n", arg + 9);
+                return -1;
+            }
+            i++;
+        }
+        else if((!strcmp(arg, "--kill-after") || !strcmp(arg, "-k")) && i + 1 < p->nargs)
+        {
+            if(parse_duration(p->args[i + 1], &job->kill_after_ns) < 0)
+            {
+                fprintf(stderr, "-xssh: timeout: %s: invalid time interval\n", p->args[i + 1]);
+                return -1;
+            }
+            i += 2;
+        }
+        else if(!strncmp(arg, "--kill-after=", 13))
+        {
+            if(parse_duration(arg + 13, &job->kill_after_ns) < 0)
+            {
+                fprintf(stderr, "-xssh: timeout: %s: invalid time interval\n", arg + 13);
+                return -1;
+            }
+            i++;
+        }
+        else if(parse_duration(arg, ns) == 0)
+        {
+            have_duration = 1;
+            i++;
+        }
+        else
+        {
+            fprintf(stderr, "-xssh: timeout: %s: invalid time interval\n", arg);
+            return -1;
+        }
+    }
+
+    //options may also follow duration
+    while(i + 1 < p->nargs && p->args[i][0] == '-')
+    {
+        if(!strcmp(p->args[i], "--signal") || !strcmp(p->args[i], "-s"))
+            job->timeout_sig = parse_signal(p->args[i + 1]);
+        else if(!strcmp(p->args[i], "--kill-after") || !strcmp(p->args[i], "-k"))
+        {
+            if(parse_duration(p->args[i + 1], &job->kill_after_ns) < 0)
+                job->timeout_sig = -1;
+        }
+        else
+            break;
+        if(job->timeout_sig < 0)
+        {
+            fprintf(stderr, "-xssh: timeout: %s: invalid argument\n", p->args[i + 1]);
+            return -1;
+        }
+        i += 2;
+    }
+
+    if(!have_duration || i >= p->nargs)
+    {
+        fprintf(stderr, "-xssh: timeout: usage: timeout DURATION [--signal SIG] [--kill-after D] command\n");
+        return -1;
+    }
+
+    //drop timeout words, command name copy in args[0] follows new first word
+    for(k = first; k < i; k++)
+        free_arg(p, p->args[k]);
+    memmove(&p->args[first], &p->args[i], (p->nargs - i + 1) * sizeof(char *));
+    p->nargs -= i - first;
+    if(first == 1)
+    {
+        char *name = strdup(p->args[1]);
+        if(name)
+        {
+            free_arg(p, p->args[0]);
+            p->args[0] = name;
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief  Arms timerfd of job, it is served by wait_job(), line editor and before each command line through
+*  wait_ready() and timeout_fire(). No process is created for it.
+*
+* @return 0 on success else -1
+*/
+int timeout_arm(job_info *job, uint64_t ns)
+{
+    struct itimerspec its;
+
+    if(job->timer_fd <= 0)
+    {
+        job->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if(job->timer_fd < 0)
+        {
+            job->timer_fd = 0;
+            fprintf(stderr, "-xssh:%s(%d) timerfd_create failed: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+            return -1;
+        }
+        g_context.ntimers++;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000ULL;
+    its.it_value.tv_nsec = ns % 1000000000ULL;
+    if(!ns)
+        its.it_value.tv_nsec = 1;   //zero would disarm
+    return timerfd_settime(job->timer_fd, 0, &its, NULL);
+}
+
+void timeout_disarm(job_info *job)
+{
+    if(job->timer_fd > 0)
+    {
+        close(job->timer_fd);
+        job->timer_fd = 0;
+        g_context.ntimers--;
+    }
+}
+
+/*Signals process group of job if its timer has expired: first with timeout signal, after --kill-after with SIGKILL*/
+static void timeout_fire(job_info *job)
+{
+    uint64_t expirations;
+
+    if(job->timer_fd <= 0 || read(job->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    if(!job->timed_out)
+    {
+        job->timed_out = 1;
+        kill(-job->pgid, job->timeout_sig);
+        if(job->timeout_sig != SIGKILL)
+            kill(-job->pgid, SIGCONT);  //stopped job shall see the signal too
+        if(job->kill_after_ns && job->timeout_sig != SIGKILL)
+        {
+            timeout_arm(job, job->kill_after_ns);
+            return;
+        }
+    }
+    else
+    {
+        job->timed_out = 2;
+        kill(-job->pgid, SIGKILL);
+    }
+    timeout_disarm(job);
+}
+
+/**
+* @brief  Waits until fd is readable, or until SIGCHLD arrives if fd is negative, firing timeouts of jobs which
+*  expire meanwhile.
+*
+* @return 1 if fd is readable (or SIGCHLD arrived), 0 if only timers were served
+*/
+int wait_ready(int fd)
+{
+    job_info *job = NULL;
+    int n = 0, i, max = 2;
+
+    CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+        max++;
+
+    struct pollfd pfd[max];
+    job_info *owner[max];
+
+    pfd[n].fd = fd >= 0 ? fd : g_context.sigchld_pipe[0];
+    pfd[n].events = POLLIN;
+    owner[n++] = NULL;
+    if(g_context.fg_job && g_context.fg_job->timer_fd > 0)
+    {
+        pfd[n].fd = g_context.fg_job->timer_fd;
+        pfd[n].events = POLLIN;
+        owner[n++] = g_context.fg_job;
+    }
+    CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+    {
+        if(job->timer_fd > 0 && job != g_context.fg_job)
+        {
+            pfd[n].fd = job->timer_fd;
+            pfd[n].events = POLLIN;
+            owner[n++] = job;
+        }
+    }
+
+    if(poll(pfd, n, -1) <= 0)
+        return 0;
+
+    for(i = 1; i < n; i++)
+        if(pfd[i].revents)
+            timeout_fire(owner[i]);
+
+    if(!pfd[0].revents)
+        return 0;
+    if(fd < 0)
+    {
+        char drain[64];
+        while(read(g_context.sigchld_pipe[0], drain, sizeof(drain)) > 0)
+            ;
+    }
+    return 1;
+}
+
+/*Fires expired timers without waiting*/
+void timeout_poll()
+{
+    job_info *job = NULL;
+
+    if(g_context.fg_job)
+        timeout_fire(g_context.fg_job);
+    CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+        timeout_fire(job);
+}
+
+fast_builtin_fn find_fast_builtin(const char *name)
+{
+    int i;
+    for(i = 0; fast_builtins[i].name; i++)
+    {
+        if(!strcmp(fast_builtins[i].name, name))
+            return fast_builtins[i].fn;
+    }
+    return NULL;
+}
+
+/*Index of internal instruction named name (as used by deinstr, 1 based), 0 if none*/
+static int find_instr(const char *name)
+{
+    int i;
+    for(i = 0; i < INSNUM; i++)
+        if(!strcmp(instr[i], name))
+            return i + 1;
+    return 0;
+}
+
+/*Builtins which can be a stage of pipeline: internal instructions, functions and fast builtins*/
+int is_stage_builtin(const char *name)
+{
+    return find_instr(name) || find_function(name) || find_fast_builtin(name);
+}
+
+/**
+* @brief  Runs builtin stage of pipeline with its stdin, stdout and redirections already set up. Forked child runs
+*  it instead of exec, XSSH runs last stage itself when stage_in_shell() allows it.
+*
+* @return exit status
+*/
+int run_stage_builtin(proc_info *p)
+{
+    int nassign = count_assignments(p);
+    int argc = p->nargs - 1 - nassign;
+    char **argv = &p->args[1 + nassign];
+    int ins = find_instr(argv[0]);
+
+    if(ins)
+    {
+        //internal instructions parse the command buffer themselves
+        char buffer[BUFLEN] = {0};
+        int i, len = 0;
+
+        for(i = 0; i < argc && len < BUFLEN - 2; i++)
+            len += snprintf(buffer + len, BUFLEN - 1 - len, i ? " %s" : "%s", argv[i]);
+        strcat(buffer, "\n");
+        sprintf(varvalue[1], "%d", 0);
+        run_instr(ins, buffer);
+        return atoi(varvalue[1]);
+    }
+    if(find_function(argv[0]))
+        return call_function(argc, argv);
+    return find_fast_builtin(argv[0])(argc, argv);
+}
+
+/**
+* @brief  Checks if last stage of foreground pipeline can run inside XSSH: builtin which only writes to
+*  stdout (it neither reads input nor changes XSSH state) without redirections or VAR=value prefixes.
+*/
+int stage_in_shell(job_info *job, proc_info *p)
+{
+    static const char *pure[] = {"echo", "printf", "true", "false", "test", "[", "show", "pwd", "jobs", "help", NULL};
+    int i;
+
+    if(job->background || job->capture_fd > 0 || p->nargs < 2 || count_assignments(p) ||
+       !CIRCLEQ_EMPTY(&p->redirect_info_list))
+        return 0;
+    for(i = 0; pure[i]; i++)
+        if(!strcmp(pure[i], p->args[1]))
+            return 1;
+    return 0;
+}
+
+/**
+* @brief  Runs a fast builtin inside XSSH process. Descriptors touched by redirections are saved before
+* applying redirections and restored afterwards, exit status is stored in $?. Stdout of job of a command
+* substitution (capture_fd) is its capture file, redirections apply on top of it.
+*
+* @param job [IN] job having single process, destroyed by this function
+* @param fn  [IN] builtin to run
+*
+* @return exit status of builtin
+*/
+int run_fast_builtin(job_info *job, fast_builtin_fn fn)
+{
+    proc_info *p = CIRCLEQ_FIRST(&job->proc_info_list);
+    redirect_info *rinfo = NULL;
+    int fds[BUFLEN];
+    int saved[BUFLEN];
+    int nsaved = 0;
+    int status = 0;
+
+    fflush(stdout);
+    if(job->capture_fd > 0)
+    {
+        fds[nsaved] = 1;
+        saved[nsaved] = fcntl(1, F_DUPFD_CLOEXEC, 10);
+        nsaved++;
+    }
+    CIRCLEQ_FOREACH(rinfo, &p->redirect_info_list, link)
+    {
+        int fd = (rinfo->mode <= 3 || rinfo->mode == 8) ? rinfo->srcfd : rinfo->dstfd;
+        int i;
+
+        for(i = 0; i < nsaved && fds[i] != fd; i++)
+            ;
+        if(i < nsaved || nsaved == BUFLEN)
+            continue;
+
+        fds[nsaved] = fd;
+        saved[nsaved] = fcntl(fd, F_DUPFD_CLOEXEC, 10);  //-1 if fd was not open, it is closed again on restore
+        nsaved++;
+    }
+
+    if((job->capture_fd > 0 && dup2(job->capture_fd, 1) < 0) || open_heredocs(job) < 0 || setup_redirections(p) < 0)
+        status = 1;
+    else
+    {
+        if(!g_context.in_builtin)
+            g_context.interrupted = 0;
+        g_context.in_builtin++;
+        //VAR=value prefixes matter only for environment of external commands
+        int nassign = count_assignments(p);
+        status = fn(p->nargs - 1 - nassign, &p->args[1 + nassign]);
+        g_context.in_builtin--;
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    while(nsaved--)
+    {
+        if(saved[nsaved] >= 0)
+        {
+            dup2(saved[nsaved], fds[nsaved]);
+            close(saved[nsaved]);
+        }
+        else
+            close(fds[nsaved]);
+    }
+
+    //relays see end of output once descriptors are restored
+    while(p->nrelays > 0)
+        waitpid(p->relays[--p->nrelays], NULL, 0);
+
+    sprintf(varvalue[1], "%d", status);
+    destroy_job(job);
+    return status;
+}
+
+void wait_job()
+{
+    siginfo_t info; 
+    int exitstatus = 0;
+    int pending = 1;
+
+    while(g_context.fg_job)
+    { 
+        int flags = WEXITED | WSTOPPED | WCONTINUED;
+
+        //with timeouts armed, SIGCHLD and timers are waited together and children are collected without blocking.
+        //After each collected child another one may be pending without new SIGCHLD, so waitid is tried again first.
+        if(g_context.ntimers > 0)
+        {
+            if(!pending && !wait_ready(-1))
+                continue;
+            flags |= WNOHANG;
+        }
+
+        info.si_pid = 0;
+        int retval = waitid(P_PGID, g_context.fg_job->pgid, &info, flags);
+        if(retval < 0 && errno == ECHILD)
+            break;    
+        if(flags & WNOHANG)
+        {
+            pending = info.si_pid != 0;
+            if(!pending)
+                continue;
+        }
+
+        int s_status = info.si_status;
+        if(g_context.trace)
+            trace_wait_event(g_context.fg_job, &info);
+
+        if(info.si_code == CLD_EXITED)
+            process_terminated(g_context.fg_job, info.si_pid, info.si_status);
+
+        if(info.si_code == CLD_STOPPED)
+            process_stopped(g_context.fg_job, info.si_pid);
+
+        if(info.si_code == CLD_KILLED)
+        {
+           process_killed(g_context.fg_job, info.si_pid, info.si_status);
+        }
+        
+        if(info.si_code == CLD_CONTINUED)
+        {
+            process_continued(g_context.fg_job, info.si_pid);
+            fg_job_continued();
+        }
+
+        if((g_context.fg_job->state == XSSH_JOB_STATE_STOPPED))
+        {
+            fg_job_stopped();
+            break;
+        }
+    
+        if((g_context.fg_job->state == XSSH_JOB_STATE_KILLED) || (g_context.fg_job->state == XSSH_JOB_STATE_DONE))
+        {
+            if(info.si_code == CLD_KILLED && info.si_status == SIGINT)
+            {
+                printf("-xssh: Exit pid %d\n", g_context.fg_job->pgid);  
+                g_context.interrupted = 1;
+            }
+            fg_job_terminated();
+            break;
+        }
+
+    }
+
+    //if(g_context.fg_job)
+      //  fg_job_terminated();
+    wait_background_job(0);
+}
+
+void wait_background_job(int pstatus)
+{
+    job_info *job = NULL;
+    job_info *next = NULL;
+    siginfo_t info; 
+
+    //finished jobs are removed while walking the list, so next job is taken before
+    for(job = CIRCLEQ_FIRST(&g_context.bg_jobs); job != (void *)&g_context.bg_jobs; job = next)
+    {
+        int removed = 0;
+        next = CIRCLEQ_NEXT(job, link);
+        do
+        {
+            info.si_pid = 0; 
+            int retval = waitid(P_PGID, job->pgid, &info, WNOHANG | WEXITED | WSTOPPED | WCONTINUED);
+            if(retval < 0 && errno == ECHILD)
+                break;
+            if(retval < 0)
+            {
+                fprintf(stderr, "Failed to wait the background process with pgid=%d, errno=%d", job->pgid, errno);
+                break;    
+            }
+        
+            if(retval == 0 && !info.si_pid)
+                continue;
+
+            if(g_context.trace)
+                trace_wait_event(job, &info);
+
+            if(info.si_code == CLD_EXITED)
+                process_terminated(job, info.si_pid, info.si_status);
+
+            if(info.si_code == CLD_STOPPED)
+                process_stopped(job, info.si_pid);
+
+            if(info.si_code == CLD_KILLED)
+                process_killed(job, info.si_pid, info.si_status);
+
+            if(info.si_code == CLD_CONTINUED)
+                process_continued(job, info.si_pid);
+
+            if(job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED)
+            {
+                CIRCLEQ_REMOVE(&g_context.bg_jobs, job, link);      
+                print_job_status(job);
+                pipestat_report(job);
+                cache_commit(job);
+                destroy_job(job);
+                removed = 1;
+                break;
+            }
+        }while(info.si_pid);
+      
+        if(pstatus && !removed) 
+            print_job_status(job);
+    }
+}
+
+void print_job_status(job_info *job)
+{         
+    if(job->timed_out && (job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED) && !job->job_spec)
+        fprintf(stdout, "TIMED OUT %s %d %s\n", state_str[job->state], job->status, job->cmd);
+    else if(job->timed_out && (job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED))
+        fprintf(stdout, "[%d] TIMED OUT %s %d %s\n", job->job_spec, state_str[job->state], job->status, job->cmd);
+    else if(job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED)
+        fprintf(stdout, "[%d] %s %d %s\n", job->job_spec, state_str[job->state], job->status, job->cmd);
+    else if(job->state == XSSH_JOB_STATE_RUNNING)
+    {
+        if(job->background) 
+            fprintf(stdout, "[%d] %s %s &\n", job->job_spec, state_str[job->state], job->cmd);
+        else
+            fprintf(stdout, "%s\n", job->cmd);
+    }
+    else
+        fprintf(stdout, "[%d] %s %s\n", job->job_spec, state_str[job->state], job->cmd);
+}
+
+void sigint_fg_job()
+{
+    if(g_context.fg_job)
+        kill(-g_context.fg_job->pgid, SIGINT);     
+}
+
+void sigtstp_fg_job()
+{
+    if(g_context.fg_job)
+       suspend_job(g_context.fg_job); 
+}
+
+void fg_job_stopped()
+{
+    if(g_context.fg_job)
+    {
+        send_job_to_bg(g_context.fg_job, 0);
+        print_job_status(g_context.fg_job);
+        sprintf(varvalue[1], "%d", 128 + SIGTSTP);
+    }
+
+    bring_job_to_fg(NULL);
+}
+
+void fg_job_terminated()
+{
+    if(g_context.fg_job)
+    {
+        if(g_context.fg_job->job_spec && CIRCLEQ_EMPTY(&g_context.bg_jobs))
+            g_context.max_bg_job_index = 0;  //no background job or foregroung
+        sprintf(varvalue[1], "%d", g_context.fg_job->inshell ? g_context.fg_job->inshell_status : g_context.fg_job->status);
+        //same exit status as timeout(1): 124, or 137 if signal which was sent last is SIGKILL (-s KILL or --kill-after)
+        if(g_context.fg_job->timed_out)
+        {
+            int sig = g_context.fg_job->timed_out == 2 ? SIGKILL : g_context.fg_job->timeout_sig;
+            print_job_status(g_context.fg_job);
+            sprintf(varvalue[1], "%d", sig == SIGKILL ? 128 + SIGKILL : 124);
+        }
+        if(g_context.fg_job->start_ns)
+            stats_record(XSSH_STAT_FG_JOB, now_ns() - g_context.fg_job->start_ns);
+        pipestat_report(g_context.fg_job);
+        cache_commit(g_context.fg_job);
+        destroy_job(g_context.fg_job);
+    } 
+    bring_job_to_fg(NULL);
+}
+
+void fg_job_continued()
+{
+    /*if(g_context.fg_job)
+    {
+        print_job_status(g_context.fg_job);
+    }*/
+}
+
+void suspend_job(job_info *job)
+{
+    //kill(job->pgid, SIGTSTP);
+}
+
+void resume_job(job_info *job)
+{
+    kill(-job->pgid, SIGCONT);  
+}
+
+void send_job_to_bg(job_info *job, int resume)
+{
+    sprintf(varvalue[2], "%d", job->pgid); 
+    if(!job->job_spec)
+        job->job_spec = ++g_context.max_bg_job_index;
+    g_context.last_bg_job_index = job->job_spec;
+    CIRCLEQ_INSERT_TAIL(&g_context.bg_jobs, job, link);
+    job->background = 1;
+    if(resume)
+        resume_job(job);
+}
+
+void bring_job_to_fg(job_info *job)
+{
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    uint64_t ts = now_ns();
+    tcsetpgrp(STDIN_FILENO, job ? job->pgid: getpgrp());
+    if(g_context.trace)
+        trace_add('X', "tcsetpgrp", job ? job->pgid : rootpid, rootpid, ts, now_ns() - ts, 0, NULL);
+
+    g_context.fg_job = job;
+    if(g_context.fg_job)
+    {
+        resume_job(g_context.fg_job);
+        g_context.fg_job->background = 0;
+        //print_job_status(g_context.fg_job);
+    }
+
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+}
+
+
+void process_stopped(job_info *job, pid_t pid)
+{
+    int found = 0;
+    proc_info *p = NULL;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        if(p->pid == pid)
+        {
+            found = 1;
+            break;
+        } 
+    }
+
+    if(found)
+    {
+        if(p->state == XSSH_PROC_STATE_RUNNING)
+        {
+            job->nrunning--;
+            job->nstopped++;
+            p->state = XSSH_PROC_STATE_STOPPED;
+        }
+
+        if(job->nrunning == 0)
+            job->state = XSSH_JOB_STATE_STOPPED;
+    }
+}
+
+void process_continued(job_info *job, pid_t pid)
+{
+    int found = 0;
+    proc_info *p = NULL;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        if(p->pid == pid)
+        {
+            found = 1;
+            break;
+        } 
+    }    
+
+    if(found)
+    {
+        if(p->state == XSSH_PROC_STATE_STOPPED)
+        {
+            job->nrunning++;
+            job->nstopped--;
+            p->state = XSSH_PROC_STATE_RUNNING;
+        }
+
+        if(job->nrunning > 0)
+            job->state = XSSH_JOB_STATE_RUNNING;
+    }
+ 
+}
+
+/*Last process of job has exited: job is finished with state unless its relays still write output*/
+static void job_ended(job_info *job, job_state state)
+{
+    job->end_state = state;
+    if(job->nhelpers > 0)
+    {
+        job->state = XSSH_JOB_STATE_RUNNING;
+        return;
+    }
+
+    job->state = state;
+    if(g_context.trace)
+        trace_add('X', "job", job->pgid, job->pgid, job->start_ns, now_ns() - job->start_ns, job->status, job->cmd);
+}
+
+/*Relay of job has exited, see start_relays()*/
+static void helper_exited(job_info *job, pid_t pid)
+{
+    int i;
+
+    for(i = 0; i < job->nhelpers; i++)
+    {
+        if(job->helpers[i] == pid)
+        {
+            job->helpers[i] = job->helpers[--job->nhelpers];
+            if(job->nprocs == 0)
+                job_ended(job, job->end_state);
+            return;
+        }
+    }
+}
+
+void process_killed(job_info *job, pid_t pid, int signal)
+{
+    int found = 0;
+    proc_info *p = NULL;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        if(p->pid == pid)
+        {
+            found = 1;
+            break; 
+        } 
+    }
+
+    if(found)
+    {
+        if(p->state == XSSH_PROC_STATE_STOPPED)
+            job->nstopped--;
+
+        if(p->state == XSSH_PROC_STATE_RUNNING)
+            job->nrunning--;
+        
+        p->state = XSSH_PROC_STATE_KILLED;
+        if(p->cache_prefix)
+            job->cache_failed = 1;
+        stats_child_reaped();
+        if(g_context.trace)
+            trace_add('X', "proc", job->pgid, pid, p->start_ns, now_ns() - p->start_ns, signal, p->nargs ? p->args[0] : NULL);
+
+        if(job->nrunning > 0)
+            job->state = XSSH_JOB_STATE_RUNNING;
+        else
+            job->state = XSSH_JOB_STATE_STOPPED;
+
+
+        //Each killed process shall be removed from the job proc list 
+        CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
+        job->nprocs--;
+        job->status = signal;
+
+        if(job->nprocs == 0)
+            job_ended(job, XSSH_JOB_STATE_KILLED);
+    } 
+    else
+        helper_exited(job, pid);
+}
+
+void process_terminated(job_info *job, pid_t pid, int status)
+{
+    int found = 0;
+    proc_info *p = NULL;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        if(p->pid == pid)
+        {
+            found = 1;
+            break; 
+        } 
+    }
+
+   if(found)
+    {
+        if(p->state == XSSH_PROC_STATE_STOPPED)
+            job->nstopped--;
+
+        if(p->state == XSSH_PROC_STATE_RUNNING)
+            job->nrunning--;
+
+        p->state = XSSH_PROC_STATE_TERMINATED;
+        if(p->cache_prefix && status)
+            job->cache_failed = 1;
+        stats_child_reaped();
+        if(g_context.trace)
+            trace_add('X', "proc", job->pgid, pid, p->start_ns, now_ns() - p->start_ns, status, p->nargs ? p->args[0] : NULL);
+
+        if(job->nrunning > 0)
+            job->state = XSSH_JOB_STATE_RUNNING;
+        else
+            job->state = XSSH_JOB_STATE_STOPPED;
+
+        CIRCLEQ_REMOVE(&job->proc_info_list, p, link); 
+        job->nprocs--;
+        job->status = status;
+
+        if(job->nprocs == 0)
+            job_ended(job, XSSH_JOB_STATE_DONE);
+    } 
+    else
+        helper_exited(job, pid);
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+* @brief  Allocates the shared trace ring buffer and starts recording.
+*
+* @param file [IN] File in which recorded events shall be written when tracing stops.
+*
+* @return 0 on success else -1
+*/
+int trace_start(const char *file)
+{
+    if(strlen(file) >= BUFLEN)
+    {
+        fprintf(stderr, "-xssh: trace: %s: file name too long\n", file);
+        return -1;
+    }
+
+    if(!g_context.trace)
+    {
+        void *ring = mmap(NULL, sizeof(trace_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(ring == MAP_FAILED)
+        {
+            fprintf(stderr, "-xssh:%s(%d) mmap failed: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+            return -1;
+        }
+        g_context.trace = ring;
+    }
+
+    strcpy(g_context.trace_file, file);
+    return 0;
+}
+
+void trace_stop()
+{
+    if(g_context.trace)
+        munmap(g_context.trace, sizeof(trace_ring));
+    g_context.trace = NULL;
+}
+
+/**
+* @brief  Records an event in trace ring buffer. It is safe to call from forked child before exec
+* since ring buffer is a shared mapping and slot is reserved atomically.
+*/
+void trace_add(char ph, const char *name, pid_t pid, pid_t tid, uint64_t ts, uint64_t dur, int arg, const char *label)
+{
+    trace_ring *ring = g_context.trace;
+    if(!ring)
+        return;
+
+    uint64_t idx = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    trace_event *ev = &ring->events[idx % TRACE_RING_SIZE];
+
+    ev->ts = ts;
+    ev->dur = dur;
+    ev->ph = ph;
+    ev->pid = pid;
+    ev->tid = tid;
+    ev->name = name;
+    ev->arg = arg;
+    ev->label[0] = '\0';
+    if(label)
+    {
+        strncpy(ev->label, label, sizeof(ev->label) - 1);
+        ev->label[sizeof(ev->label) - 1] = '\0';
+    }
+    __atomic_store_n(&ev->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+/**
+* @brief  Records stop, continue, exit and kill notifications received by waitid() for a job process.
+*/
+void trace_wait_event(job_info *job, siginfo_t *info)
+{
+    const char *name = NULL;
+
+    if(info->si_code == CLD_EXITED)
+        name = "exit";
+    else if(info->si_code == CLD_KILLED || info->si_code == CLD_DUMPED)
+        name = "killed";
+    else if(info->si_code == CLD_STOPPED)
+        name = info->si_status == SIGTSTP ? "SIGTSTP" : "stopped";
+    else if(info->si_code == CLD_CONTINUED)
+        name = "SIGCONT";
+
+    if(name)
+        trace_add('i', name, job->pgid, info->si_pid, now_ns(), 0, info->si_status, NULL);
+}
+
+static void trace_json_string(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for(; *str; str++)
+    {
+        if(*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if((unsigned char)*str < 0x20)
+            fprintf(fp, "\\u%04x", *str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+/**
+* @brief  Writes events present in trace ring buffer into a Chrome/Perfetto JSON trace file.
+*
+* @param file [IN] output file path
+*
+* @return 0 on success else -1
+*/
+int trace_dump(const char *file)
+{
+    trace_ring *ring = g_context.trace;
+    uint64_t head, first, idx;
+    int n = 0;
+
+    if(!ring)
+        return -1;
+
+    FILE *fp = fopen(file, "w");
+    if(!fp)
+    {
+        fprintf(stderr, "-xssh: trace: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"xssh\"}}", rootpid);
+    for(idx = first; idx < head; idx++)
+    {
+        trace_event *ev = &ring->events[idx % TRACE_RING_SIZE];
+        if(__atomic_load_n(&ev->seq, __ATOMIC_ACQUIRE) != idx + 1)
+            continue;   //slot is being written or already overwritten
+
+        if(!strcmp(ev->name, "job"))
+        {
+            fprintf(fp, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":", ev->pid);
+            trace_json_string(fp, ev->label);
+            fprintf(fp, "}}");
+        }
+
+        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"xssh\",\"ph\":\"%c\",\"ts\":%llu.%03llu,\"pid\":%d,\"tid\":%d",
+                ev->name, ev->ph, (unsigned long long)(ev->ts / 1000), (unsigned long long)(ev->ts % 1000), ev->pid, ev->tid);
+        if(ev->ph == 'X')
+            fprintf(fp, ",\"dur\":%llu.%03llu", (unsigned long long)(ev->dur / 1000), (unsigned long long)(ev->dur % 1000));
+        else
+            fprintf(fp, ",\"s\":\"t\"");
+        fprintf(fp, ",\"args\":{\"value\":%d", ev->arg);
+        if(ev->label[0])
+        {
+            fprintf(fp, ",\"cmd\":");
+            trace_json_string(fp, ev->label);
+        }
+        fprintf(fp, "}}");
+        n++;
+    }
+    fprintf(fp, "\n]}\n");
+
+    if(fclose(fp) != 0)
+    {
+        fprintf(stderr, "-xssh: trace: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    if(head - first > n)
+        fprintf(stderr, "-xssh: trace: %llu events dropped\n", (unsigned long long)(head - first - n));
+    return 0;
+}
+
+/*Dumps pending trace when XSSH exits. Children exiting after a failed exec share the handler, so check pid.*/
+void trace_atexit()
+{
+    if(g_context.trace && getpid() == rootpid)
+        trace_dump(g_context.trace_file);
+}
+
+/**
+* @brief  Maps latency histograms. Mapping is shared so that children forked later can record into it.
+*
+* @return 0 on success else -1
+*/
+int stats_init()
+{
+    void *mem = mmap(NULL, sizeof(xssh_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+    {
+        fprintf(stderr, "-xssh:%s(%d) mmap failed: %s\n", __FUNCTION__, __LINE__, strerror(errno));
+        return -1;
+    }
+    g_context.stats = mem;
+    return 0;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+    int msb, shift;
+
+    if(ns < (1 << HIST_SUB_BITS))
+        return ns;
+
+    msb = 63 - __builtin_clzll(ns);
+    shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+/*Largest value which falls in bucket*/
+static uint64_t hist_bucket_max(int bucket)
+{
+    int shift;
+
+    if(bucket < (1 << HIST_SUB_BITS))
+        return bucket;
+
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+    return ((((uint64_t)1 << HIST_SUB_BITS) + (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void stats_record(stat_id id, uint64_t ns)
+{
+    latency_hist *h;
+    uint64_t max;
+
+    if(!g_context.stats)
+        return;
+
+    h = &g_context.stats->hist[id];
+    __atomic_fetch_add(&h->buckets[hist_bucket(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*Called whenever a child is reaped, records the delay since the (first pending) SIGCHLD*/
+void stats_child_reaped()
+{
+    uint64_t ns = g_context.sigchld_ns;
+    if(!ns)
+        return;
+
+    g_context.sigchld_ns = 0;
+    stats_record(XSSH_STAT_EXIT_NOTICE, now_ns() - ns);
+}
+
+uint64_t hist_percentile(latency_hist *h, double pct)
+{
+    uint64_t count = h->count;
+    uint64_t rank, seen = 0;
+    int i;
+
+    if(!count)
+        return 0;
+
+    rank = (uint64_t)(count * pct / 100.0);
+    if(rank >= count)
+        rank = count - 1;
+
+    for(i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if(seen > rank)
+        {
+            uint64_t val = hist_bucket_max(i);
+            return val < h->max ? val : h->max;
+        }
+    }
+    return h->max;
+}
+
+void hist_fmt_ns(char *str, uint64_t ns)
+{
+    if(ns < 1000)
+        sprintf(str, "%lluns", (unsigned long long)ns);
+    else if(ns < 1000000)
+        sprintf(str, "%.1fus", ns / 1e3);
+    else if(ns < 1000000000)
+        sprintf(str, "%.2fms", ns / 1e6);
+    else
+        sprintf(str, "%.2fs", ns / 1e9);
+}
+
+/**
+* @brief  Maps history file, creating and initializing it if needed. Cost does not depend on number of entries.
+*
+* @return 0 on success else -1
+*/
+int history_open()
+{
+    history_index *h = &g_context.history;
+    history_header hdr;
+    char path[4096];
+    struct stat st;
+    const char *file = getenv("XSSH_HISTFILE");
+    int fd, retval = -1;
+
+    if(h->hdr)
+        return 0;
+    if(g_context.history_failed)
+        return -1;
+    g_context.history_failed = 1;
+
+    if(!file)
+    {
+        if(!getenv("HOME"))
+            return -1;
+        snprintf(path, sizeof(path), "%s/.xssh_history", getenv("HOME"));
+        file = path;
+    }
+
+    fd = open(file, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd < 0)
+    {
+        fprintf(stderr, "-xssh: history: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    //only first shell initializes the file, others wait for it
+    flock(fd, LOCK_EX);
+    if(fstat(fd, &st) < 0)
+        goto done;
+
+    if(st.st_size == 0)
+    {
+        const char *size = getenv("XSSH_HISTSIZE");
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = HISTORY_MAGIC;
+        hdr.nslots = size && atol(size) > 0 ? atol(size) : HISTORY_SLOTS;
+        if(ftruncate(fd, sizeof(hdr) + hdr.nslots * sizeof(history_slot)) < 0 ||
+           pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+            goto done;
+        st.st_size = sizeof(hdr) + hdr.nslots * sizeof(history_slot);
+    }
+    else if(pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != HISTORY_MAGIC || !hdr.nslots ||
+            st.st_size < sizeof(hdr) + hdr.nslots * sizeof(history_slot))
+    {
+        fprintf(stderr, "-xssh: history: %s: not a history file\n", file);
+        goto done;
+    }
+
+    h->maplen = sizeof(hdr) + hdr.nslots * sizeof(history_slot);
+    h->hdr = mmap(NULL, h->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(h->hdr == MAP_FAILED)
+    {
+        h->hdr = NULL;
+        goto done;
+    }
+    h->slots = (history_slot *)(h->hdr + 1);
+    g_context.history_failed = 0;
+    retval = 0;
+
+done:
+    flock(fd, LOCK_UN);
+    close(fd);  //mapping keeps the file
+    return retval;
+}
+
+/*Appends command line to history ring, blank lines are not recorded*/
+void history_add(const char *line)
+{
+    history_slot *slot = NULL;
+    uint64_t seq;
+    int len = strlen(line);
+
+    while(len > 0 && (line[len - 1] == '\n' || isspace(line[len - 1])))
+        len--;
+    while(len > 0 && isspace(*line))
+    {
+        line++;
+        len--;
+    }
+    if(len == 0)
+        return;
+
+    if(len >= BUFLEN)
+        len = BUFLEN - 1;
+    memcpy(g_context.last_cmd, line, len);
+    g_context.last_cmd[len] = '\0';
+
+    if(history_open() < 0)
+        return;
+    if(len >= HISTORY_TEXT)
+        len = HISTORY_TEXT - 1;
+
+    seq = __atomic_fetch_add(&g_context.history.hdr->next, 1, __ATOMIC_RELAXED);
+    slot = &g_context.history.slots[seq % g_context.history.hdr->nslots];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELEASE);
+    memcpy(slot->text, line, len);
+    slot->text[len] = '\0';
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*Mask of character pairs of str, bit of a pair is hash of both characters*/
+static uint64_t history_mask(const char *str, int len)
+{
+    uint64_t mask = 0;
+    int i;
+    for(i = 0; i + 1 < len; i++)
+        mask |= 1ULL << (((unsigned char)str[i] * 31 + (unsigned char)str[i + 1]) & 63);
+    return mask;
+}
+
+/*Position of first entry of index with sequence number seq or greater, entries are in order of seq*/
+static long history_index_find(history_index *h, uint64_t seq)
+{
+    long lo = 0, hi = h->n;
+
+    //entries normally come in order, so newest is checked first
+    if(!h->n || h->entries[h->n - 1].seq < seq)
+        return h->n;
+    while(lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+        if(h->entries[mid].seq < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*Adds one entry to index at its place by seq, entry published after newer ones is inserted among them*/
+static int history_index_add(history_index *h, uint64_t seq, const char *text, int len)
+{
+    long k = history_index_find(h, seq);
+
+    if(h->n == h->cap)
+    {
+        long cap = h->cap ? h->cap * 2 : 1024;
+        history_entry *tmp = realloc(h->entries, cap * sizeof(history_entry));
+        if(!tmp)
+            return -1;
+        h->entries = tmp;
+        h->cap = cap;
+    }
+
+    if(h->arena_len + len + 1 > h->arena_cap)
+    {
+        size_t cap = h->arena_cap ? h->arena_cap * 2 : 65536;
+        while(cap < h->arena_len + len + 1)
+            cap *= 2;
+        char *tmp = realloc(h->arena, cap);
+        if(!tmp)
+            return -1;
+        h->arena = tmp;
+        h->arena_cap = cap;
+    }
+
+    memcpy(h->arena + h->arena_len, text, len);
+    h->arena[h->arena_len + len] = '\0';
+    memmove(&h->entries[k + 1], &h->entries[k], (h->n - k) * sizeof(history_entry));
+    h->entries[k].seq = seq;
+    h->entries[k].mask = history_mask(text, len);
+    h->entries[k].off = h->arena_len;
+    h->entries[k].len = len;
+    h->arena_len += len + 1;
+    h->n++;
+    return 0;
+}
+
+/**
+* @brief  Brings index up to date with ring. Only entries appended (by any shell) since last call are read,
+*     index is rebuilt from the ring when it grows to twice the ring size. Slot still being written stops synced,
+*     so next call reads it again, entries after it which are indexed already are skipped.
+*
+* @return 0 on success else -1
+*/
+int history_sync()
+{
+    history_index *h = &g_context.history;
+    char text[HISTORY_TEXT];
+    uint64_t next, seq, unsynced;
+
+    if(history_open() < 0)
+        return -1;
+
+    next = __atomic_load_n(&h->hdr->next, __ATOMIC_ACQUIRE);
+    if(h->n >= 2 * h->hdr->nslots)
+    {
+        h->n = 0;
+        h->arena_len = 0;
+        h->synced = 0;
+    }
+
+    seq = h->synced;
+    if(next > h->hdr->nslots && seq < next - h->hdr->nslots)
+        seq = next - h->hdr->nslots;
+
+    for(unsynced = next; seq < next; seq++)
+    {
+        history_slot *slot = &h->slots[seq % h->hdr->nslots];
+        uint64_t published = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long k = 0;
+
+        if(published == seq + 1)
+        {
+            k = history_index_find(h, seq);
+            if(k < h->n && h->entries[k].seq == seq)
+                continue;
+
+            memcpy(text, slot->text, HISTORY_TEXT);
+            text[HISTORY_TEXT - 1] = '\0';
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            published = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        }
+
+        //slot being written (older or zero seq) is read again by next call, overwritten one (newer seq) is gone
+        if(published != seq + 1)
+        {
+            if(published < seq + 1 && unsynced == next)
+                unsynced = seq;
+            continue;
+        }
+
+        if(history_index_add(h, seq, text, strlen(text)) < 0)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            return -1;
+        }
+    }
+    h->synced = unsynced;
+    return 0;
+}
+
+const char *history_text(long i)
+{
+    return g_context.history.arena + g_context.history.entries[i].off;
+}
+
+/**
+* @brief  Finds newest indexed entry older than entry from which contains pattern (or starts with it).
+*     Repeated calls with previous result as from walk older matches, as needed by incremental reverse search.
+*
+* @param pattern [IN] text to search
+* @param from    [IN] search entries before this index, number of entries to search from newest
+* @param prefix  [IN] if entry shall start with pattern
+*
+* @return index of entry or -1 if there is none
+*/
+long history_search(const char *pattern, long from, int prefix)
+{
+    history_index *h = &g_context.history;
+    int len = strlen(pattern);
+    uint64_t mask = history_mask(pattern, len);
+    long i;
+
+    if(from > h->n)
+        from = h->n;
+
+    for(i = from - 1; i >= 0; i--)
+    {
+        history_entry *e = &h->entries[i];
+        if(e->len < len || (e->mask & mask) != mask)
+            continue;
+
+        const char *text = h->arena + e->off;
+        if(prefix ? !strncmp(text, pattern, len) : (strstr(text, pattern) != NULL))
+            return i;
+    }
+    return -1;
+}
+
+/**
+* @brief  Reads one command line into buffer (with trailing newline like fgets). Interactive terminal input goes
+*     through the line editor, otherwise prompt (if xsshprint) is printed and line is read with fgets.
+*
+* @return 1 if a line is read, 0 on end of input
+*/
+int read_input(char *buffer, int size, const char *prompt, int xsshprint)
+{
+    const char *term = getenv("TERM");
+
+    if(g_context.ntimers > 0)
+        timeout_poll();
+
+    if(xsshprint && isatty(STDOUT_FILENO) && !(term && !strcmp(term, "dumb")))
+        return edit_line(buffer, size, prompt);
+
+    if(xsshprint)
+    {
+        printf("%s", prompt);
+        fflush(stdout);
+    }
+    return fgets(buffer, size, stdin) != NULL;
+}
+
+enum
+{
+    KEY_CTRL_A = 1, KEY_CTRL_B = 2, KEY_CTRL_C = 3, KEY_CTRL_D = 4, KEY_CTRL_E = 5, KEY_CTRL_F = 6,
+    KEY_CTRL_G = 7, KEY_CTRL_H = 8, KEY_TAB = 9, KEY_CTRL_K = 11, KEY_CTRL_L = 12, KEY_ENTER = 13,
+    KEY_CTRL_N = 14, KEY_CTRL_P = 16, KEY_CTRL_R = 18, KEY_CTRL_U = 21, KEY_CTRL_W = 23, KEY_ESC = 27,
+    KEY_BACKSPACE = 127,
+
+    /*escape sequences*/
+    KEY_UP = 1000, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE
+};
+
+static void edit_write(const char *str, int len)
+{
+    while(len > 0)
+    {
+        ssize_t n = write(STDOUT_FILENO, str, len);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return;
+        str += n;
+        len -= n;
+    }
+}
+
+/*Reads a key, escape sequences of arrows, Home, End and Delete are decoded. Returns -1 on end of input*/
+static int edit_read_key()
+{
+    unsigned char c, seq[3];
+
+    //timeouts of background jobs fire while waiting for key
+    while(g_context.ntimers > 0 && !wait_ready(STDIN_FILENO))
+        ;
+    if(read(STDIN_FILENO, &c, 1) != 1)
+        return -1;
+    if(c != KEY_ESC)
+        return c;
+
+    if(read(STDIN_FILENO, &seq[0], 1) != 1 || read(STDIN_FILENO, &seq[1], 1) != 1)
+        return KEY_ESC;
+
+    if(seq[0] == '[' && isdigit(seq[1]))
+    {
+        if(read(STDIN_FILENO, &seq[2], 1) != 1 || seq[2] != '~')
+            return KEY_ESC;
+        switch(seq[1])
+        {
+            case '1': case '7': return KEY_HOME;
+            case '4': case '8': return KEY_END;
+            case '3': return KEY_DELETE;
+        }
+        return KEY_ESC;
+    }
+
+    if(seq[0] == '[' || seq[0] == 'O')
+    {
+        switch(seq[1])
+        {
+            case 'A': return KEY_UP;
+            case 'B': return KEY_DOWN;
+            case 'C': return KEY_RIGHT;
+            case 'D': return KEY_LEFT;
+            case 'H': return KEY_HOME;
+            case 'F': return KEY_END;
+        }
+    }
+    return KEY_ESC;
+}
+
+/*Redraws prompt and line and puts cursor at editing position*/
+static void edit_refresh(line_editor *e)
+{
+    char seq[32];
+    int col = strlen(e->prompt) + e->pos;
+
+    edit_write("\r", 1);
+    edit_write(e->prompt, strlen(e->prompt));
+    edit_write(e->buf, e->len);
+    edit_write("\x1b[K\r", 4);
+    if(col)
+    {
+        sprintf(seq, "\x1b[%dC", col);
+        edit_write(seq, strlen(seq));
+    }
+}
+
+static void edit_insert(line_editor *e, const char *str, int n)
+{
+    if(e->len + n > e->size - 2)
+        n = e->size - 2 - e->len;
+    if(n <= 0)
+        return;
+
+    memmove(e->buf + e->pos + n, e->buf + e->pos, e->len - e->pos);
+    memcpy(e->buf + e->pos, str, n);
+    e->len += n;
+    e->pos += n;
+    e->buf[e->len] = '\0';
+}
+
+/*Deletes n characters starting at from*/
+static void edit_delete(line_editor *e, int from, int n)
+{
+    memmove(e->buf + from, e->buf + from + n, e->len - from - n);
+    e->len -= n;
+    if(e->pos > from + n)
+        e->pos -= n;
+    else if(e->pos > from)
+        e->pos = from;
+    e->buf[e->len] = '\0';
+}
+
+static void edit_set(line_editor *e, const char *str, int len)
+{
+    if(len > e->size - 2)
+        len = e->size - 2;
+    memcpy(e->buf, str, len);
+    e->buf[len] = '\0';
+    e->len = e->pos = len;
+}
+
+/**
+* @brief  Up/Down: shows older/newer history entry starting with the text typed before navigation started
+*     (any entry if nothing was typed).
+*/
+static void edit_history(line_editor *e, int older)
+{
+    history_index *h = &g_context.history;
+    long i;
+
+    if(history_sync() < 0)
+        return;
+
+    if(e->hist_idx < 0 || e->hist_idx > h->n)
+    {
+        //start of navigation: remember own line, its text is the prefix
+        e->hist_idx = h->n;
+        memcpy(e->saved, e->buf, e->len);
+        e->saved[e->len] = '\0';
+        e->saved_len = e->len;
+    }
+
+    if(older)
+        i = history_search(e->saved, e->hist_idx, 1);
+    else
+    {
+        for(i = e->hist_idx + 1; i < h->n; i++)
+            if(!strncmp(history_text(i), e->saved, e->saved_len))
+                break;
+    }
+
+    if(i >= 0 && i < h->n)
+    {
+        e->hist_idx = i;
+        edit_set(e, history_text(i), strlen(history_text(i)));
+    }
+    else if(!older)
+    {
+        e->hist_idx = h->n;
+        edit_set(e, e->saved, e->saved_len);
+    }
+}
+
+/**
+* @brief  Ctrl-R incremental reverse search. Each typed character narrows search starting from current match,
+*     Ctrl-R goes to next older match, Enter runs the match, Ctrl-G or Ctrl-C restore the line, any other key
+*     leaves match in the line for editing.
+*
+* @return key which ended search (KEY_ENTER for accepting) or -1 on end of input
+*/
+static int edit_search(line_editor *e)
+{
+    char pattern[BUFLEN] = {0};
+    char line[2 * BUFLEN + 64];
+    int plen = 0;
+    long match = -1;
+    int failed = 0;
+    int key;
+
+    if(history_sync() < 0)
+        return KEY_CTRL_G;
+
+    memcpy(e->saved, e->buf, e->len);
+    e->saved_len = e->len;
+
+    while(1)
+    {
+        const char *text = match >= 0 ? history_text(match) : "";
+        int n = snprintf(line, sizeof(line), "\r(%sreverse-i-search)`%s': %s\x1b[K", failed ? "failed " : "", pattern,
+                         text);
+        edit_write(line, n);
+
+        key = edit_read_key();
+        if(key == KEY_CTRL_R)
+        {
+            long i = plen ? history_search(pattern, match >= 0 ? match : g_context.history.n, 0) : -1;
+            failed = (i < 0);
+            if(i >= 0)
+                match = i;
+        }
+        else if(key == KEY_BACKSPACE || key == KEY_CTRL_H)
+        {
+            if(plen)
+                pattern[--plen] = '\0';
+            match = plen ? history_search(pattern, g_context.history.n, 0) : -1;
+            failed = plen && match < 0;
+        }
+        else if(key >= 32 && key < 127)
+        {
+            if(plen < BUFLEN - 1)
+            {
+                pattern[plen++] = key;
+                pattern[plen] = '\0';
+            }
+
+            //a longer pattern can only match current match or older entries
+            long i = history_search(pattern, match >= 0 ? match + 1 : g_context.history.n, 0);
+            failed = (i < 0);
+            if(i >= 0)
+                match = i;
+        }
+        else if(key == KEY_CTRL_G || key == KEY_CTRL_C || key < 0)
+        {
+            edit_set(e, e->saved, e->saved_len);
+            return key < 0 ? -1 : KEY_CTRL_G;
+        }
+        else
+        {
+            if(match >= 0)
+                edit_set(e, history_text(match), strlen(history_text(match)));
+            e->hist_idx = -1;
+            return key;
+        }
+    }
+}
+
+static int str_list_add(str_list *l, const char *str, int len)
+{
+    if(l->n == l->cap)
+    {
+        int cap = l->cap ? l->cap * 2 : 64;
+        char **tmp = realloc(l->v, cap * sizeof(char *));
+        if(!tmp)
+            return -1;
+        l->v = tmp;
+        l->cap = cap;
+    }
+
+    l->v[l->n] = strndup(str, len);
+    if(!l->v[l->n])
+        return -1;
+    l->n++;
+    return 0;
+}
+
+static void str_list_free(str_list *l)
+{
+    while(l->n)
+        free(l->v[--l->n]);
+    free(l->v);
+    memset(l, 0, sizeof(str_list));
+}
+
+static int str_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*Sorts list and removes duplicates*/
+static void str_list_sort(str_list *l)
+{
+    int i, n = 0;
+
+    qsort(l->v, l->n, sizeof(char *), str_cmp);
+    for(i = 0; i < l->n; i++)
+    {
+        if(n && !strcmp(l->v[n - 1], l->v[i]))
+            free(l->v[i]);
+        else
+            l->v[n++] = l->v[i];
+    }
+    l->n = n;
+}
+
+/*Reads executables of one PATH directory*/
+static void path_dir_load(path_dir *d)
+{
+    str_list names = {0};
+    struct dirent *ent = NULL;
+    DIR *dir = NULL;
+
+    while(d->n)
+        free(d->names[--d->n]);
+    free(d->names);
+    d->names = NULL;
+    d->dirty = 0;
+
+    dir = opendir(d->path);
+    if(!dir)
+        return;
+
+    while((ent = readdir(dir)) != NULL)
+    {
+        struct stat st;
+
+        if(ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+            continue;
+        if(ent->d_type != DT_REG && (fstatat(dirfd(dir), ent->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode)))
+            continue;
+        if(faccessat(dirfd(dir), ent->d_name, X_OK, 0) < 0)
+            continue;
+        if(str_list_add(&names, ent->d_name, strlen(ent->d_name)) < 0)
+            break;
+    }
+    closedir(dir);
+
+    qsort(names.v, names.n, sizeof(char *), str_cmp);
+    d->names = names.v;
+    d->n = names.n;
+}
+
+static void path_index_free(path_index *idx)
+{
+    int i;
+
+    for(i = 0; i < idx->ndirs; i++)
+    {
+        while(idx->dirs[i].n)
+            free(idx->dirs[i].names[--idx->dirs[i].n]);
+        free(idx->dirs[i].names);
+        free(idx->dirs[i].path);
+    }
+    free(idx->dirs);
+    free(idx->path);
+    if(idx->inotify_fd > 0)
+        close(idx->inotify_fd);
+    memset(idx, 0, sizeof(path_index));
+}
+
+/**
+* @brief  Brings command index up to date: rebuilds it if $PATH changed, otherwise drains inotify events and
+*     re-reads directories which changed since last call.
+*/
+void path_index_refresh()
+{
+    path_index *idx = &g_context.commands;
+    const char *path = getenv("PATH") ? getenv("PATH") : "/usr/local/bin:/usr/bin:/bin";
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int i;
+
+    if(!idx->path || strcmp(idx->path, path))
+    {
+        char *copy = strdup(path);
+        char *dir = NULL;
+        char *saveptr = NULL;
+
+        path_index_free(idx);
+        idx->path = strdup(path);
+        idx->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        for(dir = strtok_r(copy, ":", &saveptr); dir; dir = strtok_r(NULL, ":", &saveptr))
+        {
+            path_dir *tmp = realloc(idx->dirs, (idx->ndirs + 1) * sizeof(path_dir));
+            if(!tmp)
+                break;
+            idx->dirs = tmp;
+            memset(&idx->dirs[idx->ndirs], 0, sizeof(path_dir));
+            idx->dirs[idx->ndirs].path = strdup(dir);
+            idx->dirs[idx->ndirs].dirty = 1;
+            idx->dirs[idx->ndirs].wd = idx->inotify_fd < 0 ? -1 :
+                inotify_add_watch(idx->inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                                  IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+            idx->ndirs++;
+        }
+        free(copy);
+    }
+
+    while(idx->inotify_fd > 0)
+    {
+        ssize_t len = read(idx->inotify_fd, events, sizeof(events));
+        char *ptr = events;
+
+        if(len <= 0)
+            break;
+        while(ptr < events + len)
+        {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            for(i = 0; i < idx->ndirs; i++)
+                if(idx->dirs[i].wd == ev->wd)
+                    idx->dirs[i].dirty = 1;
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    for(i = 0; i < idx->ndirs; i++)
+        if(idx->dirs[i].dirty)
+            path_dir_load(&idx->dirs[i]);
+}
+
+/*Adds commands (builtins, functions, executables on PATH) starting with prefix*/
+static void complete_command(str_list *cands, const char *prefix, int len)
+{
+    func_info *func = NULL;
+    int i, j;
+
+    for(i = 0; i < INSNUM; i++)
+        if(!strncmp(instr[i], prefix, len))
+            str_list_add(cands, instr[i], strlen(instr[i]));
+    for(i = 0; fast_builtins[i].name; i++)
+        if(!strncmp(fast_builtins[i].name, prefix, len))
+            str_list_add(cands, fast_builtins[i].name, strlen(fast_builtins[i].name));
+    CIRCLEQ_FOREACH(func, &g_context.funcs, link)
+        if(!strncmp(func->name, prefix, len))
+            str_list_add(cands, func->name, strlen(func->name));
+
+    path_index_refresh();
+    for(i = 0; i < g_context.commands.ndirs; i++)
+    {
+        path_dir *d = &g_context.commands.dirs[i];
+        int lo = 0, hi = d->n;
+
+        //first name not less than prefix
+        while(lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if(strncmp(d->names[mid], prefix, len) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for(j = lo; j < d->n && !strncmp(d->names[j], prefix, len); j++)
+            str_list_add(cands, d->names[j], strlen(d->names[j]));
+    }
+}
+
+/*Adds files matching word, directories get trailing '/'*/
+static void complete_file(str_list *cands, const char *word, int len)
+{
+    char dirname[BUFLEN];
+    const char *slash = NULL;
+    const char *base = word;
+    int blen = len, dlen = 0;
+    struct dirent *ent = NULL;
+    DIR *dir = NULL;
+
+    for(slash = word + len - 1; slash >= word && *slash != '/'; slash--)
+        ;
+    if(slash >= word)
+    {
+        dlen = slash - word + 1;
+        base = slash + 1;
+        blen = len - dlen;
+    }
+    snprintf(dirname, sizeof(dirname), "%.*s", dlen ? dlen : 1, dlen ? word : ".");
+
+    dir = opendir(dirname);
+    if(!dir)
+        return;
+
+    while((ent = readdir(dir)) != NULL)
+    {
+        char name[BUFLEN];
+        struct stat st;
+        int isdir = ent->d_type == DT_DIR;
+
+        if(strncmp(ent->d_name, base, blen) || (ent->d_name[0] == '.' && base[0] != '.') ||
+           !strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        if(ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN)
+            isdir = fstatat(dirfd(dir), ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+
+        int n = snprintf(name, sizeof(name), "%.*s%s%s", dlen, word, ent->d_name, isdir ? "/" : "");
+        if(n < sizeof(name))
+            str_list_add(cands, name, n);
+    }
+    closedir(dir);
+}
+
+/*Adds %n job specs of background jobs*/
+static void complete_job(str_list *cands, const char *word, int len)
+{
+    job_info *job = NULL;
+    char spec[32];
+
+    CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+    {
+        int n = sprintf(spec, "%%%d", job->job_spec);
+        if(!strncmp(spec, word, len))
+            str_list_add(cands, spec, n);
+    }
+}
+
+/**
+* @brief  Tab completion of word before cursor. Unique candidate is inserted, several candidates are completed up to
+*     their common prefix and listed if Tab is pressed again without progress.
+*/
+static void edit_complete(line_editor *e, int again)
+{
+    str_list cands = {0};
+    int start = e->pos, prev, len, common, i;
+    int command = 0;
+
+    while(start > 0 && !isspace(e->buf[start - 1]))
+        start--;
+    for(prev = start - 1; prev >= 0 && isspace(e->buf[prev]); prev--)
+        ;
+    len = e->pos - start;
+
+    //first word of command (also after |, ; and &) is a command unless it is a path
+    command = (prev < 0 || strchr("|;&", e->buf[prev])) && !memchr(e->buf + start, '/', len);
+    if(e->buf[start] == '%')
+        complete_job(&cands, e->buf + start, len);
+    else if(command)
+        complete_command(&cands, e->buf + start, len);
+    else
+        complete_file(&cands, e->buf + start, len);
+
+    str_list_sort(&cands);
+    if(!cands.n)
+    {
+        edit_write("\a", 1);
+        return;
+    }
+
+    common = strlen(cands.v[0]);
+    for(i = 1; i < cands.n; i++)
+    {
+        int j = 0;
+        while(j < common && cands.v[i][j] == cands.v[0][j])
+            j++;
+        common = j;
+    }
+
+    if(common > len)
+        edit_insert(e, cands.v[0] + len, common - len);
+    if(cands.n == 1 && cands.v[0][common - 1] != '/')
+        edit_insert(e, " ", 1);
+    else if(cands.n > 1 && common == len && again)
+    {
+        //list candidates below the line, then prompt is redrawn by caller
+        edit_write("\r\n", 2);
+        for(i = 0; i < cands.n && i < 200; i++)
+        {
+            const char *name = cands.v[i];
+            char spec[2 * BUFLEN + 2];   //%N, two spaces and command of job
+            job_info *job = NULL;
+
+            if(name[0] == '%')
+            {
+                CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+                    if(job->job_spec == atoi(name + 1))
+                        break;
+                if(job != (void *)&g_context.bg_jobs)
+                {
+                    snprintf(spec, sizeof(spec), "%s  %s", name, job->cmd);
+                    name = spec;
+                }
+            }
+            edit_write(name, strlen(name));
+            edit_write(name[0] == '%' ? "\r\n" : "  ", 2);
+        }
+        if(cands.n > 200)
+            edit_write("...", 3);
+        edit_write("\r\n", 2);
+    }
+    else if(cands.n > 1 && common == len)
+        edit_write("\a", 1);
+
+    str_list_free(&cands);
+}
+
+/**
+* @brief  Reads a line from terminal in raw mode with editing, history recall, reverse search and completion.
+*
+* @return 1 if a line is read, 0 on end of input (Ctrl-D on empty line)
+*/
+int edit_line(char *buffer, int size, const char *prompt)
+{
+    struct termios orig, raw;
+    line_editor e;
+    int key, last = 0, retval = 1;
+
+    fflush(stdout);
+    if(tcgetattr(STDIN_FILENO, &orig) < 0)
+    {
+        printf("%s", prompt);
+        fflush(stdout);
+        return fgets(buffer, size, stdin) != NULL;
+    }
+
+    raw = orig;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+    raw.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    memset(&e, 0, sizeof(e));
+    e.buf = buffer;
+    e.size = size;
+    e.prompt = prompt;
+    e.hist_idx = -1;
+    buffer[0] = '\0';
+    edit_refresh(&e);
+
+    while(1)
+    {
+        key = edit_read_key();
+        if(key == KEY_CTRL_R)
+        {
+            key = edit_search(&e);
+            if(key != KEY_ENTER && key != '\n' && key >= 0)
+            {
+                edit_refresh(&e);
+                continue;   //search ends and key is not processed further, as in most shells
+            }
+        }
+
+        if(key < 0 || (key == KEY_CTRL_D && e.len == 0))
+        {
+            retval = 0;
+            edit_write("\r\n", 2);
+            break;
+        }
+
+        if(key == KEY_ENTER || key == '\n')
+        {
+            edit_write("\r\n", 2);
+            break;
+        }
+
+        switch(key)
+        {
+            case KEY_CTRL_C:
+                edit_write("^C\r\n", 4);
+                e.len = e.pos = 0;
+                e.buf[0] = '\0';
+                e.hist_idx = -1;
+                sprintf(varvalue[1], "%d", 130);
+                break;
+            case KEY_TAB:
+                edit_complete(&e, last == KEY_TAB);
+                break;
+            case KEY_BACKSPACE:
+            case KEY_CTRL_H:
+                if(e.pos > 0)
+                    edit_delete(&e, e.pos - 1, 1);
+                break;
+            case KEY_DELETE:
+            case KEY_CTRL_D:
+                if(e.pos < e.len)
+                    edit_delete(&e, e.pos, 1);
+                break;
+            case KEY_LEFT:
+            case KEY_CTRL_B:
+                if(e.pos > 0)
+                    e.pos--;
+                break;
+            case KEY_RIGHT:
+            case KEY_CTRL_F:
+                if(e.pos < e.len)
+                    e.pos++;
+                break;
+            case KEY_HOME:
+            case KEY_CTRL_A:
+                e.pos = 0;
+                break;
+            case KEY_END:
+            case KEY_CTRL_E:
+                e.pos = e.len;
+                break;
+            case KEY_CTRL_K:
+                edit_delete(&e, e.pos, e.len - e.pos);
+                break;
+            case KEY_CTRL_U:
+                edit_delete(&e, 0, e.pos);
+                break;
+            case KEY_CTRL_W:
+            {
+                int start = e.pos;
+                while(start > 0 && isspace(e.buf[start - 1]))
+                    start--;
+                while(start > 0 && !isspace(e.buf[start - 1]))
+                    start--;
+                edit_delete(&e, start, e.pos - start);
+                break;
+            }
+            case KEY_CTRL_L:
+                edit_write("\x1b[H\x1b[2J", 7);
+                break;
+            case KEY_UP:
+            case KEY_CTRL_P:
+                edit_history(&e, 1);
+                break;
+            case KEY_DOWN:
+            case KEY_CTRL_N:
+                edit_history(&e, 0);
+                break;
+            default:
+                if(key >= 32 && key < 256 && key != KEY_BACKSPACE)
+                {
+                    char c = key;
+                    edit_insert(&e, &c, 1);
+                    e.hist_idx = -1;
+                }
+                break;
+        }
+
+        //moving in line keeps history navigation, editing starts a new one with new prefix
+        if(key == KEY_BACKSPACE || key == KEY_CTRL_H || key == KEY_DELETE || key == KEY_CTRL_K || key == KEY_CTRL_U ||
+           key == KEY_CTRL_W || key == KEY_TAB)
+            e.hist_idx = -1;
+        last = key;
+        edit_refresh(&e);
+    }
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig);
+    if(retval)
+    {
+        buffer[e.len] = '\n';
+        buffer[e.len + 1] = '\0';
+    }
+    return retval;
+}
+
+/*Finds entry of name in environment cache, -1 if there is none*/
+static int env_find(const char *name)
+{
+    size_t len = strlen(name);
+    int i;
+
+    for(i = 0; i < g_context.env.n; i++)
+    {
+        if(!strncmp(g_context.env.envp[i], name, len) && g_context.env.envp[i][len] == '=')
+            return i;
+    }
+    return -1;
+}
 
 /**
-* @brief This function parse the Command buffer and determines information such as command arguments and recirecton info.
-*
-* @param proc_buffer [IN] Command buffer for a single command being parsed.
+* @brief  Imports environ of XSSH into environment cache and points environ to the cache.
 *
-* @return instance of proc_info structure on sucess else NULL
+* @return 0 on success else -1
 */
-proc_info * create_proc(const char *proc_buffer)
+int env_init()
 {
-    int retval = 0;
-    int token = 0;
-    int len = 0;
-    int i = 0;
-    int j = 0;
-    int nargs = 0; 
-    char *cur_token = NULL;
-    char *prev_token = NULL;
-    char *cmdbuffer = NULL;
-    char *endcmdbuffer = NULL;
+    extern char **environ;
+    env_cache *env = &g_context.env;
+    int i, n = 0;
 
-    proc_info *p = NULL;
-    redirect_info *rinfo = NULL;
+    while(environ && environ[n])
+        n++;
 
-    len = strlen(proc_buffer);
-    cur_token = malloc(BUFLEN);
-    if(!cur_token)
+    env->cap = n + 16;
+    env->envp = malloc(env->cap * sizeof(char *));
+    if(!env->envp)
     {
         fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-        retval = -1;
-        goto done;
+        return -1;
     }
-    memset(cur_token, 0, BUFLEN);
 
-    prev_token = malloc(BUFLEN);
-    if(!prev_token)
+    for(i = 0; i < n; i++)
     {
-        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-        retval = -1;
-        goto done;
+        env->envp[env->n] = strdup(environ[i]);
+        if(env->envp[env->n])
+            env->n++;
     }
-    memset(prev_token, 0, BUFLEN);
+    env->envp[env->n] = NULL;
+    environ = env->envp;
+    return 0;
+}
+
+/**
+* @brief  Sets name=value in environment cache. Only entry of name is replaced (or appended).
+*
+* @return 0 on success else -1
+*/
+int env_set(const char *name, const char *value)
+{
+    extern char **environ;
+    env_cache *env = &g_context.env;
+    char *entry = NULL;
+    int i;
 
-    cmdbuffer = malloc(BUFLEN);
-    if(!cmdbuffer)
+    if(asprintf(&entry, "%s=%s", name, value) < 0)
     {
         fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-        retval = -1;
-        goto done;
+        return -1;
     }
-    memset(cmdbuffer, 0, BUFLEN);
 
-    p = malloc(sizeof(proc_info));
-    if(!p)
+    i = env_find(name);
+    if(i >= 0)
     {
-        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-        retval = -1;
-        goto done;   
+        free(env->envp[i]);
+        env->envp[i] = entry;
+        return 0;
     }
-    memset(p, 0, sizeof(proc_info));
-    CIRCLEQ_INIT(&p->redirect_info_list); 
 
-    while(i <= len)
+    if(env->n + 1 >= env->cap)
     {
-        // if character is one of '>', '<', '&', '\0', ' ' then is invalid char for a token. 
-        if(!isvalidtokenchar(proc_buffer[i]))
+        char **tmp = realloc(env->envp, env->cap * 2 * sizeof(char *));
+        if(!tmp)
         {
-            if(token)
-            { 
-                memcpy(cur_token, &proc_buffer[j], i - j);
-                cur_token[i - j] = '\0';
-                token = 0;
-            }
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            free(entry);
+            return -1;
         }
-        else
-        {
-            if(!token)
-            {
-                j = i;
-                token = 1;
-            }
-            i++;
-            continue;
-        } 
+        env->envp = tmp;
+        env->cap *= 2;
+        environ = env->envp;
+    }
 
-        if(rinfo)
-        {
-            if(strlen(cur_token))
-            { 
-                int fd = -1;
-                char *file = strdup(cur_token); 
+    env->envp[env->n++] = entry;
+    env->envp[env->n] = NULL;
+    return 0;
+}
 
-                if(file == NULL)
-                {
-                    fprintf(stderr, "-xssh:%s(%d)]: malloc failed", __FUNCTION__, __LINE__);
-                    retval = -1;
-                    goto done;
-                }
+/*Removes name from environment cache, last entry takes its slot*/
+void env_unset(const char *name)
+{
+    env_cache *env = &g_context.env;
+    int i = env_find(name);
 
-                if(isvalidfd(cur_token))
-                    fd = atol(cur_token);
+    if(i < 0)
+        return;
 
-                if(rinfo->mode == 1)
-                {
-                    rinfo->dstfile = file;
-                    rinfo->dstfd = -1;
-                    //fprintf(stdout, "%d>%s\n", rinfo.srcfd, rinfo.dstfile);
-                }
+    free(env->envp[i]);
+    env->envp[i] = env->envp[--env->n];
+    env->envp[env->n] = NULL;
+}
 
-                if(rinfo->mode == 2)
-                {
-                    rinfo->dstfile = file;
-                    rinfo->dstfd = -1;
-                    //fprintf(stdout, "%d>>%s\n", rinfo.srcfd, rinfo.dstfile);
-                }
+/*Returns value of name in environment or NULL*/
+char *env_get(const char *name)
+{
+    int i = env_find(name);
+    //rc file being snapshotted depends on value it saw, "NAME=value" or "NAME" if not set
+    if(g_context.rc_env)
+        str_list_add(g_context.rc_env, i < 0 ? name : g_context.env.envp[i], strlen(i < 0 ? name : g_context.env.envp[i]));
+    return i < 0 ? NULL : strchr(g_context.env.envp[i], '=') + 1;
+}
 
-                if(rinfo->mode == 3)
-                {
-                    rinfo->dstfd = fd;
-                    rinfo->dstfile = file;
+/*Checks if word is NAME=value*/
+int is_assignment(const char *word)
+{
+    int i = 0;
 
-                    if(rinfo->dstfd >=0)
-                    {
-                        free(rinfo->dstfile);
-                        rinfo->dstfile = NULL;
-                    }
+    if(!isalpha(word[0]) && word[0] != '_')
+        return 0;
+    while(isalnum(word[i]) || word[i] == '_')
+        i++;
+    return word[i] == '=';
+}
 
-                    if(rinfo->dstfile)
-                    {
-                        if(rinfo->srcfd != 1)
-                        {
-                            fprintf(stderr, "-xssh:%s ambiguous redirect", cur_token);
-                            retval = -1;
-                            goto done;
-                        }
-                        else
-                            rinfo->mode = 1;
-                    }
+/*Returns number of NAME=value words preceding command name of process*/
+int count_assignments(proc_info *p)
+{
+    int n = 0;
+    while(n + 1 < p->nargs && is_assignment(p->args[n + 1]))
+        n++;
+    return n;
+}
 
-                    //if(rinfo->dstfile)
-                    //fprintf(stdout, "%d>%s\n", rinfo.srcfd, rinfo.dstfile);
-                    //else
-                    //fprintf(stdout, "%d>&%d\n", rinfo.srcfd, rinfo.dstfd);
-                }
+/*Checks if word has *, ? or [...]*/
+int is_glob_pattern(const char *word)
+{
+    const char *ptr = strpbrk(word, "*?[");
+    while(ptr)
+    {
+        if(*ptr != '[' || strchr(ptr + 1, ']'))
+            return 1;
+        ptr = strpbrk(ptr + 1, "*?[");
+    }
+    return 0;
+}
 
-                if(rinfo->mode == 4)
-                {
-                    rinfo->srcfd = -1;
-                    rinfo->srcfile = file;
-                    //fprintf(stdout, "%d<%s\n", rinfo->dstfd, rinfo->srcfile);   
-                }
+/*Pattern component of a word still to be matched in directory dir*/
+typedef struct _glob_item
+{
+    int  word;
+    char *dir;          //path of directory with trailing '/', "" for current directory
+    char comp[256];     //pattern component to match in dir
+    const char *next;   //components after comp, NULL if comp is last
+    int  dironly;       //pattern ends with '/', only directories match
+    int  done;
+}glob_item;
+
+typedef struct _glob_match
+{
+    int    word;
+    size_t off;
+}glob_match;
 
-                if(rinfo->mode == 5)
-                {
-                    rinfo->dstfd = fd;
-                    rinfo->dstfile = file;
+typedef struct _glob_state
+{
+    glob_item *items;
+    int  nitems;
+    int  cap;
+    glob_match *matches;
+    int  nmatches;
+    int  matchcap;
+    char *arena;
+    size_t len;
+    size_t size;
+}glob_state;
+
+/*linux_dirent64 as returned by getdents64*/
+typedef struct _glob_dirent
+{
+    uint64_t d_ino;
+    int64_t  d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char d_name[];
+}glob_dirent;
+
+/*Appends dir + name (+ '/') to arena as match of word*/
+static int glob_add_match(glob_state *g, int word, const char *dir, const char *name, int slash)
+{
+    size_t need = strlen(dir) + strlen(name) + 2;
 
-                    if(rinfo->dstfd >=0)
-                    {
-                        free(rinfo->dstfile);
-                        rinfo->dstfile = NULL;
-                    }
+    if(g->nmatches == g->matchcap)
+    {
+        int cap = g->matchcap ? g->matchcap * 2 : 256;
+        glob_match *tmp = realloc(g->matches, cap * sizeof(glob_match));
+        if(!tmp)
+            return -1;
+        g->matches = tmp;
+        g->matchcap = cap;
+    }
 
-                    if(rinfo->dstfile)
-                    {
-                        fprintf(stderr, "-xssh:%s ambiguous redirect", cur_token);
-                        retval = -1;
-                        goto done;
-                    }
+    if(g->len + need > g->size)
+    {
+        size_t size = g->size ? g->size * 2 : 65536;
+        while(size < g->len + need)
+            size *= 2;
+        char *tmp = realloc(g->arena, size);
+        if(!tmp)
+            return -1;
+        g->arena = tmp;
+        g->size = size;
+    }
 
-                    //fprintf(stdout, "%d<&%d\n", rinfo->dstfd, rinfo->srcfd);   
-                }
+    g->matches[g->nmatches].word = word;
+    g->matches[g->nmatches].off = g->len;
+    g->nmatches++;
+    g->len += sprintf(g->arena + g->len, "%s%s%s", dir, name, slash ? "/" : "") + 1;
+    return 0;
+}
 
-                CIRCLEQ_INSERT_TAIL(&p->redirect_info_list, rinfo, link);
-                rinfo = NULL;
-                cur_token[0] = '\0';
-            }
+/**
+* @brief  Adds work item for pattern rest of word in directory dir. Components without wildcards are appended to
+*     directory directly (last one is checked with lstat) so only directories with wildcard components are read.
+*/
+static int glob_push(glob_state *g, int word, const char *dir, const char *rest)
+{
+    char path[4096];
+    glob_item *item = NULL;
+
+    snprintf(path, sizeof(path), "%s", dir);
+    while(1)
+    {
+        const char *slash = strchr(rest, '/');
+        int clen = slash ? slash - rest : strlen(rest);
+        size_t plen = strlen(path);
+
+        if(clen >= sizeof(item->comp) || plen + clen + 2 >= sizeof(path))
+        {
+            fprintf(stderr, "-xssh: %s%s: pattern too long\n", dir, rest);
+            return -1;
         }
 
-        if(p->background)
+        if(clen == 0 && slash)
         {
-            if(strlen(cur_token) != 0)
-            {
-                fprintf(stderr, "-xssh:%s ambiguous redirect", cur_token);
-                retval = -1;
-                goto done;
-            }
+            rest = slash + 1;   //"a//b"
+            continue;
         }
 
-        //symbol 
-        memcpy(prev_token, cur_token, strlen(cur_token) + 1);
-        cur_token[0] = '\0';
+        memcpy(path + plen, rest, clen);
+        path[plen + clen] = '\0';
+        if(is_glob_pattern(path + plen))
+        {
+            path[plen] = '\0';
+            break;
+        }
 
-        //if char is either '<' or '>'.
-        if(isredir(proc_buffer[i]))
+        if(!slash || !slash[1])
         {
-            if(rinfo || p->background)
-            {
-                fprintf(stderr, "-xssh: syntax error near unexpected token `%c'", proc_buffer[i]);
-                retval = -1;
-                goto done;
-            }
+            //literal last component, word matches if the path exists
+            struct stat st;
+            if(lstat(path, &st) < 0 || (slash && !S_ISDIR(st.st_mode)))
+                return 0;
+            path[plen] = '\0';
+            char name[256];
+            memcpy(name, rest, clen);
+            name[clen] = '\0';
+            return glob_add_match(g, word, path, name, slash != NULL);
+        }
+        strcat(path, "/");
+        rest = slash + 1;
+    }
 
-            rinfo = malloc(sizeof(redirect_info));
-            if(!rinfo)
-            {
-                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-                retval = -1;
-                goto done;
-            }
-            memset(rinfo, 0, sizeof(redirect_info)); 
-            rinfo->srcfd = -1;
-            rinfo->srcfile = NULL;
-            rinfo->dstfile = NULL;
-            rinfo->dstfd = -1; 
+    if(g->nitems == g->cap)
+    {
+        int cap = g->cap ? g->cap * 2 : 16;
+        glob_item *tmp = realloc(g->items, cap * sizeof(glob_item));
+        if(!tmp)
+            return -1;
+        g->items = tmp;
+        g->cap = cap;
+    }
 
-            int fd = -1;
-            int start = 0;
+    item = &g->items[g->nitems];
+    memset(item, 0, sizeof(glob_item));
+    item->word = word;
+    item->dir = strdup(path);
+    if(!item->dir)
+        return -1;
 
-            if(isvalidfd(prev_token))
-                fd = atol(prev_token);
+    const char *slash = strchr(rest, '/');
+    int clen = slash ? slash - rest : strlen(rest);
+    memcpy(item->comp, rest, clen);
+    item->comp[clen] = '\0';
+    item->next = (slash && slash[1]) ? slash + 1 : NULL;
+    item->dironly = slash && !slash[1];
+    g->nitems++;
+    return 0;
+}
 
-            if(fd >= 0)
-                prev_token[0]='\0';
+/**
+* @brief  Reads directory of item first with getdents64 into one reused buffer and matches every entry against
+*     patterns of all pending items of the same directory.
+*/
+static int glob_read_dir(glob_state *g, int first, char *buf, size_t bufsize)
+{
+    const char *dir = g->items[first].dir;
+    int fd, i, end = g->nitems;
+    long n;
 
-            if(isoutredir(proc_buffer[i]))
+    fd = open(dir[0] ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0)
+        goto done;
+
+    while((n = syscall(SYS_getdents64, fd, buf, bufsize)) > 0)
+    {
+        long off;
+        for(off = 0; off < n; off += ((glob_dirent *)(buf + off))->d_reclen)
+        {
+            glob_dirent *ent = (glob_dirent *)(buf + off);
+            int isdir = -1;
+
+            if(ent->d_name[0] == '.' && (!ent->d_name[1] || (ent->d_name[1] == '.' && !ent->d_name[2])))
+                continue;
+
+            for(i = first; i < end; i++)
             {
-                rinfo->srcfile = NULL; 
-                rinfo->srcfd = fd; 
-                if(rinfo->srcfd < 0)
-                    rinfo->srcfd = 1;
+                glob_item *item = &g->items[i];
+                if(item->done || strcmp(item->dir, dir))
+                    continue;
+                if(fnmatch(item->comp, ent->d_name, FNM_PERIOD) != 0)
+                    continue;
 
-                rinfo->mode = 1;
-                if(((i + 1) < len) && isoutredir(proc_buffer[i + 1]))
-                {
-                    rinfo->mode = 2;
-                    i++;
-                }
-                else if(((i + 1)< len) && isampersand(proc_buffer[i + 1]))
+                if(item->next || item->dironly)
                 {
-                    rinfo->mode = 3;
-                    i++;
+                    if(isdir < 0)
+                    {
+                        struct stat st;
+                        isdir = ent->d_type == DT_DIR;
+                        if(ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN)
+                            isdir = fstatat(fd, ent->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+                    }
+                    if(!isdir)
+                        continue;
                 }
-            }
-            else
-            {
-                rinfo->srcfd = -1;
-                rinfo->srcfile = NULL;
-                rinfo->dstfile = NULL;
-                rinfo->dstfd = fd; 
-                if(rinfo->dstfd < 0)
-                    rinfo->dstfd = 0;
 
-                rinfo->mode = 4;
-                if(((i + 1) < len) && isampersand(proc_buffer[i + 1]))
+                if(item->next)
                 {
-                    rinfo->mode = 5;
-                    i++;
+                    //items array may move, directory and rest are taken before pushing
+                    char path[4096];
+                    const char *next = item->next;
+                    int word = item->word;
+                    snprintf(path, sizeof(path), "%s%s/", dir, ent->d_name);
+                    if(glob_push(g, word, path, next) < 0)
+                    {
+                        close(fd);
+                        return -1;
+                    }
+                    dir = g->items[first].dir;
+                }
+                else if(glob_add_match(g, item->word, dir, ent->d_name, item->dironly) < 0)
+                {
+                    close(fd);
+                    return -1;
                 }
             }
-
         }
-        else if (isampersand(proc_buffer[i]))  //If char is '&'
-        {
-            if(rinfo)
-            {
-                fprintf(stderr, "-xssh: syntax error near unexpected token `&'");
-                retval = -1;
-                goto done;
-            }
+    }
+    close(fd);
 
-            p->background = 1;
-        }else if(proc_buffer[i] == '\0')
+done:
+    for(i = first; i < end; i++)
+        if(!strcmp(g->items[i].dir, g->items[first].dir))
+            g->items[i].done = 1;
+    return 0;
+}
+
+static const char *glob_sort_arena;
+
+static int glob_match_cmp(const void *a, const void *b)
+{
+    const glob_match *x = a, *y = b;
+    if(x->word != y->word)
+        return x->word - y->word;
+    return strcmp(glob_sort_arena + x->off, glob_sort_arena + y->off);
+}
+
+/**
+* @brief  Replaces arguments of job's processes which have wildcards with sorted matching path names. Each directory
+*     is read once for all patterns of the job which need it. Matches are stored in one arena owned by job, so
+*     no memory is allocated per directory entry. Word without any match is kept as is, pattern
+*     longer than a path can be is an error.
+*
+* @return 0 on success else -1
+*/
+int expand_globs(job_info *job)
+{
+    glob_state g;
+    proc_info *p = NULL;
+    proc_info **wproc = NULL;
+    int *warg = NULL;
+    int nwords = 0, i, m, retval = -1;
+    char *buf = NULL;
+    const size_t bufsize = 256 * 1024;
+
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+        for(i = 1; i < p->nargs; i++)
+            if(is_glob_pattern(p->args[i]))
+                nwords++;
+    if(!nwords)
+        return 0;
+
+    memset(&g, 0, sizeof(g));
+    wproc = malloc(nwords * sizeof(proc_info *));
+    warg = malloc(nwords * sizeof(int));
+    buf = malloc(bufsize);
+    if(!wproc || !warg || !buf)
+        goto done;
+
+    nwords = 0;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        for(i = 1; i < p->nargs; i++)
         {
-            if(rinfo)
-            {
-                fprintf(stderr, "-xssh: syntax error near unexpected token `newline'");
-                retval = -1;
+            if(!is_glob_pattern(p->args[i]))
+                continue;
+            wproc[nwords] = p;
+            warg[nwords] = i;
+            if(glob_push(&g, nwords, p->args[i][0] == '/' ? "/" : "", p->args[i] + (p->args[i][0] == '/')) < 0)
                 goto done;
-            }
+            nwords++;
         }
+    }
 
-        if(strlen(prev_token) != 0)
-        {
-            //consuming it as an argument to program
-            //printf("argument = %s\n", prev_token); 
-            int len = 0;
-            if(!endcmdbuffer)
-            {
-                endcmdbuffer = cmdbuffer;
-                endcmdbuffer += sprintf(endcmdbuffer, "%s", prev_token);   
-            }
-            else
-                endcmdbuffer += sprintf(endcmdbuffer, " %s", prev_token);
+    for(i = 0; i < g.nitems; i++)
+        if(!g.items[i].done && glob_read_dir(&g, i, buf, bufsize) < 0)
+            goto done;
 
-            nargs++;
-        }
-        i++; 
-    }
+    glob_sort_arena = g.arena;
+    qsort(g.matches, g.nmatches, sizeof(glob_match), glob_match_cmp);
 
-    if(nargs)
+    //splice matches into argv of each process, last word first so earlier argument indexes stay valid
+    for(m = g.nmatches, i = nwords - 1; i >= 0; i--)
     {
-        int cnt = 0;
-        char *ptr = NULL;
-        char *saveptr = NULL;
+        int last = m, k;
+        while(m > 0 && g.matches[m - 1].word == i)
+            m--;
+        int count = last - m;
+        if(!count)
+            continue;
 
-        nargs +=1; 
-        p->args = malloc(sizeof(char*) * (nargs + 1));
-        if(!p->args)
-        {
-            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-            retval = -1;
+        p = wproc[i];
+        char **args = malloc((p->nargs + count) * sizeof(char *));
+        if(!args)
             goto done;
-        }
-        memset(p->args, 0, p->nargs);
-        p->nargs = nargs;
-
-        ptr = strtok_r(cmdbuffer, " ", &saveptr);
+        memcpy(args, p->args, warg[i] * sizeof(char *));
+        for(k = 0; k < count; k++)
+            args[warg[i] + k] = g.arena + g.matches[m + k].off;
+        memcpy(args + warg[i] + count, p->args + warg[i] + 1, (p->nargs - warg[i]) * sizeof(char *));
 
-        p->args[cnt] = strdup(ptr);
-        if(!p->args[cnt])
+        if(warg[i] == 1)
         {
-            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-            retval = -1;
-            goto done;
+            free_arg(p, p->args[0]);
+            args[0] = strdup(args[1]);
         }
-        cnt++; 
-        while(ptr != NULL)
-        { 
-            p->args[cnt] = strdup(ptr);
-            if(!p->args[cnt])
-            {
-                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
-                retval = -1;
-                goto done;
-            }
-
-            ptr = strtok_r(NULL, " ", &saveptr);
-            cnt++;     
-        };
+        free_arg(p, p->args[warg[i]]);
+        free(p->args);
+        p->args = args;
+        p->nargs += count - 1;
+    }
 
-        p->args[cnt] = NULL;
-    } 
+    job->glob_arena = g.arena;
+    job->glob_len = g.len;
+    g.arena = NULL;
+    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    {
+        p->glob_arena = job->glob_arena;
+        p->glob_len = job->glob_len;
+    }
+    retval = 0;
 
 done:
-    if(rinfo)
-        destroy_redirectinfo(rinfo);
-
-    if(cmdbuffer)
-        free(cmdbuffer);
+    for(i = 0; i < g.nitems; i++)
+        free(g.items[i].dir);
+    free(g.items);
+    free(g.matches);
+    free(g.arena);
+    free(buf);
+    free(wproc);
+    free(warg);
+    return retval;
+}
 
-    if(prev_token)
-        free(prev_token);
+/**
+* @brief  Daemon mode. Command lines are read from clients of a Unix socket, one per line:
+*
+*     run <command line>       run job, its output goes to stdout of daemon
+*     capture <command line>   run job and send back what it writes to stdout
+*
+*  and daemon answers with lines
+*
+*     queued <id>              job is parsed and waits for a free slot
+*     started <id> <pgid>      job is running
+*     out <id> <n>             followed by n bytes of captured output
+*     exit <id> <status>       job is done, status is 128 + signal if it was killed
+*     error <message>          line could not be parsed
+*
+*  Jobs are parsed with create_job() and started with execute_job() in their own process groups, at most max_jobs
+*  run at the same time and others wait in submission order. Lists (;, &&, ||) and compound commands are run by a
+*  forked copy of XSSH, which is the only process of their job. Daemon is one thread driven by poll(), SIGCHLD wakes
+*  it through a self pipe. Captured output waiting to be sent to a client is bounded, pipe of job is not read while
+*  queue of its client is full, so a job writing faster than its client reads blocks.
+*/
+#define SERVE_MAX_JOBS  8
+#define SERVE_OUT_MAX   (256 * 1024)
 
-    if(cur_token)
-        free(cur_token);
+typedef struct _serve_client
+{
+    int  fd;
+    char in[4 * BUFLEN];
+    int  inlen;
+    char *out;
+    size_t outlen;
+    size_t outcap;
+    int  eof;       //client closed its side, it is closed once its jobs finish and output is sent
+    int  njobs;
+    CIRCLEQ_ENTRY(_serve_client) link;
+}serve_client;
+
+typedef struct _serve_job
+{
+    int  id;
+    job_info *job;
+    serve_client *client;
+    int  outfd;     //read end of capture pipe, -1 if output is not captured or all of it is read
+    char *list;     //list or compound command run by serve_fork_list(), job is NULL until it starts
+    CIRCLEQ_ENTRY(_serve_job) link;
+}serve_job;
+
+typedef struct _serve_state
+{
+    CIRCLEQ_HEAD(serve_clients_head, _serve_client) clients;
+    CIRCLEQ_HEAD(serve_pending_head, _serve_job) pending;
+    CIRCLEQ_HEAD(serve_running_head, _serve_job) running;
+    int  nrunning;
+    int  max_jobs;
+    int  next_id;
+    int  lfd;
+}serve_state;
+
+/*Queues bytes for client, they are written when socket is writable*/
+static void serve_send(serve_client *c, const char *data, size_t len)
+{
+    if(!c || c->fd < 0)
+        return;
 
-    if(retval != 0)
+    if(c->outlen + len > c->outcap)
     {
-        if(p)
-            destroy_proc(p);
-        p = NULL;
+        size_t cap = c->outcap ? c->outcap : 4096;
+        while(cap < c->outlen + len)
+            cap *= 2;
+        char *tmp = realloc(c->out, cap);
+        if(!tmp)
+        {
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            return;
+        }
+        c->out = tmp;
+        c->outcap = cap;
     }
-    return p;
+    memcpy(c->out + c->outlen, data, len);
+    c->outlen += len;
 }
 
-void destroy_redirectinfo(redirect_info *rinfo)
+static void serve_sendf(serve_client *c, const char *fmt, ...)
 {
-    if(!rinfo)
-        return;
-
-    if(rinfo->srcfile)
-        free(rinfo->srcfile);
-
-    if(rinfo->dstfile)
-        free(rinfo->dstfile);
+    char line[2 * BUFLEN];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if(n > 0)
+        serve_send(c, line, n < sizeof(line) ? n : sizeof(line) - 1);
+}
 
-    free(rinfo);
+static void serve_close_client(serve_state *st, serve_client *c)
+{
+    serve_job *sj = NULL;
+
+    //jobs of client keep running, their output is dropped
+    CIRCLEQ_FOREACH(sj, &st->pending, link)
+        if(sj->client == c)
+            sj->client = NULL;
+    CIRCLEQ_FOREACH(sj, &st->running, link)
+        if(sj->client == c)
+            sj->client = NULL;
+
+    CIRCLEQ_REMOVE(&st->clients, c, link);
+    close(c->fd);
+    free(c->out);
+    free(c);
 }
 
-void destroy_proc(proc_info *p)
+/*Parses one request line of client and queues the job*/
+static void serve_request(serve_state *st, serve_client *c, char *line)
 {
-    if(!p)
+    char buffer[BUFLEN];
+    serve_job *sj = NULL;
+    job_info *job = NULL;
+    char *list = NULL;
+    int capture = 0;
+
+    if(!strncmp(line, "capture ", 8))
+    {
+        capture = 1;
+        line += 8;
+    }
+    else if(!strncmp(line, "run ", 4))
+        line += 4;
+    else
+    {
+        serve_sendf(c, "error unknown request\n");
         return;
+    }
 
-    while(!CIRCLEQ_EMPTY(&p->redirect_info_list))
+    if(strlen(line) >= BUFLEN - 1)
     {
-        redirect_info *rinfo = CIRCLEQ_FIRST(&p->redirect_info_list); 
-        CIRCLEQ_REMOVE(&p->redirect_info_list, rinfo, link);
-        destroy_redirectinfo(rinfo);
+        serve_sendf(c, "error command too long\n");
+        return;
     }
+    sprintf(buffer, "%s\n", line);
+    strip_comment(buffer);
 
-    if(p->nargs)
+    //list is parsed and expanded by XSSH which runs it once it starts
+    if(is_compound(buffer) || is_list(buffer))
     {
-        int i = 0;
-        for(i = 0; i < p->nargs; i++)
+        list = strdup(buffer);
+        if(!list)
         {
-            if(p->args[i])
-                free(p->args[i]);
+            serve_sendf(c, "error out of memory\n");
+            return;
         }
-        free(p->args);
     }
+    else
+    {
+        job = create_job(buffer);
+        if(!job || !CIRCLEQ_FIRST(&job->proc_info_list)->nargs)
+        {
+            destroy_job(job);
+            serve_sendf(c, "error syntax error\n");
+            return;
+        }
 
-    free(p);
+        //variables take their values when job is submitted, as for a command line
+        if(expand_job(job) < 0)
+        {
+            destroy_job(job);
+            st->next_id++;
+            serve_sendf(c, "queued %d\nexit %d %d\n", st->next_id, st->next_id, 1);
+            return;
+        }
+    }
+
+    sj = malloc(sizeof(serve_job));
+    if(!sj)
+    {
+        destroy_job(job);
+        free(list);
+        serve_sendf(c, "error out of memory\n");
+        return;
+    }
+    memset(sj, 0, sizeof(serve_job));
+    sj->id = ++st->next_id;
+    sj->job = job;
+    sj->list = list;
+    sj->client = c;
+    sj->outfd = capture ? 0 : -1;   //0: pipe is created when job starts
+    c->njobs++;
+    CIRCLEQ_INSERT_TAIL(&st->pending, sj, link);
+    serve_sendf(c, "queued %d\n", sj->id);
 }
 
 /**
-* @brief  This function parse the command buffer and deteremines processes and thier redirection info then if parsing is successful
-* it allocates a job_info structure.
+* @brief  Starts list or compound command of daemon job in a forked copy of XSSH, which is the only process of job
+*     and leader of its process group. Commands of list run one after another in it as on a command line.
 *
-* @param buffer[BUFLEN]  [IN] Buffer to parsed
+* @param outfd [IN] descriptor which becomes stdout of list, -1 to keep stdout of daemon
 *
-* @return job_info structure
+* @return job or NULL on failure
 */
-job_info * create_job(char buffer[BUFLEN])
+static job_info *serve_fork_list(serve_state *st, const char *list, int outfd)
 {
-    int retval = 0;
-    int c = 0, k = 0;
-    char *saveptr = NULL;
-    char *token = NULL;
-    char cmdBuffer[BUFLEN]={0};
-    job_info *job = NULL;
-    proc_info *p = NULL;
+    char buffer[BUFLEN];
+    job_info *job = calloc(1, sizeof(job_info));
+    proc_info *p = calloc(1, sizeof(proc_info));
+    serve_client *c = NULL;
+    pid_t pid;
 
-    ltrim(buffer);
-    rtrim(buffer);
+    if(!job || !p)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        free(job);
+        free(p);
+        return NULL;
+    }
+    CIRCLEQ_INIT(&job->proc_info_list);
+    CIRCLEQ_INIT(&p->redirect_info_list);
+    CIRCLEQ_INSERT_TAIL(&job->proc_info_list, p, link);
+    job->nprocs = 1;
+    snprintf(job->cmd, BUFLEN, "%s", list);
+    rtrim(job->cmd);
+
+    fflush(stdout);
+    pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
+        destroy_job(job);
+        return NULL;
+    }
+
+    if(pid == 0)
+    {
+        //sockets belong to daemon, so clients see end of file when it closes them
+        setpgid(0, 0);
+        close(st->lfd);
+        CIRCLEQ_FOREACH(c, &st->clients, link)
+            close(c->fd);
+        if(outfd >= 0)
+            dup2(outfd, 1);
+        signal(SIGPIPE, SIG_DFL);
+        g_context.subshell = 1;
+        snprintf(buffer, BUFLEN, "%s", list);
+        run_line(buffer, 0, now_ns());
+        fflush(stdout);
+        _exit(atoi(varvalue[1]));
+    }
+
+    setpgid(pid, pid);
+    p->pid = pid;
+    p->pgid = pid;
+    p->state = XSSH_PROC_STATE_RUNNING;
+    p->start_ns = now_ns();
+    job->pgid = pid;
+    job->nrunning = 1;
+    job->start_ns = p->start_ns;
+    return job;
+}
+
+/*Starts pending jobs while there are free slots*/
+static void serve_start_jobs(serve_state *st)
+{
+    while(st->nrunning < st->max_jobs && !CIRCLEQ_EMPTY(&st->pending))
+    {
+        serve_job *sj = CIRCLEQ_FIRST(&st->pending);
+        int fd[2] = {-1, -1};
+
+        CIRCLEQ_REMOVE(&st->pending, sj, link);
+        if(sj->job)
+        {
+            sj->job->background = 1;    //never takes the terminal
+            if(expand_globs(sj->job) < 0)
+            {
+                serve_sendf(sj->client, "exit %d %d\n", sj->id, 1);
+                goto failed;
+            }
+        }
+        if(sj->outfd == 0)
+        {
+            if(pipe2(fd, O_CLOEXEC) < 0)
+            {
+                serve_sendf(sj->client, "exit %d %d\n", sj->id, 126);
+                goto failed;
+            }
+            if(sj->job)
+                sj->job->capture_fd = fd[1];
+            sj->outfd = fd[0];
+            fcntl(sj->outfd, F_SETFL, O_NONBLOCK);
+        }
+
+        if(sj->list)
+            sj->job = serve_fork_list(st, sj->list, fd[1]);
+        if(sj->list ? !sj->job : (execute_job(sj->job) < 0 || !sj->job->pgid))
+        {
+            serve_sendf(sj->client, "exit %d %d\n", sj->id, 126);
+            if(fd[1] >= 0)
+                close(fd[1]);
+            if(sj->outfd >= 0)
+                close(sj->outfd);
+            goto failed;
+        }
+        if(fd[1] >= 0)
+            close(fd[1]);
+
+        sj->job->state = XSSH_JOB_STATE_RUNNING;
+        serve_sendf(sj->client, "started %d %d\n", sj->id, sj->job->pgid);
+        CIRCLEQ_INSERT_TAIL(&st->running, sj, link);
+        st->nrunning++;
+        continue;
+
+failed:
+        if(sj->client)
+            sj->client->njobs--;
+        destroy_job(sj->job);
+        free(sj->list);
+        free(sj);
+    }
+}
+
+/*Output of job is not read while queue of its client is full*/
+static int serve_client_full(serve_client *c)
+{
+    return c && c->fd >= 0 && c->outlen >= SERVE_OUT_MAX;
+}
+
+/*Reads available captured output of job and forwards it to client until queue of client is full*/
+static void serve_read_output(serve_job *sj)
+{
+    char data[16384];
+
+    while(!serve_client_full(sj->client))
+    {
+        ssize_t n = read(sj->outfd, data, sizeof(data));
+        if(n > 0)
+        {
+            serve_sendf(sj->client, "out %d %zd\n", sj->id, n);
+            serve_send(sj->client, data, n);
+            continue;
+        }
+
+        if(n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            close(sj->outfd);
+            sj->outfd = -1;
+        }
+        break;
+    }
+}
+
+/*Reaps processes of running jobs, job is finished once all its processes are reaped and output is read*/
+static void serve_reap(serve_state *st)
+{
+    serve_job *sj = CIRCLEQ_FIRST(&st->running);
+
+    while(sj != (void *)&st->running)
+    {
+        serve_job *next = CIRCLEQ_NEXT(sj, link);
+        job_info *job = sj->job;
+        siginfo_t info;
+
+        while(job->nprocs > 0 || job->nhelpers > 0)
+        {
+            info.si_pid = 0;
+            if(waitid(P_PGID, job->pgid, &info, WEXITED | WNOHANG) < 0 || info.si_pid == 0)
+                break;
+            if(info.si_code == CLD_EXITED)
+                process_terminated(job, info.si_pid, info.si_status);
+            else
+                process_killed(job, info.si_pid, info.si_status);
+        }
+
+        if((job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED) && sj->outfd < 0)
+        {
+            int status = job->state == XSSH_JOB_STATE_KILLED ? 128 + job->status : job->status;
+            serve_sendf(sj->client, "exit %d %d\n", sj->id, status);
+            if(job->start_ns)
+                stats_record(XSSH_STAT_FG_JOB, now_ns() - job->start_ns);
+            if(sj->client)
+                sj->client->njobs--;
+            CIRCLEQ_REMOVE(&st->running, sj, link);
+            st->nrunning--;
+            destroy_job(job);
+            free(sj->list);
+            free(sj);
+        }
+        sj = next;
+    }
+}
+
+int serve(const char *path, int max_jobs)
+{
+    struct sockaddr_un addr;
+    serve_state st;
+    struct pollfd *fds = NULL;
+    serve_client **fdclient = NULL;
+    serve_job **fdjob = NULL;
+    int nfds = 0, capfds = 0;
+    int lfd, devnull;
+
+    memset(&st, 0, sizeof(st));
+    CIRCLEQ_INIT(&st.clients);
+    CIRCLEQ_INIT(&st.pending);
+    CIRCLEQ_INIT(&st.running);
+    st.max_jobs = max_jobs > 0 ? max_jobs : SERVE_MAX_JOBS;
+    st.lfd = -1;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "-xssh: %s: socket path too long\n", path);
+        return 1;
+    }
+
+    lfd = st.lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if(lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0)
+    {
+        fprintf(stderr, "-xssh: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    if(g_context.sigchld_pipe[0] <= 0)
+    {
+        fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
+        return 1;
+    }
 
-    strcpy(cmdBuffer, buffer);
- 
+    //jobs do not read terminal of daemon
+    devnull = open("/dev/null", O_RDONLY);
+    if(devnull > 0)
+    {
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    catchsigchld();
 
-    token = strtok_r(buffer, "|", &saveptr);
-    while (token != NULL)
+    while(1)
     {
-        p = create_proc(token);
-        if(!p)
+        serve_client *c = NULL;
+        serve_job *sj = NULL;
+        int i, need = 2;
+
+        serve_start_jobs(&st);
+
+        CIRCLEQ_FOREACH(c, &st.clients, link)
+            need++;
+        CIRCLEQ_FOREACH(sj, &st.running, link)
+            need++;
+        if(need > capfds)
         {
-            retval = -1;
-            goto done;
+            capfds = need * 2;
+            fds = realloc(fds, capfds * sizeof(struct pollfd));
+            fdclient = realloc(fdclient, capfds * sizeof(serve_client *));
+            fdjob = realloc(fdjob, capfds * sizeof(serve_job *));
+            if(!fds || !fdclient || !fdjob)
+            {
+                fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+                return 1;
+            }
         }
 
-        if(!job)
+        nfds = 0;
+        fds[nfds].fd = lfd;
+        fds[nfds].events = POLLIN;
+        fdclient[nfds] = NULL;
+        fdjob[nfds++] = NULL;
+        fds[nfds].fd = g_context.sigchld_pipe[0];
+        fds[nfds].events = POLLIN;
+        fdclient[nfds] = NULL;
+        fdjob[nfds++] = NULL;
+        CIRCLEQ_FOREACH(c, &st.clients, link)
         {
-            job = malloc(sizeof(job_info));
-            if(!job)
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = (c->eof ? 0 : POLLIN) | (c->outlen ? POLLOUT : 0);
+            fdclient[nfds] = c;
+            fdjob[nfds++] = NULL;
+        }
+        CIRCLEQ_FOREACH(sj, &st.running, link)
+        {
+            //negative fd is ignored by poll
+            fds[nfds].fd = serve_client_full(sj->client) ? -1 : sj->outfd;
+            fds[nfds].events = POLLIN;
+            fdclient[nfds] = NULL;
+            fdjob[nfds++] = sj;
+        }
+
+        if(poll(fds, nfds, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "-xssh:%s(%d) poll failed\n", __FUNCTION__, __LINE__);
+            return 1;
+        }
+
+        if(fds[0].revents & POLLIN)
+        {
+            int cfd;
+            while((cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0)
             {
-                fprintf(stderr, "-xssh:%s(%d)]: malloc failed", __FUNCTION__, __LINE__);
-                retval = -1;
-                goto done;
+                c = malloc(sizeof(serve_client));
+                if(!c)
+                {
+                    close(cfd);
+                    continue;
+                }
+                memset(c, 0, sizeof(serve_client));
+                c->fd = cfd;
+                CIRCLEQ_INSERT_TAIL(&st.clients, c, link);
             }
-            memset(job, 0, sizeof(job_info));
-            CIRCLEQ_INIT(&job->proc_info_list);
         }
 
-
-       /* If '|' exists. It means more than one commands are piped together. 
-        * So each process get appended in job_info's process list in same order 
-        * as they are present in command buffer.
-        */
-        token = strtok_r(NULL, "|", &saveptr);
-      
-        /*If sets of commands supposed to run in background then last process background field shall be set
-         * to 1 by create_proc functon.
-         * If background flag is set for a command but it is not the last command in command list
-         * then parser will fail.
-         */
-        if(p->background && token)
+        if(fds[1].revents & POLLIN)
         {
-            fprintf(stderr, "-xssh: syntax error near unexpected token `|'");
-            retval = -1;
-            goto done;
+            char drain[64];
+            while(read(g_context.sigchld_pipe[0], drain, sizeof(drain)) > 0)
+                ;
         }
-        
-        if(p->background)
-            job->background = 1;   
 
-        CIRCLEQ_INSERT_TAIL(&job->proc_info_list, p, link);
-        job->nprocs++;
-        p = NULL; 
-    }
+        //captured output first, so that exit is sent after all output of job
+        for(i = 2; i < nfds; i++)
+            if(fdjob[i] && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)))
+                serve_read_output(fdjob[i]);
+        serve_reap(&st);
 
+        for(i = 2; i < nfds; i++)
+        {
+            c = fdclient[i];
+            if(!c)
+                continue;
 
-    if(job->background)
-        cmdBuffer[strlen(cmdBuffer)-1]='\0';
-    strcpy(job->cmd, cmdBuffer);
+            if(fds[i].revents & POLLIN)
+            {
+                ssize_t n = read(c->fd, c->in + c->inlen, sizeof(c->in) - c->inlen);
+                if(n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR)))
+                    c->eof = 1;
+                else if(n > 0)
+                {
+                    char *start = c->in, *nl;
+                    c->inlen += n;
+                    while((nl = memchr(start, '\n', c->in + c->inlen - start)) != NULL)
+                    {
+                        *nl = '\0';
+                        serve_request(&st, c, start);
+                        start = nl + 1;
+                    }
+                    c->inlen -= start - c->in;
+                    memmove(c->in, start, c->inlen);
+                    if(c->inlen == sizeof(c->in))
+                    {
+                        serve_sendf(c, "error command too long\n");
+                        c->inlen = 0;
+                    }
+                }
+            }
 
-done:
+            if(c->outlen && (fds[i].revents & POLLOUT))
+            {
+                ssize_t n = write(c->fd, c->out, c->outlen);
+                if(n > 0)
+                {
+                    memmove(c->out, c->out + n, c->outlen - n);
+                    c->outlen -= n;
+                }
+                else if(n < 0 && errno != EAGAIN && errno != EINTR)
+                {
+                    serve_close_client(&st, c);
+                    continue;
+                }
+            }
 
-    if(p)
-        destroy_proc(p);
-    if(retval != 0)
-    {
-        destroy_job(job);
-        job = NULL;
+            if((fds[i].revents & (POLLERR | POLLHUP)) && !c->outlen)
+                c->eof = 1;
+            if(c->eof && !c->njobs && !c->outlen)
+                serve_close_client(&st, c);
+        }
     }
-    return job;
+    return 0;
 }
 
-void destroy_job(job_info *job)
+/*Returns alias named by len bytes of word or NULL*/
+static alias_info *find_alias(const char *word, size_t len)
 {
-    if(!job)
-        return;
-
-    while(!CIRCLEQ_EMPTY(&job->proc_info_list))
+    alias_info *a = NULL;
+    CIRCLEQ_FOREACH(a, &g_context.aliases, link)
     {
-        proc_info *p = CIRCLEQ_FIRST(&job->proc_info_list);
-        CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
-        destroy_proc(p);
+        if(strlen(a->name) == len && !strncmp(a->name, word, len))
+            return a;
     }
+    return NULL;
+}
 
-    free(job);
+static void free_alias(alias_info *a)
+{
+    if(!snap_owns(a->name))
+        free(a->name);
+    if(!snap_owns(a->value))
+        free(a->value);
+    if(!snap_owns(a))
+        free(a);
 }
 
 /**
-* @brief  This function will execute the command using execvp and shall be called just after fork() in execute_job function.
-* but before it does execvp it also does some prequired task such pipe and redirection setup
-*
-* @param inprevpipe  previous pipe's in open file discritor 
-* @param inpipe      current pipe in open file descriptor.
-* @param outpipe     current pipe out open file descriptor
-* @param p
+* @brief  alias builtin.
+*     alias               - print all aliases
+*     alias name          - print alias name
+*     alias name=value    - define alias, value is rest of line (e.g. alias ll=ls -l)
 */
-void run_exec (int inprevpipe, int inpipe, int outpipe, proc_info *p)
+void alias(char buffer[BUFLEN])
 {
-    int retval = 0;
-    if(inpipe != 0)    //last process in job will have inpipe as 0 and outpipe as 1
-        close(inpipe); 
+    char *arg = buffer + 5;
+    char *eq = NULL;
+    alias_info *a = NULL;
 
-    if(outpipe != 1)
+    rtrim(buffer);
+    ltrim(arg);
+    if(!*arg)
     {
- 
-        retval = dup2(outpipe, 1);
-        if(retval < 0)
-        {
-            fprintf(stderr, "-xssh:%s(%d) dup failed\n", __FUNCTION__, __LINE__);
-            goto done;
-        }
+        CIRCLEQ_FOREACH(a, &g_context.aliases, link)
+            fprintf(stdout, "alias %s=%s\n", a->name, a->value);
+        sprintf(varvalue[1], "%d", 0);
+        return;
+    }
 
-        close(outpipe);    //should we do it  
+    eq = strchr(arg, '=');
+    a = find_alias(arg, eq ? (size_t)(eq - arg) : strlen(arg));
+    if(!eq)
+    {
+        if(a)
+            fprintf(stdout, "alias %s=%s\n", a->name, a->value);
+        else
+            fprintf(stderr, "-xssh: alias: %s: not found\n", arg);
+        sprintf(varvalue[1], "%d", a ? 0 : 1);
+        return;
     }
 
-    if(inprevpipe != 0)
+    *eq = '\0';
+    if(!*arg || strpbrk(arg, " \t/$|&;<>"))
     {
-        retval = dup2(inprevpipe, 0);
-        if(retval < 0)
+        fprintf(stderr, "-xssh: alias: `%s': invalid alias name\n", arg);
+        sprintf(varvalue[1], "%d", 1);
+        return;
+    }
+
+    if(!a)
+    {
+        a = calloc(1, sizeof(alias_info));
+        if(!a || !(a->name = strdup(arg)))
         {
-            fprintf(stderr, "-xssh:%s(%d) dup failed\n", __FUNCTION__, __LINE__);
-            goto done;
+            fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+            free(a);
+            sprintf(varvalue[1], "%d", 1);
+            return;
         }
-
-        close(inprevpipe); //should we do it 
+        CIRCLEQ_INSERT_TAIL(&g_context.aliases, a, link);
     }
+    else if(!snap_owns(a->value))
+        free(a->value);
+    a->value = strdup(eq + 1);
+    if(!a->value)
+    {
+        CIRCLEQ_REMOVE(&g_context.aliases, a, link);
+        free_alias(a);
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        sprintf(varvalue[1], "%d", 1);
+        return;
+    }
+    sprintf(varvalue[1], "%d", 0);
+}
 
-    //redirection setup
+/**
+* @brief  unalias builtin.
+*     unalias name...     - remove aliases
+*     unalias -a          - remove all aliases
+*/
+void unalias(char buffer[BUFLEN])
+{
+    char *arg = NULL, *saveptr = NULL;
+    alias_info *a = NULL;
+    int status = 0;
 
-    redirect_info *rinfo = NULL;
-    CIRCLEQ_FOREACH(rinfo,  &p->redirect_info_list, link)
+    rtrim(buffer);
+    for(arg = strtok_r(buffer + 7, " ", &saveptr); arg; arg = strtok_r(NULL, " ", &saveptr))
     {
-        int fd1;
-        int fd2;
-
-        if(rinfo->mode == 1)
+        if(!strcmp(arg, "-a"))
         {
-            int srcfd = rinfo->srcfd;
-            char *dstfile = rinfo->dstfile;
-            
-            fd1 = srcfd; 
-            fd2 = open(rinfo->dstfile, O_CREAT | O_WRONLY | O_TRUNC, 0777);
-            if(fd2 < 1)
+            while(!CIRCLEQ_EMPTY(&g_context.aliases))
             {
-                retval = -errno;
-                fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, rinfo->dstfile);
+                a = CIRCLEQ_FIRST(&g_context.aliases);
+                CIRCLEQ_REMOVE(&g_context.aliases, a, link);
+                free_alias(a);
             }
- 
-            //fprintf(stderr, "file=%s, fd=%d", dstfile, fd2);
+            continue;
         }
-
-        if(rinfo->mode == 2)
+        a = find_alias(arg, strlen(arg));
+        if(!a)
         {
-            int srcfd = rinfo->srcfd;
-            char *dstfile = rinfo->dstfile;
-            
-            fd1 = srcfd; 
-            fd2 = open(dstfile, O_CREAT | O_WRONLY | O_APPEND, 0777);
-            if(fd2 < 1)
-            {
-                retval = -errno;
-                fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, rinfo->dstfile);
-            } 
-
+            fprintf(stderr, "-xssh: unalias: %s: not found\n", arg);
+            status = 1;
+            continue;
         }
+        CIRCLEQ_REMOVE(&g_context.aliases, a, link);
+        free_alias(a);
+    }
+    sprintf(varvalue[1], "%d", status);
+}
 
-        if(rinfo->mode == 3)
-        {
-            int srcfd = rinfo->srcfd;
-            int dstfd = rinfo->dstfd;
-            fd1 = srcfd;
-            fd2 = dstfd;
-        } 
+/**
+* @brief  Replaces first word of each pipeline stage of command line with value of alias of that name. Value which
+*     starts with another alias is expanded again, but an alias is not expanded twice in a stage.
+*
+* @return 0 on success, -1 if line would not fit in buffer
+*/
+int alias_expand(char buffer[BUFLEN])
+{
+    char out[BUFLEN];
+    alias_info *used[16];
+    int nused = 0, pos = 0, i;
 
-        if(rinfo->mode == 4)
+    if(CIRCLEQ_EMPTY(&g_context.aliases))
+        return 0;
+
+    while(buffer[pos])
+    {
+        alias_info *a = NULL;
+        int start, end;
+
+        while(buffer[pos] == ' ' || buffer[pos] == '\t')
+            pos++;
+        start = pos;
+        while(buffer[pos] && !isspace(buffer[pos]) && !strchr("|&;<>", buffer[pos]))
+            pos++;
+        end = pos;
+
+        if(end > start && nused < 16)
+            a = find_alias(buffer + start, end - start);
+        for(i = 0; a && i < nused; i++)
+            if(used[i] == a)
+                a = NULL;
+        if(a)
         {
-            char *srcfile = rinfo->srcfile;
-            int dstfd = rinfo->dstfd;
-        
-            fd1 = dstfd;
-            fd2 = open(srcfile, O_RDONLY);
-            if(fd2 < 1)
+            if(strlen(buffer) - (end - start) + strlen(a->value) >= BUFLEN)
             {
-                retval = -errno;
-                fprintf(stderr, "-xssh:%s(%d) failed to open file(%s)\n", __FUNCTION__, __LINE__, rinfo->dstfile);
-            } 
+                fprintf(stderr, "-xssh: %s: alias expansion too long\n", a->name);
+                return -1;
+            }
+            snprintf(out, sizeof(out), "%.*s%s%s", start, buffer, a->value, buffer + end);
+            strcpy(buffer, out);
+            used[nused++] = a;
+            pos = start;
+            continue;
         }
 
-        if(rinfo->mode == 5)
+        //next stage, '|' inside $(...) belongs to inner command
+        nused = 0;
+        while(buffer[pos] && buffer[pos] != '|')
         {
-            int srcfd = rinfo->srcfd;
-            int dstfd = rinfo->dstfd;
-            fd1 = dstfd;
-            fd2 = srcfd;
+            int span = subst_span(buffer + pos);
+            pos += span ? span : 1;
         }
+        if(buffer[pos])
+            pos++;
+    }
+    return 0;
+}
 
-        if(dup2(fd2, fd1) < 0)
+/*
+* rc snapshot: image of state defined by rc file. Pointers in image hold offsets from its start until snap_load()
+* adds address of mapping to each of them (offsets of all of them are listed in relocation table), so image is
+* used where it is mapped and syntax trees of functions are not copied.
+*/
+#define SNAP_MAGIC   "XSSHSNP"
+#define SNAP_VERSION 1
+
+typedef struct _snap_var
+{
+    char *name;
+    char *value;
+    int  exported;
+}snap_var;
+
+/*Environment variable read by rc file, hash is 0 if it was not set*/
+typedef struct _snap_env
+{
+    char *name;
+    uint64_t hash;
+}snap_env;
+
+typedef struct _snap_header
+{
+    char     magic[8];
+    uint64_t layout;        //image of other build (other struct layout) is not used
+    int64_t  rc_sec;        //mtime and size of rc file image was made from
+    int64_t  rc_nsec;
+    uint64_t rc_size;
+    uint64_t size;
+    uint64_t relocs;        //offset of relocation table
+    uint64_t nrelocs;
+    snap_var *vars;
+    func_info *funcs;
+    alias_info *aliases;
+    snap_env *env;
+    int      nvars;
+    int      nfuncs;
+    int      naliases;
+    int      nenv;
+}snap_header;
+
+/*Image being written*/
+typedef struct _snap_buf
+{
+    char   *data;
+    size_t len;
+    size_t cap;
+    uint64_t *relocs;
+    size_t nrelocs;
+    size_t relocs_cap;
+    int    failed;
+}snap_buf;
+
+int snap_owns(const void *ptr)
+{
+    return g_context.snap && (const char *)ptr >= g_context.snap && (const char *)ptr < g_context.snap + g_context.snap_len;
+}
+
+static uint64_t snap_layout()
+{
+    uint64_t v[] = {SNAP_VERSION, INSNUM, BUFLEN, sizeof(void *), sizeof(snap_header), sizeof(ast_node),
+                    sizeof(job_info), sizeof(proc_info), sizeof(redirect_info), sizeof(func_info), sizeof(alias_info),
+                    offsetof(ast_node, children), offsetof(job_info, proc_info_list),
+                    offsetof(proc_info, redirect_info_list)};
+    return fnv1a(0xcbf29ce484222325ULL, v, sizeof(v));
+}
+
+static uint64_t snap_env_hash(const char *value)
+{
+    return value ? fnv1a(0xcbf29ce484222325ULL, value, strlen(value) + 1) | 1 : 0;
+}
+
+/*Allocates zeroed size bytes in image and returns their offset, 0 on failure (offset 0 is header)*/
+static size_t snap_alloc(snap_buf *sb, size_t size)
+{
+    size_t off = (sb->len + 7) & ~(size_t)7;
+
+    if(sb->failed)
+        return 0;
+    if(off + size > sb->cap)
+    {
+        size_t cap = sb->cap ? sb->cap * 2 : 4096;
+        char *tmp = NULL;
+
+        while(cap < off + size)
+            cap *= 2;
+        tmp = realloc(sb->data, cap);
+        if(!tmp)
         {
-            retval = -errno;
-            fprintf(stderr, "-xssh:%s(%d) failed to dup\n", __FUNCTION__, __LINE__);
-            goto done;         
+            sb->failed = 1;
+            return 0;
+        }
+        sb->data = tmp;
+        sb->cap = cap;
+    }
+    memset(sb->data + sb->len, 0, off + size - sb->len);
+    sb->len = off + size;
+    return off;
+}
+
+/*Stores offset target (0 for NULL) in pointer at offset at*/
+static void snap_ptr(snap_buf *sb, size_t at, size_t target)
+{
+    if(sb->failed)
+        return;
+    *(uintptr_t *)(sb->data + at) = target;
+    if(!target)
+        return;
+    if(sb->nrelocs == sb->relocs_cap)
+    {
+        size_t cap = sb->relocs_cap ? sb->relocs_cap * 2 : 256;
+        uint64_t *tmp = realloc(sb->relocs, cap * sizeof(uint64_t));
+        if(!tmp)
+        {
+            sb->failed = 1;
+            return;
         }
-        close(fd2); 
+        sb->relocs = tmp;
+        sb->relocs_cap = cap;
     }
+    sb->relocs[sb->nrelocs++] = at;
+}
+
+static size_t snap_str(snap_buf *sb, const char *str)
+{
+    size_t off = 0;
+
+    if(str && (off = snap_alloc(sb, strlen(str) + 1)))
+        memcpy(sb->data + off, str, strlen(str) + 1);
+    return off;
+}
+
+/*Links elements (offsets, link is offset of CIRCLEQ_ENTRY in element) into CIRCLEQ_HEAD at offset head*/
+static void snap_list(snap_buf *sb, size_t head, const size_t *elems, int n, size_t link)
+{
+    int i;
 
-    if(p->nargs > 0)
+    //empty list and ends of list point to head itself as after CIRCLEQ_INIT
+    snap_ptr(sb, head, n ? elems[0] : head);
+    snap_ptr(sb, head + sizeof(void *), n ? elems[n - 1] : head);
+    for(i = 0; i < n; i++)
     {
-        retval = execvp(p->args[0], &p->args[1]);
-        if(retval < 0)
-        {
-            fprintf(stderr, "-xssh:%s(%d) execvp failed\n", __FUNCTION__, __LINE__);
-            goto done;
-        }
+        snap_ptr(sb, elems[i] + link, i + 1 < n ? elems[i + 1] : head);
+        snap_ptr(sb, elems[i] + link + sizeof(void *), i ? elems[i - 1] : head);
     }
-    else
-        exit(0);
-done:
-    if(retval < 0)
-        exit(-errno);   
 }
 
-int execute_job(job_info *job)
+/*Copies what instantiate_job() uses of a job template*/
+static size_t snap_proc(snap_buf *sb, proc_info *tp)
 {
-    int i = 0, inprevpipe = 0, inpipe = 0, outpipe = 1;
-    int end = job->nprocs - 1;
-    int retval = 0;
-    proc_info *p = NULL;
+    redirect_info *tr = NULL;
+    size_t off = snap_alloc(sb, sizeof(proc_info));
+    size_t args = 0, elems[64];
+    int i, n = 0;
 
-    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    if(!off)
+        return 0;
+    ((proc_info *)(sb->data + off))->background = tp->background;
+    ((proc_info *)(sb->data + off))->nargs = tp->nargs;
+    if(tp->nargs && (args = snap_alloc(sb, sizeof(char *) * (tp->nargs + 1))))
+        for(i = 0; i < tp->nargs; i++)
+            snap_ptr(sb, args + i * sizeof(char *), snap_str(sb, tp->args[i]));
+    snap_ptr(sb, off + offsetof(proc_info, args), args);
+
+    CIRCLEQ_FOREACH(tr, &tp->redirect_info_list, link)
     {
-        if (i >=0 && i < end)
-        {
-            int fd[2] = {0};
-            retval = pipe(fd);
-            if(retval < 0)
-            {
-                retval = -errno;
-                fprintf(stderr, "-xssh:%s(%d) error pipe", __FUNCTION__, __LINE__);
-                goto done;
-            }
+        size_t r = snap_alloc(sb, sizeof(redirect_info));
 
-            inpipe = fd[0];
-            outpipe = fd[1];
-        }
-        else
+        if(!r || n == 64)
         {
-            inpipe  = 0; 
-            outpipe = 1;
+            sb->failed = 1;
+            return 0;
         }
+        memcpy(sb->data + r, tr, sizeof(redirect_info));
+        ((redirect_info *)(sb->data + r))->memfd = 0;
+        snap_ptr(sb, r + offsetof(redirect_info, srcfile), snap_str(sb, tr->srcfile));
+        snap_ptr(sb, r + offsetof(redirect_info, dstfile), snap_str(sb, tr->dstfile));
+        snap_ptr(sb, r + offsetof(redirect_info, body), snap_str(sb, tr->body));
+        elems[n++] = r;
+    }
+    snap_list(sb, off + offsetof(proc_info, redirect_info_list), elems, n, offsetof(redirect_info, link));
+    return off;
+}
 
-        int pid = fork();
-        if(pid < 0)
-        {
-            retval = -errno;
-            fprintf(stderr, "-xssh:%s(%d) error fork", __FUNCTION__, __LINE__);
-            goto done;
-        }
+static size_t snap_job(snap_buf *sb, job_info *tmpl)
+{
+    proc_info *tp = NULL;
+    size_t off = 0, elems[BUFLEN];
+    int n = 0;
 
-        if(pid == 0)
-        {
-            retval = setpgid(getpid(), i ? job->pgid : 0);
-            if(retval < 0)
-            {
-                //fprintf(stderr, "-xssh:%s(%d) error setpgid", __FUNCTION__, __LINE__);
-                exit(-errno);
-            }
+    if(!tmpl || !(off = snap_alloc(sb, sizeof(job_info))))
+        return 0;
+    ((job_info *)(sb->data + off))->background = tmpl->background;
+    ((job_info *)(sb->data + off))->nprocs = tmpl->nprocs;
+    memcpy(((job_info *)(sb->data + off))->cmd, tmpl->cmd, BUFLEN);
 
-            if(i == 0 && !job->background)
-            {
-                /* a) Only those processes which are part of terminal's foreground process group shall be 
-                 *   able to read from terminal (e.g. STDIN).
-                 * 
-                 * b) If any process's group is not terminal's foreground process group and that process performs any read using STDIN
-                 *    then it will receive SIGTTIN signal and if that process has not handled that signal
-                 *    then it will get another signal SIGSTOP which eventually leads to process being stopped.
-                 *
-                 * c) So if child process is supposed to be run in foreground then it must it's process group as
-                 *    terminal's foreground process group using tcsetpgrp
-                 *
-                 * d) Once child process's process group becomes terminal foreground process group.
-                 *    Not even XSSH can read input from STDIN. So we must be careful before XSSH perform any input I/O
-                 *    it must bring it's process group to terminal's foreground process group
-                 */
+    CIRCLEQ_FOREACH(tp, &tmpl->proc_info_list, link)
+    {
+        if(n == BUFLEN)
+        {
+            sb->failed = 1;
+            return 0;
+        }
+        elems[n++] = snap_proc(sb, tp);
+    }
+    snap_list(sb, off + offsetof(job_info, proc_info_list), elems, n, offsetof(proc_info, link));
+    return off;
+}
 
+static size_t snap_node(snap_buf *sb, ast_node *node)
+{
+    ast_node *child = NULL;
+    size_t off = 0, words = 0, *elems = NULL;
+    int n = 0, i;
 
-                signal(SIGTTIN, SIG_IGN);  
-                signal(SIGTTOU, SIG_IGN);  
-                
-                //setting this process group in terminal foreground process group
-                retval = tcsetpgrp(STDIN_FILENO, getpgrp());
-                if(retval < 0)
-                {
-                    fprintf(stderr, "-xssh:%s(%d) error tcsetpgrp", __FUNCTION__, __LINE__);
-                    signal(SIGTTIN, SIG_DFL);
-                    signal(SIGTTOU, SIG_DFL);
-                    exit(-errno);
-                }
+    if(!node || !(off = snap_alloc(sb, sizeof(ast_node))))
+        return 0;
+    ((ast_node *)(sb->data + off))->type = node->type;
+    ((ast_node *)(sb->data + off))->ins = node->ins;
+    ((ast_node *)(sb->data + off))->nwords = node->nwords;
+    ((ast_node *)(sb->data + off))->levels = node->levels;
+
+    snap_ptr(sb, off + offsetof(ast_node, tmpl), snap_job(sb, node->tmpl));
+    snap_ptr(sb, off + offsetof(ast_node, cond), snap_node(sb, node->cond));
+    snap_ptr(sb, off + offsetof(ast_node, body), snap_node(sb, node->body));
+    snap_ptr(sb, off + offsetof(ast_node, orelse), snap_node(sb, node->orelse));
+    snap_ptr(sb, off + offsetof(ast_node, var), snap_str(sb, node->var));
+    if(node->words && node->nwords > 0 && (words = snap_alloc(sb, sizeof(char *) * node->nwords)))
+        for(i = 0; i < node->nwords; i++)
+            snap_ptr(sb, words + i * sizeof(char *), snap_str(sb, node->words[i]));
+    snap_ptr(sb, off + offsetof(ast_node, words), words);
+
+    CIRCLEQ_FOREACH(child, &node->children, link)
+        n++;
+    elems = malloc(sizeof(size_t) * (n + 1));
+    if(!elems)
+    {
+        sb->failed = 1;
+        return 0;
+    }
+    n = 0;
+    CIRCLEQ_FOREACH(child, &node->children, link)
+        elems[n++] = snap_node(sb, child);
+    snap_list(sb, off + offsetof(ast_node, children), elems, n, offsetof(ast_node, link));
+    free(elems);
+    return off;
+}
 
-                signal(SIGTTIN, SIG_DFL);  
-                signal(SIGTTOU, SIG_DFL);  
-            }
-            
-            run_exec(inprevpipe, inpipe, outpipe, p);  //run_exec will either suceed or do exit
+/**
+* @brief  Writes variables, functions and aliases defined by rc file into snapshot file path.
+*
+* @param rc  [IN] stat of rc file, its mtime and size validate snapshot
+* @param env [IN] environment variables rc file read ("NAME=value", "NAME" if not set)
+*/
+static int snap_write(const char *path, const struct stat *rc, str_list *env)
+{
+    snap_buf sb;
+    snap_header *h = NULL;
+    func_info *func = NULL;
+    alias_info *a = NULL;
+    size_t hdr, vars = 0, funcs = 0, aliases = 0, envs = 0, relocs = 0;
+    int nvars = 0, nfuncs = 0, naliases = 0, nenv = 0, i, j, fd;
+    char tmp[4096 + 32];
+    ssize_t n = 0;
+
+    memset(&sb, 0, sizeof(sb));
+    hdr = snap_alloc(&sb, sizeof(snap_header));
+
+    //$$, $? and $! (first three entries) belong to each shell
+    for(j = 3; j < varmax; j++)
+        if(varname[j][0])
+            nvars++;
+    if(nvars && (vars = snap_alloc(&sb, sizeof(snap_var) * nvars)))
+    {
+        for(i = 0, j = 3; j < varmax; j++)
+        {
+            if(!varname[j][0])
+                continue;
+            snap_ptr(&sb, vars + i * sizeof(snap_var) + offsetof(snap_var, name), snap_str(&sb, varname[j]));
+            snap_ptr(&sb, vars + i * sizeof(snap_var) + offsetof(snap_var, value), snap_str(&sb, varvalue[j]));
+            ((snap_var *)(sb.data + vars))[i++].exported = varexported[j];
         }
+    }
 
-        retval = setpgid(pid, i ? job->pgid : 0);
-        if(retval < 0 && errno != EACCES)
+    CIRCLEQ_FOREACH(func, &g_context.funcs, link)
+        nfuncs++;
+    if(nfuncs && (funcs = snap_alloc(&sb, sizeof(func_info) * nfuncs)))
+    {
+        i = 0;
+        CIRCLEQ_FOREACH(func, &g_context.funcs, link)
         {
-            fprintf(stderr, "-xssh:%s(%d) error setpgid", __FUNCTION__, __LINE__);
-            goto done;
+            snap_ptr(&sb, funcs + i * sizeof(func_info) + offsetof(func_info, name), snap_str(&sb, func->name));
+            snap_ptr(&sb, funcs + i * sizeof(func_info) + offsetof(func_info, body), snap_node(&sb, func->body));
+            i++;
         }
+    }
 
-        retval = 0;        
-        job->pgid = i ? job->pgid : pid;
-        job->lastpid = pid;
-        p->pid = pid;
-        p->state = XSSH_PROC_STATE_RUNNING;
-        job->nrunning++;
- 
-        if (i == end)   
+    CIRCLEQ_FOREACH(a, &g_context.aliases, link)
+        naliases++;
+    if(naliases && (aliases = snap_alloc(&sb, sizeof(alias_info) * naliases)))
+    {
+        i = 0;
+        CIRCLEQ_FOREACH(a, &g_context.aliases, link)
         {
-            if(inprevpipe != 0)
-            {
-                close(inprevpipe);
-                inprevpipe = 0;
-            }
+            snap_ptr(&sb, aliases + i * sizeof(alias_info) + offsetof(alias_info, name), snap_str(&sb, a->name));
+            snap_ptr(&sb, aliases + i * sizeof(alias_info) + offsetof(alias_info, value), snap_str(&sb, a->value));
+            i++;
         }
-        else if( i > 0)
-        {
-            retval = dup2(inpipe, inprevpipe);
-            if(retval < 0)
-            {
-                fprintf(stderr, "-xssh:%s(%d) error dup2", __FUNCTION__, __LINE__);
-                retval = -errno;
-                goto done;
-            }
+    }
 
-            retval = 0;
-            close(inpipe);
-            close(outpipe);
+    //first lookup of a name saw value from environment, later ones may see what rc file set
+    if(env->n && (envs = snap_alloc(&sb, sizeof(snap_env) * env->n)))
+    {
+        for(i = 0; i < env->n; i++)
+        {
+            char *eq = strchr(env->v[i], '=');
+            size_t len = eq ? (size_t)(eq - env->v[i]) : strlen(env->v[i]);
 
-            inpipe = 0;
-            outpipe = 1;
-        }
-        else
-        {   
-            //no need to check outpipe since whenever control will come here. outpipe will have valid pipe fd  
-            close(outpipe);
-            inprevpipe = inpipe;
-            inpipe = 0;
-            outpipe = 1;
+            for(j = 0; j < i; j++)
+                if(!strncmp(env->v[j], env->v[i], len) && (env->v[j][len] == '=' || !env->v[j][len]))
+                    break;
+            if(j < i)
+                continue;
+            if(eq)
+                *eq = '\0';
+            snap_ptr(&sb, envs + nenv * sizeof(snap_env) + offsetof(snap_env, name), snap_str(&sb, env->v[i]));
+            ((snap_env *)(sb.data + envs))[nenv++].hash = snap_env_hash(eq ? eq + 1 : NULL);
+            if(eq)
+                *eq = '=';
         }
-        i++;
     }
 
-done:
-    if(inprevpipe != 0)
-        close(inprevpipe);
-    if(inpipe != 0)
-        close(inpipe);
-    if(outpipe != 1)
-        close(outpipe);
+    snap_ptr(&sb, hdr + offsetof(snap_header, vars), vars);
+    snap_ptr(&sb, hdr + offsetof(snap_header, funcs), funcs);
+    snap_ptr(&sb, hdr + offsetof(snap_header, aliases), aliases);
+    snap_ptr(&sb, hdr + offsetof(snap_header, env), envs);
+    if(sb.nrelocs && (relocs = snap_alloc(&sb, sizeof(uint64_t) * sb.nrelocs)))
+        memcpy(sb.data + relocs, sb.relocs, sizeof(uint64_t) * sb.nrelocs);
+    if(sb.failed)
+    {
+        fprintf(stderr, "-xssh:%s(%d) malloc failed", __FUNCTION__, __LINE__);
+        free(sb.data);
+        free(sb.relocs);
+        return -1;
+    }
 
-    return retval; 
+    h = (snap_header *)(sb.data + hdr);
+    memcpy(h->magic, SNAP_MAGIC, sizeof(h->magic));
+    h->layout = snap_layout();
+    h->rc_sec = rc->st_mtim.tv_sec;
+    h->rc_nsec = rc->st_mtim.tv_nsec;
+    h->rc_size = rc->st_size;
+    h->size = sb.len;
+    h->relocs = relocs;
+    h->nrelocs = sb.nrelocs;
+    h->nvars = nvars;
+    h->nfuncs = nfuncs;
+    h->naliases = naliases;
+    h->nenv = nenv;
+
+    //renamed into place, so another shell starting meanwhile maps either old or complete new image
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd >= 0)
+    {
+        n = write(fd, sb.data, sb.len);
+        close(fd);
+        if(n != (ssize_t)sb.len || rename(tmp, path) < 0)
+            unlink(tmp);
+    }
+    free(sb.data);
+    free(sb.relocs);
+    return fd >= 0 && n == (ssize_t)sb.len ? 0 : -1;
 }
 
-void wait_job()
+/**
+* @brief  Maps snapshot path and defines its variables, functions and aliases if it was made by this build from rc
+*     file with same mtime and size, and environment variables rc file read still have same values.
+*
+* @return 0 if snapshot was loaded else -1
+*/
+static int snap_load(const char *path, const struct stat *rc)
 {
-    siginfo_t info; 
-    int exitstatus = 0;
+    struct stat st;
+    snap_header *h = NULL;
+    char *base = NULL;
+    uint64_t *relocs = NULL, i;
+    int fd, k, j;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(snap_header))
+    {
+        close(fd);
+        return -1;
+    }
+    //private writable mapping: relocation and linking entries into lists only touch pages of this shell
+    base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return -1;
 
-    while(g_context.fg_job)
-    { 
-        int retval = waitid(P_PGID, g_context.fg_job->pgid, &info, WEXITED | WSTOPPED | WCONTINUED);
-        if(retval < 0 && errno == ECHILD)
-            break;    
+    h = (snap_header *)base;
+    if(memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) || h->layout != snap_layout() || h->size != (uint64_t)st.st_size ||
+       h->rc_sec != rc->st_mtim.tv_sec || h->rc_nsec != rc->st_mtim.tv_nsec || h->rc_size != (uint64_t)rc->st_size ||
+       h->relocs % 8 || h->relocs + h->nrelocs * sizeof(uint64_t) > h->size)
+        goto stale;
 
-        int s_status = info.si_status;
-        if(info.si_code == CLD_EXITED)
-            process_terminated(g_context.fg_job, info.si_pid, info.si_status);
+    relocs = (uint64_t *)(base + h->relocs);
+    for(i = 0; i < h->nrelocs; i++)
+    {
+        uintptr_t *ptr = (uintptr_t *)(base + relocs[i]);
 
-        if(info.si_code == CLD_STOPPED)
-            process_stopped(g_context.fg_job, info.si_pid);
+        if(relocs[i] % 8 || relocs[i] >= h->relocs || *ptr >= h->relocs)
+            goto stale;
+        *ptr += (uintptr_t)base;
+    }
 
-        if(info.si_code == CLD_KILLED)
-        {
-           process_killed(g_context.fg_job, info.si_pid, info.si_status);
-        }
-        
-        if(info.si_code == CLD_CONTINUED)
-        {
-            process_continued(g_context.fg_job, info.si_pid);
-            fg_job_continued();
-        }
+    for(k = 0; k < h->nenv; k++)
+        if(snap_env_hash(getenv(h->env[k].name)) != h->env[k].hash)
+            goto stale;
 
-        if((g_context.fg_job->state == XSSH_JOB_STATE_STOPPED))
-        {
-            fg_job_stopped();
-            break;
-        }
-    
-        if((g_context.fg_job->state == XSSH_JOB_STATE_KILLED) || (g_context.fg_job->state == XSSH_JOB_STATE_DONE))
+    for(k = 0; k < h->nvars; k++)
+    {
+        if(setvar(h->vars[k].name, h->vars[k].value) < 0)
+            continue;
+        for(j = 0; strcmp(varname[j], h->vars[k].name); j++)
+            ;
+        if(h->vars[k].exported && !varexported[j])
         {
-            if(info.si_code == CLD_KILLED && info.si_status == SIGINT)
-                printf("-xssh: Exit pid %d\n", g_context.fg_job->pgid);  
-            fg_job_terminated();
-            break;
+            varexported[j] = 1;
+            env_set(varname[j], varvalue[j]);
         }
-
     }
+    for(k = 0; k < h->nfuncs; k++)
+        CIRCLEQ_INSERT_TAIL(&g_context.funcs, &h->funcs[k], link);
+    for(k = 0; k < h->naliases; k++)
+        CIRCLEQ_INSERT_TAIL(&g_context.aliases, &h->aliases[k], link);
 
-    //if(g_context.fg_job)
-      //  fg_job_terminated();
-    wait_background_job(0);
+    g_context.snap = base;
+    g_context.snap_len = st.st_size;
+    return 0;
+
+stale:
+    munmap(base, st.st_size);
+    return -1;
 }
 
-void wait_background_job(int pstatus)
+/*rc file which only defines variables, functions and aliases produces same state in every shell*/
+static int rc_pure(ast_node *node)
 {
-    job_info *job = NULL;
-    siginfo_t info; 
-    CIRCLEQ_FOREACH(job, &g_context.bg_jobs, link)
+    ast_node *child = NULL;
+    proc_info *p = NULL;
+    int i;
+
+    switch(node->type)
     {
-        do
-        {
-            info.si_pid = 0; 
-            int retval = waitid(P_PGID, job->pgid, &info, WNOHANG | WEXITED | WSTOPPED | WCONTINUED);
-            if(retval < 0 && errno == ECHILD)
-                break;
-            if(retval < 0)
-            {
-                fprintf(stderr, "Failed to wait the background process with pgid=%d, errno=%d", job->pgid, errno);
-                break;    
-            }
-        
-            if(retval == 0 && !info.si_pid)
-                continue;
+        case XSSH_NODE_LIST:
+            CIRCLEQ_FOREACH(child, &node->children, link)
+                if(!rc_pure(child))
+                    return 0;
+            return 1;
+
+        case XSSH_NODE_FUNCDEF:
+            return 1;
+
+        case XSSH_NODE_CMD:
+            if(!node->tmpl)
+                return 0;
+            //command substitution can give other output on next start
+            CIRCLEQ_FOREACH(p, &node->tmpl->proc_info_list, link)
+                for(i = 1; i < p->nargs; i++)
+                    if(has_subst(p->args[i]))
+                        return 0;
+            //set, export, unexport, alias, unalias
+            if(node->ins)
+                return node->ins == 2 || node->ins == 3 || node->ins == 4 || node->ins == 21 || node->ins == 22;
+            if(!node->tmpl || node->tmpl->nprocs != 1 || node->tmpl->background)
+                return 0;
+            p = CIRCLEQ_FIRST(&node->tmpl->proc_info_list);
+            if(p->nargs < 2 || !CIRCLEQ_EMPTY(&p->redirect_info_list))
+                return 0;
+            for(i = 1; i < p->nargs; i++)
+                if(!is_assignment(p->args[i]))
+                    return 0;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
 
-            if(info.si_code == CLD_EXITED)
-                process_terminated(job, info.si_pid, info.si_status);
+/**
+* @brief  Runs rc file (~/.xsshrc, or file named by XSSH_RC, empty XSSH_RC disables it) at startup.
+*
+*     State produced by rc file which only defines things (see rc_pure()) is written to snapshot (rc file name with
+*     .snap suffix): variable table, aliases and parsed functions. Following starts map snapshot while it is valid,
+*     so nothing is read or parsed. Messages of definitions are not printed, as they are not on warm start. Other
+*     rc files are run on every start.
+*/
+void rc_load()
+{
+    char path[4096], snap[4096 + 8];
+    const char *rc = getenv("XSSH_RC");
+    struct stat st;
+    str_list env;
+    ast_node *root = NULL;
+    char *src = NULL;
+    size_t len = 0;
+    int fd, incomplete = 0, pure, saved = -1;
+
+    if(rc && !*rc)
+        return;
+    if(rc)
+        snprintf(path, sizeof(path), "%s", rc);
+    else if(getenv("HOME"))
+        snprintf(path, sizeof(path), "%s/.xsshrc", getenv("HOME"));
+    else
+        return;
+    if(stat(path, &st) < 0)
+        return;
 
-            if(info.si_code == CLD_STOPPED)
-                process_stopped(job, info.si_pid);
+    snprintf(snap, sizeof(snap), "%s.snap", path);
+    if(!snap_load(snap, &st))
+        return;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+        fprintf(stderr, "-xssh: %s: %s\n", path, strerror(errno));
+        return;
+    }
+    src = read_all(fd, &len);
+    close(fd);
+    if(!src)
+        return;
 
-            if(info.si_code == CLD_KILLED)
-                process_killed(job, info.si_pid, info.si_status);
+    root = parse_compound(src, &incomplete);
+    if(!root)
+    {
+        fprintf(stderr, "-xssh: %s: %s\n", path, incomplete ? "syntax error: unexpected end of file" : "not loaded");
+        free(src);
+        return;
+    }
 
-            if(info.si_code == CLD_CONTINUED)
-                process_continued(job, info.si_pid);
+    memset(&env, 0, sizeof(env));
+    pure = rc_pure(root);
+    if(pure)
+    {
+        int nul = open("/dev/null", O_WRONLY | O_CLOEXEC);
 
-            if(job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED)
-            {
-                job_info *temp = CIRCLEQ_LOOP_PREV(&g_context.bg_jobs, job, link);
-                CIRCLEQ_REMOVE(&g_context.bg_jobs, job, link);      
-                print_job_status(job);
-                destroy_job(job);
-                job = temp;
-                break;
-            }
-        }while(info.si_pid);
-      
-        if(pstatus) 
-            print_job_status(job);
+        fflush(stdout);
+        saved = dup(STDOUT_FILENO);
+        if(nul >= 0)
+        {
+            dup2(nul, STDOUT_FILENO);
+            close(nul);
+        }
+        g_context.rc_env = &env;
+        g_context.rc_volatile = 0;
     }
-}
 
-void print_job_status(job_info *job)
-{         
-    if(job->state == XSSH_JOB_STATE_DONE || job->state == XSSH_JOB_STATE_KILLED)
-        fprintf(stdout, "[%d] %s %d %s\n", job->job_spec, state_str[job->state], job->status, job->cmd);
-    else if(job->state == XSSH_JOB_STATE_RUNNING)
+    g_context.interrupted = 0;
+    g_context.in_builtin++;
+    exec_node(root);
+    g_context.in_builtin--;
+    g_context.breaks = 0;
+    g_context.continues = 0;
+
+    if(pure)
     {
-        if(job->background) 
-            fprintf(stdout, "[%d] %s %s &\n", job->job_spec, state_str[job->state], job->cmd);
-        else
-            fprintf(stdout, "%s\n", job->cmd);
+        fflush(stdout);
+        if(saved >= 0)
+        {
+            dup2(saved, STDOUT_FILENO);
+            close(saved);
+        }
+        g_context.rc_env = NULL;
     }
+
+    if(pure && !g_context.rc_volatile)
+        snap_write(snap, &st, &env);
     else
-        fprintf(stdout, "[%d] %s %s\n", job->job_spec, state_str[job->state], job->cmd);
-}
+        unlink(snap);
 
-void sigint_fg_job()
-{
-    if(g_context.fg_job)
-        kill(-g_context.fg_job->pgid, SIGINT);     
+    str_list_free(&env);
+    destroy_node(root);
+    free(src);
+    sprintf(varvalue[1], "%d", 0);
 }
 
-void sigtstp_fg_job()
+/*
+* Job control harness (xssh --bench-jobctl): drives xssh on a pseudo-terminal as a user would, ctrl+C and ctrl+Z are
+* typed into terminal, so signals are generated by line discipline and delivered to foreground process group set by
+* bring_job_to_fg(). State of job processes is read from /proc, owner of terminal with tcgetpgrp() on master side.
+*/
+#define JC_TIMEOUT_NS (5 * 1000000000ULL)
+
+typedef enum _jc_metric
 {
-    if(g_context.fg_job)
-       suspend_job(g_context.fg_job); 
-}
+    JC_START_FG,        //command typed -> job owns terminal and runs
+    JC_INT_DEAD,        //ctrl+C -> job process dead
+    JC_INT_PROMPT,      //ctrl+C -> prompt printed
+    JC_TSTP_STOPPED,    //ctrl+Z -> job process stopped
+    JC_TSTP_PROMPT,     //ctrl+Z -> prompt printed
+    JC_BG_RUNNING,      //bg N -> job process runs again
+    JC_FG_OWNER,        //fg N -> job owns terminal and runs
+    JC_NMETRICS
+}jc_metric;
+
+static const char *jc_metric_names[] =
+{
+    "start -> job owns tty", "ctrl+C -> job dead", "ctrl+C -> prompt", "ctrl+Z -> job stopped",
+    "ctrl+Z -> prompt", "bg -> job running", "fg -> job owns tty",
+};
 
-void fg_job_stopped()
+typedef struct _jc_harness
 {
-    if(g_context.fg_job)
+    int   master;
+    pid_t shell;
+    char  out[1 << 16];     //output of shell not yet consumed
+    size_t len;
+    int   checks;
+    int   failed;
+    uint64_t *lat[JC_NMETRICS];
+    int   nlat[JC_NMETRICS];
+}jc_harness;
+
+/*Appends output of shell which arrives within ms milliseconds*/
+static void jc_read(jc_harness *h, int ms)
+{
+    struct pollfd pfd = {h->master, POLLIN, 0};
+    ssize_t n;
+
+    if(poll(&pfd, 1, ms) <= 0)
+        return;
+    if(h->len > sizeof(h->out) / 2)
     {
-        send_job_to_bg(g_context.fg_job, 0);
-        print_job_status(g_context.fg_job);
+        memmove(h->out, h->out + h->len - sizeof(h->out) / 4, sizeof(h->out) / 4);
+        h->len = sizeof(h->out) / 4;
     }
-
-    bring_job_to_fg(NULL);
+    n = read(h->master, h->out + h->len, sizeof(h->out) - 1 - h->len);
+    if(n > 0)
+        h->len += n;
+    h->out[h->len] = '\0';
 }
 
-void fg_job_terminated()
+/*Consumes output up to and including needle, text before it is copied to text. Returns 1 if needle was seen*/
+static int jc_take(jc_harness *h, const char *needle, char *text, size_t size)
 {
-    if(g_context.fg_job)
-    {
-        if(g_context.fg_job->job_spec && CIRCLEQ_EMPTY(&g_context.bg_jobs))
-            g_context.max_bg_job_index = 0;  //no background job or foregroung
-        sprintf(varvalue[1], "%d", g_context.fg_job->status);
-        destroy_job(g_context.fg_job);
-    } 
-    bring_job_to_fg(NULL);
-}
+    char *p = strstr(h->out, needle);
+    size_t n;
 
-void fg_job_continued()
-{
-    /*if(g_context.fg_job)
-    {
-        print_job_status(g_context.fg_job);
-    }*/
+    if(!p)
+        return 0;
+    n = p - h->out;
+    if(text)
+        snprintf(text, size, "%.*s", (int)n, h->out);
+    n += strlen(needle);
+    memmove(h->out, h->out + n, h->len - n + 1);
+    h->len -= n;
+    return 1;
 }
 
-void suspend_job(job_info *job)
+static void jc_send(jc_harness *h, const char *str)
 {
-    //kill(job->pgid, SIGTSTP);
+    if(write(h->master, str, strlen(str)) < 0)
+        fprintf(stderr, "-xssh: jobctl: write: %s\n", strerror(errno));
 }
 
-void resume_job(job_info *job)
+/*State letter of process from /proc (0 if it is gone), comm receives its command name*/
+static char jc_state(pid_t pid, char *comm, size_t size)
 {
-    kill(-job->pgid, SIGCONT);  
+    char path[64], buf[512], *end = NULL;
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if(n <= 0)
+        return 0;
+    buf[n] = '\0';
+    if(!(end = strrchr(buf, ')')) || !end[1])
+        return 0;
+    if(comm)
+        snprintf(comm, size, "%.*s", (int)(end - strchr(buf, '(') - 1), strchr(buf, '(') + 1);
+    return end[2];
 }
 
-void send_job_to_bg(job_info *job, int resume)
+static void jc_record(jc_harness *h, jc_metric m, uint64_t ns)
 {
-    sprintf(varvalue[2], "%d", job->pgid); 
-    if(!job->job_spec)
-        job->job_spec = ++g_context.max_bg_job_index;
-    g_context.last_bg_job_index = job->job_spec;
-    CIRCLEQ_INSERT_TAIL(&g_context.bg_jobs, job, link);
-    job->background = 1;
-    if(resume)
-        resume_job(job);
+    h->lat[m][h->nlat[m]++] = ns;
 }
 
-void bring_job_to_fg(job_info *job)
+static int jc_check(jc_harness *h, int ok, const char *what, int job)
 {
-    signal(SIGTTIN, SIG_IGN);
-    signal(SIGTTOU, SIG_IGN);
-
-    tcsetpgrp(STDIN_FILENO, job ? job->pgid: getpgrp());
-
-    g_context.fg_job = job;
-    if(g_context.fg_job)
+    h->checks++;
+    if(!ok)
     {
-        resume_job(g_context.fg_job);
-        g_context.fg_job->background = 0;
-        //print_job_status(g_context.fg_job);
+        h->failed++;
+        fprintf(stderr, "jobctl: FAIL %s (job %d)\n", what, job);
     }
-
-    signal(SIGTTIN, SIG_DFL);
-    signal(SIGTTOU, SIG_DFL);
+    return ok;
 }
 
-
-void process_stopped(job_info *job, pid_t pid)
+/*Waits for prompt, text before it goes to text. Returns ns waited since t0, 0 on timeout*/
+static uint64_t jc_prompt(jc_harness *h, uint64_t t0, char *text, size_t size)
 {
-    int found = 0;
-    proc_info *p = NULL;
-    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    while(now_ns() - t0 < JC_TIMEOUT_NS)
     {
-        if(p->pid == pid)
-        {
-            found = 1;
-            break;
-        } 
+        if(jc_take(h, "xssh>> ", text, size))
+            return now_ns() - t0;
+        jc_read(h, 1);
     }
+    return 0;
+}
 
-    if(found)
+/**
+* @brief  Waits until terminal belongs to process group other than shell (or pgid if it is given) whose leader has
+*     exec'ed sleep and is not stopped.
+*
+* @return ns waited since t0, 0 on timeout
+*/
+static uint64_t jc_wait_owner(jc_harness *h, uint64_t t0, pid_t *pgid)
+{
+    while(now_ns() - t0 < JC_TIMEOUT_NS)
     {
-        if(p->state == XSSH_PROC_STATE_RUNNING)
+        pid_t pg = tcgetpgrp(h->master);
+        char comm[64] = "", state;
+
+        if(pg > 0 && pg != h->shell && (!*pgid || pg == *pgid))
         {
-            job->nrunning--;
-            job->nstopped++;
-            p->state = XSSH_PROC_STATE_STOPPED;
+            state = jc_state(pg, comm, sizeof(comm));
+            if(state && state != 'T' && state != 'Z' && !strcmp(comm, "sleep"))
+            {
+                *pgid = pg;
+                return now_ns() - t0;
+            }
         }
-
-        if(job->nrunning == 0)
-            job->state = XSSH_JOB_STATE_STOPPED;
+        jc_read(h, 1);
     }
+    return 0;
 }
 
-void process_continued(job_info *job, pid_t pid)
+/*Waits until leader of pgid is dead (or stopped if stop is set) and prompt is printed, latencies go to m and m + 1*/
+static int jc_wait_signal(jc_harness *h, uint64_t t0, pid_t pgid, int stop, jc_metric m, char *text, size_t size)
 {
-    int found = 0;
-    proc_info *p = NULL;
-    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
-    {
-        if(p->pid == pid)
-        {
-            found = 1;
-            break;
-        } 
-    }    
+    uint64_t proc_ns = 0, prompt_ns = 0;
 
-    if(found)
+    while((!proc_ns || !prompt_ns) && now_ns() - t0 < JC_TIMEOUT_NS)
     {
-        if(p->state == XSSH_PROC_STATE_STOPPED)
-        {
-            job->nrunning++;
-            job->nstopped--;
-            p->state = XSSH_PROC_STATE_RUNNING;
-        }
-
-        if(job->nrunning > 0)
-            job->state = XSSH_JOB_STATE_RUNNING;
+        char state = jc_state(pgid, NULL, 0);
+
+        if(!proc_ns && (stop ? state == 'T' : (!state || state == 'Z')))
+            proc_ns = now_ns() - t0;
+        if(!prompt_ns && jc_take(h, "xssh>> ", text, size))
+            prompt_ns = now_ns() - t0;
+        if(!proc_ns || !prompt_ns)
+            jc_read(h, 1);
     }
- 
+    if(proc_ns)
+        jc_record(h, m, proc_ns);
+    if(prompt_ns)
+        jc_record(h, m + 1, prompt_ns);
+    return proc_ns && prompt_ns ? 0 : -1;
 }
 
-void process_killed(job_info *job, pid_t pid, int signal)
+/*Brings shell back to its prompt after a failed step*/
+static void jc_recover(jc_harness *h, pid_t pgid)
 {
-    int found = 0;
-    proc_info *p = NULL;
-    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
-    {
-        if(p->pid == pid)
-        {
-            found = 1;
-            break; 
-        } 
-    }
+    if(pgid > 0)
+        kill(-pgid, SIGKILL);
+    jc_send(h, "\n");
+    jc_prompt(h, now_ns(), NULL, 0);
+}
 
-    if(found)
+/**
+* @brief  One round: sleep killed by ctrl+C, sleep stopped by ctrl+Z, checked in jobs, continued by bg, brought back
+*     by fg and killed by ctrl+C. Shell is at its prompt before and after round.
+*/
+static void jc_round(jc_harness *h)
+{
+    static char text[1 << 16];
+    char spec[32];
+    pid_t pgid = 0;
+    uint64_t t0, ns;
+    int job = 0;
+    char *p = NULL;
+
+    t0 = now_ns();
+    //plain sleep is run inside xssh by its builtin, job needs a process of its own
+    jc_send(h, "/bin/sleep 1000\n");
+    if(!jc_check(h, (ns = jc_wait_owner(h, t0, &pgid)) != 0, "job did not get terminal", 0))
+        return jc_recover(h, pgid);
+    jc_record(h, JC_START_FG, ns);
+    t0 = now_ns();
+    jc_send(h, "\003");
+    if(!jc_check(h, !jc_wait_signal(h, t0, pgid, 0, JC_INT_DEAD, NULL, 0), "ctrl+C did not end job", 0))
+        return jc_recover(h, pgid);
+    jc_check(h, tcgetpgrp(h->master) == h->shell, "terminal not returned to shell after ctrl+C", 0);
+
+    pgid = 0;
+    t0 = now_ns();
+    jc_send(h, "/bin/sleep 1000\n");
+    if(!jc_check(h, (ns = jc_wait_owner(h, t0, &pgid)) != 0, "job did not get terminal", 0))
+        return jc_recover(h, pgid);
+    jc_record(h, JC_START_FG, ns);
+    t0 = now_ns();
+    jc_send(h, "\032");
+    if(!jc_check(h, !jc_wait_signal(h, t0, pgid, 1, JC_TSTP_STOPPED, text, sizeof(text)), "ctrl+Z did not stop job", 0))
+        return jc_recover(h, pgid);
+    for(p = strchr(text, '['); p && sscanf(p, "[%d] STOPPED", &job) != 1; p = strchr(p + 1, '['))
+        ;
+    if(!jc_check(h, p && strstr(p, "STOPPED"), "ctrl+Z did not report stopped job", 0))
+        return jc_recover(h, pgid);
+    jc_check(h, tcgetpgrp(h->master) == h->shell, "terminal not returned to shell after ctrl+Z", job);
+
+    sprintf(spec, "[%d] STOPPED", job);
+    jc_send(h, "jobs\n");
+    jc_prompt(h, now_ns(), text, sizeof(text));
+    jc_check(h, strstr(text, spec) != NULL, "stopped job not listed by jobs", job);
+
+    sprintf(spec, "bg %d\n", job);
+    t0 = now_ns();
+    jc_send(h, spec);
+    ns = 0;
+    while(!ns && now_ns() - t0 < JC_TIMEOUT_NS)
     {
-        if(p->state == XSSH_PROC_STATE_STOPPED)
-            job->nstopped--;
-
-        if(p->state == XSSH_PROC_STATE_RUNNING)
-            job->nrunning--;
-        
-        p->state = XSSH_PROC_STATE_KILLED;
-
-        if(job->nrunning > 0)
-            job->state = XSSH_JOB_STATE_RUNNING;
+        char state = jc_state(pgid, NULL, 0);
+        if(state && state != 'T')
+            ns = now_ns() - t0;
         else
-            job->state = XSSH_JOB_STATE_STOPPED;
+            jc_read(h, 1);
+    }
+    jc_prompt(h, t0, NULL, 0);
+    if(!jc_check(h, ns != 0, "bg did not continue job", job))
+        return jc_recover(h, pgid);
+    jc_record(h, JC_BG_RUNNING, ns);
+
+    sprintf(spec, "[%d] RUNNING", job);
+    jc_send(h, "jobs\n");
+    jc_prompt(h, now_ns(), text, sizeof(text));
+    jc_check(h, strstr(text, spec) != NULL, "continued job not listed as running", job);
+
+    sprintf(spec, "fg %d\n", job);
+    t0 = now_ns();
+    jc_send(h, spec);
+    if(!jc_check(h, (ns = jc_wait_owner(h, t0, &pgid)) != 0, "fg did not give terminal to job", job))
+        return jc_recover(h, pgid);
+    jc_record(h, JC_FG_OWNER, ns);
+    t0 = now_ns();
+    jc_send(h, "\003");
+    if(!jc_check(h, !jc_wait_signal(h, t0, pgid, 0, JC_INT_DEAD, NULL, 0), "ctrl+C did not end job brought by fg", job))
+        return jc_recover(h, pgid);
+
+    sprintf(spec, "[%d] ", job);
+    jc_send(h, "jobs\n");
+    jc_prompt(h, now_ns(), text, sizeof(text));
+    jc_check(h, strstr(text, spec) == NULL, "killed job still listed by jobs", job);
+}
 
+static int jc_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
 
-        //Each killed process shall be removed from the job proc list 
-        CIRCLEQ_REMOVE(&job->proc_info_list, p, link);
-        job->nprocs--;
-        job->status = signal;
+/*Prints p50, p99 and max of each metric and resets them*/
+static void jc_report(jc_harness *h, const char *title)
+{
+    int m;
 
-        if(job->nprocs == 0)
-            job->state = XSSH_JOB_STATE_KILLED;
-    } 
+    printf("%s\n  %-24s %6s %10s %10s %10s\n", title, "", "n", "p50", "p99", "max");
+    for(m = 0; m < JC_NMETRICS; m++)
+    {
+        char str[3][32] = {"-", "-", "-"};
+        int n = h->nlat[m];
+
+        if(n)
+        {
+            qsort(h->lat[m], n, sizeof(uint64_t), jc_cmp);
+            hist_fmt_ns(str[0], h->lat[m][n / 2]);
+            hist_fmt_ns(str[1], h->lat[m][(n * 99) / 100]);
+            hist_fmt_ns(str[2], h->lat[m][n - 1]);
+        }
+        printf("  %-24s %6d %10s %10s %10s\n", jc_metric_names[m], n, str[0], str[1], str[2]);
+        h->nlat[m] = 0;
+    }
+    fflush(stdout);
 }
 
-void process_terminated(job_info *job, pid_t pid, int status)
+/**
+* @brief  xssh --bench-jobctl [JOBS] [ROUNDS]: runs xssh on a pseudo-terminal and measures how fast ctrl+C and ctrl+Z
+*     end or stop foreground job and give prompt back, and checks jobs, bg and fg on the way. Rounds are run with no
+*     background job and again with JOBS background jobs alive.
+*
+* @return 0 if all checks passed, 1 otherwise
+*/
+int jobctl_bench(int njobs, int rounds)
 {
-    int found = 0;
-    proc_info *p = NULL;
-    CIRCLEQ_FOREACH(p, &job->proc_info_list, link)
+    static char text[1 << 16];
+    jc_harness *h = NULL;
+    struct termios tio;
+    char *name = NULL, *p = NULL;
+    int i, m, phase, count = 0, status = 1;
+    uint64_t t0;
+
+    h = calloc(1, sizeof(jc_harness));
+    for(m = 0; h && m < JC_NMETRICS; m++)
+        if(!(h->lat[m] = malloc(sizeof(uint64_t) * 2 * (rounds + 1))))
+            return 1;
+    if(!h)
+        return 1;
+
+    h->master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(h->master < 0 || grantpt(h->master) < 0 || unlockpt(h->master) < 0 || !(name = ptsname(h->master)))
     {
-        if(p->pid == pid)
-        {
-            found = 1;
-            break; 
-        } 
+        fprintf(stderr, "-xssh: jobctl: pseudo-terminal: %s\n", strerror(errno));
+        return 1;
     }
 
-   if(found)
+    h->shell = fork();
+    if(h->shell < 0)
     {
-        if(p->state == XSSH_PROC_STATE_STOPPED)
-            job->nstopped--;
+        fprintf(stderr, "-xssh: jobctl: fork: %s\n", strerror(errno));
+        return 1;
+    }
+    if(h->shell == 0)
+    {
+        //new session, terminal opened first becomes controlling terminal of shell
+        int fd;
+
+        setsid();
+        fd = open(name, O_RDWR);
+        if(fd < 0)
+            _exit(127);
+        if(!tcgetattr(fd, &tio))
+        {
+            tio.c_lflag &= ~ECHO;
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        if(fd > STDERR_FILENO)
+            close(fd);
+        //plain prompt without line editor, no rc file of user
+        setenv("TERM", "dumb", 1);
+        setenv("XSSH_RC", "", 1);
+        execl("/proc/self/exe", "xssh", (char *)NULL);
+        _exit(127);
+    }
 
-        if(p->state == XSSH_PROC_STATE_RUNNING)
-            job->nrunning--;
+    if(!jc_prompt(h, now_ns(), NULL, 0))
+    {
+        fprintf(stderr, "-xssh: jobctl: shell did not print prompt\n");
+        goto done;
+    }
 
-        p->state = XSSH_PROC_STATE_TERMINATED;
+    printf("jobctl: %d rounds of ctrl+C, ctrl+Z, jobs, bg, fg on %s\n", rounds, name);
+    for(phase = 0; phase < 2; phase++)
+    {
+        if(phase)
+        {
+            t0 = now_ns();
+            for(i = 0; i < njobs; i++)
+            {
+                jc_send(h, "/bin/sleep 1000 &\n");
+                if(!jc_prompt(h, now_ns(), NULL, 0))
+                    break;
+            }
+            hist_fmt_ns(text, now_ns() - t0);
+            printf("jobctl: started %d background jobs in %s\n", i, text);
+            jc_check(h, i == njobs, "background job start timed out", i);
+        }
+        for(i = 0; i < rounds; i++)
+            jc_round(h);
+        snprintf(text, sizeof(text), "with %d background jobs:", phase ? njobs : 0);
+        jc_report(h, text);
+    }
 
-        if(job->nrunning > 0)
-            job->state = XSSH_JOB_STATE_RUNNING;
-        else
-            job->state = XSSH_JOB_STATE_STOPPED;
+    //every background job is still there and running, their pids are killed at the end
+    jc_send(h, "jobs -l\n");
+    jc_prompt(h, now_ns(), text, sizeof(text));
+    for(p = text; (p = strstr(p, " RUNNING ")); p++)
+    {
+        char *line = p;
+        while(line > text && line[-1] != '\n')
+            line--;
+        if(line[0] == ' ' && line[1] == ' ')
+        {
+            kill(atoi(line), SIGKILL);
+            count++;
+        }
+    }
+    jc_check(h, count == njobs, "jobs -l does not list every background job", count);
 
-        CIRCLEQ_REMOVE(&job->proc_info_list, p, link); 
-        job->nprocs--;
-        job->status = status;
+    printf("jobctl: %d checks, %d failed\n", h->checks, h->failed);
+    status = h->failed ? 1 : 0;
 
-        if(job->nprocs == 0)
-            job->state = XSSH_JOB_STATE_DONE;
-    } 
+done:
+    jc_send(h, "exit 0\n");
+    t0 = now_ns();
+    while(waitpid(h->shell, NULL, WNOHANG) == 0)
+    {
+        if(now_ns() - t0 > JC_TIMEOUT_NS)
+        {
+            kill(h->shell, SIGKILL);
+            waitpid(h->shell, NULL, 0);
+            break;
+        }
+        jc_read(h, 10);
+    }
+    close(h->master);
+    for(m = 0; m < JC_NMETRICS; m++)
+        free(h->lat[m]);
+    free(h);
+    return status;
 }
-